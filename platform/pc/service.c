@@ -4,7 +4,6 @@
 #include <pci.h>
 #include <pagecache.h>
 #include <tfs.h>
-#include <pagecache.h>
 #include <apic.h>
 #include <region.h>
 #include <page.h>
@@ -176,6 +175,14 @@ void mm_service(void)
     heap p = (heap)heap_physical(&heaps);
     u64 free = heap_total(p) - heap_allocated(p);
     mm_debug("%s: total %ld, alloc %ld, free %ld\n", __func__, heap_total(p), heap_allocated(p), free);
+    if (free < PAGECACHE_DRAIN_CUTOFF) {
+        /* objects parked in the heap depots are idle; give them back before
+           evicting cached data */
+        u64 drained = magazine_heap_drain(heaps.locked);
+        if (drained > 0)
+            mm_debug("   returned %ld bytes from heap depots\n", drained);
+        free = heap_total(p) - heap_allocated(p);
+    }
     if (free < PAGECACHE_DRAIN_CUTOFF) {
         u64 drain_bytes = PAGECACHE_DRAIN_CUTOFF - free;
         u64 drained = pagecache_drain(drain_bytes);
@@ -348,11 +355,12 @@ halt_handler vm_halt;
 void vm_exit(u8 code)
 {
 #ifdef SMP_DUMP_FRAME_RETURN_COUNT
-    rprintf("cpu\tframe returns\n");
+    rprintf("cpu\tframe returns\tkernel lock contended\tthreads stolen\n");
     for (int i = 0; i < MAX_CPUS; i++) {
         cpuinfo ci = cpuinfo_from_id(i);
-        if (ci->frcount)
-            rprintf("%d\t%ld\n", i, ci->frcount);
+        if (ci->frcount || ci->kern_lock_contended || ci->threads_stolen)
+            rprintf("%d\t%ld\t\t%ld\t\t\t%ld\n", i, ci->frcount, ci->kern_lock_contended,
+                    ci->threads_stolen);
     }
 #endif
 
@@ -454,9 +462,6 @@ static void new_cpu()
 }
 #endif
 
-u64 xsave_features();
-u64 xsave_frame_size();
-
 static void __attribute__((noinline)) init_service_new_stack()
 {
     kernel_heaps kh = &heaps;
@@ -475,11 +480,6 @@ static void __attribute__((noinline)) init_service_new_stack()
     unmap(0, PAGESIZE);         /* unmap zero page */
     reclaim_regions();          /* unmap and reclaim stage2 stack */
     init_extra_prints();
-#if 0 // XXX
-    if (xsave_frame_size() == 0){
-        halt("xsave not supported\n");
-    }
-#endif
     init_pci(kh);
     init_console(kh);
     init_symtab(kh);
@@ -572,6 +572,7 @@ static void __attribute__((noinline)) init_service_new_stack()
     start_cpu(misc, heap_backed(kh), TARGET_EXCLUSIVE_BROADCAST, new_cpu);
     kernel_delay(milliseconds(200));   /* temp, til we check tables to know what we have */
     init_debug("total CPUs %d\n", total_processors);
+    init_cpu_topology();
     init_flush(heap_general(kh));
 #endif
     init_debug("starting runloop");
@@ -648,8 +649,10 @@ static void init_kernel_heaps()
     heaps.general = allocate_mcache(&bootstrap, (heap)heaps.backed, 5, 20, PAGESIZE_2M);
     assert(heaps.general != INVALID_ADDRESS);
 
-    heaps.locked = locking_heap_wrapper(&bootstrap,
-        allocate_mcache(&bootstrap, (heap)heaps.backed, 5, 20, PAGESIZE_2M));
+    /* cache objects up to 4K in per-cpu magazines */
+    heaps.locked = magazine_heap_wrapper(&bootstrap,
+        allocate_mcache(&bootstrap, (heap)heaps.backed, 5, 20, PAGESIZE_2M),
+        PAGESIZE_2M, 5, 12);
     assert(heaps.locked != INVALID_ADDRESS);
 }
 
@@ -772,8 +775,9 @@ void init_service(u64 rdi, u64 rsi)
     cr &= ~C0_EM;
     mov_to_cr("cr0", cr);
     mov_from_cr("cr4", cr);
-    cr |= CR4_OSFXSR | CR4_OSXMMEXCPT /* | CR4_OSXSAVE */;
+    cr |= CR4_OSFXSR | CR4_OSXMMEXCPT;
     mov_to_cr("cr4", cr);
+    init_extended_state();
     init_kernel_heaps();
     if (cmdline)
         cmdline_parse(cmdline);
@@ -1377,7 +1377,7 @@ int ena_up(struct ena_adapter *adapter)
      * reset and timer service will be activated afterwards.
      */
     if (ENA_FLAG_ISSET (ENA_FLAG_DEVICE_RUNNING, adapter))
-        adapter->timer_service = register_timer(runloop_timers,
+        adapter->timer_service = kern_register_timer(
             CLOCK_ID_MONOTONIC, seconds(1), false, seconds(1),
             init_closure(&adapter->timer_task, ena_timer_task, adapter));
 
@@ -1914,7 +1914,7 @@ int ena_restore_device(struct ena_adapter *adapter)
          * caused by missing keep alive.
          */
         adapter->keep_alive_timestamp = uptime();
-        adapter->timer_service = register_timer(runloop_timers, CLOCK_ID_MONOTONIC,
+        adapter->timer_service = kern_register_timer(CLOCK_ID_MONOTONIC,
             seconds(1), false, seconds(1), (timer_handler)&adapter->timer_task);
     }
     ENA_FLAG_CLEAR_ATOMIC(ENA_FLAG_DEV_UP_BEFORE_RESET, adapter);
@@ -22,6 +22,12 @@
 #define RUNLOOP_TIMER_MAX_PERIOD_US     100000
 #define RUNLOOP_TIMER_MIN_PERIOD_US     1000
 
+/* kernel lock attempts by a CPU with expired timers or queued CPU work */
+#define KERN_LOCK_LOCAL_SPIN_MAX        1024
+
+/* pollers queued on a CPU; enqueue_cpu_poll() fails beyond this */
+#define CPU_POLL_QUEUE_SIZE             64
+
 /* XXX just for initial mp bringup... */
 #define MAX_CPUS 16
 
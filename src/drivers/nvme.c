@@ -36,8 +36,9 @@
 #define NVME_AQ_IDX     0   /* admin queue index */
 #define NVME_AQ_MSIX    0   /* admin queue MSI-X slot */
 
-#define NVME_IOQ_IDX    1   /* I/O queue index and identifier */
-#define NVME_IOQ_MSIX   1   /* I/O queue MSI-X slot */
+/* I/O queue n (starting from 1) uses MSI-X slot n, targeted at cpu n - 1; a
+   controller with a single vector gets one I/O queue sharing the admin slot */
+#define NVME_IOQ_ORDER_MAX  10
 
 /* command Dword 0 */
 #define NVME_CID(id)    ((id) << 16)
@@ -79,6 +80,11 @@
 #define NVME_OPC_MI_RECV    0x1E
 #define NVME_OPC_DBL_CFG    0x7C
 
+/* Feature identifiers */
+#define NVME_FEAT_NUM_QUEUES    0x07
+#define NVME_NSQ(dw)    (((dw) & 0xFFFF) + 1)   /* number of I/O SQs, 0's based */
+#define NVME_NCQ(dw)    (((dw) >> 16) + 1)      /* number of I/O CQs, 0's based */
+
 /* Identify command */
 #define CNS_IDENTIFY_NAMESPACE  0
 #define CNS_IDENTIFY_CONTROLLER 1
@@ -104,8 +110,6 @@
 #define NVME_ASQ_ORDER  1
 #define NVME_ACQ_ORDER  1
 
-#define NVME_CID_MAX    0xFFFE
-
 //#define NVME_DEBUG
 #ifdef NVME_DEBUG
 #define nvme_debug(x, ...) do {rprintf("NVMe: " x "\n", ##__VA_ARGS__);} while(0)
@@ -166,9 +170,27 @@ typedef struct nvme_cq {
 declare_closure_struct(1, 0, void, nvme_admin_irq,
                        struct nvme *, n);
 declare_closure_struct(1, 0, void, nvme_io_irq,
-                       struct nvme *, n);
+                       struct nvme_ioq *, q);
 declare_closure_struct(1, 0, void, nvme_bh_service,
-                       struct nvme *, n);
+                       struct nvme_ioq *, q);
+
+/* An I/O submission/completion queue pair. Requests are submitted to the
+   pair of the issuing cpu and completed on that cpu's interrupt, so that
+   queues are neither shared nor bounced between cpus in the common case;
+   the lock covers submissions from other cpus when there are fewer pairs
+   than cpus. */
+typedef struct nvme_ioq {
+    struct nvme *n;
+    int idx;    /* queue identifier */
+    struct nvme_sq sq;
+    struct nvme_cq cq;
+    closure_struct(nvme_io_irq, irq);
+    struct list pending_reqs, free_reqs, done_reqs;
+    vector cmds;    /* indexed by command ID, unique within the queue */
+    struct list free_cmds;
+    closure_struct(nvme_bh_service, bh_service);
+    struct spinlock lock;
+} *nvme_ioq;
 
 typedef struct nvme {
     heap general, contiguous;
@@ -180,15 +202,11 @@ typedef struct nvme {
     struct nvme_cq acq; /* admin completion queue */
     closure_struct(nvme_admin_irq, admin_irq);
     thunk ac_handler;   /* admin completion handler */
+    thunk ioq_irq;      /* I/O queue interrupt sharing the admin MSI-X slot */
+    int msix_count;
     int ioq_order;     /* I/O queue size */
-    struct nvme_sq iosq;    /* I/O submission queue */
-    struct nvme_cq iocq;    /* I/O completion queue */
-    closure_struct(nvme_io_irq, io_irq);
-    struct list pending_reqs, free_reqs, done_reqs;
-    vector cmds;
-    struct list free_cmds;
-    closure_struct(nvme_bh_service, bh_service);
-    struct spinlock lock;
+    int ioq_count;     /* number of I/O queue pairs */
+    nvme_ioq ioqs;
 } *nvme;
 
 typedef struct nvme_ioreq {
@@ -278,6 +296,11 @@ static struct nvme_cqe *nvme_get_cqe(nvme_cq q)
     return cqe;
 }
 
+static inline boolean nvme_cq_empty(nvme_cq q)
+{
+    return NVME_PHASE_TAG(q->ring[q->head].dw3) == q->phase;
+}
+
 static inline void nvme_cq_doorbell(nvme n, int q_idx, nvme_cq q)
 {
     /* Completion queue head doorbell register offset */
@@ -286,38 +309,42 @@ static inline void nvme_cq_doorbell(nvme n, int q_idx, nvme_cq q)
     pci_bar_write_4(&n->bar, cqhdbl, q->head);
 }
 
-static nvme_ioreq nvme_get_ioreq(nvme n)
+static nvme_ioreq nvme_get_ioreq(nvme_ioq q)
 {
     nvme_ioreq req;
-    spin_lock(&n->lock);
-    list l = list_get_next(&n->free_reqs);
+    u64 irqflags = spin_lock_irq(&q->lock);
+    list l = list_get_next(&q->free_reqs);
     if (l) {
         list_delete(l);
         req = struct_from_list(l, nvme_ioreq, l);
     } else {
+        req = 0;
+    }
+    spin_unlock_irq(&q->lock, irqflags);
+    if (!req) {
         nvme_debug("new request allocation");
-        req = allocate(n->general, sizeof(*req));
+        req = allocate(q->n->general, sizeof(*req));
     }
-    spin_unlock(&n->lock);
     return req;
 }
 
 /* Called with the lock held. */
-static nvme_iocmd nvme_get_iocmd(nvme n, boolean allocate)
+static nvme_iocmd nvme_get_iocmd(nvme_ioq q, boolean allocate)
 {
-    list l = list_get_next(&n->free_cmds);
+    list l = list_get_next(&q->free_cmds);
     if (l) {
         list_delete(l);
         return struct_from_list(l, nvme_iocmd, l);
-    } else if (allocate && (vector_length(n->cmds) <= NVME_CID_MAX)) {
+    } else if (allocate && (vector_length(q->cmds) < MASK(q->sq.order))) {
+        /* no more commands can be outstanding than the queue holds */
         nvme_debug("new command allocation");
-        nvme_iocmd cmd = allocate(n->general, sizeof(*cmd));
+        nvme_iocmd cmd = allocate(q->n->general, sizeof(*cmd));
         if (cmd == INVALID_ADDRESS) {
             nvme_debug("command allocation failed");
             return cmd;
         }
-        cmd->id = vector_length(n->cmds);
-        vector_push(n->cmds, cmd);
+        cmd->id = vector_length(q->cmds);
+        vector_push(q->cmds, cmd);
         return cmd;
     } else {
         nvme_debug("no available commands");
@@ -326,17 +353,17 @@ static nvme_iocmd nvme_get_iocmd(nvme n, boolean allocate)
 }
 
 /* Called with the lock held. */
-static void nvme_service_pending(nvme n, boolean allocate)
+static void nvme_service_pending(nvme_ioq q, boolean allocate)
 {
     boolean new_reqs = false;
     list l;
-    while ((l = list_get_next(&n->pending_reqs))) {
-        nvme_iocmd cmd = nvme_get_iocmd(n, allocate);
+    while ((l = list_get_next(&q->pending_reqs))) {
+        nvme_iocmd cmd = nvme_get_iocmd(q, allocate);
         if (cmd == INVALID_ADDRESS)
             break;
-        struct nvme_sqe *sqe = nvme_get_sqe(&n->iosq);
+        struct nvme_sqe *sqe = nvme_get_sqe(&q->sq);
         if (!sqe) {
-            list_insert_before(list_begin(&n->free_cmds), &cmd->l);
+            list_insert_before(list_begin(&q->free_cmds), &cmd->l);
             break;
         }
         new_reqs = true;
@@ -357,7 +384,7 @@ static void nvme_service_pending(nvme n, boolean allocate)
         }
         if (nlb == range_span(req->blocks))
             list_delete(l);
-        nvme_debug("request sectors [0x%x, 0x%x), cmd ID 0x%0x",
+        nvme_debug("[q%d] request sectors [0x%x, 0x%x), cmd ID 0x%0x", q->idx,
                    req->blocks.start, req->blocks.start + nlb, cmd->id);
         sqe->cdw10 = req->blocks.start;
         sqe->cdw12 = nlb - 1;
@@ -367,7 +394,12 @@ static void nvme_service_pending(nvme n, boolean allocate)
         new_reqs = true;
     }
     if (new_reqs)
-        nvme_sq_doorbell(n, NVME_IOQ_IDX, &n->iosq);
+        nvme_sq_doorbell(q->n, q->idx, &q->sq);
+}
+
+static inline nvme_ioq nvme_local_ioq(nvme n)
+{
+    return &n->ioqs[current_cpu()->id % n->ioq_count];
 }
 
 closure_function(3, 3, void, nvme_io,
@@ -377,8 +409,9 @@ closure_function(3, 3, void, nvme_io,
     nvme n = bound(n);
     u32 namespace = bound(namespace);
     boolean write = bound(write);
-    nvme_debug("[%d] %s %R", namespace, write ? "write" : "read", blocks);
-    nvme_ioreq req = nvme_get_ioreq(n);
+    nvme_ioq q = nvme_local_ioq(n);
+    nvme_debug("[%d] %s %R on q%d", namespace, write ? "write" : "read", blocks, q->idx);
+    nvme_ioreq req = nvme_get_ioreq(q);
     if (req == INVALID_ADDRESS) {
         apply(sh, timm("result", "request allocation failed"));
         return;
@@ -390,26 +423,26 @@ closure_function(3, 3, void, nvme_io,
     req->pending_cmds = 0;
     req->sh = sh;
     req->sc = NVME_SC_OK;
-    u64 irqflags = spin_lock_irq(&n->lock);
-    list_push_back(&n->pending_reqs, &req->l);
-    nvme_service_pending(n, true);
-    spin_unlock_irq(&n->lock, irqflags);
+    u64 irqflags = spin_lock_irq(&q->lock);
+    list_push_back(&q->pending_reqs, &req->l);
+    nvme_service_pending(q, true);
+    spin_unlock_irq(&q->lock, irqflags);
 }
 
 define_closure_function(1, 0, void, nvme_io_irq,
-                        nvme, n)
+                        nvme_ioq, q)
 {
-    nvme_debug("%s", __func__);
-    nvme n = bound(n);
-    spin_lock(&n->lock);
-    boolean done_empty = list_empty(&n->done_reqs);
+    nvme_ioq q = bound(q);
+    nvme_debug("%s: q%d", __func__, q->idx);
+    spin_lock(&q->lock);
+    boolean done_empty = list_empty(&q->done_reqs);
     struct nvme_cqe *cqe;
-    while ((cqe = nvme_get_cqe(&n->iocq))) {
-        n->iosq.head = NVME_SQ_HEAD(cqe->dw2);
-        nvme_iocmd cmd = vector_get(n->cmds, NVME_CMD_ID(cqe->dw3));
+    while ((cqe = nvme_get_cqe(&q->cq))) {
+        q->sq.head = NVME_SQ_HEAD(cqe->dw2);
+        nvme_iocmd cmd = vector_get(q->cmds, NVME_CMD_ID(cqe->dw3));
         nvme_debug("  cmd ID 0x%0x complete", cmd->id);
         nvme_ioreq req = cmd->req;
-        list_insert_before(list_begin(&n->free_cmds), &cmd->l);
+        list_insert_before(list_begin(&q->free_cmds), &cmd->l);
         int sc = NVME_STATUS_CODE(cqe->dw3);
         u64 remaining = range_span(req->blocks);
         if ((sc != NVME_SC_OK) && (remaining != 0))
@@ -418,33 +451,33 @@ define_closure_function(1, 0, void, nvme_io_irq,
             req->sc = sc;
         boolean req_complete = !(--req->pending_cmds) && (!remaining || (sc != NVME_SC_OK));
         if (req_complete)
-            list_push_back(&n->done_reqs, &req->l);
+            list_push_back(&q->done_reqs, &req->l);
     }
-    nvme_cq_doorbell(n, NVME_IOQ_IDX, &n->iocq);
-    nvme_service_pending(n, false);
-    if (done_empty && !list_empty(&n->done_reqs))
-        enqueue(bhqueue, &n->bh_service);
-    spin_unlock(&n->lock);
+    nvme_cq_doorbell(q->n, q->idx, &q->cq);
+    nvme_service_pending(q, false);
+    if (done_empty && !list_empty(&q->done_reqs))
+        enqueue(bhqueue, &q->bh_service);
+    spin_unlock(&q->lock);
 }
 
 define_closure_function(1, 0, void, nvme_bh_service,
-                        nvme, n)
+                        nvme_ioq, q)
 {
-    nvme_debug("%s", __func__);
-    nvme n = bound(n);
+    nvme_ioq q = bound(q);
+    nvme_debug("%s: q%d", __func__, q->idx);
     list l;
-    u64 irqflags = spin_lock_irq(&n->lock);
-    while ((l = list_get_next(&n->done_reqs))) {
+    u64 irqflags = spin_lock_irq(&q->lock);
+    while ((l = list_get_next(&q->done_reqs))) {
         list_delete(l);
-        spin_unlock_irq(&n->lock, irqflags);
+        spin_unlock_irq(&q->lock, irqflags);
         nvme_ioreq req = struct_from_list(l, nvme_ioreq, l);
         apply(req->sh, (req->sc == NVME_SC_OK) ? STATUS_OK :
                 timm("result", "NVMe status code 0x%x", req->sc));
-        irqflags = spin_lock_irq(&n->lock);
-        list_insert_before(list_begin(&n->free_reqs), l);
+        irqflags = spin_lock_irq(&q->lock);
+        list_insert_before(list_begin(&q->free_reqs), l);
     }
-    nvme_service_pending(n, true);
-    spin_unlock_irq(&n->lock, irqflags);
+    nvme_service_pending(q, true);
+    spin_unlock_irq(&q->lock, irqflags);
 }
 
 closure_function(4, 0, void, nvme_ns_attach,
@@ -693,10 +726,16 @@ static boolean nvme_get_active_namespaces(nvme n, u32 start_id, storage_attach a
     return true;
 }
 
-closure_function(2, 0, void, nvme_create_iosq_resp,
-                 nvme, n, storage_attach, a)
+static boolean nvme_create_iosq(nvme n, int qid, storage_attach a);
+
+/* Queues are created one admin command at a time, completion queues first.
+   Failing to create a pair other than the first leaves the controller
+   running with the pairs created so far. */
+closure_function(3, 0, void, nvme_create_iosq_resp,
+                 nvme, n, int, qid, storage_attach, a)
 {
     nvme n = bound(n);
+    int qid = bound(qid);
     storage_attach a = bound(a);
     struct nvme_cqe *cqe = nvme_get_cqe(&n->acq);
     if (cqe) {
@@ -704,96 +743,223 @@ closure_function(2, 0, void, nvme_create_iosq_resp,
         int sc = NVME_STATUS_CODE(cqe->dw3);
         nvme_cq_doorbell(n, NVME_AQ_IDX, &n->acq);
         if (sc == NVME_SC_OK) {
-            nvme_debug("I/O SQ created");
-            if (n->vs >= NVME_VER(1, 1, 0))
-                nvme_get_active_namespaces(n, 0, a);
-            else
-                nvme_identify_controller(n, a);
+            nvme_debug("I/O SQ %d created", qid);
         } else {
-            msg_err("failed to create I/O SQ: status code 0x%x\n", sc);
+            msg_err("failed to create I/O SQ %d: status code 0x%x\n", qid, sc);
+            nvme_deinit_sq(n, &n->ioqs[qid - 1].sq);
+            if (qid == 1)
+                goto done;
+            n->ioq_count = qid - 1;
+        }
+        if (qid < n->ioq_count) {
+            if (nvme_create_iosq(n, qid + 1, a))
+                goto done;
+            n->ioq_count = qid;
         }
+        nvme_debug("%d I/O queue pair(s) active", n->ioq_count);
+        if (n->vs >= NVME_VER(1, 1, 0))
+            nvme_get_active_namespaces(n, 0, a);
+        else
+            nvme_identify_controller(n, a);
     }
+  done:
     closure_finish();
 }
 
-static boolean nvme_create_iosq(nvme n, storage_attach a)
+static boolean nvme_create_iosq(nvme n, int qid, storage_attach a)
 {
-    if (!nvme_init_sq(n, &n->iosq, n->ioq_order)) {
+    nvme_ioq q = &n->ioqs[qid - 1];
+    if (!nvme_init_sq(n, &q->sq, n->ioq_order)) {
         msg_err("failed to initialize queue\n");
         return false;
     }
-    n->ac_handler = closure(n->general, nvme_create_iosq_resp, n, a);
+    n->ac_handler = closure(n->general, nvme_create_iosq_resp, n, qid, a);
     if (n->ac_handler == INVALID_ADDRESS) {
         msg_err("failed to allocate completion handler\n");
-        nvme_deinit_sq(n, &n->iosq);
+        nvme_deinit_sq(n, &q->sq);
         return false;
     }
 
     /* Zero out all submission queue entries, so that when submitting an entry
      * only used fields need to be set. This relies on the fact that all I/O
      * commands use the same set of fields. */
-    zero(n->iosq.ring, U64_FROM_BIT(n->iosq.order) * sizeof(struct nvme_sqe));
+    zero(q->sq.ring, U64_FROM_BIT(q->sq.order) * sizeof(struct nvme_sqe));
 
     struct nvme_sqe *cmd = nvme_get_sqe(&n->asq);
     assert(cmd);
     zero(cmd, sizeof(*cmd));
     cmd->cdw0 = NVME_CID(n->asq.tail) | NVME_CMD_PRP | NVME_OPC_CRE_IOSQ;
-    cmd->dptr.prp1 = physical_from_virtual(n->iosq.ring);
-    cmd->cdw10 = (MASK(n->ioq_order) << 16) | NVME_IOQ_IDX; /* queue size and queue ID */
-    cmd->cdw11 = (NVME_IOQ_IDX << 16) | 0x01;  /* completion queue ID, physically contiguous */
+    cmd->dptr.prp1 = physical_from_virtual(q->sq.ring);
+    cmd->cdw10 = (MASK(n->ioq_order) << 16) | qid; /* queue size and queue ID */
+    cmd->cdw11 = (qid << 16) | 0x01;  /* completion queue ID, physically contiguous */
     nvme_sq_doorbell(n, NVME_AQ_IDX, &n->asq);
     return true;
 }
 
-closure_function(2, 0, void, nvme_create_iocq_resp,
-                 nvme, n, storage_attach, a)
+static boolean nvme_create_iocq(nvme n, int qid, storage_attach a);
+
+closure_function(3, 0, void, nvme_create_iocq_resp,
+                 nvme, n, int, qid, storage_attach, a)
 {
     nvme n = bound(n);
+    int qid = bound(qid);
+    storage_attach a = bound(a);
     struct nvme_cqe *cqe = nvme_get_cqe(&n->acq);
     if (cqe) {
         n->asq.head = NVME_SQ_HEAD(cqe->dw2);
         int sc = NVME_STATUS_CODE(cqe->dw3);
         nvme_cq_doorbell(n, NVME_AQ_IDX, &n->acq);
         if (sc == NVME_SC_OK) {
-            nvme_debug("I/O CQ created");
-            nvme_create_iosq(n, bound(a));
+            nvme_debug("I/O CQ %d created", qid);
+            if (qid >= n->msix_count)
+                n->ioq_irq = (thunk)&n->ioqs[qid - 1].irq;
         } else {
-            msg_err("failed to create I/O CQ: status code 0x%x\n", sc);
+            msg_err("failed to create I/O CQ %d: status code 0x%x\n", qid, sc);
+            if (qid < n->msix_count)
+                pci_teardown_msix(n->d, qid);
+            nvme_deinit_cq(n, &n->ioqs[qid - 1].cq);
+            if (qid == 1)
+                goto done;
+            n->ioq_count = qid - 1;
+        }
+        if (qid < n->ioq_count) {
+            if (nvme_create_iocq(n, qid + 1, a))
+                goto done;
+            n->ioq_count = qid;
         }
+        nvme_create_iosq(n, 1, a);
     }
+  done:
     closure_finish();
 }
 
-static boolean nvme_create_iocq(nvme n, storage_attach a)
+static boolean nvme_create_iocq(nvme n, int qid, storage_attach a)
 {
-    if (!nvme_init_cq(n, &n->iocq, n->ioq_order)) {
+    nvme_ioq q = &n->ioqs[qid - 1];
+    if (!nvme_init_cq(n, &q->cq, n->ioq_order)) {
         msg_err("failed to initialize queue\n");
         return false;
     }
-    n->ac_handler = closure(n->general, nvme_create_iocq_resp, n, a);
+    n->ac_handler = closure(n->general, nvme_create_iocq_resp, n, qid, a);
     if (n->ac_handler == INVALID_ADDRESS) {
         msg_err("failed to allocate completion handler\n");
-        nvme_deinit_cq(n, &n->iocq);
+        nvme_deinit_cq(n, &q->cq);
         return false;
     }
-    pci_setup_msix(n->d, NVME_IOQ_MSIX, init_closure(&n->io_irq, nvme_io_irq, n), "nvme I/O");
+    int msix = (qid < n->msix_count) ? qid : NVME_AQ_MSIX;
+    if (msix != NVME_AQ_MSIX) {
+        pci_setup_msix(n->d, msix, (thunk)&q->irq, "nvme I/O");
+        if (qid > 1)
+            pci_set_msix_target(n->d, msix, qid - 1);
+    }
     struct nvme_sqe *cmd = nvme_get_sqe(&n->asq);
     assert(cmd);
     zero(cmd, sizeof(*cmd));
     cmd->cdw0 = NVME_CID(n->asq.tail) | NVME_CMD_PRP | NVME_OPC_CRE_IOCQ;
-    cmd->dptr.prp1 = physical_from_virtual(n->iocq.ring);
-    cmd->cdw10 = (MASK(n->ioq_order) << 16) | NVME_IOQ_IDX; /* queue size and queue ID */
-    cmd->cdw11 = (NVME_IOQ_MSIX << 16) | 0x03;  /* interrupts enabled, physically contiguous */
+    cmd->dptr.prp1 = physical_from_virtual(q->cq.ring);
+    cmd->cdw10 = (MASK(n->ioq_order) << 16) | qid; /* queue size and queue ID */
+    cmd->cdw11 = (msix << 16) | 0x03;  /* MSI-X slot, interrupts enabled, physically contiguous */
     nvme_sq_doorbell(n, NVME_AQ_IDX, &n->asq);
     return true;
 }
 
+static void nvme_deinit_ioqs(nvme n, int count)
+{
+    for (int i = 0; i < count; i++)
+        deallocate_vector(n->ioqs[i].cmds);
+    deallocate(n->general, n->ioqs, n->ioq_count * sizeof(struct nvme_ioq));
+}
+
+static boolean nvme_init_ioqs(nvme n)
+{
+    n->ioqs = allocate(n->general, n->ioq_count * sizeof(struct nvme_ioq));
+    if (n->ioqs == INVALID_ADDRESS)
+        return false;
+    for (int i = 0; i < n->ioq_count; i++) {
+        nvme_ioq q = &n->ioqs[i];
+        q->cmds = allocate_vector(n->general, U64_FROM_BIT(n->ioq_order));
+        if (q->cmds == INVALID_ADDRESS) {
+            nvme_deinit_ioqs(n, i);
+            return false;
+        }
+        q->n = n;
+        q->idx = i + 1;
+        list_init(&q->pending_reqs);
+        list_init(&q->free_reqs);
+        list_init(&q->done_reqs);
+        list_init(&q->free_cmds);
+        spin_lock_init(&q->lock);
+        init_closure(&q->irq, nvme_io_irq, q);
+        init_closure(&q->bh_service, nvme_bh_service, q);
+    }
+    return true;
+}
+
+closure_function(2, 0, void, nvme_set_num_queues_resp,
+                 nvme, n, storage_attach, a)
+{
+    nvme n = bound(n);
+    struct nvme_cqe *cqe = nvme_get_cqe(&n->acq);
+    if (cqe) {
+        n->asq.head = NVME_SQ_HEAD(cqe->dw2);
+        int sc = NVME_STATUS_CODE(cqe->dw3);
+        nvme_cq_doorbell(n, NVME_AQ_IDX, &n->acq);
+
+        /* the controller may allocate fewer (or more) queues than requested;
+           a single pair is always available */
+        if (sc == NVME_SC_OK) {
+            nvme_debug("controller allocated %d SQs, %d CQs",
+                       NVME_NSQ(cqe->dw0), NVME_NCQ(cqe->dw0));
+            n->ioq_count = MIN(n->ioq_count, MIN(NVME_NSQ(cqe->dw0), NVME_NCQ(cqe->dw0)));
+        } else {
+            msg_err("failed to set number of queues: status code 0x%x\n", sc);
+            n->ioq_count = 1;
+        }
+        if (!nvme_init_ioqs(n))
+            msg_err("failed to allocate I/O queues\n");
+        else if (!nvme_create_iocq(n, 1, bound(a)))
+            nvme_deinit_ioqs(n, n->ioq_count);
+    }
+    closure_finish();
+}
+
+/* Run once the secondary cpus are up: ask for one I/O queue pair per cpu,
+   limited by the available MSI-X vectors (one of which serves the admin
+   queue). */
+closure_function(2, 0, void, nvme_ioq_setup,
+                 nvme, n, storage_attach, a)
+{
+    nvme n = bound(n);
+    n->ioq_count = MAX(1, MIN(total_processors, n->msix_count - 1));
+    nvme_debug("requesting %d I/O queue pair(s)", n->ioq_count);
+    n->ac_handler = closure(n->general, nvme_set_num_queues_resp, n, bound(a));
+    if (n->ac_handler == INVALID_ADDRESS) {
+        msg_err("failed to allocate completion handler\n");
+        goto done;
+    }
+    struct nvme_sqe *cmd = nvme_get_sqe(&n->asq);
+    assert(cmd);
+    zero(cmd, sizeof(*cmd));
+    cmd->cdw0 = NVME_CID(n->asq.tail) | NVME_CMD_PRP | NVME_OPC_SET_FEAT;
+    cmd->cdw10 = NVME_FEAT_NUM_QUEUES;
+    cmd->cdw11 = ((n->ioq_count - 1) << 16) | (n->ioq_count - 1);  /* 0's based CQ and SQ counts */
+    nvme_sq_doorbell(n, NVME_AQ_IDX, &n->asq);
+  done:
+    closure_finish();
+}
+
 define_closure_function(1, 0, void, nvme_admin_irq,
                         nvme, n)
 {
     nvme n = bound(n);
     nvme_debug("%s (%F)", __func__, n->ac_handler);
-    apply(n->ac_handler);
+
+    /* the handler of the last admin command is gone once attach completes,
+       so only call it for an actual admin completion */
+    if (!nvme_cq_empty(&n->acq))
+        apply(n->ac_handler);
+    if (n->ioq_irq)
+        apply(n->ioq_irq);
 }
 
 closure_function(3, 1, boolean, nvme_probe,
@@ -803,6 +969,10 @@ closure_function(3, 1, boolean, nvme_probe,
     if ((pci_get_class(d) != PCIC_STORAGE) || (pci_get_subclass(d) != PCIS_STORAGE_NVM) ||
             (pci_get_prog_if(d) != PCIPI_STORAGE_NVME))
         return false;
+    if (pci_get_msix_count(d) == 0) {
+        msg_err("controller does not support MSI-X\n");
+        return false;
+    }
     heap general = bound(general);
     nvme n = allocate(general, sizeof(*n));
     if (n == INVALID_ADDRESS)
@@ -836,13 +1006,10 @@ closure_function(3, 1, boolean, nvme_probe,
     n->ioq_order = find_order(mqes);
     if (mqes != U64_FROM_BIT(n->ioq_order))
         n->ioq_order--;
+    /* with a queue pair per cpu, deeper queues only cost memory */
+    n->ioq_order = MIN(n->ioq_order, NVME_IOQ_ORDER_MAX);
     nvme_debug("new controller (version %d.%d.%d), MQES %d, I/O queue order %d",
                NVME_VS_MJR(n->vs), NVME_VS_MNR(n->vs), NVME_VS_TER(n->vs), mqes, n->ioq_order);
-    n->cmds = allocate_vector(general, NVME_CID_MAX + 1);
-    if (n->cmds == INVALID_ADDRESS) {
-        msg_err("failed to allocate request vector\n");
-        goto deinit_acq;
-    }
     pci_bar_write_4(&n->bar, NVME_AQA, NVME_AQA_ACQS(U64_FROM_BIT(NVME_ACQ_ORDER)) |
                     NVME_AQA_ASQS(U64_FROM_BIT(NVME_ASQ_ORDER)));
     pci_bar_write_8(&n->bar, NVME_ASQ, physical_from_virtual(n->asq.ring));
@@ -857,22 +1024,24 @@ closure_function(3, 1, boolean, nvme_probe,
             kernel_delay(milliseconds(1 << retries));
         } else {
             msg_err("failed to enable controller\n");
-            goto free_cmds;
+            goto deinit_acq;
         }
     }
     n->d = d;
-    pci_enable_msix(d);
+    n->ioq_irq = 0;
+    n->msix_count = pci_enable_msix(d);
     pci_setup_msix(d, NVME_AQ_MSIX, init_closure(&n->admin_irq, nvme_admin_irq, n), "nvme admin");
-    list_init(&n->pending_reqs);
-    list_init(&n->free_reqs);
-    list_init(&n->done_reqs);
-    list_init(&n->free_cmds);
-    spin_lock_init(&n->lock);
-    init_closure(&n->bh_service, nvme_bh_service, n);
-    if (nvme_create_iocq(n, bound(a)))
+
+    /* defer I/O queue creation until the runloop starts, by which time all
+       cpus are online */
+    thunk ioq_setup = closure(general, nvme_ioq_setup, n, bound(a));
+    if (ioq_setup != INVALID_ADDRESS) {
+        enqueue(runqueue, ioq_setup);
         return true;
-  free_cmds:
-    deallocate_vector(n->cmds);
+    }
+    msg_err("failed to allocate queue setup closure\n");
+    pci_teardown_msix(d, NVME_AQ_MSIX);
+    pci_disable_msix(d);
   deinit_acq:
     nvme_deinit_cq(n, &n->acq);
   deinit_asq:
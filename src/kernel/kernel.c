@@ -79,6 +79,17 @@ void resume_kernel_context(kernel_context c)
     frame_return(c->frame);
 }
 
+table proc_stats;
+
+void register_proc_stats(heap h, symbol name, proc_stats_handler sh)
+{
+    if (!proc_stats) {
+        proc_stats = allocate_table(h, key_from_symbol, pointer_equal);
+        assert(proc_stats != INVALID_ADDRESS);
+    }
+    table_set(proc_stats, name, sh);
+}
+
 struct cpuinfo cpuinfos[MAX_CPUS];
 
 static void init_cpuinfos(heap backed)
@@ -100,6 +111,9 @@ static void init_cpuinfos(heap backed)
         ci->thread_queue = allocate_queue(backed, MAX_THREADS);
         ci->last_timer_update = 0;
         ci->frcount = 0;
+        ci->kern_lock_contended = 0;
+        ci->threads_stolen = 0;
+        ci->smt_siblings = ci->pkg_siblings = U64_FROM_BIT(i);
         /* frame and stacks */
         ci->kernel_context = allocate_kernel_context(backed);
         ci->exception_stack = allocate_stack(backed, EXCEPT_STACK_SIZE);
@@ -119,4 +133,5 @@ void init_kernel_contexts(heap backed)
     assert(spare_kernel_context != INVALID_ADDRESS);
     init_cpuinfos(backed);
     current_cpu()->state = cpu_kernel;
+    enable_heap_magazines();
 }
@@ -50,8 +50,17 @@ typedef struct cpuinfo {
     int state;
     boolean have_kernel_lock;
     queue thread_queue;
+    queue cpu_queue;            /* kernel thunks to run on this cpu */
+    queue poll_queue;           /* pollers keeping this cpu out of hlt */
+    timerheap timers;
     timestamp last_timer_update;
     u64 frcount;
+    u64 kern_lock_contended;
+    u64 threads_stolen;
+
+    /* topology masks used to order thread steal victims */
+    u64 smt_siblings;
+    u64 pkg_siblings;
 
     /* The following fields are used rarely or only on initialization. */
 
@@ -216,12 +225,20 @@ _IRQSAFE_1(void *, queue_peek, queue);
 
 extern queue bhqueue;
 extern queue runqueue;
-extern timerheap runloop_timers;
+
+void enqueue_cpu(u64 cpu, thunk t);
+boolean enqueue_cpu_poll(u64 cpu, thunk t);
+timer kern_register_timer(clock_id id, timestamp val, boolean absolute,
+                          timestamp interval, timer_handler n);
 
 backed_heap physically_backed(heap meta, heap virtual, heap physical, u64 pagesize,
                               boolean locking);
 void physically_backed_dealloc_virtual(backed_heap bh, u64 x, bytes length);
 heap locking_heap_wrapper(heap meta, heap parent);
+heap magazine_heap_wrapper(heap meta, heap parent, bytes parent_pagesize,
+                           int min_order, int max_order);
+u64 magazine_heap_drain(heap h);
+void enable_heap_magazines(void);
 
 void print_stack(context c);
 void print_frame(context f);
@@ -239,7 +256,7 @@ boolean init_hpet(kernel_heaps kh);
 void process_bhqueue();
 void install_fallback_fault_handler(fault_handler h);
 
-void msi_format(u32 *address, u32 *data, int vector);
+void msi_format(u32 *address, u32 *data, int vector, u32 target_cpu);
 
 u64 allocate_interrupt(void);
 void deallocate_interrupt(u64 irq);
@@ -247,6 +264,7 @@ void register_interrupt(int vector, thunk t, const char *name);
 void unregister_interrupt(int vector);
 void triple_fault(void) __attribute__((noreturn));
 void start_cpu(heap h, heap stackheap, int index, void (*ap_entry)());
+void init_cpu_topology(void);
 void install_idt(void);
 
 #define IST_EXCEPTION 1
@@ -331,3 +349,9 @@ extern int shutdown_vector;
 
 typedef closure_type(halt_handler, void, int);
 extern halt_handler vm_halt;
+
+/* Statistics published by kernel components, keyed by symbol; the unix
+   layer presents each as a read-only file under /proc. */
+typedef closure_type(proc_stats_handler, void, buffer);
+extern table proc_stats;
+void register_proc_stats(heap h, symbol name, proc_stats_handler sh);
@@ -70,3 +70,306 @@ heap locking_heap_wrapper(heap meta, heap parent)
     spin_lock_init(&hl->lock);
     return (heap)hl;
 }
+
+/* Per-cpu magazine layer (after Bonwick and Adams, "Magazines and Vmem")
+
+   Objects are cached per cpu and per size class - the order of the
+   object size, rounded up - in magazines: fixed-size stacks of object
+   pointers. Each cpu holds a loaded and a previous magazine for each
+   class, so alloc and free are satisfied with interrupts disabled but
+   without taking the heap lock unless both magazines are empty (alloc)
+   or full (free). Then, under the lock, the depot exchanges a full
+   magazine for an empty one or vice versa, refilling from or flushing
+   to the parent in bulk when the depot has none to give.
+
+   The parent must be an mcache: the size class of an object freed with
+   an unspecified size (-1ull) is recovered from its objcache page
+   footer, and the magazines themselves are allocated from the parent.
+   Objects held in magazines are counted as allocated by the parent. */
+
+#define MAGAZINE_ROUNDS         32
+#define MAGAZINE_BYTES_MAX      (32 * KB)  /* scale rounds down for larger classes */
+#define DEPOT_FULL_MAX          (2 * MAX_CPUS)
+
+typedef struct magazine {
+    struct list l;
+    int rounds;
+    u64 objs[MAGAZINE_ROUNDS];
+} *magazine;
+
+typedef struct magazine_cpu {
+    magazine loaded;
+    magazine previous;
+} *magazine_cpu;
+
+typedef struct magazine_depot {
+    struct list full;
+    struct list empty;
+    u64 nfull;
+    int capacity;               /* rounds per magazine for this class */
+} *magazine_depot;
+
+typedef struct magheap {
+    struct heaplock hl;         /* must be first */
+    bytes parent_pagesize;
+    int min_order;
+    int max_order;
+    struct magazine_depot *depots;
+    struct magazine_cpu *cpus;  /* [cpu][class] */
+} *magheap;
+
+static boolean magazines_enabled;
+
+/* called once the boot cpu can identify itself */
+void enable_heap_magazines(void)
+{
+    magazines_enabled = true;
+}
+
+static inline int magheap_nclasses(magheap mh)
+{
+    return mh->max_order - mh->min_order + 1;
+}
+
+static inline magazine_cpu magheap_cpu(magheap mh, int class)
+{
+    return &mh->cpus[current_cpu()->id * magheap_nclasses(mh) + class];
+}
+
+static inline int magheap_class(magheap mh, bytes size)
+{
+    int order = MAX(find_order(size), mh->min_order);
+    return order <= mh->max_order ? order - mh->min_order : -1;
+}
+
+/* heap lock held */
+static magazine magazine_get_empty_locked(magheap mh, magazine_depot d)
+{
+    list l = list_get_next(&d->empty);
+    if (l) {
+        list_delete(l);
+        return struct_from_list(l, magazine, l);
+    }
+    magazine m = allocate(mh->hl.parent, sizeof(struct magazine));
+    if (m != INVALID_ADDRESS)
+        m->rounds = 0;
+    return m;
+}
+
+/* heap lock held */
+static void magazine_flush_locked(magheap mh, magazine m, bytes objsize)
+{
+    while (m->rounds > 0)
+        deallocate_u64(mh->hl.parent, m->objs[--m->rounds], objsize);
+}
+
+static u64 magheap_alloc(heap h, bytes size)
+{
+    magheap mh = (magheap)h;
+    int class = magheap_class(mh, size);
+    if (!magazines_enabled || class < 0)
+        return heaplock_alloc(h, size);
+
+    u64 irqflags = irq_disable_save();
+    magazine_cpu mc = magheap_cpu(mh, class);
+    magazine_depot d = &mh->depots[class];
+    u64 a;
+    if (mc->loaded && mc->loaded->rounds > 0)
+        goto out_pop;
+    if (mc->previous && mc->previous->rounds > 0) {
+        magazine m = mc->loaded;
+        mc->loaded = mc->previous;
+        mc->previous = m;
+        goto out_pop;
+    }
+
+    /* both empty (or absent): exchange with the depot or refill in bulk */
+    bytes objsize = U64_FROM_BIT(class + mh->min_order);
+    spin_lock(&mh->hl.lock);
+    list l = list_get_next(&d->full);
+    if (l) {
+        list_delete(l);
+        d->nfull--;
+        if (mc->previous)
+            list_push_back(&d->empty, &mc->previous->l);
+        mc->previous = mc->loaded;
+        mc->loaded = struct_from_list(l, magazine, l);
+    } else {
+        if (!mc->loaded) {
+            mc->loaded = magazine_get_empty_locked(mh, d);
+            if (mc->loaded == INVALID_ADDRESS) {
+                mc->loaded = 0;
+                a = allocate_u64(mh->hl.parent, size);
+                spin_unlock(&mh->hl.lock);
+                irq_restore(irqflags);
+                return a;
+            }
+        }
+        magazine m = mc->loaded;
+        while (m->rounds < d->capacity / 2) {
+            u64 o = allocate_u64(mh->hl.parent, objsize);
+            if (o == INVALID_PHYSICAL)
+                break;
+            m->objs[m->rounds++] = o;
+        }
+        if (m->rounds == 0) {
+            spin_unlock(&mh->hl.lock);
+            irq_restore(irqflags);
+            return INVALID_PHYSICAL;
+        }
+    }
+    spin_unlock(&mh->hl.lock);
+  out_pop:
+    a = mc->loaded->objs[--mc->loaded->rounds];
+    irq_restore(irqflags);
+    return a;
+}
+
+static void magheap_dealloc(heap h, u64 x, bytes size)
+{
+    magheap mh = (magheap)h;
+    if (size == -1ull) {
+        heap o = objcache_from_object(x, mh->parent_pagesize);
+        if (o == INVALID_ADDRESS) {
+            heaplock_dealloc(h, x, size);   /* let the parent complain */
+            return;
+        }
+        size = o->pagesize;
+    }
+    int class = magheap_class(mh, size);
+    if (!magazines_enabled || class < 0) {
+        heaplock_dealloc(h, x, size);
+        return;
+    }
+
+    u64 irqflags = irq_disable_save();
+    magazine_cpu mc = magheap_cpu(mh, class);
+    magazine_depot d = &mh->depots[class];
+    if (mc->loaded && mc->loaded->rounds < d->capacity)
+        goto out_push;
+    /* previous may be partly filled, as refills only go halfway */
+    if (mc->previous && mc->previous->rounds < d->capacity) {
+        magazine m = mc->loaded;
+        mc->loaded = mc->previous;
+        mc->previous = m;
+        goto out_push;
+    }
+
+    /* both full (or absent): hand a full magazine to the depot */
+    bytes objsize = U64_FROM_BIT(class + mh->min_order);
+    spin_lock(&mh->hl.lock);
+    if (mc->previous) {
+        if (d->nfull >= DEPOT_FULL_MAX) {
+            /* depot is saturated; return the objects to the parent */
+            magazine_flush_locked(mh, mc->previous, objsize);
+            list_push_back(&d->empty, &mc->previous->l);
+        } else {
+            list_push_back(&d->full, &mc->previous->l);
+            d->nfull++;
+        }
+    }
+    mc->previous = mc->loaded;
+    mc->loaded = magazine_get_empty_locked(mh, d);
+    if (mc->loaded == INVALID_ADDRESS) {
+        mc->loaded = 0;
+        deallocate_u64(mh->hl.parent, x, objsize);
+        spin_unlock(&mh->hl.lock);
+        irq_restore(irqflags);
+        return;
+    }
+    spin_unlock(&mh->hl.lock);
+  out_push:
+    mc->loaded->objs[mc->loaded->rounds++] = x;
+    irq_restore(irqflags);
+}
+
+/* Return the magazines parked in the depots, along with the objects in
+   the full ones, to the parent. Magazines loaded on the cpus are left
+   alone, as only their own cpu may touch them. The lock is dropped
+   between magazines to bound the time spent with interrupts disabled.
+   Returns the number of bytes given back. */
+u64 magazine_heap_drain(heap h)
+{
+    magheap mh = (magheap)h;
+    heaplock hl = &mh->hl;
+    u64 drained = 0;
+    for (int class = magheap_nclasses(mh) - 1; class >= 0; class--) {
+        magazine_depot d = &mh->depots[class];
+        bytes objsize = U64_FROM_BIT(class + mh->min_order);
+        while (1) {
+            lock_heap(hl);
+            list l = list_get_next(&d->full);
+            if (l) {
+                d->nfull--;
+            } else {
+                l = list_get_next(&d->empty);
+                if (!l) {
+                    unlock_heap(hl);
+                    break;
+                }
+            }
+            list_delete(l);
+            magazine m = struct_from_list(l, magazine, l);
+            drained += m->rounds * objsize + sizeof(struct magazine);
+            magazine_flush_locked(mh, m, objsize);
+            deallocate(hl->parent, m, sizeof(struct magazine));
+            unlock_heap(hl);
+        }
+    }
+    return drained;
+}
+
+/* assuming no contention on destroy */
+static void magheap_destroy(heap h)
+{
+    magheap mh = (magheap)h;
+    heap meta = mh->hl.meta;
+    int nclasses = magheap_nclasses(mh);
+    deallocate(meta, mh->cpus, sizeof(struct magazine_cpu) * MAX_CPUS * nclasses);
+    deallocate(meta, mh->depots, sizeof(struct magazine_depot) * nclasses);
+    destroy_heap(mh->hl.parent);    /* takes magazines and their objects with it */
+    deallocate(meta, mh, sizeof(*mh));
+}
+
+/* min_order and max_order bound the size classes to cache; other sizes
+   go straight to the parent under the heap lock */
+heap magazine_heap_wrapper(heap meta, heap parent, bytes parent_pagesize,
+                           int min_order, int max_order)
+{
+    magheap mh = allocate(meta, sizeof(*mh));
+    if (mh == INVALID_ADDRESS)
+        return INVALID_ADDRESS;
+    int nclasses = max_order - min_order + 1;
+    mh->depots = allocate(meta, sizeof(struct magazine_depot) * nclasses);
+    if (mh->depots == INVALID_ADDRESS)
+        goto fail_dealloc_mh;
+    mh->cpus = allocate_zero(meta, sizeof(struct magazine_cpu) * MAX_CPUS * nclasses);
+    if (mh->cpus == INVALID_ADDRESS)
+        goto fail_dealloc_depots;
+    for (int i = 0; i < nclasses; i++) {
+        magazine_depot d = &mh->depots[i];
+        list_init(&d->full);
+        list_init(&d->empty);
+        d->nfull = 0;
+        d->capacity = MAX(2, MIN(MAGAZINE_ROUNDS, MAGAZINE_BYTES_MAX >> (min_order + i)));
+    }
+    heaplock hl = &mh->hl;
+    hl->h.alloc = magheap_alloc;
+    hl->h.dealloc = magheap_dealloc;
+    hl->h.destroy = magheap_destroy;
+    hl->h.allocated = heaplock_allocated;
+    hl->h.total = heaplock_total;
+    hl->h.pagesize = parent->pagesize;
+    hl->parent = parent;
+    hl->meta = meta;
+    spin_lock_init(&hl->lock);
+    mh->parent_pagesize = parent_pagesize;
+    mh->min_order = min_order;
+    mh->max_order = max_order;
+    return (heap)mh;
+  fail_dealloc_depots:
+    deallocate(meta, mh->depots, sizeof(struct magazine_depot) * nclasses);
+  fail_dealloc_mh:
+    deallocate(meta, mh, sizeof(*mh));
+    return INVALID_ADDRESS;
+}
@@ -104,11 +104,26 @@ static inline void pagecache_unlock_node(pagecache_node pn)
     spin_unlock(&pn->pages_lock);
 }
 
+/* bracket page tree modifications for lockless readers; pages_lock held */
+static inline void pagecache_node_modify_begin(pagecache_node pn)
+{
+    pn->pages_seq++;
+    write_barrier();
+}
+
+static inline void pagecache_node_modify_end(pagecache_node pn)
+{
+    write_barrier();
+    pn->pages_seq++;
+}
+
 #else
 #define pagecache_lock_state(pc)
 #define pagecache_unlock_state(pc)
 #define pagecache_lock_node(pn)
 #define pagecache_unlock_node(pn)
+#define pagecache_node_modify_begin(pn)
+#define pagecache_node_modify_end(pn)
 #endif
 
 static inline void change_page_state_locked(pagecache pc, pagecache_page pp, int state)
@@ -397,7 +412,9 @@ static pagecache_page allocate_page_nodelocked(pagecache_node pn, u64 offset)
 #endif
     list_init(&pp->bh_completions);
     list_init(&pp->rq_completions);
+    pagecache_node_modify_begin(pn);
     assert(rbtree_insert_node(&pn->pages, &pp->rbnode));
+    pagecache_node_modify_end(pn);
     fetch_and_add(&pc->total_pages, 1); /* decrement happens without cache lock */
     return pp;
   fail_dealloc_contiguous:
@@ -469,6 +486,104 @@ static pagecache_page page_lookup_or_alloc_nodelocked(pagecache_node pn, u64 n)
     return pp;
 }
 
+#ifdef KERNEL
+/* bound on descent in case a concurrent rotation leads us astray */
+#define PAGE_LOOKUP_LOCKLESS_MAX_DEPTH 128
+
+static pagecache_page page_lookup_lockless(pagecache_node pn, u64 n)
+{
+    word seq = *(volatile word *)&pn->pages_seq;
+    if (seq & 1)
+        return INVALID_ADDRESS;
+    read_barrier();
+    rbnode h = *(volatile rbnode *)&pn->pages.root;
+    for (int depth = 0; h && depth < PAGE_LOOKUP_LOCKLESS_MAX_DEPTH; depth++) {
+        u64 o = page_offset((pagecache_page)h);
+        if (o == n)
+            break;
+        h = *(volatile rbnode *)&h->c[n < o ? 0 : 1];
+    }
+    read_barrier();
+    if (!h || page_offset((pagecache_page)h) != n ||
+        *(volatile word *)&pn->pages_seq != seq)
+        return INVALID_ADDRESS;
+    return (pagecache_page)h;
+}
+
+/* Move pages touched by lockless hits to the tail of the active list,
+   taking state_lock once per batch rather than once per access. */
+static void pagecache_lru_drain(pagecache pc, pagecache_lru_batch b)
+{
+    pagecache_page pages[PAGECACHE_LRU_BATCH];
+    u64 flags = spin_lock_irq(&b->lock);
+    u64 count = b->count;
+    runtime_memcpy(pages, b->pages, count * sizeof(pagecache_page));
+    b->count = 0;
+    spin_unlock_irq(&b->lock, flags);
+    if (count == 0)
+        return;
+
+    pagecache_lock_state(pc);
+    for (u64 i = 0; i < count; i++) {
+        pagecache_page pp = pages[i];
+        if (pp->evicted)
+            continue;
+        switch (page_state(pp)) {
+        case PAGECACHE_PAGESTATE_ACTIVE:
+            pagelist_touch(&pc->active, pp);
+            break;
+        case PAGECACHE_PAGESTATE_NEW:
+            change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_ACTIVE);
+            break;
+        }
+    }
+    pagecache_unlock_state(pc);
+
+    /* may free pages, which takes state_lock */
+    for (u64 i = 0; i < count; i++)
+        refcount_release(&pages[i]->refcount);
+}
+
+static void pagecache_lru_drain_all(pagecache pc)
+{
+    for (int i = 0; i < MAX_CPUS; i++)
+        pagecache_lru_drain(pc, &pc->lru_batch[i]);
+}
+
+static void pagecache_lru_touch(pagecache pc, pagecache_page pp)
+{
+    pagecache_lru_batch b = &pc->lru_batch[current_cpu()->id];
+    refcount_reserve(&pp->refcount);
+    u64 flags = spin_lock_irq(&b->lock);
+    b->pages[b->count++] = pp;
+    boolean full = b->count == PAGECACHE_LRU_BATCH;
+    spin_unlock_irq(&b->lock, flags);
+    if (full)
+        pagecache_lru_drain(pc, b);
+}
+
+/* Return a referenced page if it is present and filled, without taking
+   pages_lock or state_lock. */
+static pagecache_page pagecache_get_page_if_cached(pagecache_node pn, u64 n)
+{
+    pagecache_page pp = page_lookup_lockless(pn, n);
+    if (pp == INVALID_ADDRESS || !refcount_reserve_if_live(&pp->refcount))
+        return INVALID_ADDRESS;
+    switch (page_state(pp)) {
+    case PAGECACHE_PAGESTATE_NEW:
+    case PAGECACHE_PAGESTATE_ACTIVE:
+        pagecache_lru_touch(pn->pv->pc, pp);
+        /* fall through */
+    case PAGECACHE_PAGESTATE_WRITING:
+    case PAGECACHE_PAGESTATE_DIRTY:
+        return pp;
+    default:
+        refcount_release(&pp->refcount);
+        return INVALID_ADDRESS;
+    }
+}
+#endif
+
 static void touch_or_fill_page_by_num_nodelocked(pagecache_node pn, u64 n, merge m, boolean bh)
 {
     pagecache_page pp = page_lookup_or_alloc_nodelocked(pn, n);
@@ -700,6 +815,10 @@ u64 pagecache_drain(u64 drain_bytes)
 
     if ((v = allocate_vector(pc->h, DRAIN_ITER_MAX)) == INVALID_ADDRESS)
         return 0;
+#ifdef KERNEL
+    /* release references held by pending lru touches */
+    pagecache_lru_drain_all(pc);
+#endif
     while (evicted < pages) {
         pagecache_lock_state(pc);
         u64 n = evict_pages_locked(pc, MIN(pages - evicted, DRAIN_ITER_MAX), v);
@@ -784,9 +903,30 @@ closure_function(1, 3, void, pagecache_read_sg,
         q.end = pn->length;
     k.state_offset = q.start >> pc->page_order;
     u64 end = (q.end + MASK(pc->page_order)) >> pc->page_order;
+    u64 pi = k.state_offset;
+#ifdef KERNEL
+    /* serve leading cache hits without node or state locks */
+    for (; pi < end; pi++) {
+        pagecache_page pp = pagecache_get_page_if_cached(pn, pi);
+        if (pp == INVALID_ADDRESS)
+            break;
+        range r = byte_range_from_page(pc, pp);
+        range i = range_intersection(q, r);
+        sg_buf sgb = sg_list_tail_add(sg, range_span(i));
+        sgb->buf = pp->kvirt + (i.start - r.start);
+        sgb->size = range_span(i);
+        sgb->offset = 0;
+        sgb->refcount = &pp->refcount;
+    }
+    if (pi == end) {
+        apply(sh, STATUS_OK);
+        return;
+    }
+    k.state_offset = pi;
+#endif
     pagecache_lock_node(pn);
     pagecache_page pp = (pagecache_page)rbtree_lookup(&pn->pages, &k.rbnode);
-    for (u64 pi = k.state_offset; pi < end; pi++) {
+    for (; pi < end; pi++) {
         if (pp == INVALID_ADDRESS || page_offset(pp) > pi) {
             pp = allocate_page_nodelocked(pn, pi);
             if (pp == INVALID_ADDRESS) {
@@ -932,6 +1072,7 @@ static void pagecache_scan(pagecache pc)
     if (pc->scan_in_progress)   /* unnecessary? */
         return;
     pc->scan_in_progress = true;
+    pagecache_lru_drain_all(pc);
     pagecache_scan_shared_mappings(pc);
     pagecache_commit_dirty_pages(pc);
 }
@@ -957,8 +1098,8 @@ void pagecache_node_add_shared_map(pagecache_node pn, range q /* bytes */, u64 n
     assert(rangemap_insert(pn->shared_maps, &sm->n));
     if (!pc->scan_timer) {
         timestamp t = seconds(PAGECACHE_SCAN_PERIOD_SECONDS);
-        pc->scan_timer = register_timer(runloop_timers, CLOCK_ID_MONOTONIC, t, false, t,
-                                        (timer_handler)&pc->do_scan_timer);
+        pc->scan_timer = kern_register_timer(CLOCK_ID_MONOTONIC, t, false, t,
+                                             (timer_handler)&pc->do_scan_timer);
     }
     pagecache_unlock_state(pc);
 }
@@ -1085,6 +1226,125 @@ void pagecache_node_fetch_pages(pagecache_node pn, range r)
     apply(sh, STATUS_OK);
 }
 
+#endif
+
+/* Readahead
+
+   A stream that reads the page following its previous read (or starts at
+   the beginning of the file) is considered sequential, and a window sized
+   after the read is issued past it. The trailing async_size pages of the
+   window are the most recently issued readahead; once the reader reaches
+   the first of them (the marker), the next chunk is issued past the
+   window, each one larger than the last up to ra->max. The window then
+   spans from the old marker, which the reader is now consuming, to the end
+   of the new chunk, so that the reads leading up to the new marker fall
+   inside it and issue nothing. Reads elsewhere drop the window, so random
+   access doesn't generate readahead. */
+
+static inline u64 ra_initial_size(u64 req, u64 max)
+{
+    u64 size = U64_FROM_BIT(find_order(req));
+    if (size <= max / 32)
+        size *= 4;
+    else if (size <= max / 4)
+        size *= 2;
+    else
+        size = max;
+    return MAX(size, req);
+}
+
+static inline u64 ra_next_size(u64 size, u64 max)
+{
+    return MIN(size < max / 16 ? size * 4 : size * 2, max);
+}
+
+/* Update the window for a read of pages [first, last], which follows a read
+   ending before page prev; returns the pages to fetch, if any. */
+static inline range ra_advance(pagecache_ra ra, u64 first, u64 last, u64 prev)
+{
+    u64 window_end = ra->start + ra->size;
+    if (ra->size > 0 && first >= ra->start && first < window_end) {
+        u64 marker = window_end - ra->async_size;
+        if (last < marker)
+            return irange(0, 0);
+        u64 fetch_start = MAX(window_end, last + 1);
+        ra->async_size = ra_next_size(ra->async_size ? ra->async_size : ra->size, ra->max);
+        ra->start = marker;
+        ra->size = fetch_start + ra->async_size - marker;
+        return irange(fetch_start, fetch_start + ra->async_size);
+    }
+    if (first != prev) {
+        /* random access */
+        ra->size = ra->async_size = 0;
+        return irange(0, 0);
+    }
+    u64 req = last + 1 - first;
+    ra->start = first;
+    ra->size = ra_initial_size(req, ra->max);
+    ra->async_size = ra->size - req;
+    return irange(last + 1, ra->start + ra->size);
+}
+
+#ifdef STAGE3
+void pagecache_set_readahead_max(u64 max)
+{
+    pagecache pc = global_pagecache;
+    pc->readahead_max = max >> pc->page_order;
+}
+
+u64 pagecache_get_readahead_max(void)
+{
+    pagecache pc = global_pagecache;
+    return pc->readahead_max << pc->page_order;
+}
+
+void pagecache_ra_init(pagecache_ra ra, u64 max)
+{
+    ra->start = ra->size = ra->async_size = ra->prev = 0;
+    ra->max = max >> global_pagecache->page_order;
+}
+
+static void ra_fetch(pagecache_node pn, u64 start, u64 end /* pages */)
+{
+    pagecache pc = pn->pv->pc;
+    if (start < end)
+        pagecache_node_fetch_pages(pn, range_lshift(irange(start, end), pc->page_order));
+}
+
+void pagecache_node_readahead(pagecache_node pn, pagecache_ra ra, range r)
+{
+    pagecache pc = pn->pv->pc;
+    if (ra->max == 0 || range_span(r) == 0)
+        return;
+    u64 first = r.start >> pc->page_order;
+    u64 last = (r.end - 1) >> pc->page_order;
+    u64 prev = ra->prev;
+    ra->prev = last + 1;
+    if (r.start >= pn->length)
+        return;
+    range f = ra_advance(ra, first, last, prev);
+    pagecache_debug("%s: node %p, window %ld, size %ld, async %ld, fetch %R\n",
+                    __func__, pn, ra->start, ra->size, ra->async_size, f);
+    ra_fetch(pn, f.start, f.end);
+}
+
+/* Read the given range regardless of access pattern, and arm a marker near
+   its end so that a reader following it continues with async windows. */
+void pagecache_node_force_readahead(pagecache_node pn, pagecache_ra ra, range r)
+{
+    pagecache pc = pn->pv->pc;
+    if (r.end > pn->length)
+        r.end = pn->length;
+    if (!range_valid(r) || range_span(r) == 0)
+        return;
+    pagecache_node_fetch_pages(pn, r);
+    if (ra->max == 0)
+        return;
+    ra->start = r.start >> pc->page_order;
+    ra->size = ((r.end + MASK(pc->page_order)) >> pc->page_order) - ra->start;
+    ra->async_size = MIN(ra->size, ra->max);
+}
+
 static void map_page(pagecache pc, pagecache_page pp, u64 vaddr, u64 flags)
 {
     assert(pp->refcount.c != 0);
@@ -1128,8 +1388,17 @@ void pagecache_map_page(pagecache_node pn, u64 node_offset, u64 vaddr, u64 flags
 boolean pagecache_map_page_if_filled(pagecache_node pn, u64 node_offset, u64 vaddr, u64 flags)
 {
     boolean mapped = false;
+    u64 pi = node_offset >> pn->pv->pc->page_order;
+    pagecache_page pp;
+#ifdef KERNEL
+    pp = pagecache_get_page_if_cached(pn, pi);
+    if (pp != INVALID_ADDRESS) {
+        map_page(pn->pv->pc, pp, vaddr, flags);
+        return true;
+    }
+#endif
     pagecache_lock_node(pn);
-    pagecache_page pp = page_lookup_nodelocked(pn, node_offset >> pn->pv->pc->page_order);
+    pp = page_lookup_nodelocked(pn, pi);
     pagecache_debug("%s: pn %p, node_offset 0x%lx, vaddr 0x%lx, flags 0x%lx, pp %p\n",
                     __func__, pn, node_offset, vaddr, flags, pp);
     if (pp == INVALID_ADDRESS)
@@ -1143,6 +1412,61 @@ boolean pagecache_map_page_if_filled(pagecache_node pn, u64 node_offset, u64 vad
     return mapped;
 }
 
+/* Fault-around: map the pages backing [q.start, q.end) that are already
+   filled and not yet mapped, node_offset corresponding to q.start. Like
+   pagecache_map_page_if_filled, nothing is allocated or read. Returns the
+   number of pages mapped. */
+u64 pagecache_map_filled_pages(pagecache_node pn, u64 node_offset, range q, u64 flags)
+{
+    pagecache pc = pn->pv->pc;
+    u64 pagesize = cache_pagesize(pc);
+    pagecache_page pages[PAGECACHE_MAP_AROUND_MAX];
+    u64 vaddrs[PAGECACHE_MAP_AROUND_MAX];
+    int n = 0;
+
+    pagecache_lock_node(pn);
+    for (u64 v = q.start; v < q.end && n < PAGECACHE_MAP_AROUND_MAX;
+         v += pagesize, node_offset += pagesize) {
+        if (physical_from_virtual(pointer_from_u64(v)) != INVALID_PHYSICAL)
+            continue;           /* already mapped, possibly a private copy */
+        pagecache_page pp = page_lookup_nodelocked(pn, node_offset >> pc->page_order);
+        if (pp == INVALID_ADDRESS)
+            continue;
+        pages[n] = pp;
+        vaddrs[n++] = v;
+    }
+
+    /* take references and touch under a single acquisition of state_lock */
+    int mapped = 0;
+    pagecache_lock_state(pc);
+    for (int i = 0; i < n; i++) {
+        pagecache_page pp = pages[i];
+        switch (page_state(pp)) {
+        case PAGECACHE_PAGESTATE_ACTIVE:
+            pagelist_touch(&pc->active, pp);
+            break;
+        case PAGECACHE_PAGESTATE_NEW:
+            change_page_state_locked(pc, pp, PAGECACHE_PAGESTATE_ACTIVE);
+            break;
+        case PAGECACHE_PAGESTATE_WRITING:
+        case PAGECACHE_PAGESTATE_DIRTY:
+            break;
+        default:
+            continue;           /* not filled */
+        }
+        refcount_reserve(&pp->refcount);
+        pages[mapped] = pp;
+        vaddrs[mapped++] = vaddrs[i];
+    }
+    pagecache_unlock_state(pc);
+
+    for (int i = 0; i < mapped; i++)
+        map_page(pc, pages[i], vaddrs[i], flags);
+    pagecache_unlock_node(pn);
+    pagecache_debug("%s: pn %p, q %R, mapped %d\n", __func__, pn, q, mapped);
+    return mapped;
+}
+
 /* need to move these to x86-specific pc routines */
 closure_function(4, 3, boolean, pagecache_unmap_page_nodelocked,
                  pagecache_node, pn, u64, vaddr_base, u64, node_offset, flush_entry, fe,
@@ -1249,6 +1573,7 @@ pagecache_node pagecache_allocate_node(pagecache_volume pv, sg_io fs_read, sg_io
     }
 #ifdef KERNEL
     spin_lock_init(&pn->pages_lock);
+    pn->pages_seq = 0;
 #endif
     list_insert_before(&pv->nodes, &pn->l);
     init_rbtree(&pn->pages, closure(h, pagecache_page_compare),
@@ -1320,6 +1645,7 @@ void init_pagecache(heap general, heap contiguous, heap physical, u64 pagesize)
     pc->total_pages = 0;
     pc->page_order = find_order(pagesize);
     assert(pagesize == U64_FROM_BIT(pc->page_order));
+    pc->readahead_max = PAGECACHE_READAHEAD_MAX_DEFAULT >> pc->page_order;
     pc->h = general;
     pc->contiguous = contiguous;
     pc->physical = physical;
@@ -1347,6 +1673,10 @@ void init_pagecache(heap general, heap contiguous, heap physical, u64 pagesize)
 #ifdef KERNEL
     init_pagecache_completion_queue(pc, &pc->bh_completions);
     init_pagecache_completion_queue(pc, &pc->rq_completions);
+    for (int i = 0; i < MAX_CPUS; i++) {
+        spin_lock_init(&pc->lru_batch[i].lock);
+        pc->lru_batch[i].count = 0;
+    }
 
     pc->scan_in_progress = false;
     pc->scan_timer = 0;
@@ -31,10 +31,35 @@ void pagecache_map_page(pagecache_node pn, u64 node_offset, u64 vaddr, u64 flags
 
 boolean pagecache_map_page_if_filled(pagecache_node pn, u64 node_offset, u64 vaddr, u64 flags);
 
+#define PAGECACHE_MAP_AROUND_MAX 64 /* pages */
+
+u64 pagecache_map_filled_pages(pagecache_node pn, u64 node_offset, range q, u64 flags);
+
 boolean pagecache_node_do_page_cow(pagecache_node pn, u64 node_offset, u64 vaddr, u64 flags);
 
 void pagecache_node_fetch_pages(pagecache_node pn, range r /* bytes */);
 
+/* readahead state of a sequential stream, e.g. an open file (in pages) */
+typedef struct pagecache_ra {
+    u64 start;                  /* first page of the current window */
+    u64 size;                   /* pages in the current window; 0 if none */
+    u64 async_size;             /* trailing pages of the window last issued */
+    u64 prev;                   /* page following the previous read */
+    u64 max;                    /* window size limit; 0 disables readahead */
+} *pagecache_ra;
+
+#define PAGECACHE_READAHEAD_MAX_DEFAULT (2 * MB)
+
+void pagecache_set_readahead_max(u64 max /* bytes */);
+
+u64 pagecache_get_readahead_max(void);
+
+void pagecache_ra_init(pagecache_ra ra, u64 max /* bytes */);
+
+void pagecache_node_readahead(pagecache_node pn, pagecache_ra ra, range r /* bytes */);
+
+void pagecache_node_force_readahead(pagecache_node pn, pagecache_ra ra, range r /* bytes */);
+
 void pagecache_node_scan_and_commit_shared_pages(pagecache_node pn, range q /* bytes */);
 
 void pagecache_node_close_shared_pages(pagecache_node pn, range q /* bytes */, flush_entry fe);
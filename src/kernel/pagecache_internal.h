@@ -26,9 +26,22 @@ typedef struct pagecache_completion_queue {
     closure_struct(pagecache_service_completions, service);
 } *pagecache_completion_queue;
 
+/* Per-cpu batch of pages touched by lockless cache hits; each entry
+   holds a page reference until the batch is drained under state_lock. */
+#define PAGECACHE_LRU_BATCH 14
+
+typedef struct pagecache_lru_batch {
+#ifdef KERNEL
+    struct spinlock lock;
+#endif
+    u64 count;
+    struct pagecache_page *pages[PAGECACHE_LRU_BATCH];
+} *pagecache_lru_batch;
+
 typedef struct pagecache {
     word total_pages;
     int page_order;
+    u64 readahead_max;          /* default readahead window limit, in pages */
     heap h;
     heap contiguous;
     heap physical;
@@ -46,6 +59,9 @@ typedef struct pagecache {
     struct pagelist active;
     struct pagelist writing;
     struct pagelist dirty;     /* phase 2 */
+#ifdef KERNEL
+    struct pagecache_lru_batch lru_batch[MAX_CPUS];
+#endif
     struct list volumes;
     struct list shared_maps;
 
@@ -71,9 +87,15 @@ typedef struct pagecache_node {
     pagecache_volume pv;
 
     /* pages_lock covers traversal, insertions and removals - consider
-       changing to a rw lock or semaphore */
+       changing to a rw lock or semaphore
+
+       pages_seq is odd while the tree is being modified; cache hits
+       walk the tree without pages_lock and retry under the lock if
+       the sequence changed. This relies on pages never being removed
+       from the tree nor freed while the node exists. */
 #ifdef KERNEL
     struct spinlock pages_lock;
+    word pages_seq;
 #endif
     struct rbtree pages;
     rangemap shared_maps;       /* shared mappings associated with this node */
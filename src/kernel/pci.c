@@ -2,6 +2,7 @@
 #include <pci.h>
 #include <page.h>
 #include <io.h>
+#include <apic.h>
 
 #ifdef PCI_DEBUG
 # define pci_debug rprintf
@@ -270,11 +271,11 @@ int pci_enable_msix(pci_dev dev)
     return num_entries;
 }
 
-void msi_format(u32 *address, u32 *data, int vector)
+void msi_format(u32 *address, u32 *data, int vector, u32 target_cpu)
 {
     u32 dm = 0;             // destination mode: ignored if rh == 0
     u32 rh = 0;             // redirection hint: 0 - disabled
-    u32 destination = 0;    // destination APIC
+    u32 destination = apic_id_from_cpu(target_cpu);  // destination APIC
     *address = (0xfee << 20) | (destination << 12) | (rh << 3) | (dm << 2);
 
     u32 mode = 0;           // delivery mode: 000 fixed, 001 lowest, 010 smi, 100 nmi, 101 init, 111 extint
@@ -292,7 +293,7 @@ void pci_setup_msix(pci_dev dev, int msi_slot, thunk h, const char *name)
 
     u32 a, d;
     u32 vector_control = 0;
-    msi_format(&a, &d, v);
+    msi_format(&a, &d, v, 0);
 
     msix_table[msi_slot*4] = a;
     msix_table[msi_slot*4 + 1] = 0;
@@ -300,6 +301,23 @@ void pci_setup_msix(pci_dev dev, int msi_slot, thunk h, const char *name)
     msix_table[msi_slot*4 + 3] = vector_control;
 }
 
+/* Steer an MSI-X vector to another cpu; the entry is masked while the
+   message is rewritten so that no interrupt is delivered half-formed. */
+void pci_set_msix_target(pci_dev dev, int msi_slot, u32 target_cpu)
+{
+    u32 *msix_table = pci_msix_table(dev);
+    int v = msix_table[msi_slot*4 + 2] & 0xFF;
+    pci_debug("%s: msix_table %p, msi %d: int %d, cpu %d\n", __func__, msix_table, msi_slot, v, target_cpu);
+
+    u32 a, d;
+    msi_format(&a, &d, v, target_cpu);
+    u32 vector_control = msix_table[msi_slot*4 + 3];
+    msix_table[msi_slot*4 + 3] = vector_control | 0x1;
+    msix_table[msi_slot*4] = a;
+    msix_table[msi_slot*4 + 2] = d;
+    msix_table[msi_slot*4 + 3] = vector_control;
+}
+
 void pci_teardown_msix(pci_dev dev, int msi_slot)
 {
     u32 *msix_table = pci_msix_table(dev);
@@ -28,20 +28,25 @@ boolean shutting_down;
 
 queue runqueue;                 /* kernel space from ?*/
 queue bhqueue;                  /* kernel from interrupt */
-timerheap runloop_timers;
 u64 idle_cpu_mask;              /* xxx - limited to 64 aps. consider merging with bitmask */
-timestamp last_timer_update;
 
 static timestamp runloop_timer_min;
 static timestamp runloop_timer_max;
 
+/* used instead of the per-CPU heaps when the platform timer is global */
+static timerheap runloop_timers;
+static timestamp runloop_last_timer_update;
+
 static struct spinlock kernel_lock;
 
 void kern_lock()
 {
     cpuinfo ci = current_cpu();
     assert(ci->state != cpu_interrupt);
-    spin_lock(&kernel_lock);
+    if (!spin_try(&kernel_lock)) {
+        ci->kern_lock_contended++;
+        spin_lock(&kernel_lock);
+    }
     ci->have_kernel_lock = true;
 }
 
@@ -49,12 +54,31 @@ boolean kern_try_lock()
 {
     cpuinfo ci = current_cpu();
     assert(ci->state != cpu_interrupt);
-    if (!spin_try(&kernel_lock))
+    if (!spin_try(&kernel_lock)) {
+        ci->kern_lock_contended++;
         return false;
+    }
     ci->have_kernel_lock = true;
     return true;
 }
 
+/* Spin for the kernel lock on behalf of work that only this CPU can run. The
+   lock may be held across a suspended kernel context (see do_demand_page), so
+   the wait is bounded; the caller rearms the platform timer to retry. */
+static boolean kern_lock_local(cpuinfo ci)
+{
+    for (int i = 0; i < KERN_LOCK_LOCAL_SPIN_MAX; i++) {
+        if (spin_try(&kernel_lock)) {
+            ci->have_kernel_lock = true;
+            return true;
+        }
+        if (i == 0)
+            ci->kern_lock_contended++;
+        kern_pause();
+    }
+    return false;
+}
+
 void kern_unlock()
 {
     cpuinfo ci = current_cpu();
@@ -63,10 +87,32 @@ void kern_unlock()
     spin_unlock(&kernel_lock);
 }
 
+/* Per-CPU timer heaps need a platform timer that each CPU can arm for
+   itself, which is what a per-CPU init (lapic, TSC deadline, Hyper-V
+   synthetic timer) indicates. A single comparator (HPET) or a timer
+   interrupt bound to one CPU (Xen VIRQ_TIMER) would lose timers armed on
+   other CPUs, so in that case all timers go to the global heap, which, as
+   before, is only touched under the kernel lock. */
+static inline boolean percpu_timers(void)
+{
+    return platform_timer_percpu_init != 0;
+}
+
+static inline timerheap runloop_timerheap(cpuinfo ci)
+{
+    return percpu_timers() ? ci->timers : runloop_timers;
+}
+
+/* With per-CPU heaps, a timer is kept in the heap of the registering CPU,
+   which is the only one to service it; interrupts are disabled so that
+   registration can't race with the runloop on this CPU. */
 timer kern_register_timer(clock_id id, timestamp val, boolean absolute,
             timestamp interval, timer_handler n)
 {
-    return register_timer(runloop_timers, id, val, absolute, interval, n);
+    u64 flags = irq_disable_save();
+    timer t = register_timer(runloop_timerheap(current_cpu()), id, val, absolute, interval, n);
+    irq_restore(flags);
+    return t;
 }
 KLIB_EXPORT(kern_register_timer);
 
@@ -81,16 +127,18 @@ static void run_thunk(thunk t, int cpustate)
     //    halt("handler returned %d", cpustate);
 }
 
-/* called with kernel lock held */
-static inline boolean update_timer(void)
+/* called with interrupts disabled, and with the kernel lock held if the
+   timer heap is global */
+static inline boolean update_timer(cpuinfo ci, timestamp here)
 {
-    timestamp next = timer_check(runloop_timers);
-    if (last_timer_update && next == last_timer_update)
+    timestamp *last = percpu_timers() ? &ci->last_timer_update : &runloop_last_timer_update;
+    timestamp next = timer_check(runloop_timerheap(ci));
+    if (*last && next == *last)
         return false;
-    s64 delta = next - now(CLOCK_ID_MONOTONIC);
+    s64 delta = next - here;
     timestamp timeout = delta > (s64)runloop_timer_min ? MIN(delta, runloop_timer_max) : runloop_timer_min;
     sched_debug("set platform timer: delta %lx, timeout %lx\n", delta, timeout);
-    last_timer_update = current_cpu()->last_timer_update = next + timeout - delta;
+    *last = ci->last_timer_update = next + timeout - delta;
     runloop_timer(timeout);
     return true;
 }
@@ -118,6 +166,18 @@ NOTRACE void __attribute__((noreturn)) kernel_sleep(void)
         asm volatile("sti; hlt" ::: "memory");
 }
 
+/* Instead of halting, open a window for pending interrupts (whose handlers
+   end in the runloop anyway) and go around again to run the pollers. The
+   CPU still advertises itself as idle so that threads get migrated here. */
+static void __attribute__((noreturn)) kernel_poll(cpuinfo ci)
+{
+    ci->state = cpu_idle;
+    atomic_set_bit(&idle_cpu_mask, ci->id);
+    asm volatile("sti; pause; cli" ::: "memory");
+    atomic_clear_bit(&idle_cpu_mask, ci->id);
+    runloop();
+}
+
 static void wakeup_cpu(u64 cpu)
 {
     if (atomic_test_and_clear_bit(&idle_cpu_mask, cpu)) {
@@ -126,27 +186,93 @@ static void wakeup_cpu(u64 cpu)
     }
 }
 
-static thunk migrate_to_self(thunk t, u64 cpu_mask)
+/* Queue a kernel thunk to be run on a specific CPU, under the kernel lock,
+   and kick that CPU out of hlt if it is idle. */
+void enqueue_cpu(u64 cpu, thunk t)
 {
-    while (cpu_mask) {
-        u64 cpu = lsb(cpu_mask);
+    cpuinfo ci = cpuinfo_from_id(cpu);
+    assert(enqueue_irqsafe(ci->cpu_queue, t));
+    if (cpu != current_cpu()->id)
+        wakeup_cpu(cpu);
+}
+KLIB_EXPORT(enqueue_cpu);
+
+/* Queue a poller to be run once by the runloop of a specific CPU, under the
+   kernel lock. Unlike enqueue_cpu(), a poller that requeues itself is not run
+   again until the next runloop pass, and while any poller is queued the CPU
+   busy-polls instead of halting. The poll queue is bounded; if it is full,
+   false is returned and the caller must fall back to interrupt-driven
+   operation. */
+boolean enqueue_cpu_poll(u64 cpu, thunk t)
+{
+    cpuinfo ci = cpuinfo_from_id(cpu);
+    if (!enqueue_irqsafe(ci->poll_queue, t)) {
+        sched_debug("poll queue of CPU %d full\n", cpu);
+        return false;
+    }
+    if (cpu != current_cpu()->id)
+        wakeup_cpu(cpu);
+    return true;
+}
+KLIB_EXPORT(enqueue_cpu_poll);
+
+/* Remove and return the nearest CPU in cpu_mask, or -1 if empty. SMT siblings
+   come first, then CPUs in the same package, then everything else; within
+   each tier, CPUs are visited round-robin starting after ci. */
+static u64 next_victim(cpuinfo ci, u64 *cpu_mask)
+{
+    u64 tiers[] = { ci->smt_siblings, ci->pkg_siblings, -1ull };
+    for (int i = 0; i < sizeof(tiers) / sizeof(tiers[0]); i++) {
+        u64 m = *cpu_mask & tiers[i];
+        if (!m)
+            continue;
+        u64 above = m & ~MASK(ci->id + 1);
+        u64 cpu = lsb(above ? above : m);
+        *cpu_mask &= ~U64_FROM_BIT(cpu);
+        return cpu;
+    }
+    return -1ull;
+}
+
+/* Take half (rounded up) of the threads queued on victim. The first is
+   returned to be run here, the rest are moved onto our queue. */
+static thunk steal_threads(cpuinfo ci, cpuinfo victim)
+{
+    u64 n = (queue_length(victim->thread_queue) + 1) / 2;
+    thunk t = INVALID_ADDRESS;
+    while (n-- > 0) {
+        thunk s = dequeue(victim->thread_queue);
+        if (s == INVALID_ADDRESS)
+            break;
+        if (t == INVALID_ADDRESS)
+            t = s;
+        else if (!enqueue(ci->thread_queue, s))
+            assert(enqueue(victim->thread_queue, s));
+    }
+    if (t != INVALID_ADDRESS) {
+        sched_debug("stole threads from CPU %d\n", victim->id);
+        ci->threads_stolen++;
+    }
+    return t;
+}
+
+static thunk migrate_to_self(cpuinfo ci, thunk t, u64 cpu_mask)
+{
+    u64 cpu;
+    while ((cpu = next_victim(ci, &cpu_mask)) != -1ull) {
         cpuinfo cpui = cpuinfo_from_id(cpu);
-        if (t == INVALID_ADDRESS) {
-            t = dequeue(cpui->thread_queue);
-            if (t != INVALID_ADDRESS)
-                sched_debug("migrating thread from idle CPU %d to self\n", cpu);
-        }
+        if (t == INVALID_ADDRESS)
+            t = steal_threads(ci, cpui);
         if ((t != INVALID_ADDRESS) && !queue_empty(cpui->thread_queue))
             wakeup_cpu(cpu);
-        cpu_mask &= ~U64_FROM_BIT(cpu);
     }
     return t;
 }
 
 static void migrate_from_self(cpuinfo ci, u64 cpu_mask)
 {
-    while (cpu_mask) {
-        u64 cpu = lsb(cpu_mask);
+    u64 cpu;
+    while ((cpu = next_victim(ci, &cpu_mask)) != -1ull) {
         cpuinfo cpui = cpuinfo_from_id(cpu);
         thunk t;
         if (!queue_empty(cpui->thread_queue)) {
@@ -156,7 +282,6 @@ static void migrate_from_self(cpuinfo ci, u64 cpu_mask)
             enqueue(cpui->thread_queue, t);
             wakeup_cpu(cpu);
         }
-        cpu_mask &= ~U64_FROM_BIT(cpu);
     }
 }
 
@@ -169,9 +294,9 @@ NOTRACE void __attribute__((noreturn)) runloop_internal()
 
     sched_thread_pause();
     disable_interrupts();
-    sched_debug("runloop from %s b:%d r:%d t:%d i:%x%s\n", state_strings[ci->state],
-                queue_length(bhqueue), queue_length(runqueue), queue_length(ci->thread_queue),
-                idle_cpu_mask, ci->have_kernel_lock ? " locked" : "");
+    sched_debug("runloop from %s b:%d r:%d c:%d t:%d i:%x%s\n", state_strings[ci->state],
+                queue_length(bhqueue), queue_length(runqueue), queue_length(ci->cpu_queue),
+                queue_length(ci->thread_queue), idle_cpu_mask, ci->have_kernel_lock ? " locked" : "");
     ci->state = cpu_kernel;
 
     /* bhqueue is for operations outside the realm of the kernel lock,
@@ -179,63 +304,89 @@ NOTRACE void __attribute__((noreturn)) runloop_internal()
     while ((t = dequeue(bhqueue)) != INVALID_ADDRESS)
         run_thunk(t, cpu_kernel);
 
-    if (kern_try_lock()) {
+    /* Work on the global runqueue can be picked up by any CPU, so it's only
+       serviced opportunistically, and so is the global timer heap. Nobody
+       else will run our expired timers or our CPU queue, though, so spin for
+       the lock if either is pending. */
+    timestamp here = now(CLOCK_ID_MONOTONIC);
+    boolean local_work = !queue_empty(ci->cpu_queue) || !queue_empty(ci->poll_queue) ||
+        (percpu_timers() && timer_check(ci->timers) <= here);
+    if (local_work ? kern_lock_local(ci) : kern_try_lock()) {
         /* invoke expired timer callbacks */
         ci->state = cpu_kernel;
-        timer_service(runloop_timers, now(CLOCK_ID_MONOTONIC));
+        timer_service(runloop_timerheap(ci), here);
+
+        while ((t = dequeue(ci->cpu_queue)) != INVALID_ADDRESS)
+            run_thunk(t, cpu_kernel);
+
+        /* one pass over the pollers; those that requeue wait for the next */
+        for (u64 n = queue_length(ci->poll_queue); n > 0; n--) {
+            if ((t = dequeue(ci->poll_queue)) == INVALID_ADDRESS)
+                break;
+            run_thunk(t, cpu_kernel);
+        }
 
         while ((t = dequeue(runqueue)) != INVALID_ADDRESS)
             run_thunk(t, cpu_kernel);
 
         /* should be a list of per-runloop checks - also low-pri background */
         mm_service();
-        timer_updated = update_timer();
-
+        if (!percpu_timers())
+            timer_updated = update_timer(ci, now(CLOCK_ID_MONOTONIC));
         kern_unlock();
+        if (percpu_timers())
+            timer_updated = update_timer(ci, now(CLOCK_ID_MONOTONIC));
+    } else if (local_work && percpu_timers()) {
+        sched_debug("local work pending, kernel lock busy; retry on timer\n");
+        runloop_timer(runloop_timer_min);
+        ci->last_timer_update = here + runloop_timer_min;
+        timer_updated = true;
+    } else if (local_work) {
+        /* the global timer may fire on another CPU; come back here instead */
+        sched_debug("local work pending, kernel lock busy; retry on self ipi\n");
+        apic_ipi(ci->id, 0, wakeup_vector);
+    } else if (percpu_timers()) {
+        timer_updated = update_timer(ci, here);
     }
 
     if (!shutting_down) {
         t = dequeue(ci->thread_queue);
         if (t == INVALID_ADDRESS) {
-            if (idle_cpu_mask) {
-                /* Try to steal a thread from an idle CPU (so that it doesn't
-                 * have to be woken up), and wake up CPUs that have a non-empty
-                 * thread queue). */
-                t = migrate_to_self(t, idle_cpu_mask & ~MASK(ci->id + 1));
-                t = migrate_to_self(t, idle_cpu_mask & MASK(ci->id));
-            }
+            /* Try to steal threads from an idle CPU first (so that it doesn't
+             * have to be woken up), and wake up CPUs that still have a
+             * non-empty thread queue. */
+            u64 others = MASK(total_processors) & ~U64_FROM_BIT(ci->id);
+            if (idle_cpu_mask)
+                t = migrate_to_self(ci, t, idle_cpu_mask & others);
             if (t == INVALID_ADDRESS) {
-                /* No threads found in idle CPUs: try to steal a thread from a
-                 * CPU that is currently running another thread. */
-                for (u64 cpu = ci->id + 1; ; cpu++) {
-                    if (cpu == total_processors)
-                        cpu = 0;
-                    if (cpu == ci->id)
-                        break;
+                /* No threads found in idle CPUs: try to steal from a CPU that
+                 * is currently running another thread. */
+                u64 cpu;
+                while ((cpu = next_victim(ci, &others)) != -1ull) {
                     cpuinfo cpui = cpuinfo_from_id(cpu);
-                    if (cpui->state == cpu_user) {
-                        t = dequeue(cpui->thread_queue);
-                        if (t != INVALID_ADDRESS) {
-                            sched_debug("migrating thread from CPU %d to self\n", cpu);
-                            break;
-                        }
-                    }
+                    if (cpui->state == cpu_user &&
+                        (t = steal_threads(ci, cpui)) != INVALID_ADDRESS)
+                        break;
                 }
             }
         } else if (idle_cpu_mask) {
             /* Wake up idle CPUs that have a non-empty thread queue, and if our
              * thread queue is non-empty, migrate our threads to idle CPUs. */
-            migrate_from_self(ci, idle_cpu_mask & ~MASK(ci->id + 1));
-            migrate_from_self(ci, idle_cpu_mask & MASK(ci->id));
+            migrate_from_self(ci, idle_cpu_mask & ~U64_FROM_BIT(ci->id));
         }
         if (t != INVALID_ADDRESS) {
-            if (!timer_updated && (total_processors > 1)) {
-                timestamp here = now(CLOCK_ID_MONOTONIC);
+            /* pollers only get to run between time slices */
+            boolean polling = !queue_empty(ci->poll_queue);
+            if (!timer_updated && (total_processors > 1 || polling)) {
+                timestamp slice = polling ? runloop_timer_min : runloop_timer_max;
                 s64 timeout = ci->last_timer_update - here;
-                if ((timeout < 0) || (timeout > runloop_timer_max)) {
+                if ((timeout < 0) || (timeout > slice)) {
                     sched_debug("setting CPU scheduler timer\n");
-                    runloop_timer(runloop_timer_max);
-                    ci->last_timer_update = here + runloop_timer_max;
+                    runloop_timer(slice);
+                    ci->last_timer_update = here + slice;
+                    /* a global timer has been overridden: rearm it next time */
+                    if (!percpu_timers())
+                        runloop_last_timer_update = 0;
                 }
             }
            /* Make sure TLB entries are appropriately flushed before
@@ -246,6 +397,8 @@ NOTRACE void __attribute__((noreturn)) runloop_internal()
     }
 
     sched_thread_pause();
+    if (!shutting_down && !queue_empty(ci->poll_queue))
+        kernel_poll(ci);
     kernel_sleep();
 }    
 
@@ -267,6 +420,15 @@ void init_scheduler(heap h)
     /* scheduling queues init */
     runqueue = allocate_queue(h, 2048);
     bhqueue = allocate_queue(h, 2048);
+    for (int i = 0; i < MAX_CPUS; i++) {
+        cpuinfo ci = cpuinfo_from_id(i);
+        ci->cpu_queue = allocate_queue(h, 2048);
+        assert(ci->cpu_queue != INVALID_ADDRESS);
+        ci->poll_queue = allocate_queue(h, CPU_POLL_QUEUE_SIZE);
+        assert(ci->poll_queue != INVALID_ADDRESS);
+        ci->timers = allocate_timerheap(h, "runloop");
+        assert(ci->timers != INVALID_ADDRESS);
+    }
     runloop_timers = allocate_timerheap(h, "runloop");
     assert(runloop_timers != INVALID_ADDRESS);
     shutting_down = false;
@@ -183,6 +183,7 @@ closure_function(3, 0, void, startup,
     tuple pro = resolve_path(root, split(general, p, '/'));
     if (table_find(root, sym(exec_protection)))
         table_set(pro, sym(exec), null_value);  /* set executable flag */
+    virtqueue_configure(root);
     init_network_iface(root);
     filesystem_read_entire(fs, pro, heap_backed(kh), pg, closure(general, read_program_fail));
     closure_finish();
@@ -48,14 +48,19 @@
 #define LWIP_NO_CTYPE_H 1
 
 #define LWIP_WND_SCALE 1
+#define TCP_RCV_SCALE 8         /* windows up to 16MB */
 #define TCP_MSS 1460            /* Assuming ethernet; may want to derive this */
-#define TCP_WND 65535
-#define TCP_SND_BUF 65535
+/* TCP_WND and TCP_SND_BUF are only ceilings; the per-socket windows and
+   send buffers are sized, and auto-tuned, in netsyscall.c. */
+#define TCP_WND (0xffff << TCP_RCV_SCALE)
+#define TCP_SND_BUF TCP_WND
+#define TCP_SNDLOWAT (4 * TCP_MSS)
 #define TCP_SND_QUEUELEN TCP_SNDQUEUELEN_OVERFLOW
 #define TCP_OVERSIZE TCP_MSS
 #define TCP_QUEUE_OOSEQ 1
+#define LWIP_TCP_PCB_NUM_EXT_ARGS 1
+#define SO_REUSE 1
 
-#define TCP_RCV_SCALE 0         /* XXX check */
 #define TCP_LISTEN_BACKLOG 1
 #define LWIP_DHCP 1
 // would prefer to set this dynamically...also,
@@ -64,6 +69,7 @@
 // some other policy
 #define DHCP_DOES_ARP_CHECK 0
 #define LWIP_NETIF_LOOPBACK 1
+#define LWIP_CHECKSUM_CTRL_PER_NETIF 1
 #define LWIP_NETIF_HOSTNAME 1
 #define MEMP_MEM_MALLOC 1
 typedef unsigned long size_t;
@@ -147,6 +153,7 @@ void lwip_memset(void *x, unsigned char v, unsigned long len);
 int lwip_memcmp(const void *x, const void *y, unsigned long len);
 int lwip_strcmp(const char *x, const char *y);
 int lwip_strncmp(const char *x, const char *y, unsigned long len);
+unsigned short lwip_chksum(const void *dataptr, int len);
 
 #define memcpy(__a, __b, __c) lwip_memcpy(__a, __b, __c)
 #define memcmp(__a, __b, __c) lwip_memcmp(__a, __b, __c)
@@ -156,6 +163,7 @@ int lwip_strncmp(const char *x, const char *y, unsigned long len);
 #define strncmp(__a, __b, __c) lwip_strncmp(__a, __b, __c)
 #define strcmp(__a, __b) lwip_strcmp(__a, __b)
 #define atoi(__a) lwip_atoi(__a)
+#define LWIP_CHKSUM lwip_chksum
 
 static inline void *calloc(size_t n, size_t s)
 {
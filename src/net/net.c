@@ -41,8 +41,8 @@ void sys_timeouts_init(void)
     for (int i = 0; i < n; i++) {
         struct net_lwip_timer * t = (struct net_lwip_timer *)&net_lwip_timers[i];
         timestamp interval = milliseconds(t->interval_ms);
-        register_timer(runloop_timers, CLOCK_ID_MONOTONIC, interval, false, interval,
-                       closure(lwip_heap, dispatch_lwip_timer, t->handler, t->name));
+        kern_register_timer(CLOCK_ID_MONOTONIC, interval, false, interval,
+                            closure(lwip_heap, dispatch_lwip_timer, t->handler, t->name));
 #ifdef LWIP_DEBUG
         lwip_debug("registered %s timer with period of %ld ms\n", t->name, t->interval_ms);
 #endif
@@ -108,6 +108,11 @@ int lwip_memcmp(const void *x, const void *y, unsigned long len)
     return runtime_memcmp(x, y, len);
 }
 
+unsigned short lwip_chksum(const void *dataptr, int len)
+{
+    return csum_fold(csum_add(0, dataptr, len));
+}
+
 int lwip_strcmp(const char *x, const char *y)
 {
     return runtime_strcmp(x, y);
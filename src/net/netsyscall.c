@@ -61,6 +61,17 @@ struct mmsghdr {
     unsigned int msg_len;
 };
 
+#define MSG_OOB         0x00000001
+#define MSG_DONTROUTE   0x00000004
+#define MSG_PROBE       0x00000010
+#define MSG_TRUNC       0x00000020
+#define MSG_DONTWAIT    0x00000040
+#define MSG_EOR         0x00000080
+#define MSG_CONFIRM     0x00000800
+#define MSG_NOSIGNAL    0x00004000
+#define MSG_MORE        0x00008000
+#define MSG_WAITFORONE  0x00010000
+
 struct ifmap {
     unsigned long mem_start;
     unsigned long mem_end;
@@ -121,16 +132,69 @@ enum udp_socket_state {
     UDP_SOCK_CREATED = 1,
 };
 
+/* Buffers queued to lwIP by reference (see socket_sg_write) must not be
+   released until the peer has acknowledged all data queued from them. */
+typedef struct tcp_zc_ref {
+    struct list l;
+    refcount r;
+    u32 end_seq;                /* sequence number following the last byte */
+} *tcp_zc_ref;
+
+typedef struct tcp_zc {
+    heap h;
+    struct list refs;           /* ordered by end_seq */
+} *tcp_zc;
+
+/* Socket buffer sizes: connections start with TCP_SOCK_BUF_INIT and are
+   auto-tuned up to tcp_rmem_max / tcp_wmem_max. */
+#define TCP_SOCK_BUF_INIT           (64 * KB)
+#define TCP_SOCK_BUF_MIN            (2 * TCP_MSS)
+#define TCP_SOCK_BUF_MAX_DEFAULT    (4 * MB)
+
+/* pcb extension argument holding the tcp_zc of a detached pcb */
+static u8 tcp_zc_ext_id;
+
+static u32 tcp_rmem_max = TCP_SOCK_BUF_MAX_DEFAULT;
+static u32 tcp_wmem_max = TCP_SOCK_BUF_MAX_DEFAULT;
+
+/* Sockets listening on the same address and port with SO_REUSEPORT. Each
+   socket binds its own pcb (with SOF_REUSEADDR, so lwIP allows the shared
+   port), but lwIP allows one listening pcb per address and port, so the
+   group owns that one, and connections accepted on it are spread across
+   the members by a hash of the remote address and port. */
+typedef struct reuseport_group {
+    struct list l;              /* on reuseport_groups */
+    struct tcp_pcb *lw;
+    ip_addr_t addr;             /* as bound by the members */
+    u16 port;
+    vector members;             /* listening sockets */
+} *reuseport_group;
+
+static heap reuseport_heap;
+static struct list reuseport_groups;
+
 typedef struct netsock {
     struct sock sock;            /* must be first */
     process p;
     queue incoming;
     err_t lwip_error;           /* lwIP error code; ERR_OK if normal */
     u8 ipv6only:1;
+    u8 reuseport:1;
+    u8 conn_refused:1;          /* reset while connecting; ERR_RST is ECONNREFUSED */
     union {
 	struct {
 	    struct tcp_pcb *lw;
 	    enum tcp_socket_state state; // half open?
+	    tcp_zc zc;
+	    reuseport_group group;  /* if listening with SO_REUSEPORT */
+	    struct pbuf *rcv_tail;  /* last pbuf queued to incoming */
+	    u32 rcv_queued;         /* received bytes not yet read */
+	    u32 rcv_limit;          /* receive buffer, i.e. window ceiling */
+	    u32 rcv_max;            /* auto-tuning bound for rcv_limit */
+	    u64 rcv_total;
+	    u64 rcv_mark;           /* rcv_total at last rcv_limit change */
+	    u32 snd_limit;          /* send buffer */
+	    u32 snd_max;            /* auto-tuning bound for snd_limit */
 	} tcp;
 	struct {
 	    struct udp_pcb *lw;
@@ -143,17 +207,22 @@ static sysreturn netsock_bind(struct sock *sock, struct sockaddr *addr,
         socklen_t addrlen);
 static sysreturn netsock_listen(struct sock *sock, int backlog);
 static sysreturn netsock_connect(struct sock *sock, struct sockaddr *addr,
-        socklen_t addrlen);
+        socklen_t addrlen, thread t, boolean bh, io_completion completion);
 static sysreturn netsock_accept4(struct sock *sock, struct sockaddr *addr,
-        socklen_t *addrlen, int flags);
+        socklen_t *addrlen, int flags, thread t, boolean bh,
+        io_completion completion);
 static sysreturn netsock_sendto(struct sock *sock, void *buf, u64 len,
-        int flags, struct sockaddr *dest_addr, socklen_t addrlen);
+        int flags, struct sockaddr *dest_addr, socklen_t addrlen, thread t,
+        boolean bh, io_completion completion);
 static sysreturn netsock_recvfrom(struct sock *sock, void *buf, u64 len,
-        int flags, struct sockaddr *src_addr, socklen_t *addrlen);
+        int flags, struct sockaddr *src_addr, socklen_t *addrlen, thread t,
+        boolean bh, io_completion completion);
 static sysreturn netsock_sendmsg(struct sock *sock, const struct msghdr *msg,
-                                 int flags);
+                                 int flags, thread t, boolean bh,
+                                 io_completion completion);
 static sysreturn netsock_recvmsg(struct sock *sock, struct msghdr *msg,
-                                 int flags);
+                                 int flags, thread t, boolean bh,
+                                 io_completion completion);
 
 static thunk net_loop_poll;
 static boolean net_loop_poll_queued;
@@ -173,6 +242,201 @@ static void netsock_check_loop(void)
     }
 }
 
+/* Returns the tracking entry for data about to be queued by reference from a
+   buffer held by r, or INVALID_ADDRESS if the data should be copied instead. */
+static tcp_zc_ref tcp_zc_get(netsock s, refcount r)
+{
+    tcp_zc zc = s->info.tcp.zc;
+    if (!zc) {
+        zc = allocate(s->sock.h, sizeof(*zc));
+        if (zc == INVALID_ADDRESS)
+            return INVALID_ADDRESS;
+        zc->h = s->sock.h;
+        list_init(&zc->refs);
+        s->info.tcp.zc = zc;
+    }
+    if (!list_empty(&zc->refs)) {
+        tcp_zc_ref last = struct_from_list(zc->refs.prev, tcp_zc_ref, l);
+        if (last->r == r)
+            return last;
+    }
+    tcp_zc_ref ref = allocate(zc->h, sizeof(*ref));
+    if (ref == INVALID_ADDRESS)
+        return ref;
+    ref->r = r;
+    ref->l.next = 0;            /* not tracked yet */
+    return ref;
+}
+
+static void tcp_zc_put(netsock s, tcp_zc_ref ref, boolean queued)
+{
+    tcp_zc zc = s->info.tcp.zc;
+    if (!ref->l.next) {
+        if (!queued) {
+            deallocate(zc->h, ref, sizeof(*ref));
+            return;
+        }
+        refcount_reserve(ref->r);
+        list_push_back(&zc->refs, &ref->l);
+    }
+    if (queued)
+        ref->end_seq = s->info.tcp.lw->snd_lbb;
+}
+
+static void tcp_zc_release(tcp_zc zc, boolean all, u32 lastack)
+{
+    list_foreach(&zc->refs, e) {
+        tcp_zc_ref ref = struct_from_list(e, tcp_zc_ref, l);
+        if (!all && (s32)(lastack - ref->end_seq) < 0)
+            break;
+        list_delete(e);
+        refcount_release(ref->r);
+        deallocate(zc->h, ref, sizeof(*ref));
+    }
+}
+
+static void tcp_zc_free(tcp_zc zc)
+{
+    tcp_zc_release(zc, true, 0);
+    deallocate(zc->h, zc, sizeof(*zc));
+}
+
+/* lwIP callbacks for a pcb that outlived its socket with data still
+   referenced */
+static err_t tcp_zc_sent(void *arg, struct tcp_pcb *pcb, u16 len)
+{
+    tcp_zc zc = arg;
+    tcp_zc_release(zc, false, pcb->lastack);
+    if (list_empty(&zc->refs)) {
+        tcp_arg(pcb, 0);
+        tcp_ext_arg_set(pcb, tcp_zc_ext_id, 0);
+        deallocate(zc->h, zc, sizeof(*zc));
+    }
+    return ERR_OK;
+}
+
+/* Invoked whenever lwIP frees the pcb, including the paths (reset on close,
+   abort) that never reach the error callback. */
+static void tcp_zc_destroy(u8_t id, void *data)
+{
+    if (data)
+        tcp_zc_free(data);
+}
+
+static const struct tcp_ext_arg_callbacks tcp_zc_ext_callbacks = {
+    .destroy = tcp_zc_destroy,
+};
+
+/* Prevent lwIP callbacks from referencing the socket, which is going away.
+   Buffers still referenced by unacknowledged segments are released as the
+   pcb is drained, or all at once when lwIP frees it. */
+static void tcp_detach(netsock s)
+{
+    struct tcp_pcb *lw = s->info.tcp.lw;
+    tcp_zc zc = s->info.tcp.zc;
+    s->info.tcp.zc = 0;
+    if (zc && !list_empty(&zc->refs)) {
+        tcp_arg(lw, zc);
+        tcp_recv(lw, 0);
+        tcp_sent(lw, tcp_zc_sent);
+        tcp_err(lw, 0);
+        tcp_ext_arg_set_callbacks(lw, tcp_zc_ext_id, &tcp_zc_ext_callbacks);
+        tcp_ext_arg_set(lw, tcp_zc_ext_id, zc);
+        return;
+    }
+    tcp_arg(lw, 0);
+    if (zc)
+        deallocate(zc->h, zc, sizeof(*zc));
+}
+
+/* Open the receive window for buffer space freed since the last update. */
+static void tcp_sock_rcv_update(netsock s)
+{
+    struct tcp_pcb *lw = s->info.tcp.lw;
+    if (!lw)
+        return;
+    u32 limit = MIN(s->info.tcp.rcv_limit, TCP_WND_MAX(lw));
+    u32 used = lw->rcv_wnd + s->info.tcp.rcv_queued;
+    while (used < limit) {
+        /* tcp_recved() takes a 16-bit length */
+        u16 n = MIN(limit - used, U16_MAX);
+        tcp_recved(lw, n);
+        used += n;
+    }
+}
+
+/* lwIP's tcp_close() takes a receive window short of TCP_WND_MAX to mean
+   that the application left data unread, and resets the connection instead
+   of sending a FIN. The window is only held back by the socket buffer limit,
+   so open it fully before closing unless data really is left unread. */
+static void tcp_sock_rcv_close(netsock s)
+{
+    struct tcp_pcb *lw = s->info.tcp.lw;
+    if ((lw->state != ESTABLISHED && lw->state != CLOSE_WAIT) ||
+        s->info.tcp.rcv_queued)
+        return;
+    while (lw->rcv_wnd < TCP_WND_MAX(lw))
+        tcp_recved(lw, MIN(TCP_WND_MAX(lw) - lw->rcv_wnd, U16_MAX));
+}
+
+/* Called when the reader has drained the receive queue. A connection that
+   moved two full windows since the last adjustment without the reader
+   falling behind is bound by the window, so let it grow. */
+static void tcp_sock_rcv_tune(netsock s)
+{
+    u32 limit = s->info.tcp.rcv_limit;
+    if (limit >= s->info.tcp.rcv_max ||
+        s->info.tcp.rcv_total - s->info.tcp.rcv_mark < 2 * (u64)limit)
+        return;
+    s->info.tcp.rcv_limit = MIN(2 * (u64)limit, s->info.tcp.rcv_max);
+    s->info.tcp.rcv_mark = s->info.tcp.rcv_total;
+    net_debug("sock %d, rcv_limit %d\n", s->sock.fd, s->info.tcp.rcv_limit);
+}
+
+/* lwIP opens the whole of TCP_WND once window scaling is negotiated; trim
+   it to the socket receive buffer without retracting the window offered in
+   the SYN. */
+static void tcp_sock_established(netsock s)
+{
+    struct tcp_pcb *lw = s->info.tcp.lw;
+    u32 limit = MIN(s->info.tcp.rcv_limit, TCP_WND_MAX(lw));
+    if (lw->rcv_wnd > limit)
+        lw->rcv_wnd = limit;
+    lw->rcv_ann_wnd = MIN(lw->rcv_ann_wnd, MAX(lw->rcv_wnd, U16_MAX));
+    lw->rcv_ann_right_edge = lw->rcv_nxt + lw->rcv_ann_wnd;
+}
+
+/* Space available for new data. Unless pinned by SO_SNDBUF, the send buffer
+   follows twice what the connection may have in flight, as bounded by both
+   the congestion window and the peer's receive window. */
+static u32 tcp_sock_sndbuf(netsock s)
+{
+    struct tcp_pcb *lw = s->info.tcp.lw;
+    u32 queued = TCP_SND_BUF - lw->snd_buf;
+    if (s->info.tcp.snd_limit < s->info.tcp.snd_max) {
+        u64 target = 2 * (u64)MIN(lw->cwnd, lw->snd_wnd);
+        if (target > s->info.tcp.snd_limit)
+            s->info.tcp.snd_limit = MIN(target, s->info.tcp.snd_max);
+    }
+    if (queued >= s->info.tcp.snd_limit)
+        return 0;
+    return MIN(s->info.tcp.snd_limit - queued, lw->snd_buf);
+}
+
+/* Explicitly sized buffers are exempt from auto-tuning, as on Linux. */
+static void tcp_sock_set_buf(netsock s, int optname, u32 val)
+{
+    if (optname == SO_RCVBUF) {
+        val = MAX(MIN(val, tcp_rmem_max), TCP_SOCK_BUF_MIN);
+        s->info.tcp.rcv_limit = s->info.tcp.rcv_max = val;
+        if (s->info.tcp.state == TCP_SOCK_OPEN)
+            tcp_sock_rcv_update(s);
+    } else {
+        val = MAX(MIN(val, tcp_wmem_max), TCP_SOCK_BUF_MIN);
+        s->info.tcp.snd_limit = s->info.tcp.snd_max = val;
+    }
+}
+
 static netsock get_netsock(struct sock *sock)
 {
     if ((sock->domain != AF_INET) && (sock->domain != AF_INET6))
@@ -195,8 +459,12 @@ closure_function(1, 1, u32, socket_events,
         } else if (s->info.tcp.state == TCP_SOCK_OPEN) {
             return (in ? EPOLLIN | EPOLLRDNORM : 0) |
                 (s->info.tcp.lw->state == ESTABLISHED ?
-                (tcp_sndbuf(s->info.tcp.lw) ? EPOLLOUT | EPOLLWRNORM : 0) :
+                (tcp_sock_sndbuf(s) ? EPOLLOUT | EPOLLWRNORM : 0) :
                 EPOLLIN | EPOLLHUP);
+        } else if (s->info.tcp.state == TCP_SOCK_UNDEFINED) {
+            /* connection reset, refused or shut down: nothing will block */
+            return (in ? EPOLLRDNORM : 0) | EPOLLIN | EPOLLOUT | EPOLLHUP |
+                (s->lwip_error != ERR_OK ? EPOLLERR : 0);
         } else {
             return 0;
         }
@@ -353,6 +621,13 @@ static inline s64 lwip_to_errno(s8 err)
     return -EINVAL;		/* XXX unknown - check return value */
 }
 
+static inline s64 netsock_lwip_errno(netsock s, err_t err)
+{
+    if (err == ERR_RST && s->conn_refused)
+        return -ECONNREFUSED;
+    return lwip_to_errno(err);
+}
+
 static inline void pbuf_consume(struct pbuf *p, u64 length)
 {
     p->len -= length;
@@ -365,6 +640,85 @@ struct udp_entry {
     u16 rport;
 };
 
+/* Skip past filled iovec entries; returns false once the iovec is full. */
+static inline boolean iov_advance(struct iovec *iov, int iovcnt, int *iv, u64 *off)
+{
+    while (*iv < iovcnt && *off == iov[*iv].iov_len) {
+        (*iv)++;
+        *off = 0;
+    }
+    return *iv < iovcnt;
+}
+
+/* Copy data from the head of the incoming queue, which must not be empty,
+   into an iovec. A datagram is consumed whole, with any excess discarded
+   and flagged with MSG_TRUNC; stream data is consumed as far as it fits.
+   Returns the number of bytes copied. */
+static u64 netsock_dequeue_iov(netsock s, struct iovec *iov, int iovcnt,
+                               struct sockaddr *src_addr, socklen_t *addrlen,
+                               int *msg_flags)
+{
+    void *p = queue_peek(s->incoming);
+    assert(p != INVALID_ADDRESS);
+    if (src_addr) {
+        if (s->sock.type == SOCK_STREAM) {
+            remote_sockaddr(s, src_addr, addrlen);
+        } else {
+            struct udp_entry * e = p;
+            addrport_to_sockaddr(s->sock.domain, &e->raddr, e->rport, src_addr,
+                                 addrlen);
+        }
+    }
+
+    u64 xfer_total = 0;
+    int iv = 0;
+    u64 iov_off = 0;
+
+    /* TCP: consume multiple buffers to fill request, if available. */
+    do {
+        struct pbuf * pbuf = s->sock.type == SOCK_STREAM ? (struct pbuf *)p :
+            ((struct udp_entry *)p)->pbuf;
+        struct pbuf *cur_buf = pbuf;
+
+        while (cur_buf && iov_advance(iov, iovcnt, &iv, &iov_off)) {
+            if (cur_buf->len > 0) {
+                u64 xfer = MIN(iov[iv].iov_len - iov_off, cur_buf->len);
+                runtime_memcpy(iov[iv].iov_base + iov_off, cur_buf->payload, xfer);
+                pbuf_consume(cur_buf, xfer);
+                iov_off += xfer;
+                xfer_total += xfer;
+                if (s->sock.type == SOCK_STREAM)
+                    s->info.tcp.rcv_queued -= xfer;
+            }
+            if (cur_buf->len == 0)
+                cur_buf = cur_buf->next;
+        }
+
+        if (!cur_buf || (s->sock.type == SOCK_DGRAM)) {
+            assert(dequeue(s->incoming) == p);
+            if (s->sock.type == SOCK_DGRAM) {
+                if (cur_buf && msg_flags)
+                    *msg_flags |= MSG_TRUNC;
+                deallocate(s->sock.h, p, sizeof(struct udp_entry));
+            } else if (p == s->info.tcp.rcv_tail) {
+                s->info.tcp.rcv_tail = 0;
+            }
+            pbuf_free(pbuf);
+            p = queue_peek(s->incoming);
+            if (p == INVALID_ADDRESS)
+                fdesc_notify_events(&s->sock.f); /* reset a triggered EPOLLIN condition */
+        }
+    } while (s->sock.type == SOCK_STREAM && p != INVALID_ADDRESS &&
+             iov_advance(iov, iovcnt, &iv, &iov_off));
+
+    if (s->sock.type == SOCK_STREAM) {
+        if (p == INVALID_ADDRESS)
+            tcp_sock_rcv_tune(s);
+        tcp_sock_rcv_update(s);
+    }
+    return xfer_total;
+}
+
 static sysreturn sock_read_bh_internal(netsock s, thread t, void * dest,
                                        u64 length, struct sockaddr * src_addr,
                                        socklen_t * addrlen, io_completion completion, u64 flags)
@@ -408,51 +762,8 @@ static sysreturn sock_read_bh_internal(netsock s, thread t, void * dest,
         return BLOCKQ_BLOCK_REQUIRED;               /* back to chewing more cud */
     }
 
-    if (src_addr) {
-        if (s->sock.type == SOCK_STREAM) {
-            remote_sockaddr(s, src_addr, addrlen);
-        } else {
-            struct udp_entry * e = p;
-            addrport_to_sockaddr(s->sock.domain, &e->raddr, e->rport, src_addr,
-                                 addrlen);
-        }
-    }
-
-    u64 xfer_total = 0;
-
-    /* TCP: consume multiple buffers to fill request, if available. */
-    do {
-        struct pbuf * pbuf = s->sock.type == SOCK_STREAM ? (struct pbuf *)p :
-            ((struct udp_entry *)p)->pbuf;
-        struct pbuf *cur_buf = pbuf;
-
-        do {
-            if (cur_buf->len > 0) {
-                u64 xfer = MIN(length, cur_buf->len);
-                runtime_memcpy(dest, cur_buf->payload, xfer);
-                pbuf_consume(cur_buf, xfer);
-                length -= xfer;
-                xfer_total += xfer;
-                dest = (char *) dest + xfer;
-                if (s->sock.type == SOCK_STREAM)
-                    tcp_recved(s->info.tcp.lw, xfer);
-            }
-            if (cur_buf->len == 0)
-                cur_buf = cur_buf->next;
-        } while ((length > 0) && cur_buf);
-
-        if (!cur_buf || (s->sock.type == SOCK_DGRAM)) {
-            assert(dequeue(s->incoming) == p);
-            if (s->sock.type == SOCK_DGRAM)
-                deallocate(s->sock.h, p, sizeof(struct udp_entry));
-            pbuf_free(pbuf);
-            p = queue_peek(s->incoming);
-            if (p == INVALID_ADDRESS)
-                fdesc_notify_events(&s->sock.f); /* reset a triggered EPOLLIN condition */
-        }
-    } while(s->sock.type == SOCK_STREAM && length > 0 && p != INVALID_ADDRESS); /* XXX simplify expression */
-
-    rv = xfer_total;
+    struct iovec iov = { .iov_base = dest, .iov_len = length };
+    rv = netsock_dequeue_iov(s, &iov, 1, src_addr, addrlen, 0);
   out:
     net_debug("   completion %p, rv %ld\n", completion, rv);
     blockq_handle_completion(s->sock.rxbq, flags, completion, t, rv);
@@ -470,7 +781,7 @@ closure_function(7, 1, sysreturn, sock_read_bh,
 }
 
 static void recvmsg_complete_internal(netsock s, struct msghdr * msg, void * dest, u64 length,
-                                      thread t, sysreturn rv)
+                                      io_completion completion, thread t, sysreturn rv)
 {
     s64 offset = 0;
     int iv = 0;
@@ -485,26 +796,26 @@ static void recvmsg_complete_internal(netsock s, struct msghdr * msg, void * des
     deallocate(s->sock.h, dest, length);
     msg->msg_controllen = 0;
     msg->msg_flags = 0;
-    apply(syscall_io_complete, t, rv);
+    apply(completion, t, rv);
 }
 
-closure_function(4, 2, void, recvmsg_complete,
-                 netsock, s, struct msghdr *, msg, void *, dest, u64, length,
+closure_function(5, 2, void, recvmsg_complete,
+                 netsock, s, struct msghdr *, msg, void *, dest, u64, length, io_completion, completion,
                  thread, t, sysreturn, rv)
 {
-    recvmsg_complete_internal(bound(s), bound(msg), bound(dest), bound(length), t, rv);
+    recvmsg_complete_internal(bound(s), bound(msg), bound(dest), bound(length), bound(completion), t, rv);
     closure_finish();
 }
 
-closure_function(5, 1, sysreturn, recvmsg_bh,
-                 netsock, s, thread, t, void *, dest, u64, length, struct msghdr *, msg,
+closure_function(6, 1, sysreturn, recvmsg_bh,
+                 netsock, s, thread, t, void *, dest, u64, length, struct msghdr *, msg, io_completion, completion,
                  u64, flags)
 {
-    io_completion completion = closure(bound(s)->sock.h, recvmsg_complete,
-                                       bound(s), bound(msg), bound(dest),
-                                       bound(length));
+    io_completion complete = closure(bound(s)->sock.h, recvmsg_complete,
+                                     bound(s), bound(msg), bound(dest),
+                                     bound(length), bound(completion));
     sysreturn rv = sock_read_bh_internal(bound(s), bound(t), bound(dest), bound(length), bound(msg)->msg_name,
-                                         &bound(msg)->msg_namelen, completion, flags);
+                                         &bound(msg)->msg_namelen, complete, flags);
     if (rv != BLOCKQ_BLOCK_REQUIRED)
         closure_finish();
     return rv;
@@ -550,11 +861,8 @@ static sysreturn socket_write_tcp_bh_internal(netsock s, thread t, void * buf,
         goto out;
     }
 
-    /* Note that the actual transmit window size is truncated to 16
-       bits here (and tcp_write() doesn't accept more than 2^16
-       anyway), so even if we have a large transmit window due to
-       LWIP_WND_SCALE, we still can't write more than 2^16. Sigh... */
-    u64 avail = tcp_sndbuf(s->info.tcp.lw);
+    struct tcp_pcb *lw = s->info.tcp.lw;
+    u64 avail = tcp_sock_sndbuf(s);
     if (avail == 0) {
       full:
         if ((flags & BLOCKQ_ACTION_BLOCKED) == 0 &&
@@ -568,27 +876,34 @@ static sysreturn socket_write_tcp_bh_internal(netsock s, thread t, void * buf,
         }
     }
 
-    /* Figure actual length and flags */
-    u64 n;
-    u8 apiflags = TCP_WRITE_FLAG_COPY;
-    if (avail < remain) {
-        n = avail;
-        apiflags |= TCP_WRITE_FLAG_MORE;
-    } else {
-        n = remain;
-    }
+    /* tcp_write() takes a 16-bit length, so queue large writes in pieces */
+    u64 n = MIN(avail, remain);
+    u64 written = 0;
+    do {
+        u64 len = MIN(n - written, U16_MAX);
+        u8 apiflags = TCP_WRITE_FLAG_COPY;
+        if (written + len < remain)
+            apiflags |= TCP_WRITE_FLAG_MORE;
+        /* tcp_write() fails with ERR_MEM when lwIP's own send buffer or
+           segment queue limit is reached before our estimate, and with
+           ERR_CONN once the connection is closing. Stop at the first error:
+           whatever was queued is returned as a short write, and the error
+           is seen again on the next call. */
+        err = tcp_write(lw, buf + written, len, apiflags);
+        if (err != ERR_OK)
+            break;
+        written += len;
+    } while (written < n);
 
-    /* XXX need to pore over lwIP error conditions here */
-    err = tcp_write(s->info.tcp.lw, buf, n, apiflags);
-    if (err == ERR_OK) {
+    if (written > 0) {
         /* XXX prob add a flag to determine whether to continuously
            post data, e.g. if used by send/sendto... */
-        err = tcp_output(s->info.tcp.lw);
+        err = tcp_output(lw);
         if (err == ERR_OK) {
-            net_debug(" tcp_write and tcp_output successful for %ld bytes\n", n);
+            net_debug(" tcp_write and tcp_output successful for %ld bytes\n", written);
             netsock_check_loop();
-            rv = n;
-            if (n == avail) {
+            rv = written;
+            if (written == avail) {
                 fdesc_notify_events(&s->sock.f); /* reset a triggered EPOLLOUT condition */
             }
         } else {
@@ -597,7 +912,8 @@ static sysreturn socket_write_tcp_bh_internal(netsock s, thread t, void * buf,
             /* XXX map error to socket tcp state */
         }
     } else if (err == ERR_MEM) {
-        /* XXX some ambiguity in lwIP - investigate */
+        /* nothing queued: treat as a full send buffer, as lwIP frees space
+           and calls tcp_sent() when the peer acknowledges data */
         net_debug(" tcp_write() returned ERR_MEM\n");
         goto full;
     } else {
@@ -707,6 +1023,138 @@ closure_function(1, 6, sysreturn, socket_write,
     return socket_write_internal(s, source, length, 0, 0, t, bh, completion);
 }
 
+/* Buffers with a refcount (e.g. pagecache pages from sendfile) are handed to
+   lwIP by reference and held until acknowledged; others are copied. */
+closure_function(5, 1, sysreturn, socket_sg_write_tcp_bh,
+                 netsock, s, thread, t, sg_list, sg, u64, remain, io_completion, completion,
+                 u64, flags)
+{
+    netsock s = bound(s);
+    thread t = bound(t);
+    sg_list sg = bound(sg);
+    u64 remain = bound(remain);
+    sysreturn rv = 0;
+    err_t err = get_lwip_error(s);
+    net_debug("fd %d, thread %ld, sg %p, remain %ld, flags 0x%lx, lwip err %d\n",
+              s->sock.fd, t->tid, sg, remain, flags, err);
+
+    if (err != ERR_OK) {
+        rv = lwip_to_errno(err);
+        goto out;
+    }
+
+    if (s->info.tcp.state != TCP_SOCK_OPEN) {
+        rv = -ENOTCONN;
+        goto out;
+    }
+
+    if (flags & BLOCKQ_ACTION_NULLIFY) {
+        rv = -ERESTARTSYS;
+        goto out;
+    }
+
+    struct tcp_pcb *lw = s->info.tcp.lw;
+    u64 written = 0;
+    sg_buf sgb;
+    while (written < remain && (sgb = sg_list_head_peek(sg)) != INVALID_ADDRESS) {
+        u64 avail = tcp_sock_sndbuf(s);
+        if (avail == 0)
+            break;
+        u64 len = sgb->size - sgb->offset;
+        /* tcp_write() takes a 16-bit length */
+        u64 n = MIN(MIN(len, remain - written), MIN(avail, U16_MAX));
+        u8 apiflags = 0;
+        if (written + n < remain)
+            apiflags |= TCP_WRITE_FLAG_MORE;
+        tcp_zc_ref ref = sgb->refcount ? tcp_zc_get(s, sgb->refcount) : INVALID_ADDRESS;
+        if (ref == INVALID_ADDRESS)
+            apiflags |= TCP_WRITE_FLAG_COPY;
+        err = tcp_write(lw, sgb->buf + sgb->offset, n, apiflags);
+        if (ref != INVALID_ADDRESS)
+            tcp_zc_put(s, ref, err == ERR_OK);
+        if (err != ERR_OK)
+            break;
+        written += n;
+        sgb->offset += n;
+        if (n == len) {
+            sg_list_head_remove(sg);
+            sg_buf_release(sgb);
+        }
+    }
+
+    if (written == 0) {
+        if (err != ERR_OK && err != ERR_MEM) {
+            net_debug(" tcp_write() lwip error: %d\n", err);
+            rv = lwip_to_errno(err);
+            goto out;
+        }
+        if ((flags & BLOCKQ_ACTION_BLOCKED) == 0 &&
+                (s->sock.f.flags & SOCK_NONBLOCK)) {
+            net_debug(" send buf full and non-blocking, return EAGAIN\n");
+            rv = -EAGAIN;
+            goto out;
+        }
+        net_debug(" send buf full, sleep\n");
+        return BLOCKQ_BLOCK_REQUIRED;
+    }
+
+    err = tcp_output(lw);
+    if (err == ERR_OK) {
+        net_debug(" tcp_write and tcp_output successful for %ld bytes\n", written);
+        netsock_check_loop();
+        rv = written;
+        if (tcp_sock_sndbuf(s) == 0)
+            fdesc_notify_events(&s->sock.f); /* reset a triggered EPOLLOUT condition */
+    } else {
+        net_debug(" tcp_output() lwip error: %d\n", err);
+        rv = lwip_to_errno(err);
+    }
+  out:
+    net_debug("   completion %p, rv %ld\n", bound(completion), rv);
+    blockq_handle_completion(s->sock.txbq, flags, bound(completion), t, rv);
+    closure_finish();
+    return rv;
+}
+
+closure_function(1, 6, sysreturn, socket_sg_write,
+                 netsock, s,
+                 sg_list, sg, u64, length, u64, offset, thread, t, boolean, bh, io_completion, completion)
+{
+    netsock s = bound(s);
+    sysreturn rv;
+    net_debug("sock %d, type %d, thread %ld, sg %p, length %ld\n",
+              s->sock.fd, s->sock.type, t->tid, sg, length);
+    if (s->sock.type == SOCK_STREAM) {
+        if (s->info.tcp.state != TCP_SOCK_OPEN) {
+            rv = -EPIPE;
+            goto out;
+        }
+        if (length == 0) {
+            rv = 0;
+            goto out;
+        }
+        blockq_action ba = closure(s->sock.h, socket_sg_write_tcp_bh, s, t, sg,
+                                   length, completion);
+        if (ba == INVALID_ADDRESS) {
+            rv = -ENOMEM;
+            goto out;
+        }
+        return blockq_check(s->sock.txbq, t, ba, bh);
+    }
+
+    /* datagrams are sent from a single contiguous buffer */
+    void *buf = allocate(s->sock.h, length);
+    if (buf == INVALID_ADDRESS) {
+        rv = -ENOMEM;
+        goto out;
+    }
+    u64 n = sg_copy_to_buf(buf, sg, length);
+    rv = socket_write_udp(s, buf, n, 0, 0);
+    deallocate(s->sock.h, buf, length);
+  out:
+    return io_complete(completion, t, rv);
+}
+
 closure_function(1, 2, sysreturn, netsock_ioctl,
                  netsock, s,
                  unsigned long, request, vlist, ap)
@@ -840,6 +1288,26 @@ closure_function(1, 2, sysreturn, netsock_ioctl,
 
 #define SOCK_QUEUE_LEN 128
 
+static void tcp_reuseport_leave(netsock s)
+{
+    reuseport_group g = s->info.tcp.group;
+    net_debug("sock %d leaves group %p\n", s->sock.fd, g);
+    s->info.tcp.group = 0;
+    for (int i = 0; i < vector_length(g->members); i++) {
+        if (vector_get(g->members, i) == s) {
+            vector_delete(g->members, i);
+            break;
+        }
+    }
+    if (vector_length(g->members) > 0)
+        return;
+    tcp_arg(g->lw, 0);
+    tcp_close(g->lw);
+    list_delete(&g->l);
+    deallocate_vector(g->members);
+    deallocate(reuseport_heap, g, sizeof(*g));
+}
+
 closure_function(1, 2, sysreturn, socket_close,
                  netsock, s,
                  thread, t, io_completion, completion)
@@ -848,13 +1316,17 @@ closure_function(1, 2, sysreturn, socket_close,
     net_debug("sock %d, type %d\n", s->sock.fd, s->sock.type);
     switch (s->sock.type) {
     case SOCK_STREAM:
+        if (s->info.tcp.group)
+            tcp_reuseport_leave(s);
         /* tcp_close() doesn't really stop everything synchronously; in order to
          * prevent any lwIP callback that might be called after tcp_close() from
          * using a stale reference to the socket structure, set the callback
          * argument to NULL. */
         if (s->info.tcp.lw) {
-            tcp_close(s->info.tcp.lw);
-            tcp_arg(s->info.tcp.lw, 0);
+            struct tcp_pcb *lw = s->info.tcp.lw;
+            tcp_sock_rcv_close(s);
+            tcp_detach(s);
+            tcp_close(lw);
             netsock_check_loop();
         }
         break;
@@ -865,6 +1337,7 @@ closure_function(1, 2, sysreturn, socket_close,
     deallocate_queue(s->incoming);
     deallocate_closure(s->sock.f.read);
     deallocate_closure(s->sock.f.write);
+    deallocate_closure(s->sock.f.sg_write);
     deallocate_closure(s->sock.f.close);
     deallocate_closure(s->sock.f.events);
     deallocate_closure(s->sock.f.ioctl);
@@ -899,7 +1372,8 @@ static sysreturn netsock_shutdown(struct sock *sock, int how)
             return -ENOTCONN;
         }
         if (shut_rx && shut_tx) {
-            tcp_arg(s->info.tcp.lw, 0);
+            tcp_sock_rcv_close(s);
+            tcp_detach(s);
         }
         tcp_shutdown(s->info.tcp.lw, shut_rx, shut_tx);
         if (shut_rx && shut_tx) {
@@ -908,6 +1382,7 @@ static sysreturn netsock_shutdown(struct sock *sock, int how)
             s->info.tcp.lw = 0;
             s->info.tcp.state = TCP_SOCK_UNDEFINED;
         }
+        wakeup_sock(s, WAKEUP_SOCK_RX | WAKEUP_SOCK_TX);
         netsock_check_loop();
         break;
     case SOCK_DGRAM:
@@ -945,8 +1420,13 @@ static void udp_input_lower(void *z, struct udp_pcb *pcb, struct pbuf *p,
 	e->pbuf = p;
 	runtime_memcpy(&e->raddr, addr, sizeof(ip_addr_t));
 	e->rport = port;
-	if (!enqueue(s->incoming, e))
-	    msg_err("incoming queue full\n");
+	if (!enqueue(s->incoming, e)) {
+	    /* drop the datagram, as a full receive buffer would */
+	    net_debug("incoming queue full\n");
+	    pbuf_free(p);
+	    deallocate(s->sock.h, e, sizeof(*e));
+	    return;
+	}
     } else {
 	msg_err("null pbuf\n");
     }
@@ -971,6 +1451,7 @@ static int allocate_sock(process p, int af, int type, u32 flags, netsock *rs)
     }
     s->sock.f.read = closure(h, socket_read, s);
     s->sock.f.write = closure(h, socket_write, s);
+    s->sock.f.sg_write = closure(h, socket_sg_write, s);
     s->sock.f.close = closure(h, socket_close, s);
     s->sock.f.events = closure(h, socket_events, s);
     s->sock.f.ioctl = closure(h, netsock_ioctl, s);
@@ -992,6 +1473,8 @@ static int allocate_sock(process p, int af, int type, u32 flags, netsock *rs)
     s->sock.recvmsg = netsock_recvmsg;
     s->sock.shutdown = netsock_shutdown;
     s->ipv6only = 0;
+    s->reuseport = 0;
+    s->conn_refused = 0;
     set_lwip_error(s, ERR_OK);
     *rs = s;
     return fd;
@@ -1011,6 +1494,15 @@ static int allocate_tcp_sock(process p, int af, struct tcp_pcb *pcb, u32 flags)
     if (fd >= 0) {
 	s->info.tcp.lw = pcb;
 	s->info.tcp.state = TCP_SOCK_CREATED;
+	s->info.tcp.zc = 0;
+	s->info.tcp.group = 0;
+	s->info.tcp.rcv_tail = 0;
+	s->info.tcp.rcv_queued = 0;
+	s->info.tcp.rcv_limit = MIN(TCP_SOCK_BUF_INIT, tcp_rmem_max);
+	s->info.tcp.rcv_max = tcp_rmem_max;
+	s->info.tcp.rcv_total = s->info.tcp.rcv_mark = 0;
+	s->info.tcp.snd_limit = MIN(TCP_SOCK_BUF_INIT, tcp_wmem_max);
+	s->info.tcp.snd_max = tcp_wmem_max;
     }
     return fd;
 }
@@ -1094,10 +1586,25 @@ static err_t tcp_input_lower(void *z, struct tcp_pcb *pcb, struct pbuf *p, err_t
 
     /* A null pbuf indicates connection closed. */
     if (p) {
-        if (!enqueue(s->incoming, p)) {
-	    msg_err("incoming queue full\n");
-            return ERR_BUF;     /* XXX verify */
+        u16 len = p->tot_len;
+        if (enqueue(s->incoming, p)) {
+            s->info.tcp.rcv_tail = p;
+        } else {
+            /* Small segments can outnumber the queue slots with a large
+               window; chain onto the newest queued pbuf instead. */
+            struct pbuf *tail = s->info.tcp.rcv_tail;
+            if (!tail || tail->tot_len + len > U16_MAX) {
+                /* Any result other than ERR_OK or ERR_ABRT makes lwIP keep p
+                   as the pcb's refused data, without shrinking the window,
+                   and offer it again from its fast timer and on the next
+                   segment. So p must not be freed or counted here. */
+                net_debug("incoming queue full, refusing %p\n", p);
+                return ERR_BUF;
+            }
+            pbuf_cat(tail, p);
         }
+        s->info.tcp.rcv_queued += len;
+        s->info.tcp.rcv_total += len;
     }
     wakeup_sock(s, WAKEUP_SOCK_RX);
 
@@ -1122,6 +1629,8 @@ static sysreturn netsock_bind(struct sock *sock, struct sockaddr *addr,
     if (sock->type == SOCK_STREAM) {
 	if (s->info.tcp.lw->local_port != 0)
 	    return -EINVAL;	/* already bound */
+        if (s->reuseport)
+            ip_set_option(s->info.tcp.lw, SOF_REUSEADDR);
 	net_debug("calling tcp_bind, pcb %p, port %d\n", s->info.tcp.lw, port);
 	err = tcp_bind(s->info.tcp.lw, &ipaddr, port);
     } else if (sock->type == SOCK_DGRAM) {
@@ -1155,11 +1664,17 @@ static void lwip_tcp_conn_err(void * z, err_t err) {
     }
     netsock s = z;
     net_debug("sock %d, err %d\n", s->sock.fd, err);
+    if (s->info.tcp.state == TCP_SOCK_IN_CONNECTION)
+        s->conn_refused = 1;
     s->info.tcp.state = TCP_SOCK_UNDEFINED;
     set_lwip_error(s, err);
 
     /* Don't try to use the pcb, it may have been deallocated already. */
     s->info.tcp.lw = 0;
+    if (s->info.tcp.zc) {
+        tcp_zc_free(s->info.tcp.zc);
+        s->info.tcp.zc = 0;
+    }
 
     wakeup_sock(s, WAKEUP_SOCK_EXCEPT);
 }
@@ -1171,12 +1686,14 @@ static err_t lwip_tcp_sent(void * arg, struct tcp_pcb * pcb, u16 len)
     }
     netsock s = (netsock)arg;
     net_debug("fd %d, pcb %p, len %d\n", s->sock.fd, pcb, len);
+    if (s->info.tcp.zc)
+        tcp_zc_release(s->info.tcp.zc, false, pcb->lastack);
     wakeup_sock(s, WAKEUP_SOCK_TX);
     return ERR_OK;
 }
 
-closure_function(2, 1, sysreturn, connect_tcp_bh,
-                 netsock, s, thread, t,
+closure_function(3, 1, sysreturn, connect_tcp_bh,
+                 netsock, s, thread, t, io_completion, completion,
                  u64, flags)
 {
     sysreturn rv = 0;
@@ -1187,7 +1704,7 @@ closure_function(2, 1, sysreturn, connect_tcp_bh,
     net_debug("sock %d, tcp state %d, thread %ld, lwip_status %d, flags 0x%lx\n",
               s->sock.fd, s->info.tcp.state, t->tid, err, flags);
 
-    rv = lwip_to_errno(err);
+    rv = netsock_lwip_errno(s, err);
     if (flags & BLOCKQ_ACTION_NULLIFY) {
         /* XXX spinlock */
         if (rv == 0) {
@@ -1199,10 +1716,15 @@ closure_function(2, 1, sysreturn, connect_tcp_bh,
 
     if (s->info.tcp.state == TCP_SOCK_IN_CONNECTION)
         return BLOCKQ_BLOCK_REQUIRED;
-    assert(s->info.tcp.state == TCP_SOCK_OPEN);
+    if (s->info.tcp.state != TCP_SOCK_OPEN) {
+        /* refused or reset; the error is reported here rather than by SO_ERROR */
+        assert(rv != 0);
+        get_and_clear_lwip_error(s);
+    }
   out:
+    blockq_handle_completion(s->sock.rxbq, flags, bound(completion), t, rv);
     closure_finish();
-    return syscall_return(t, rv);
+    return rv;
 }
 
 static err_t connect_tcp_complete(void* arg, struct tcp_pcb* tpcb, err_t err)
@@ -1219,26 +1741,33 @@ static err_t connect_tcp_complete(void* arg, struct tcp_pcb* tpcb, err_t err)
    assert(s->info.tcp.state == TCP_SOCK_IN_CONNECTION);
    s->info.tcp.state = TCP_SOCK_OPEN; /* XXX state handling needs fixing; this could indicate an error as well */
    set_lwip_error(s, err);
-   blockq_wake_one(s->sock.rxbq);
+   if (err == ERR_OK)
+       tcp_sock_established(s);
+   wakeup_sock(s, WAKEUP_SOCK_RX);
    return ERR_OK;
 }
 
-static inline err_t connect_tcp(netsock s, const ip_addr_t* address,
-                                unsigned short port)
+static sysreturn connect_tcp(netsock s, const ip_addr_t* address,
+                             unsigned short port, thread t, boolean bh,
+                             io_completion completion)
 {
+    err_t err;
     net_debug("sock %d, tcp state %d, port %d\n", s->sock.fd,
             s->info.tcp.state, port);
     switch (s->info.tcp.state) {
     case TCP_SOCK_IN_CONNECTION:
     case TCP_SOCK_ABORTING_CONNECTION:
-        return ERR_ALREADY;
+        err = ERR_ALREADY;
+        goto out;
     case TCP_SOCK_OPEN:
-        return ERR_ISCONN;
+        err = ERR_ISCONN;
+        goto out;
     case TCP_SOCK_CREATED:
         break;
     default:
         msg_err("connect attempt while in state %d\n", s->info.tcp.state);
-        return ERR_VAL;
+        err = ERR_VAL;
+        goto out;
     }
     struct tcp_pcb * lw = s->info.tcp.lw;
     tcp_arg(lw, s);
@@ -1246,21 +1775,23 @@ static inline err_t connect_tcp(netsock s, const ip_addr_t* address,
     tcp_err(lw, lwip_tcp_conn_err);
     tcp_sent(lw, lwip_tcp_sent);
     s->info.tcp.state = TCP_SOCK_IN_CONNECTION;
+    s->conn_refused = 0;
     set_lwip_error(s, ERR_OK);
-    err_t err = tcp_connect(lw, address, port, connect_tcp_complete);
+    err = tcp_connect(lw, address, port, connect_tcp_complete);
     if (err != ERR_OK)
-        return err;
+        goto out;
     netsock_check_loop();
+    if (s->sock.f.flags & SOCK_NONBLOCK)
+        return io_complete(completion, t, -EINPROGRESS);
 
-    sysreturn rv = blockq_check(s->sock.rxbq, current,
-            closure(s->sock.h, connect_tcp_bh, s, current), false);
-    /* should not return under normal cirucmstances */
-    msg_err("blockq check error: %ld\n", rv);
-    return ERR_OK;
+    blockq_action ba = closure(s->sock.h, connect_tcp_bh, s, t, completion);
+    return blockq_check(s->sock.rxbq, t, ba, bh);
+  out:
+    return io_complete(completion, t, lwip_to_errno(err));
 }
 
 static sysreturn netsock_connect(struct sock *sock, struct sockaddr *addr,
-        socklen_t addrlen)
+        socklen_t addrlen, thread t, boolean bh, io_completion completion)
 {
     err_t err = ERR_OK;
     netsock s = (netsock) sock;
@@ -1269,26 +1800,26 @@ static sysreturn netsock_connect(struct sock *sock, struct sockaddr *addr,
     sysreturn ret = sockaddr_to_addrport(s->sock.domain, addr, addrlen, &ipaddr,
         &port);
     if (ret)
-        return ret;
+        return io_complete(completion, t, ret);
     if (s->sock.type == SOCK_STREAM) {
         if (s->info.tcp.state == TCP_SOCK_IN_CONNECTION) {
             err = ERR_ALREADY;
         } else if (s->info.tcp.state == TCP_SOCK_OPEN) {
             err = ERR_ISCONN;
         } else if (s->info.tcp.state == TCP_SOCK_LISTENING) {
-            msg_warn("attempt to connect on listening socket fd = %d; ignored\n", sockfd);
+            msg_warn("attempt to connect on listening socket fd = %d; ignored\n", sock->fd);
             err = ERR_ARG;
         } else {
-            err = connect_tcp(s, &ipaddr, port);
+            return connect_tcp(s, &ipaddr, port, t, bh, completion);
         }
     } else if (s->sock.type == SOCK_DGRAM) {
 	/* Set remote endpoint */
 	err = udp_connect(s->info.udp.lw, &ipaddr, port);
     } else {
 	msg_err("can't connect on socket type %d\n", s->sock.type);
-	return -EINVAL;
+	return io_complete(completion, t, -EINVAL);
     }
-    return lwip_to_errno(err);
+    return io_complete(completion, t, lwip_to_errno(err));
 }
 
 sysreturn connect(int sockfd, struct sockaddr *addr, socklen_t addrlen)
@@ -1300,19 +1831,10 @@ sysreturn connect(int sockfd, struct sockaddr *addr, socklen_t addrlen)
     if (!validate_user_memory(addr, addrlen, false)) {
         return -EFAULT;
     }
-    return sock->connect(sock, addr, addrlen);
+    return sock->connect(sock, addr, addrlen, current, false,
+                         syscall_io_complete);
 }
 
-#define MSG_OOB         0x00000001
-#define MSG_DONTROUTE   0x00000004
-#define MSG_PROBE       0x00000010
-#define MSG_TRUNC       0x00000020
-#define MSG_DONTWAIT    0x00000040
-#define MSG_EOR         0x00000080
-#define MSG_CONFIRM     0x00000800
-#define MSG_NOSIGNAL    0x00004000
-#define MSG_MORE        0x00008000
-
 static sysreturn sendto_prepare(struct sock *sock, int flags)
 {
     /* Process flags */
@@ -1343,14 +1865,15 @@ static sysreturn sendto_prepare(struct sock *sock, int flags)
 }
 
 static sysreturn netsock_sendto(struct sock *sock, void *buf, u64 len,
-        int flags, struct sockaddr *dest_addr, socklen_t addrlen)
+        int flags, struct sockaddr *dest_addr, socklen_t addrlen, thread t,
+        boolean bh, io_completion completion)
 {
     sysreturn rv = sendto_prepare(sock, flags);
     if (rv < 0) {
-        return set_syscall_return(current, rv);
+        return io_complete(completion, t, rv);
     }
-    return socket_write_internal(sock, buf, len, dest_addr, addrlen, current, false,
-            syscall_io_complete);
+    return socket_write_internal(sock, buf, len, dest_addr, addrlen, t, bh,
+            completion);
 }
 
 sysreturn sendto(int sockfd, void *buf, u64 len, int flags,
@@ -1367,7 +1890,8 @@ sysreturn sendto(int sockfd, void *buf, u64 len, int flags,
         (dest_addr && !validate_user_memory(dest_addr, addrlen, false))) {
         return -EFAULT;
     }
-    return sock->sendto(sock, buf, len, flags, dest_addr, addrlen);
+    return sock->sendto(sock, buf, len, flags, dest_addr, addrlen, current,
+                        false, syscall_io_complete);
 }
 
 static sysreturn sendmsg_prepare(struct sock *s, const struct msghdr *msg,
@@ -1403,22 +1927,25 @@ static sysreturn sendmsg_prepare(struct sock *s, const struct msghdr *msg,
 }
 
 static void sendmsg_complete_internal(struct sock *s, void * buf, u64 len,
-                                      thread t, sysreturn rv)
+                                      io_completion completion, thread t,
+                                      sysreturn rv)
 {
     deallocate(s->h, buf, len);
-    apply(syscall_io_complete, t, rv);
+    apply(completion, t, rv);
 }
 
-closure_function(3, 2, void, sendmsg_complete,
-                 struct sock *, s, void *, buf, u64, len,
+closure_function(4, 2, void, sendmsg_complete,
+                 struct sock *, s, void *, buf, u64, len, io_completion, completion,
                  thread, t, sysreturn, rv)
 {
-    sendmsg_complete_internal(bound(s), bound(buf), bound(len), t, rv);
+    sendmsg_complete_internal(bound(s), bound(buf), bound(len),
+                              bound(completion), t, rv);
     closure_finish();
 }
 
 static sysreturn netsock_sendmsg(struct sock *s, const struct msghdr *msg,
-                                 int flags)
+                                 int flags, thread t, boolean bh,
+                                 io_completion completion)
 {
     void *buf;
     u64 len;
@@ -1426,10 +1953,11 @@ static sysreturn netsock_sendmsg(struct sock *s, const struct msghdr *msg,
 
     rv = sendmsg_prepare(s, msg, flags, &buf, &len);
     if (rv <= 0)
-        return set_syscall_return(current, rv);
-    io_completion completion = closure(s->h, sendmsg_complete, s, buf, len);
+        return io_complete(completion, t, rv);
+    io_completion write_completion = closure(s->h, sendmsg_complete, s, buf,
+                                             len, completion);
     return socket_write_internal(s, buf, len, msg->msg_name, msg->msg_namelen,
-        current, false, completion);
+        t, bh, write_completion);
 }
 
 sysreturn sendmsg(int sockfd, const struct msghdr *msg, int flags)
@@ -1441,7 +1969,7 @@ sysreturn sendmsg(int sockfd, const struct msghdr *msg, int flags)
     net_debug("sock %d, type %d, msg %p, flags 0x%x\n", s->fd, s->type, msg, flags);
     if (!validate_msghdr(msg, false))
         return -EFAULT;
-    return s->sendmsg(s, msg, flags);
+    return s->sendmsg(s, msg, flags, current, false, syscall_io_complete);
 }
 
 closure_function(3, 2, void, sendmmsg_buf_complete,
@@ -1553,18 +2081,20 @@ sysreturn sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
 }
 
 static sysreturn netsock_recvfrom(struct sock *sock, void *buf, u64 len,
-        int flags, struct sockaddr *src_addr, socklen_t *addrlen)
+        int flags, struct sockaddr *src_addr, socklen_t *addrlen, thread t,
+        boolean bh, io_completion completion)
 {
     netsock s = (netsock) sock;
     if (sock->type == SOCK_STREAM && s->info.tcp.state != TCP_SOCK_OPEN)
-        return set_syscall_error(current, (s->info.tcp.state == TCP_SOCK_UNDEFINED) ? 0 : ENOTCONN);
+        return io_complete(completion, t,
+            (s->info.tcp.state == TCP_SOCK_UNDEFINED) ? 0 : -ENOTCONN);
 
     if (len == 0)
-        return 0;
+        return io_complete(completion, t, 0);
 
-    blockq_action ba = closure(sock->h, sock_read_bh, s, current, buf, len,
-                               src_addr, addrlen, syscall_io_complete);
-    return blockq_check(sock->rxbq, current, ba, false);
+    blockq_action ba = closure(sock->h, sock_read_bh, s, t, buf, len,
+                               src_addr, addrlen, completion);
+    return blockq_check(sock->rxbq, t, ba, bh);
 }
 
 sysreturn recvfrom(int sockfd, void * buf, u64 len, int flags,
@@ -1581,33 +2111,36 @@ sysreturn recvfrom(int sockfd, void * buf, u64 len, int flags,
                      !validate_user_memory(src_addr, *addrlen, true)))
         return -EFAULT;
 
-    return sock->recvfrom(sock, buf, len, flags, src_addr, addrlen);
+    return sock->recvfrom(sock, buf, len, flags, src_addr, addrlen, current,
+                          false, syscall_io_complete);
 }
 
 static sysreturn netsock_recvmsg(struct sock *sock, struct msghdr *msg,
-                                 int flags)
+                                 int flags, thread t, boolean bh,
+                                 io_completion completion)
 {
     u64 total_len;
     u8 *buf;
     netsock s = (netsock) sock;
 
     if ((sock->type == SOCK_STREAM) && (s->info.tcp.state != TCP_SOCK_OPEN)) {
-        return set_syscall_error(current, (s->info.tcp.state == TCP_SOCK_UNDEFINED) ? 0 : ENOTCONN);
+        return io_complete(completion, t,
+            (s->info.tcp.state == TCP_SOCK_UNDEFINED) ? 0 : -ENOTCONN);
     }
     total_len = 0;
     for (int i = 0; i < msg->msg_iovlen; i++) {
         total_len += msg->msg_iov[i].iov_len;
     }
     if (total_len == 0) {
-        return 0;
+        return io_complete(completion, t, 0);
     }
     buf = allocate(sock->h, total_len);
     if (buf == INVALID_ADDRESS) {
-        return set_syscall_error(current, ENOMEM);
+        return io_complete(completion, t, -ENOMEM);
     }
-    blockq_action ba = closure(sock->h, recvmsg_bh, s, current, buf, total_len,
-            msg);
-    return blockq_check(sock->rxbq, current, ba, false);
+    blockq_action ba = closure(sock->h, recvmsg_bh, s, t, buf, total_len,
+            msg, completion);
+    return blockq_check(sock->rxbq, t, ba, bh);
 }
 
 sysreturn recvmsg(int sockfd, struct msghdr *msg, int flags)
@@ -1619,7 +2152,95 @@ sysreturn recvmsg(int sockfd, struct msghdr *msg, int flags)
     net_debug("sock %d, type %d, thread %ld\n", s->fd, s->type, current->tid);
     if (!validate_msghdr(msg, true))
         return -EFAULT;
-    return s->recvmsg(s, msg, flags);
+    return s->recvmsg(s, msg, flags, current, false, syscall_io_complete);
+}
+
+/* Datagrams (or stream data) are copied straight from the incoming queue
+   into each message's iovec, as many as are queued per wakeup. */
+closure_function(7, 1, sysreturn, recvmmsg_bh,
+                 netsock, s, thread, t, struct mmsghdr *, msgvec, unsigned int, vlen, int, flags, timestamp, timeout, unsigned int, count,
+                 u64, bqflags)
+{
+    netsock s = bound(s);
+    struct mmsghdr *msgvec = bound(msgvec);
+    unsigned int count = bound(count);
+    sysreturn rv;
+    net_debug("sock %d, thread %ld, vlen %d, count %d, bqflags 0x%lx\n",
+              s->sock.fd, bound(t)->tid, bound(vlen), count, bqflags);
+
+    if (bqflags & BLOCKQ_ACTION_NULLIFY) {
+        rv = (bound(timeout) == infinity) ? -ERESTARTSYS : -EINTR;
+        goto out;
+    }
+    if (s->sock.type == SOCK_STREAM && s->info.tcp.state != TCP_SOCK_OPEN) {
+        rv = 0;
+        goto out;
+    }
+    err_t err = get_lwip_error(s);
+    if (err != ERR_OK) {
+        rv = lwip_to_errno(err);
+        goto out;
+    }
+
+    while (count < bound(vlen) && !queue_empty(s->incoming)) {
+        struct msghdr *hdr = &msgvec[count].msg_hdr;
+        int msg_flags = 0;
+        msgvec[count].msg_len = netsock_dequeue_iov(s, hdr->msg_iov, hdr->msg_iovlen,
+                                                    hdr->msg_name, &hdr->msg_namelen,
+                                                    &msg_flags);
+        hdr->msg_controllen = 0;
+        hdr->msg_flags = msg_flags;
+        count++;
+    }
+    bound(count) = count;
+
+    boolean eof = s->sock.type == SOCK_STREAM && s->info.tcp.lw->state != ESTABLISHED;
+    if (count < bound(vlen) && !eof &&
+        !(s->sock.f.flags & SOCK_NONBLOCK) && !(bound(flags) & MSG_DONTWAIT) &&
+        !(count > 0 && (bound(flags) & MSG_WAITFORONE)) &&
+        bound(timeout) != 0 && !(bqflags & BLOCKQ_ACTION_TIMEDOUT))
+        return BLOCKQ_BLOCK_REQUIRED;
+    /* nothing more will arrive on a stream the peer has shut down */
+    rv = eof ? 0 : -EAGAIN;
+  out:
+    /* a partial batch is reported even if an error follows it */
+    if (count > 0)
+        rv = count;
+    blockq_handle_completion(s->sock.rxbq, bqflags, syscall_io_complete, bound(t), rv);
+    closure_finish();
+    return rv;
+}
+
+sysreturn recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
+                   int flags, struct timespec *timeout)
+{
+    struct sock *sock = resolve_socket(current->p, sockfd);
+    netsock s = get_netsock(sock);
+    if (!s)
+        return -EOPNOTSUPP;
+
+    net_debug("sock %d, type %d, flags 0x%x, vlen %d\n", sock->fd, sock->type,
+              flags, vlen);
+    /* as on Linux, a larger batch is silently truncated (UIO_MAXIOV) */
+    if (vlen > IOV_MAX)
+        vlen = IOV_MAX;
+    if (!validate_user_memory(msgvec, vlen * sizeof(struct mmsghdr), true) ||
+        (timeout && !validate_user_memory(timeout, sizeof(struct timespec), false)))
+        return -EFAULT;
+    for (int i = 0; i < vlen; i++) {
+        if (!validate_msghdr(&msgvec[i].msg_hdr, true))
+            return -EFAULT;
+    }
+    if (vlen == 0)
+        return 0;
+
+    timestamp ts = timeout ? time_from_timespec(timeout) : infinity;
+    blockq_action ba = closure(sock->h, recvmmsg_bh, s, current, msgvec, vlen,
+                               flags, ts, 0);
+    if (ba == INVALID_ADDRESS)
+        return -ENOMEM;
+    return blockq_check_timeout(sock->rxbq, current, ba, false, CLOCK_ID_MONOTONIC,
+                                (ts == infinity) ? 0 : ts, false);
 }
 
 static err_t accept_tcp_from_lwip(void * z, struct tcp_pcb * lw, err_t err)
@@ -1646,6 +2267,11 @@ static err_t accept_tcp_from_lwip(void * z, struct tcp_pcb * lw, err_t err)
     net_debug("new fd %d, pcb %p\n", fd, lw);
     netsock sn = vector_get(s->p->files, fd);
     sn->info.tcp.state = TCP_SOCK_OPEN;
+    sn->info.tcp.rcv_limit = s->info.tcp.rcv_limit;
+    sn->info.tcp.rcv_max = s->info.tcp.rcv_max;
+    sn->info.tcp.snd_limit = s->info.tcp.snd_limit;
+    sn->info.tcp.snd_max = s->info.tcp.snd_max;
+    tcp_sock_established(sn);
     sn->sock.fd = fd;
     set_lwip_error(s, ERR_OK);
     tcp_arg(lw, sn);
@@ -1664,12 +2290,94 @@ static err_t accept_tcp_from_lwip(void * z, struct tcp_pcb * lw, err_t err)
     return ERR_OK;
 }
 
+static u32 tcp_conn_hash(struct tcp_pcb *lw)
+{
+    u32 h = lw->remote_port;
+    if (IP_IS_V6(&lw->remote_ip)) {
+        for (int i = 0; i < 4; i++)
+            h = h * 31 + ip_2_ip6(&lw->remote_ip)->addr[i];
+    } else {
+        h = h * 31 + ip4_addr_get_u32(ip_2_ip4(&lw->remote_ip));
+    }
+    h *= 0x9e3779b1;
+    return h ^ (h >> 16);
+}
+
+static err_t accept_tcp_reuseport(void *z, struct tcp_pcb *lw, err_t err)
+{
+    reuseport_group g = z;
+    if (!g || vector_length(g->members) == 0)
+        return ERR_CLSD;
+    netsock s = vector_get(g->members, lw ? tcp_conn_hash(lw) % vector_length(g->members) : 0);
+    net_debug("group %p, pcb %p -> sock %d\n", g, lw, s->sock.fd);
+    return accept_tcp_from_lwip(s, lw, err);
+}
+
+/* The socket keeps its own bound pcb; it only shares the group's listening
+   pcb. */
+static sysreturn tcp_reuseport_listen(netsock s, int backlog)
+{
+    struct tcp_pcb *sl = s->info.tcp.lw;
+    reuseport_group g = 0;
+    if (s->info.tcp.state == TCP_SOCK_LISTENING)
+        return 0;
+    list_foreach(&reuseport_groups, l) {
+        reuseport_group rg = struct_from_list(l, reuseport_group, l);
+        if (rg->port == sl->local_port && ip_addr_cmp(&rg->addr, &sl->local_ip)) {
+            g = rg;
+            break;
+        }
+    }
+    if (!g) {
+        g = allocate(reuseport_heap, sizeof(*g));
+        if (g == INVALID_ADDRESS)
+            return -ENOMEM;
+        g->members = allocate_vector(reuseport_heap, 4);
+        if (g->members == INVALID_ADDRESS)
+            goto err_members;
+        struct tcp_pcb *lw = tcp_new_ip_type(IP_GET_TYPE(&sl->local_ip));
+        if (!lw)
+            goto err_pcb;
+        ip_set_option(lw, SOF_REUSEADDR);
+        err_t err = tcp_bind(lw, &sl->local_ip, sl->local_port);
+        if (err != ERR_OK) {
+            tcp_close(lw);
+            deallocate_vector(g->members);
+            deallocate(reuseport_heap, g, sizeof(*g));
+            return lwip_to_errno(err);
+        }
+        g->lw = tcp_listen_with_backlog(lw, backlog);
+        if (!g->lw) {
+            tcp_close(lw);
+            goto err_pcb;
+        }
+        ip_addr_copy(g->addr, sl->local_ip);
+        g->port = sl->local_port;
+        tcp_arg(g->lw, g);
+        tcp_accept(g->lw, accept_tcp_reuseport);
+        list_push_back(&reuseport_groups, &g->l);
+    }
+    net_debug("sock %d joins group %p, port %d\n", s->sock.fd, g, g->port);
+    vector_push(g->members, s);
+    s->info.tcp.group = g;
+    s->info.tcp.state = TCP_SOCK_LISTENING;
+    set_lwip_error(s, ERR_OK);
+    return 0;
+  err_pcb:
+    deallocate_vector(g->members);
+  err_members:
+    deallocate(reuseport_heap, g, sizeof(*g));
+    return -ENOMEM;
+}
+
 static sysreturn netsock_listen(struct sock *sock, int backlog)
 {
     netsock s = (netsock) sock;
     if (s->sock.type != SOCK_STREAM)
 	return -EOPNOTSUPP;
     backlog = MAX(backlog, SOCK_QUEUE_LEN);
+    if (s->reuseport && s->info.tcp.lw->local_port)
+        return tcp_reuseport_listen(s, backlog);
     struct tcp_pcb * lw = tcp_listen_with_backlog(s->info.tcp.lw, backlog);
     s->info.tcp.lw = lw;
     s->info.tcp.state = TCP_SOCK_LISTENING;
@@ -1689,8 +2397,8 @@ sysreturn listen(int sockfd, int backlog)
     return sock->listen(sock, backlog);
 }
 
-closure_function(5, 1, sysreturn, accept_bh,
-                 netsock, s, thread, t, struct sockaddr *, addr, socklen_t *, addrlen, int, flags,
+closure_function(6, 1, sysreturn, accept_bh,
+                 netsock, s, thread, t, struct sockaddr *, addr, socklen_t *, addrlen, int, flags, io_completion, completion,
                  u64, bqflags)
 {
     netsock s = bound(s);
@@ -1739,26 +2447,26 @@ closure_function(5, 1, sysreturn, accept_bh,
 
     rv = child->sock.fd;
   out:
-    syscall_return(t, rv);
-
+    blockq_handle_completion(s->sock.rxbq, bqflags, bound(completion), t, rv);
     closure_finish();
     return rv;
 }
 
 static sysreturn netsock_accept4(struct sock *sock, struct sockaddr *addr,
-        socklen_t *addrlen, int flags)
+        socklen_t *addrlen, int flags, thread t, boolean bh,
+        io_completion completion)
 {
     netsock s = (netsock) sock;
     if (sock->type != SOCK_STREAM)
-	return -EOPNOTSUPP;
+	return io_complete(completion, t, -EOPNOTSUPP);
 
     if ((s->info.tcp.state != TCP_SOCK_LISTENING) ||
             (flags & ~(SOCK_NONBLOCK | SOCK_CLOEXEC)))
-	return set_syscall_error(current, EINVAL);
+	return io_complete(completion, t, -EINVAL);
 
-    blockq_action ba = closure(sock->h, accept_bh, s, current, addr, addrlen,
-            flags);
-    return blockq_check(sock->rxbq, current, ba, false);
+    blockq_action ba = closure(sock->h, accept_bh, s, t, addr, addrlen,
+            flags, completion);
+    return blockq_check(sock->rxbq, t, ba, bh);
 }
 
 sysreturn accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen,
@@ -1776,7 +2484,8 @@ sysreturn accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen,
         return -EFAULT;
     }
 
-    return sock->accept4(sock, addr, addrlen, flags);
+    return sock->accept4(sock, addr, addrlen, flags, current, false,
+                         syscall_io_complete);
 }
 
 sysreturn accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
@@ -1797,8 +2506,9 @@ sysreturn getsockname(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
     ip_addr_t *ip_addr;
     u16_t port;
     if (s->sock.type == SOCK_STREAM) {
-        port = s->info.tcp.lw->local_port;
-        ip_addr = &s->info.tcp.lw->local_ip;
+        struct tcp_pcb *lw = s->info.tcp.lw;
+        port = lw->local_port;
+        ip_addr = &lw->local_ip;
     } else if (s->sock.type == SOCK_DGRAM) {
         port = s->info.udp.lw->local_port;
         ip_addr = &s->info.udp.lw->local_ip;
@@ -1836,6 +2546,24 @@ sysreturn setsockopt(int sockfd,
     if (!validate_user_memory(optval, optlen, false))
         return -EFAULT;
     switch (level) {
+    case SOL_SOCKET:
+        switch (optname) {
+        case SO_SNDBUF:
+        case SO_RCVBUF:
+            if (optlen < sizeof(int))
+                return -EINVAL;
+            if (s->sock.type == SOCK_STREAM)
+                tcp_sock_set_buf(s, optname, *((int *)optval));
+            break;
+        case SO_REUSEPORT:
+            if (optlen < sizeof(int))
+                return -EINVAL;
+            s->reuseport = *((int *)optval) != 0;
+            break;
+        default:
+            goto unimplemented;
+        }
+        break;
     case IPPROTO_IPV6:
         switch (optname) {
         case IPV6_V6ONLY:
@@ -1884,12 +2612,21 @@ sysreturn getsockopt(int sockfd, int level, int optname, void *optval, socklen_t
             ret_optlen = sizeof(ret_optval.val);
             break;
         case SO_ERROR:
-            ret_optval.val = -lwip_to_errno(get_and_clear_lwip_error(s));
+            ret_optval.val = -netsock_lwip_errno(s, get_and_clear_lwip_error(s));
             ret_optlen = sizeof(ret_optval.val);
             break;
         case SO_SNDBUF:
         case SO_RCVBUF:
-            ret_optval.val = 2048;  /* minimum value for this option in Linux */
+            if (s->sock.type == SOCK_STREAM)
+                /* Linux reports twice the size, the rest being bookkeeping */
+                ret_optval.val = 2 * (optname == SO_SNDBUF ?
+                                      s->info.tcp.snd_limit : s->info.tcp.rcv_limit);
+            else
+                ret_optval.val = 2048;  /* minimum value for this option in Linux */
+            ret_optlen = sizeof(ret_optval.val);
+            break;
+        case SO_REUSEPORT:
+            ret_optval.val = s->reuseport;
             ret_optlen = sizeof(ret_optval.val);
             break;
         case SO_PRIORITY:
@@ -1944,6 +2681,7 @@ void register_net_syscalls(struct syscall *map)
     register_syscall(map, sendmmsg, sendmmsg);
     register_syscall(map, recvfrom, recvfrom);
     register_syscall(map, recvmsg, recvmsg);
+    register_syscall(map, recvmmsg, recvmmsg);
     register_syscall(map, setsockopt, setsockopt);
     register_syscall(map, getsockname, getsockname);
     register_syscall(map, getpeername, getpeername);
@@ -1951,14 +2689,31 @@ void register_net_syscalls(struct syscall *map)
     register_syscall(map, shutdown, shutdown);
 }
 
-boolean netsyscall_init(unix_heaps uh)
+static void netsyscall_buf_max(tuple root, symbol name, u32 *max)
+{
+    value v = table_find(root, name);
+    if (!v)
+        return;
+    u64 n;
+    if (u64_from_value(v, &n) && n >= TCP_SOCK_BUF_MIN)
+        *max = MIN(n, TCP_WND);
+    else
+        msg_err("invalid %b; ignored\n", symbol_string(name));
+}
+
+boolean netsyscall_init(unix_heaps uh, tuple root)
 {
     kernel_heaps kh = (kernel_heaps)uh;
+    netsyscall_buf_max(root, sym(tcp_rmem_max), &tcp_rmem_max);
+    netsyscall_buf_max(root, sym(tcp_wmem_max), &tcp_wmem_max);
     heap socket_cache = allocate_objcache(heap_general(kh), heap_backed(kh),
 					  sizeof(struct netsock), PAGESIZE);
     if (socket_cache == INVALID_ADDRESS)
 	return false;
     uh->socket_cache = socket_cache;
+    reuseport_heap = heap_general(kh);
+    list_init(&reuseport_groups);
+    tcp_zc_ext_id = tcp_ext_arg_alloc_id();
     net_loop_poll = closure(heap_general(kh), netsock_poll);
     return true;
 }
@@ -7,6 +7,13 @@
 
    The bitmap length may be arbitrarily sized. The bitmap buffer is
    allocated in ALLOC_EXTEND_BITS / 8 byte increments as needed.
+
+   Bitmaps used for allocation carry two levels of summary bits (see
+   bitmap.h), so that a search can step over full words, or over
+   groups of 64 words with no room, a whole summary word at a time
+   instead of testing each map word. This keeps the cost of an
+   allocation from growing with the number of allocated bits ahead of
+   the first fit.
 */
 
 #include <runtime.h>
@@ -74,37 +81,148 @@ static boolean for_range_in_map(u64 * base, u64 start, u64 nbits, boolean set, b
     return true;
 }
 
-/* Requesting beyond the end of maxbits isn't an error; the caller may
-   use it to avoid an additional range check.
+static inline u64 *summary_base(bitmap b, int level)
+{
+    return buffer_ref(b->summary[level], 0);
+}
 
-   While bitmap_alloc() serves power-of-2 sized and aligned
-   allocations, our reserve does not require such alignment. The two
-   should co-exist without issue. */
-boolean bitmap_range_check_and_set(bitmap b, u64 start, u64 nbits, boolean validate, boolean set)
+static inline u64 summary_bytes(bitmap b, int level)
 {
-    /* check both start and end in case of overflow / corrupt args */
-    if (start >= b->maxbits || start + nbits > b->maxbits)
+    /* level 1 has a bit per map word, level 2 a bit per level 1 word */
+    u64 bits = b->mapbits >> BITMAP_WORDLEN_LOG;
+    if (level >= BITMAP_L2_FULL)
+        bits = pad(bits, BITMAP_WORDLEN) >> BITMAP_WORDLEN_LOG;
+    return pad(bits, BITMAP_WORDLEN) >> 3;
+}
+
+static inline void summary_bit(u64 *base, u64 i, boolean val)
+{
+    u64 mask = U64_FROM_BIT(i & BITMAP_WORDMASK);
+    u64 *w = pointer_from_bit(base, i);
+    *w = val ? *w | mask : *w & ~mask;
+}
+
+/* refresh summary bits for map words [wstart, wend] */
+void bitmap_summary_update(bitmap b, u64 wstart, u64 wend)
+{
+    u64 *map = bitmap_base(b);
+    u64 *full = summary_base(b, BITMAP_L1_FULL);
+    u64 *used = summary_base(b, BITMAP_L1_USED);
+    for (u64 w = wstart; w <= wend; w++) {
+        summary_bit(full, w, map[w] == -1ull);
+        summary_bit(used, w, map[w] != 0);
+    }
+    for (u64 g = wstart >> BITMAP_WORDLEN_LOG; g <= wend >> BITMAP_WORDLEN_LOG; g++) {
+        summary_bit(summary_base(b, BITMAP_L2_FULL), g, full[g] == -1ull);
+        summary_bit(summary_base(b, BITMAP_L2_NOFREE), g, used[g] == -1ull);
+        summary_bit(summary_base(b, BITMAP_L2_USED), g, used[g] != 0);
+    }
+}
+
+static void bitmap_summary_release(bitmap b)
+{
+    for (int i = 0; i < BITMAP_SUMMARIES; i++) {
+        if (b->summary[i])
+            deallocate_buffer(b->summary[i]);
+        b->summary[i] = 0;
+    }
+}
+
+/* On failure, the summaries are dropped and searches fall back to
+   scanning the map itself. */
+static boolean bitmap_summary_init(bitmap b)
+{
+    if (!b->map)
         return false;
+    for (int i = 0; i < BITMAP_SUMMARIES; i++) {
+        u64 bytes = summary_bytes(b, i);
+        buffer sb = allocate_buffer(b->map, bytes);
+        if (sb == INVALID_ADDRESS) {
+            bitmap_summary_release(b);
+            return false;
+        }
+        zero(buffer_ref(sb, 0), bytes);
+        buffer_produce(sb, bytes);
+        b->summary[i] = sb;
+    }
+    bitmap_summary_update(b, 0, (b->mapbits >> BITMAP_WORDLEN_LOG) - 1);
+    return true;
+}
 
-    bitmap_extend(b, start + nbits - 1);
-    u64 * mapbase = bitmap_base(b);
-    return (!validate || for_range_in_map(mapbase, start, nbits, false, !set)) &&
-        for_range_in_map(mapbase, start, nbits, true, set);
+/* new map words are zero, which matches zeroed summary bits */
+void bitmap_summary_extend(bitmap b)
+{
+    for (int i = 0; i < BITMAP_SUMMARIES; i++) {
+        if (!extend_total(b->summary[i], summary_bytes(b, i))) {
+            bitmap_summary_release(b);
+            return;
+        }
+    }
 }
 
-static inline u64 bitmap_alloc_internal(bitmap b, u64 nbits, u64 startbit, u64 endbit)
+/* first clear bit in [i, n) of base, or n if none */
+static u64 next_clear_bit(u64 *base, u64 i, u64 n)
 {
-    int order = find_order(nbits);
-    u64 stride = U64_FROM_BIT(order);
-    endbit = MIN(endbit, b->maxbits);
+    while (i < n) {
+        u64 w = ~*pointer_from_bit(base, i) & ~MASK(i & BITMAP_WORDMASK);
+        if (w)
+            return MIN((i & ~BITMAP_WORDMASK) + lsb(w), n);
+        i = (i | BITMAP_WORDMASK) + 1;
+    }
+    return n;
+}
 
-    u64 bit = pad(startbit, stride);
-    if (bit + nbits > endbit)
-        return INVALID_PHYSICAL;
+/* First map word at or after w whose level 1 bit is clear, using level 2
+   to pass over groups with none. Returns the number of map words if
+   there is no such word in the map; words past the map are empty. */
+static u64 next_clear_word(bitmap b, int l1, int l2, u64 w)
+{
+    u64 nwords = b->mapbits >> BITMAP_WORDLEN_LOG;
+    u64 ngroups = pad(nwords, BITMAP_WORDLEN) >> BITMAP_WORDLEN_LOG;
+    while (w < nwords) {
+        u64 g = next_clear_bit(summary_base(b, l2), w >> BITMAP_WORDLEN_LOG, ngroups);
+        if (g > w >> BITMAP_WORDLEN_LOG)
+            w = g << BITMAP_WORDLEN_LOG;
+        if (w >= nwords)
+            break;
+        u64 x = ~*pointer_from_bit(summary_base(b, l1), w) & ~MASK(w & BITMAP_WORDMASK);
+        if (x)
+            return MIN((w & ~BITMAP_WORDMASK) + lsb(x), nwords);
+        w = (w | BITMAP_WORDMASK) + 1;
+    }
+    return nwords;
+}
 
-    u64 * mapbase = bitmap_base(b);
+/* is the word-aligned range [bit, bit + nbits) clear? */
+static boolean summary_range_clear(bitmap b, u64 bit, u64 nbits)
+{
+    u64 nwords = b->mapbits >> BITMAP_WORDLEN_LOG;
+    u64 w = bit >> BITMAP_WORDLEN_LOG;
+    u64 full_words = nbits >> BITMAP_WORDLEN_LOG;
+    if (w >= nwords)
+        return true;
+    if (!for_range_in_map(summary_base(b, BITMAP_L1_USED), w,
+                          MIN(full_words, nwords - w), false, false))
+        return false;
+    u64 tail = nbits & BITMAP_WORDMASK;
+    if (tail && w + full_words < nwords)
+        return (bitmap_base(b)[w + full_words] & MASK(tail)) == 0;
+    return true;
+}
 
-    endbit -= nbits;
+static inline u64 bitmap_mark_allocated(bitmap b, u64 bit, u64 nbits)
+{
+    assert(for_range_in_map(bitmap_base(b), bit, nbits, true, true));
+    if (b->summary[0])
+        bitmap_summary_update(b, bit >> BITMAP_WORDLEN_LOG,
+                              (bit + nbits - 1) >> BITMAP_WORDLEN_LOG);
+    return bit;
+}
+
+/* endbit is the last permissible start bit */
+static u64 bitmap_alloc_flat(bitmap b, u64 nbits, u64 stride, u64 bit, u64 endbit)
+{
+    u64 * mapbase = bitmap_base(b);
 
     if (nbits >= 64) {
         /* multi-word */
@@ -151,6 +269,98 @@ static inline u64 bitmap_alloc_internal(bitmap b, u64 nbits, u64 startbit, u64 e
     return INVALID_PHYSICAL;
 }
 
+/* as bitmap_alloc_flat, but guided by the summaries */
+static u64 bitmap_alloc_summarized(bitmap b, u64 nbits, u64 stride, u64 bit, u64 endbit)
+{
+    if (nbits < BITMAP_WORDLEN) {
+        /* stride divides the word length; look for room within non-full words */
+        while (bit <= endbit) {
+            u64 w = next_clear_word(b, BITMAP_L1_FULL, BITMAP_L2_FULL, bit >> BITMAP_WORDLEN_LOG);
+            if (w << BITMAP_WORDLEN_LOG > bit)
+                bit = w << BITMAP_WORDLEN_LOG;
+            if (bit > endbit)
+                break;
+            bitmap_extend(b, bit | BITMAP_WORDMASK);
+            if (!b->summary[0])
+                return bitmap_alloc_flat(b, nbits, stride, bit, endbit);
+            u64 bw = *pointer_from_bit(bitmap_base(b), bit);
+            for (u64 offset = bit & BITMAP_WORDMASK; offset < BITMAP_WORDLEN;
+                 offset += stride, bit += stride) {
+                if (bit > endbit)
+                    return INVALID_PHYSICAL;
+                if ((bw & (MASK(nbits) << offset)) == 0)
+                    return bitmap_mark_allocated(b, bit, nbits);
+            }
+        }
+    } else {
+        /* word-aligned candidates must begin with an empty word - or an
+           empty group of words if they span at least one */
+        u64 stride_words = stride >> BITMAP_WORDLEN_LOG;
+        while (bit <= endbit) {
+            u64 w = bit >> BITMAP_WORDLEN_LOG;
+            u64 f;
+            if (nbits >= BITMAP_WORDLEN * BITMAP_WORDLEN) {
+                u64 ngroups = pad(b->mapbits >> BITMAP_WORDLEN_LOG, BITMAP_WORDLEN) >> BITMAP_WORDLEN_LOG;
+                u64 g = w >> BITMAP_WORDLEN_LOG;
+                f = g < ngroups ? next_clear_bit(summary_base(b, BITMAP_L2_USED), g, ngroups) : g;
+                f <<= BITMAP_WORDLEN_LOG;
+            } else {
+                f = next_clear_word(b, BITMAP_L1_USED, BITMAP_L2_NOFREE, w);
+            }
+            if (f > w) {
+                bit = pad(f, stride_words) << BITMAP_WORDLEN_LOG;
+                continue;
+            }
+            if (summary_range_clear(b, bit, nbits)) {
+                bitmap_extend(b, bit + nbits - 1);
+                return bitmap_mark_allocated(b, bit, nbits);
+            }
+            bit += stride;
+        }
+    }
+    return INVALID_PHYSICAL;
+}
+
+/* Requesting beyond the end of maxbits isn't an error; the caller may
+   use it to avoid an additional range check.
+
+   While bitmap_alloc() serves power-of-2 sized and aligned
+   allocations, our reserve does not require such alignment. The two
+   should co-exist without issue. */
+boolean bitmap_range_check_and_set(bitmap b, u64 start, u64 nbits, boolean validate, boolean set)
+{
+    /* check both start and end in case of overflow / corrupt args */
+    if (start >= b->maxbits || start + nbits > b->maxbits)
+        return false;
+
+    bitmap_extend(b, start + nbits - 1);
+    u64 * mapbase = bitmap_base(b);
+    if (validate && !for_range_in_map(mapbase, start, nbits, false, !set))
+        return false;
+    for_range_in_map(mapbase, start, nbits, true, set);
+    if (b->summary[0] && nbits > 0)
+        bitmap_summary_update(b, start >> BITMAP_WORDLEN_LOG,
+                              (start + nbits - 1) >> BITMAP_WORDLEN_LOG);
+    return true;
+}
+
+static inline u64 bitmap_alloc_internal(bitmap b, u64 nbits, u64 startbit, u64 endbit)
+{
+    int order = find_order(nbits);
+    u64 stride = U64_FROM_BIT(order);
+    endbit = MIN(endbit, b->maxbits);
+
+    u64 bit = pad(startbit, stride);
+    if (bit + nbits > endbit)
+        return INVALID_PHYSICAL;
+
+    endbit -= nbits;
+    if (b->summary[0] || bitmap_summary_init(b))
+        return bitmap_alloc_summarized(b, nbits, stride, bit, endbit);
+
+    return bitmap_alloc_flat(b, nbits, stride, bit, endbit);
+}
+
 u64 bitmap_alloc(bitmap b, u64 nbits)
 {
     return bitmap_alloc_internal(b, nbits, 0, b->maxbits);
@@ -187,6 +397,9 @@ boolean bitmap_dealloc(bitmap b, u64 bit, u64 size)
     }
 
     for_range_in_map(mapbase, bit, size, true, false);
+    if (b->summary[0])
+        bitmap_summary_update(b, bit >> BITMAP_WORDLEN_LOG,
+                              (bit + size - 1) >> BITMAP_WORDLEN_LOG);
     return true;
 }
 
@@ -201,6 +414,7 @@ static inline bitmap allocate_bitmap_internal(heap meta, u64 length)
 	length = -1ull << 6; /* don't pad to 0 */
     b->maxbits = length;
     b->mapbits = MIN(ALLOC_EXTEND_BITS, pad(b->maxbits, 64));
+    zero(b->summary, sizeof(b->summary));
     return b;
 }
 
@@ -221,6 +435,7 @@ bitmap allocate_bitmap(heap meta, heap map, u64 length)
 
 void deallocate_bitmap(bitmap b)
 {
+    bitmap_summary_release(b);
     if (b->alloc_map)
 	deallocate_buffer(b->alloc_map);
     deallocate(b->meta, b, sizeof(struct bitmap));
@@ -276,4 +491,6 @@ void bitmap_copy(bitmap dest, bitmap src)
 	bytes len = (dest->mapbits - src->mapbits) >> 3;
 	zero(buffer_ref(dest->alloc_map, off), len);
     }
+    if (dest->summary[0])
+        bitmap_summary_update(dest, 0, (dest->mapbits >> BITMAP_WORDLEN_LOG) - 1);
 }
@@ -2,12 +2,24 @@
    page are b0rked */
 #define ALLOC_EXTEND_BITS	U64_FROM_BIT(12)
 
+/* Summary levels, built on first allocation from a bitmap so that
+   searches can skip over full (or partially used) regions. Level 1 has
+   a bit per map word, level 2 a bit per level 1 word (4096 map bits).
+   All are zero for an empty map, so extending with zeroes is valid. */
+#define BITMAP_L1_FULL          0 /* map word is all ones */
+#define BITMAP_L1_USED          1 /* map word is non-zero */
+#define BITMAP_L2_FULL          2 /* all 64 map words full */
+#define BITMAP_L2_NOFREE        3 /* no empty map word among 64 */
+#define BITMAP_L2_USED          4 /* some map word among 64 non-zero */
+#define BITMAP_SUMMARIES        5
+
 typedef struct bitmap {
     u64 maxbits;
     u64 mapbits;
     heap meta;
     heap map;
     buffer alloc_map;
+    buffer summary[BITMAP_SUMMARIES];
 } *bitmap;
 
 boolean bitmap_range_check_and_set(bitmap b, u64 start, u64 nbits, boolean validate, boolean set);
@@ -20,6 +32,8 @@ bitmap bitmap_wrap(heap h, u64 * map, u64 length);
 void bitmap_unwrap(bitmap b);
 bitmap bitmap_clone(bitmap b);
 void bitmap_copy(bitmap dest, bitmap src);
+void bitmap_summary_update(bitmap b, u64 wstart, u64 wend);
+void bitmap_summary_extend(bitmap b);
 
 #define bitmap_foreach_word(b, w, offset)				\
     for (u64 offset = 0, * __wp = bitmap_base(b), w = *__wp;		\
@@ -44,6 +58,8 @@ static inline boolean bitmap_extend(bitmap b, u64 i)
         u64 mapbits = pad(i + 1, ALLOC_EXTEND_BITS);
         if (extend_total(b->alloc_map, mapbits >> 3)) {
             b->mapbits = mapbits;
+            if (b->summary[0])
+                bitmap_summary_extend(b);
             return true;
         }
     }
@@ -67,4 +83,6 @@ static inline void bitmap_set(bitmap b, u64 i, int val)
 	*p |= mask;
     else
 	*p &= ~mask;
+    if (b->summary[0])
+        bitmap_summary_update(b, i >> 6, i >> 6);
 }
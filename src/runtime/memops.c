@@ -1,5 +1,140 @@
 #include <runtime.h>
 
+/* Sizes below this are handled by the scalar code even when vector
+   implementations are available. */
+#define MEMOPS_SIMD_MIN 64
+
+#if defined(__x86_64__) || defined(__aarch64__)
+#define MEMOPS_SIMD
+#endif
+
+typedef u64 u64_unaligned __attribute__((aligned(1), may_alias));
+typedef u32 u32_unaligned __attribute__((aligned(1), may_alias));
+typedef u16 u16_unaligned __attribute__((aligned(1), may_alias));
+
+/* add to a one's complement sum */
+static inline u64 csum_add_carry(u64 sum, u64 x)
+{
+    sum += x;
+    return sum + (sum < x);
+}
+
+#ifdef MEMOPS_SIMD
+#if defined(__x86_64__)
+#define SIMD_BYTES  16
+#define SIMD_ATTR   __attribute__((target("sse4.1")))
+#define SIMD_FN(n)  n##_vec128
+#include "memops_simd.h"
+#undef SIMD_BYTES
+#undef SIMD_ATTR
+#undef SIMD_FN
+
+#define SIMD_BYTES  32
+#define SIMD_ATTR   __attribute__((target("avx2")))
+#define SIMD_FN(n)  n##_vec256
+#include "memops_simd.h"
+#undef SIMD_BYTES
+#undef SIMD_ATTR
+#undef SIMD_FN
+
+static inline void memops_cpuid(u32 fn, u32 ecx, u32 *v)
+{
+    asm volatile("cpuid" : "=a" (v[0]), "=b" (v[1]), "=c" (v[2]), "=d" (v[3]) : "0" (fn), "2" (ecx));
+}
+
+/* The extended state of interrupted and trapping contexts is saved on
+   kernel entry, so vector registers may be used freely at any level once
+   the OS has enabled them. YMM state must also be enabled in XCR0. */
+static boolean memops_level_supported(int level)
+{
+    u32 v[4];
+    switch (level) {
+    case MEMOPS_GENERIC:
+        return true;
+    case MEMOPS_VEC128:
+        memops_cpuid(0x1, 0, v);
+        return (v[2] & U64_FROM_BIT(19)) != 0;  /* ECX.SSE4_1 */
+    case MEMOPS_VEC256:
+        memops_cpuid(0x1, 0, v);
+        if ((v[2] & (U64_FROM_BIT(27) | U64_FROM_BIT(28))) !=
+            (U64_FROM_BIT(27) | U64_FROM_BIT(28)))    /* ECX.OSXSAVE, ECX.AVX */
+            return false;
+        u32 lo, hi;
+        asm volatile("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+        if ((lo & 0x6) != 0x6)                          /* XCR0.SSE, XCR0.AVX */
+            return false;
+        memops_cpuid(0x7, 0, v);
+        return (v[1] & U64_FROM_BIT(5)) != 0;   /* EBX.AVX2 */
+    }
+    return false;
+}
+#else
+/* Advanced SIMD is architectural on aarch64. */
+#define SIMD_BYTES  16
+#define SIMD_ATTR
+#define SIMD_FN(n)  n##_vec128
+#include "memops_simd.h"
+#undef SIMD_BYTES
+#undef SIMD_ATTR
+#undef SIMD_FN
+
+static boolean memops_level_supported(int level)
+{
+    return level == MEMOPS_GENERIC || level == MEMOPS_VEC128;
+}
+#endif
+
+static struct {
+    void (*memcpy)(void *, const void *, bytes);
+    void (*memset)(u8 *, u8, bytes);
+    int (*memcmp)(const void *, const void *, bytes);
+    u64 (*csum)(u64, const void **, bytes *);
+} memops;
+#endif
+
+/* Select the implementation level for memory operations and checksums;
+   fails if the CPU or OS does not support it. */
+boolean memops_set_level(int level)
+{
+#ifdef MEMOPS_SIMD
+    if (!memops_level_supported(level))
+        return false;
+    switch (level) {
+    case MEMOPS_GENERIC:
+        zero(&memops, sizeof(memops));
+        break;
+    case MEMOPS_VEC128:
+        memops.memcpy = memcpy_vec128;
+        memops.memset = memset_vec128;
+        memops.memcmp = memcmp_vec128;
+        memops.csum = csum_vec128;
+        break;
+#ifdef __x86_64__
+    case MEMOPS_VEC256:
+        memops.memcpy = memcpy_vec256;
+        memops.memset = memset_vec256;
+        memops.memcmp = memcmp_vec256;
+        memops.csum = csum_vec256;
+        break;
+#endif
+    }
+    return true;
+#else
+    return level == MEMOPS_GENERIC;
+#endif
+}
+
+/* Pick the widest implementation available. */
+int init_memops(void)
+{
+    int level;
+    for (level = MEMOPS_VEC256; level > MEMOPS_GENERIC; level--) {
+        if (memops_set_level(level))
+            break;
+    }
+    return level;
+}
+
 /* Copy by advancing memory addresses in forward direction. */
 static inline void memcpyf_8(void *dst, const void *src, bytes len)
 {
@@ -38,6 +173,13 @@ static inline int memcmp_8(const void *a, const void *b, bytes len)
 
 void runtime_memcpy(void *a, const void *b, bytes len)
 {
+#ifdef MEMOPS_SIMD
+    /* the vector copy runs forward only */
+    if (len >= MEMOPS_SIMD_MIN && memops.memcpy && (a <= b || a >= b + len)) {
+        memops.memcpy(a, b, len);
+        return;
+    }
+#endif
     unsigned int src_cnt, dest_cnt;
     bytes long_len, end_len;
     unsigned long *p_long_src;
@@ -127,6 +269,12 @@ KLIB_EXPORT(runtime_memcpy);
 
 void runtime_memset(u8 *a, u8 b, bytes len)
 {
+#ifdef MEMOPS_SIMD
+    if (len >= MEMOPS_SIMD_MIN && memops.memset) {
+        memops.memset(a, b, len);
+        return;
+    }
+#endif
     if (len < sizeof(long)) {
         memset_8(a, b, len);
         return;
@@ -156,6 +304,10 @@ KLIB_EXPORT(runtime_memset);
 
 int runtime_memcmp(const void *a, const void *b, bytes len)
 {
+#ifdef MEMOPS_SIMD
+    if (len >= MEMOPS_SIMD_MIN && memops.memcmp)
+        return memops.memcmp(a, b, len);
+#endif
     unsigned long res;
 
     if (len < sizeof(long)) {
@@ -207,3 +359,31 @@ int runtime_memcmp(const void *a, const void *b, bytes len)
     return memcmp_8(a + len - end_len, p_long_b, end_len);
 }
 KLIB_EXPORT(runtime_memcmp);
+
+/* Add len bytes at p to the one's complement sum, as 16-bit words in host
+   byte order; fold the result with csum_fold(). */
+u64 csum_add(u64 sum, const void *p, bytes len)
+{
+#ifdef MEMOPS_SIMD
+    if (len >= MEMOPS_SIMD_MIN && memops.csum)
+        sum = memops.csum(sum, &p, &len);
+#endif
+    while (len >= sizeof(u64)) {
+        sum = csum_add_carry(sum, *(u64_unaligned *)p);
+        p += sizeof(u64);
+        len -= sizeof(u64);
+    }
+    if (len >= sizeof(u32)) {
+        sum = csum_add_carry(sum, *(u32_unaligned *)p);
+        p += sizeof(u32);
+        len -= sizeof(u32);
+    }
+    if (len >= sizeof(u16)) {
+        sum = csum_add_carry(sum, *(u16_unaligned *)p);
+        p += sizeof(u16);
+        len -= sizeof(u16);
+    }
+    if (len)
+        sum = csum_add_carry(sum, *(u8 *)p);
+    return sum;
+}
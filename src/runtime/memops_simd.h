@@ -0,0 +1,128 @@
+/* Vector implementations of the memory operations and checksum, written
+   with generic vector types and instantiated by memops.c for each vector
+   width. The includer defines SIMD_BYTES, SIMD_ATTR (function attributes
+   enabling the instruction set) and SIMD_FN(name). All functions expect
+   len >= SIMD_BYTES. */
+
+#define SIMD_WORDS  (SIMD_BYTES / sizeof(u64))
+
+typedef u8 SIMD_FN(vu8) __attribute__((vector_size(SIMD_BYTES), aligned(1), may_alias));
+typedef u64 SIMD_FN(vu64) __attribute__((vector_size(SIMD_BYTES), aligned(1), may_alias));
+
+#define vu8     SIMD_FN(vu8)
+#define vu64    SIMD_FN(vu64)
+
+/* Copy forward; dst must not be above src within an overlapping range. The
+   final vector is loaded up front, since the loop may overwrite it when the
+   ranges overlap. */
+SIMD_ATTR static void SIMD_FN(memcpy)(void *dst, const void *src, bytes len)
+{
+    vu8 tail = *(vu8 *)(src + len - SIMD_BYTES);
+    void *dst_tail = dst + len - SIMD_BYTES;
+    while (len > 4 * SIMD_BYTES) {
+        vu8 v0 = ((vu8 *)src)[0];
+        vu8 v1 = ((vu8 *)src)[1];
+        vu8 v2 = ((vu8 *)src)[2];
+        vu8 v3 = ((vu8 *)src)[3];
+        ((vu8 *)dst)[0] = v0;
+        ((vu8 *)dst)[1] = v1;
+        ((vu8 *)dst)[2] = v2;
+        ((vu8 *)dst)[3] = v3;
+        src += 4 * SIMD_BYTES;
+        dst += 4 * SIMD_BYTES;
+        len -= 4 * SIMD_BYTES;
+    }
+    while (len > SIMD_BYTES) {
+        *(vu8 *)dst = *(vu8 *)src;
+        src += SIMD_BYTES;
+        dst += SIMD_BYTES;
+        len -= SIMD_BYTES;
+    }
+    *(vu8 *)dst_tail = tail;
+}
+
+SIMD_ATTR static void SIMD_FN(memset)(u8 *dst, u8 b, bytes len)
+{
+    vu8 v = (vu8){} + b;
+    u8 *dst_tail = dst + len - SIMD_BYTES;
+    while (len > 4 * SIMD_BYTES) {
+        ((vu8 *)dst)[0] = v;
+        ((vu8 *)dst)[1] = v;
+        ((vu8 *)dst)[2] = v;
+        ((vu8 *)dst)[3] = v;
+        dst += 4 * SIMD_BYTES;
+        len -= 4 * SIMD_BYTES;
+    }
+    while (len > SIMD_BYTES) {
+        *(vu8 *)dst = v;
+        dst += SIMD_BYTES;
+        len -= SIMD_BYTES;
+    }
+    *(vu8 *)dst_tail = v;
+}
+
+/* Returns the difference of the first mismatching bytes. */
+SIMD_ATTR static int SIMD_FN(memcmp)(const void *a, const void *b, bytes len)
+{
+    bytes off = 0;
+    while (1) {
+        if (len - off < SIMD_BYTES)
+            off = len - SIMD_BYTES;
+        vu64 x = *(vu64 *)(a + off) ^ *(vu64 *)(b + off);
+        u64 any = 0;
+        for (int i = 0; i < SIMD_WORDS; i++)
+            any |= x[i];
+        if (any) {
+            for (int i = 0; i < SIMD_WORDS; i++) {
+                if (x[i]) {
+                    /* little endian: lowest set bit is the first byte */
+                    bytes k = off + i * sizeof(u64) + __builtin_ctzll(x[i]) / 8;
+                    return ((u8 *)a)[k] - ((u8 *)b)[k];
+                }
+            }
+        }
+        off += SIMD_BYTES;
+        if (off >= len)
+            return 0;
+    }
+}
+
+/* Sum 32-bit words into 64-bit lanes, which cannot carry out before
+   2^32 vectors; the remainder is left to the scalar code. */
+SIMD_ATTR static u64 SIMD_FN(csum)(u64 sum, const void **p, bytes *len)
+{
+    vu64 mask = (vu64){} + 0xffffffffull;
+    vu64 lo0 = {}, hi0 = {}, lo1 = {}, hi1 = {};
+    const void *q = *p;
+    bytes n = *len;
+    while (n >= 2 * SIMD_BYTES) {
+        vu64 x0 = ((vu64 *)q)[0];
+        vu64 x1 = ((vu64 *)q)[1];
+        lo0 += x0 & mask;
+        hi0 += x0 >> 32;
+        lo1 += x1 & mask;
+        hi1 += x1 >> 32;
+        q += 2 * SIMD_BYTES;
+        n -= 2 * SIMD_BYTES;
+    }
+    if (n >= SIMD_BYTES) {
+        vu64 x0 = *(vu64 *)q;
+        lo0 += x0 & mask;
+        hi0 += x0 >> 32;
+        q += SIMD_BYTES;
+        n -= SIMD_BYTES;
+    }
+    lo0 += lo1;
+    hi0 += hi1;
+    for (int i = 0; i < SIMD_WORDS; i++) {
+        sum = csum_add_carry(sum, lo0[i]);
+        sum = csum_add_carry(sum, hi0[i]);
+    }
+    *p = q;
+    *len = n;
+    return sum;
+}
+
+#undef vu8
+#undef vu64
+#undef SIMD_WORDS
@@ -128,7 +128,11 @@ static inline u64 queue_length(queue q)
 
 static inline boolean queue_empty(queue q)
 {
-    return q->prod_tail == q->cons_head;
+    /* cons_head and prod_tail share a word; load them together so that a
+       check made without a lock is never torn */
+    union combined cc;
+    cc.w = q->cc.w;
+    return cc.tail == cc.head;
 }
 
 static inline boolean queue_full(queue q)
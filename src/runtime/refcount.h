@@ -15,6 +15,19 @@ static inline void refcount_reserve(refcount r)
     fetch_and_add(&r->c, 1);
 }
 
+/* take a reference only if the object is still live; used for
+   lockless lookups of objects whose memory is never reclaimed */
+static inline boolean refcount_reserve_if_live(refcount r)
+{
+    word c;
+    do {
+        c = r->c;
+        if (c == 0)
+            return false;
+    } while (!__sync_bool_compare_and_swap(&r->c, c, c + 1));
+    return true;
+}
+
 static inline boolean refcount_release(refcount r)
 {
     word n = fetch_and_add(&r->c, (word)-1);
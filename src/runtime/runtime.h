@@ -57,6 +57,26 @@ void runtime_memset(u8 *a, u8 b, bytes len);
 
 int runtime_memcmp(const void *a, const void *b, bytes len);
 
+/* memops implementation levels */
+#define MEMOPS_GENERIC  0
+#define MEMOPS_VEC128   1   /* SSE4.1, Advanced SIMD */
+#define MEMOPS_VEC256   2   /* AVX2 */
+
+int init_memops(void);
+boolean memops_set_level(int level);
+
+u64 csum_add(u64 sum, const void *p, bytes len);
+
+/* Fold a one's complement sum down to 16 bits */
+static inline u16 csum_fold(u64 sum)
+{
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return sum;
+}
+
 static inline int runtime_strlen(const char *a)
 {
     int i = 0;
@@ -131,6 +131,7 @@ void init_runtime(heap general, heap safe)
     ignore_status = (void*)ignore;
     errheap = safe;
     null_value = wrap_buffer(general, "", 1);
+    init_memops();
 }
 
 void rputs(const char *s)
@@ -556,9 +556,9 @@ static void log_set_dirty(log tl)
     }
     tl->dirty = true;
     assert(!tl->flush_timer);
-    tl->flush_timer = register_timer(runloop_timers, CLOCK_ID_MONOTONIC,
-                                     seconds(TFS_LOG_FLUSH_DELAY_SECONDS), false, 0,
-                                     closure(tl->h, log_flush_timer_expired, tl));
+    tl->flush_timer = kern_register_timer(CLOCK_ID_MONOTONIC,
+                                          seconds(TFS_LOG_FLUSH_DELAY_SECONDS), false, 0,
+                                          closure(tl->h, log_flush_timer_expired, tl));
 }
 #else
 /* mkfs: flush on close */
@@ -196,20 +196,8 @@ int filesystem_add_tuple(const char *path, tuple t)
 
 void file_readahead(file f, u64 offset, u64 len)
 {
-    u64 ra_size = 0;
-    switch (f->fadv) {
-    case POSIX_FADV_NORMAL:
-        ra_size = FILE_READAHEAD_DEFAULT;
-        break;
-    case POSIX_FADV_RANDOM: /* no read-ahead */
-        break;
-    case POSIX_FADV_SEQUENTIAL:
-        ra_size = 2 * FILE_READAHEAD_DEFAULT;
-        break;
-    }
-    if (ra_size > 0)
-        pagecache_node_fetch_pages(fsfile_get_cachenode(f->fsf),
-            irangel(offset + len, ra_size));
+    pagecache_node_readahead(fsfile_get_cachenode(f->fsf), &f->ra,
+        irangel(offset, len));
 }
 
 closure_function(4, 1, void, fs_sync_complete,
@@ -437,9 +425,13 @@ sysreturn fadvise64(int fd, s64 off, u64 len, int advice)
     file f = (file)desc;
     switch (advice) {
     case POSIX_FADV_NORMAL:
-    case POSIX_FADV_RANDOM:
+        pagecache_ra_init(&f->ra, pagecache_get_readahead_max());
+        break;
+    case POSIX_FADV_RANDOM: /* no read-ahead */
+        pagecache_ra_init(&f->ra, 0);
+        break;
     case POSIX_FADV_SEQUENTIAL:
-        f->fadv = advice;
+        pagecache_ra_init(&f->ra, 2 * pagecache_get_readahead_max());
         break;
     case POSIX_FADV_WILLNEED: {
         pagecache_node pn = fsfile_get_cachenode(f->fsf);
@@ -456,3 +448,16 @@ sysreturn fadvise64(int fd, s64 off, u64 len, int advice)
     }
     return 0;
 }
+
+sysreturn readahead(int fd, s64 offset, u64 count)
+{
+    fdesc desc = resolve_fd(current->p, fd);
+    if (!fdesc_is_readable(desc))
+        return -EBADF;
+    if (desc->type != FDESC_TYPE_REGULAR || offset < 0)
+        return -EINVAL;
+    file f = (file)desc;
+    pagecache_node_force_readahead(fsfile_get_cachenode(f->fsf), &f->ra,
+        irangel(offset, count));
+    return 0;
+}
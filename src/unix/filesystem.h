@@ -134,3 +134,4 @@ sysreturn fstatfs(int fd, struct statfs *buf);
 sysreturn fallocate(int fd, int mode, long offset, long len);
 
 sysreturn fadvise64(int fd, s64 off, u64 len, int advice);
+sysreturn readahead(int fd, s64 offset, u64 count);
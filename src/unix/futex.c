@@ -1,91 +1,267 @@
 #include <unix_internal.h>
 
+/* Futexes live in a global table hashed by key, each bucket under its own
+   spinlock. A private futex is keyed by process and user address; a futex
+   in a shared mapping is keyed by physical address so that waiters in
+   different address spaces meet. Futex objects exist only while they have
+   waiters or an operation in flight, and are freed when the last reference
+   is dropped.
+
+   Waiting and waking still go through a blockq and so require the kernel
+   lock; the futex syscall itself is lockless until it finds a futex to
+   operate on, so that uncontended wakes and waits that are satisfied by
+   spinning never take the kernel lock. A waiter registers itself in the
+   futex before blocking and holds the kernel lock from then until it is
+   on the blockq, so a waker that finds the waiter and then takes the
+   kernel lock cannot miss it. */
+
+#define FUTEX_HASH_ORDER    8
+#define FUTEX_HASH_SIZE     U64_FROM_BIT(FUTEX_HASH_ORDER)
+
+/* bounds for the number of pause iterations FUTEX_WAIT spends polling the
+   futex word before sleeping; adapted per thread */
+#define FUTEX_SPIN_MIN      64
+#define FUTEX_SPIN_MAX      4096
+
+struct futex_key {
+    process p;          /* 0 for shared futexes */
+    u64 addr;           /* user address, or physical address if shared */
+};
+
 struct futex {
-    heap h;
+    struct list l;      /* bucket list */
+    struct futex_key key;
+    u64 refcount;
     blockq bq;
+    struct list waiters;
 };
 
-static u64 futex_key_function(void *x)
+typedef struct futex_waiter {
+    struct list l;
+    struct futex *f;    /* 0 once dequeued by a waker */
+    thread t;
+    u32 bitset;
+} *futex_waiter;
+
+static struct futex_bucket {
+    struct spinlock lock;
+    struct list futexes;
+} futex_table[FUTEX_HASH_SIZE];
+
+static heap futex_heap;
+
+static boolean futex_stats;
+static struct {
+    u64 wakeups;
+    u64 latency_total;
+    u64 latency_max;
+} futex_wake_latency;
+
+static struct futex_bucket *futex_bucket(struct futex_key *k)
 {
-    return u64_from_pointer(x);
+    u64 h = (k->addr ^ u64_from_pointer(k->p)) * 0x9e3779b97f4a7c15ull;
+    return &futex_table[h >> (64 - FUTEX_HASH_ORDER)];
 }
 
-static boolean futex_key_equal(void *a, void *b)
+static void futex_get_key(process p, int *uaddr, boolean private, struct futex_key *k)
 {
-    return a == b;
+    k->p = p;
+    k->addr = u64_from_pointer(uaddr);
+    if (private)
+        return;
+    vmap vm = vmap_from_vaddr(p, k->addr);
+    if (vm == INVALID_ADDRESS || !(vm->flags & VMAP_FLAG_SHARED))
+        return;
+    physical phys = physical_from_virtual(uaddr);
+    if (phys != INVALID_PHYSICAL) {
+        k->p = 0;
+        k->addr = phys;
+    }
 }
 
-static struct futex * soft_create_futex(process p, u64 key)
+/* Returns the futex with a reference held, 0 if there is none and create
+   is false, or INVALID_ADDRESS on allocation failure. */
+static struct futex *futex_lookup_locked(struct futex_bucket *b, struct futex_key *k,
+                                         boolean create)
 {
-    heap h = heap_general(get_kernel_heaps());
-    struct futex * f;
-
-    // XXX make this all atomic wrt p->futices
-
-    f = table_find(p->futices, pointer_from_u64(key));
-    if (f)
-        return f;
+    list_foreach(&b->futexes, l) {
+        struct futex *f = struct_from_list(l, struct futex *, l);
+        if (f->key.p == k->p && f->key.addr == k->addr) {
+            f->refcount++;
+            return f;
+        }
+    }
+    if (!create)
+        return 0;
 
-    f = allocate(h, sizeof(struct futex));
+    struct futex *f = allocate(futex_heap, sizeof(struct futex));
     if (f == INVALID_ADDRESS) {
         msg_err("failed to allocate futex\n");
         return f;
     }
-
-    f->h = h;
-    f->bq = allocate_blockq(f->h, "futex");
+    f->bq = allocate_blockq(futex_heap, "futex");
     if (f->bq == INVALID_ADDRESS) {
         msg_err("failed to allocate futex blockq\n");
-        deallocate(f->h, f, sizeof(struct futex));
+        deallocate(futex_heap, f, sizeof(struct futex));
         return INVALID_ADDRESS;
     }
-
-    table_set(p->futices, pointer_from_u64(key), f);
+    f->key = *k;
+    f->refcount = 1;
+    list_init(&f->waiters);
+    list_push_back(&b->futexes, &f->l);
     return f;
 }
 
-static thread futex_wake_one(struct futex * f)
+static void futex_put_locked(struct futex *f)
+{
+    assert(f->refcount > 0);
+    if (--f->refcount > 0)
+        return;
+    assert(list_empty(&f->waiters));
+    list_delete(&f->l);
+    deallocate_blockq(f->bq);
+    deallocate(futex_heap, f, sizeof(struct futex));
+}
+
+static struct futex *futex_get(struct futex_key *k, boolean create)
 {
-    thread w;
+    struct futex_bucket *b = futex_bucket(k);
+    spin_lock(&b->lock);
+    struct futex *f = futex_lookup_locked(b, k, create);
+    spin_unlock(&b->lock);
+    return f;
+}
 
-    w = blockq_wake_one(f->bq);
-    if (w == INVALID_ADDRESS)
-        return w;
+static void futex_put(struct futex *f)
+{
+    struct futex_bucket *b = futex_bucket(&f->key);
+    spin_lock(&b->lock);
+    futex_put_locked(f);
+    spin_unlock(&b->lock);
+}
 
-    /* w must be awake */
-    assert(w->blocked_on != f->bq);
-    return w;
+/* Remove a waiter that is leaving on its own (timeout, signal, or failure
+   to block) and drop its reference. */
+static void futex_waiter_detach(futex_waiter w)
+{
+    struct futex *f = w->f;
+    if (!f)
+        return;
+    struct futex_bucket *b = futex_bucket(&f->key);
+    spin_lock(&b->lock);
+    list_delete(&w->l);
+    w->f = 0;
+    futex_put_locked(f);
+    spin_unlock(&b->lock);
 }
 
 /*
- * Wake up to 'val' waiters
- * Return the number woken
+ * Wake up to 'val' waiters whose bitset intersects 'bitset'.
+ * Return the number woken. The caller holds a reference to f and the
+ * kernel lock.
  */
-static int futex_wake_many(struct futex * f, int val)
+static int futex_wake(struct futex *f, int val, u32 bitset)
 {
-    int nr_woken;
+    struct futex_bucket *b = futex_bucket(&f->key);
+    int nr_woken = 0;
 
-    for (nr_woken = 0; nr_woken < val; nr_woken++) {
-        thread w = futex_wake_one(f);
-        if (w == INVALID_ADDRESS)
+    spin_lock(&b->lock);
+    list_foreach(&f->waiters, l) {
+        if (nr_woken >= val)
             break;
+        futex_waiter w = struct_from_list(l, futex_waiter, l);
+        if (!(w->bitset & bitset))
+            continue;
+        thread t = w->t;
+        list_delete(&w->l);
+        w->f = 0;
+        futex_put_locked(f);
+        if (futex_stats)
+            t->futex_wake_ts = now(CLOCK_ID_MONOTONIC);
+        /* the waiter was queued under the kernel lock before we saw it */
+        if (!blockq_wake_one_for_thread(f->bq, t))
+            halt("%s: futex waiter %p (tid %d) not on blockq\n", __func__, w, t->tid);
+        nr_woken++;
     }
-
+    spin_unlock(&b->lock);
     return nr_woken;
 }
 
+/* Move up to n waiters from src to dest; references held on both. */
+static int futex_requeue(struct futex *src, struct futex *dest, int n)
+{
+    struct futex_bucket *sb = futex_bucket(&src->key);
+    struct futex_bucket *db = futex_bucket(&dest->key);
+
+    if (src == dest || n <= 0)
+        return 0;
+
+    /* lock buckets in address order */
+    if (sb == db) {
+        spin_lock(&sb->lock);
+    } else if (sb < db) {
+        spin_lock(&sb->lock);
+        spin_lock(&db->lock);
+    } else {
+        spin_lock(&db->lock);
+        spin_lock(&sb->lock);
+    }
+
+    /* blockq and futex waiter lists are both in arrival order */
+    int requeued = blockq_transfer_waiters(dest->bq, src->bq, n);
+    for (int i = 0; i < requeued; i++) {
+        futex_waiter w = struct_from_list(list_begin(&src->waiters), futex_waiter, l);
+        list_delete(&w->l);
+        list_push_back(&dest->waiters, &w->l);
+        w->f = dest;
+        src->refcount--;
+        dest->refcount++;
+    }
+
+    spin_unlock(&sb->lock);
+    if (db != sb)
+        spin_unlock(&db->lock);
+    return requeued;
+}
+
 boolean futex_wake_many_by_uaddr(process p, int *uaddr, int val)
 {
+    struct futex_key k;
     struct futex * f;
 
-    f = table_find(p->futices, (void *)uaddr);
+    futex_get_key(p, uaddr, false, &k);
+    f = futex_get(&k, false);
     if (!f)
         return false;
 
-    futex_wake_many(f, val);
+    futex_wake(f, val, FUTEX_BITSET_MATCH_ANY);
+    futex_put(f);
     return true;
 }
 
+void futex_account_wakeup(thread t)
+{
+    u64 latency = now(CLOCK_ID_MONOTONIC) - t->futex_wake_ts;
+    t->futex_wake_ts = 0;
+    fetch_and_add(&futex_wake_latency.wakeups, 1);
+    fetch_and_add(&futex_wake_latency.latency_total, latency);
+    u64 max;
+    do {
+        max = futex_wake_latency.latency_max;
+        if (latency <= max)
+            break;
+    } while (!__sync_bool_compare_and_swap(&futex_wake_latency.latency_max, max, latency));
+}
+
+closure_function(0, 2, void, print_futex_stats,
+                 int, status, merge, m)
+{
+    u64 n = futex_wake_latency.wakeups;
+    rprintf("futex wakeups: %ld, wake-to-run latency avg %ld ns, max %ld ns\n", n,
+            n ? nsec_from_timestamp(futex_wake_latency.latency_total / n) : 0,
+            nsec_from_timestamp(futex_wake_latency.latency_max));
+}
+
 /*
  * futex_bh is invoked either by the bh processor in response
  * to timeout/signal delivery/etc., or by another thread in sys_futex
@@ -96,11 +272,12 @@ boolean futex_wake_many_by_uaddr(process p, int *uaddr, int val)
  *  -EINTR: if we're being nullified
  *  0: thread woken up
  */
-closure_function(4, 1, sysreturn, futex_bh,
-                 struct futex *, f, thread, t, boolean, blocked, timestamp, timeout,
+closure_function(3, 1, sysreturn, futex_bh,
+                 futex_waiter, w, boolean, blocked, timestamp, timeout,
                  u64, flags)
 {
-    thread t = bound(t);
+    futex_waiter w = bound(w);
+    thread t = w->t;
     sysreturn rv;
 
     if (flags & BLOCKQ_ACTION_NULLIFY)
@@ -108,13 +285,15 @@ closure_function(4, 1, sysreturn, futex_bh,
     else if (flags & BLOCKQ_ACTION_TIMEDOUT)
         rv = -ETIMEDOUT;
     else if (!bound(blocked)) {
-        thread_log(t, "%s: struct futex: %p, blocking\n", __func__, bound(f));
+        thread_log(t, "%s: futex waiter: %p, blocking\n", __func__, w);
         bound(blocked) = true;
         return BLOCKQ_BLOCK_REQUIRED;
     } else
         rv = 0; /* no timer expire + not us --> actual wakeup */
 
-    thread_log(t, "%s: struct futex: %p, flags 0x%lx, rv %ld\n", __func__, bound(f), flags, rv);
+    thread_log(t, "%s: futex waiter: %p, flags 0x%lx, rv %ld\n", __func__, w, flags, rv);
+    futex_waiter_detach(w);
+    deallocate(futex_heap, w, sizeof(struct futex_waiter));
     closure_finish();
     return syscall_return(t, rv);
 }
@@ -132,10 +311,180 @@ static timestamp get_timeout_timestamp(int futex_op, u64 val2)
     }
 }
 
+/* Poll the futex word for a while before going to sleep, in the hope that
+   a holder on another cpu is about to release it. Only done when running
+   without the kernel lock, since spinning with it held would stall the
+   very thread we are waiting for should it enter the kernel. The spin
+   budget grows when polling pays off and shrinks when it does not. */
+static boolean futex_spin(thread t, int *uaddr, int val)
+{
+    if (!t->syscall_nolock || total_processors < 2)
+        return false;
+    u64 spin = MAX(t->futex_spin, FUTEX_SPIN_MIN);
+    /* a fault on the futex word takes the kernel lock; stop spinning then */
+    for (u64 i = 0; i < spin && t->syscall_nolock; i++) {
+        if (*(volatile int *)uaddr != val) {
+            t->futex_spin = MIN(spin * 2, FUTEX_SPIN_MAX);
+            return true;
+        }
+        kern_pause();
+    }
+    t->futex_spin = MAX(spin / 2, FUTEX_SPIN_MIN);
+    return false;
+}
+
+static sysreturn futex_wait(int *uaddr, int val, boolean private, u32 bitset,
+                            clock_id clkid, timestamp ts, boolean absolute)
+{
+    if (!bitset)
+        return -EINVAL;
+
+    if (futex_spin(current, uaddr, val))
+        return -EAGAIN;
+
+    /* Fault the futex word in before taking the bucket lock; with the kernel
+       lock held it cannot be unmapped until we are on the blockq. */
+    syscall_acquire_lock(current);
+    if (*(volatile int *)uaddr != val)
+        return -EAGAIN;
+
+    struct futex_key k;
+    futex_get_key(current->p, uaddr, private, &k);
+    struct futex_bucket *b = futex_bucket(&k);
+    spin_lock(&b->lock);
+    struct futex *f = futex_lookup_locked(b, &k, true);
+    if (f == INVALID_ADDRESS) {
+        spin_unlock(&b->lock);
+        return -ENOMEM;
+    }
+    if (*(volatile int *)uaddr != val) {
+        futex_put_locked(f);
+        spin_unlock(&b->lock);
+        return -EAGAIN;
+    }
+    futex_waiter w = allocate(futex_heap, sizeof(struct futex_waiter));
+    if (w == INVALID_ADDRESS) {
+        futex_put_locked(f);
+        spin_unlock(&b->lock);
+        return -ENOMEM;
+    }
+    /* the waiter takes over our reference */
+    w->f = f;
+    w->t = current;
+    w->bitset = bitset;
+    list_push_back(&f->waiters, &w->l);
+    spin_unlock(&b->lock);
+
+    // if we resume we are woken up
+    set_syscall_return(current, 0);
+
+    blockq_action a = closure(futex_heap, futex_bh, w, false, ts);
+    sysreturn rv = a == INVALID_ADDRESS ? -ENOMEM :
+        blockq_check_timeout(f->bq, current, a, false, clkid, ts, absolute);
+
+    /* only reached if the thread failed to block */
+    futex_waiter_detach(w);
+    deallocate(futex_heap, w, sizeof(struct futex_waiter));
+    if (a != INVALID_ADDRESS)
+        deallocate_closure(a);
+    return rv;
+}
+
+static sysreturn futex_wake_op(process p, int *uaddr, int *uaddr2, int val,
+                               int val2, int val3, boolean private)
+{
+    int op = (val3 >> 28) & MASK(4);
+    int cmp = (val3 >> 24) & MASK(4);
+    /* both arguments are sign-extended 12-bit values */
+    int oparg = (val3 << 8) >> 20;
+    int cmparg = (val3 << 20) >> 20;
+    int oldval, c;
+
+    if (!validate_user_memory(uaddr2, sizeof(int), true))
+        return -EFAULT;
+
+    if (op & FUTEX_OP_OPARG_SHIFT) {
+        if (oparg < 0 || oparg > 31)
+            return -EINVAL;
+        oparg = 1 << oparg;
+        op &= ~FUTEX_OP_OPARG_SHIFT;
+    }
+
+    /* userspace may be operating on the word concurrently */
+    switch (op) {
+    case FUTEX_OP_SET:   oldval = __sync_lock_test_and_set(uaddr2, oparg); break;
+    case FUTEX_OP_ADD:   oldval = __sync_fetch_and_add(uaddr2, oparg); break;
+    case FUTEX_OP_OR:    oldval = __sync_fetch_and_or(uaddr2, oparg); break;
+    case FUTEX_OP_ANDN:  oldval = __sync_fetch_and_and(uaddr2, ~oparg); break;
+    case FUTEX_OP_XOR:   oldval = __sync_fetch_and_xor(uaddr2, oparg); break;
+    default:
+        return -ENOSYS;
+    }
+
+    switch (cmp) {
+    case FUTEX_OP_CMP_EQ: c = (oldval == cmparg); break;
+    case FUTEX_OP_CMP_NE: c = (oldval != cmparg); break;
+    case FUTEX_OP_CMP_LT: c = (oldval < cmparg); break;
+    case FUTEX_OP_CMP_LE: c = (oldval <= cmparg); break;
+    case FUTEX_OP_CMP_GT: c = (oldval > cmparg); break;
+    case FUTEX_OP_CMP_GE: c = (oldval >= cmparg); break;
+    default:
+        return -ENOSYS;
+    }
+
+    struct futex_key k;
+    int woken = 0;
+    futex_get_key(p, uaddr, private, &k);
+    struct futex *f = futex_get(&k, false);
+    if (f) {
+        woken = futex_wake(f, val, FUTEX_BITSET_MATCH_ANY);
+        futex_put(f);
+    }
+    if (c) {
+        futex_get_key(p, uaddr2, private, &k);
+        f = futex_get(&k, false);
+        if (f) {
+            woken += futex_wake(f, val2, FUTEX_BITSET_MATCH_ANY);
+            futex_put(f);
+        }
+    }
+    return woken;
+}
+
+static sysreturn futex_cmp_requeue(process p, int *uaddr, int *uaddr2, int val,
+                                   int val2, boolean cmp, int val3, boolean private)
+{
+    if (!validate_user_memory(uaddr2, sizeof(int), false))
+        return -EFAULT;
+    if (val < 0 || val2 < 0)
+        return -EINVAL;
+    if (cmp && *(volatile int *)uaddr != val3)
+        return -EAGAIN;
+
+    struct futex_key k;
+    futex_get_key(p, uaddr, private, &k);
+    struct futex *f = futex_get(&k, false);
+    if (!f)
+        return 0;
+    int woken = futex_wake(f, val, FUTEX_BITSET_MATCH_ANY);
+    int requeued = 0;
+    if (val2 > 0) {
+        futex_get_key(p, uaddr2, private, &k);
+        struct futex *new = futex_get(&k, true);
+        if (new == INVALID_ADDRESS) {
+            futex_put(f);
+            return -ENOMEM;
+        }
+        requeued = futex_requeue(f, new, val2);
+        futex_put(new);
+    }
+    futex_put(f);
+    return woken + requeued;
+}
+
 sysreturn futex(int *uaddr, int futex_op, int val,
                 u64 val2, int *uaddr2, int val3)
 {
-    struct futex * f;
     timestamp ts;
     int op;
 
@@ -144,133 +493,62 @@ sysreturn futex(int *uaddr, int futex_op, int val,
     boolean verbose = table_find(current->p->process_root, sym(futex_trace))
         ? true : false;
 
-    f = soft_create_futex(current->p, u64_from_pointer(uaddr));
-    if (f == INVALID_ADDRESS)
-        return set_syscall_error(current, ENOMEM);
-    
     op = futex_op & 127; // chuck the private bit
+    boolean private = (futex_op & FUTEX_PRIVATE_FLAG) != 0;
     ts = get_timeout_timestamp(op, val2);
     clock_id clkid = (futex_op & FUTEX_CLOCK_REALTIME) ? CLOCK_ID_REALTIME :
             CLOCK_ID_MONOTONIC;
 
     switch (op) {
-    case FUTEX_WAIT: {
+    case FUTEX_WAIT:
         if (verbose)
             thread_log(current, "futex_wait [%ld %p %d] %d 0x%ld",
                 current->tid, uaddr, *uaddr, val, val2);
+        return futex_wait(uaddr, val, private, FUTEX_BITSET_MATCH_ANY, clkid, ts, false);
 
-        if (*uaddr != val)
-            return set_syscall_error(current, EAGAIN);
-
-        // if we resume we are woken up
-        set_syscall_return(current, 0);
-
-        return blockq_check_timeout(f->bq, current, 
-                                    closure(f->h, futex_bh, f, current, false, ts),
-                                    false, clkid, ts, false);
-    }
-
-    case FUTEX_WAKE: {
+    case FUTEX_WAIT_BITSET:
         if (verbose)
-            thread_log(current, "futex_wake [%ld %p %d] %d",
-                current->tid, uaddr, *uaddr, val);
-        return set_syscall_return(current, futex_wake_many(f, val));
-    }
-
-    case FUTEX_CMP_REQUEUE: {
-        int woken, requeued;
-
-        if (!validate_user_memory(uaddr2, sizeof(int), false))
-            return set_syscall_error(current, EFAULT);
+            thread_log(current, "futex_wait_bitset [%ld %p %d] %d 0x%ld %d",
+                current->tid, uaddr, *uaddr, val, val2, val3);
+        return futex_wait(uaddr, val, private, val3, clkid, ts, true);
 
+    case FUTEX_WAKE:
+    case FUTEX_WAKE_BITSET: {
+        u32 bitset = op == FUTEX_WAKE ? FUTEX_BITSET_MATCH_ANY : val3;
         if (verbose)
-            thread_log(current, "futex_cmp_requeue [%ld %p %d] val: %d val2: %d uaddr2: %p %d val3: %d",
-                       current->tid, uaddr, *uaddr, val, val2, uaddr2, *uaddr2, val3);
-
-        if (*uaddr != val3)
-            return set_syscall_error(current, EAGAIN);
-
-        woken = futex_wake_many(f, val);
-
-        requeued = 0;
-        if (val2 > 0) {
-            struct futex * new = soft_create_futex(current->p, u64_from_pointer(uaddr2));
-            if (new == INVALID_ADDRESS)
-                return set_syscall_error(current, ENOMEM);
-            int requeued = blockq_transfer_waiters(new->bq, f->bq, val2);
-            if (verbose)
-                thread_log(current, " awoken: %d, re-queued %d", woken, requeued);
-        }
-
-        return set_syscall_return(current, woken + requeued);
+            thread_log(current, "futex_wake [%ld %p] %d 0x%x",
+                current->tid, uaddr, val, bitset);
+        if (!bitset)
+            return -EINVAL;
+
+        /* nobody waiting: done without the kernel lock */
+        struct futex_key k;
+        futex_get_key(current->p, uaddr, private, &k);
+        struct futex *f = futex_get(&k, false);
+        if (!f)
+            return 0;
+        syscall_acquire_lock(current);
+        int woken = futex_wake(f, val, bitset);
+        futex_put(f);
+        return woken;
     }
 
-    case FUTEX_WAKE_OP: {
-        unsigned int cmparg = val3 & MASK(12);
-        unsigned int oparg = (val3 >> 12) & MASK(12);
-        unsigned int cmp = (val3 >> 24) & MASK(4);
-        unsigned int op = (val3 >> 28) & MASK(4);
-        int oldval, wake1, wake2, c;
-
-        if (!validate_user_memory(uaddr2, sizeof(int), true))
-            return set_syscall_error(current, EFAULT);
-
-        if (verbose) {
-            thread_log(current, "futex_wake_op: [%ld %p %d] %p %d %d %d %d",
-                current->tid, uaddr, *uaddr, uaddr2, cmparg, oparg, cmp, op);
-        }
-
-        oldval = *(int *) uaddr2;
-        
-        switch (op) {
-        case FUTEX_OP_SET:   *uaddr2 = oparg; break;
-        case FUTEX_OP_ADD:   *uaddr2 += oparg; break;
-        case FUTEX_OP_OR:    *uaddr2 |= oparg; break;
-        case FUTEX_OP_ANDN:  *uaddr2 &= ~oparg; break;
-        case FUTEX_OP_XOR:   *uaddr2 ^= oparg; break;
-        }
-
-        wake1 = futex_wake_many(f, val);
-        
-        c = 0;
-        switch (cmp) {
-        case FUTEX_OP_CMP_EQ: c = (oldval == cmparg) ; break;
-        case FUTEX_OP_CMP_NE: c = (oldval != cmparg); break;
-        case FUTEX_OP_CMP_LT: c = (oldval < cmparg); break;
-        case FUTEX_OP_CMP_LE: c = (oldval <= cmparg); break;
-        case FUTEX_OP_CMP_GT: c = (oldval > cmparg) ; break;
-        case FUTEX_OP_CMP_GE: c = (oldval >= cmparg) ; break;
-        }
-        
-        wake2 = 0;
-        if (c) {
-            struct futex * f2 = 
-                soft_create_futex(current->p, u64_from_pointer(uaddr2));
-            if (f2 == INVALID_ADDRESS)
-                return set_syscall_error(current, ENOMEM);
-
-            wake2 = futex_wake_many(f2, val2);
-        }
-
-        return set_syscall_return(current, wake1 + wake2);
-    }
-
-    case FUTEX_WAIT_BITSET: {
+    case FUTEX_REQUEUE:
+    case FUTEX_CMP_REQUEUE:
         if (verbose)
-            thread_log(current, "futex_wait_bitset [%ld %p %d] %d 0x%ld %d",
-                current->tid, uaddr, *uaddr, val, val2, val3);
+            thread_log(current, "futex_cmp_requeue [%ld %p %d] val: %d val2: %d uaddr2: %p val3: %d",
+                       current->tid, uaddr, *uaddr, val, val2, uaddr2, val3);
+        syscall_acquire_lock(current);
+        return futex_cmp_requeue(current->p, uaddr, uaddr2, val, val2,
+                                 op == FUTEX_CMP_REQUEUE, val3, private);
 
-        if (*uaddr != val)
-            return set_syscall_error(current, EAGAIN);
-
-        set_syscall_return(current, 0);
-        return blockq_check_timeout(f->bq, current, 
-                                    closure(f->h, futex_bh, f, current, false, ts),
-                                    false, clkid, ts, true);
-    }
+    case FUTEX_WAKE_OP:
+        if (verbose)
+            thread_log(current, "futex_wake_op: [%ld %p %d] %p %d %d 0x%x",
+                current->tid, uaddr, *uaddr, uaddr2, val, val2, val3);
+        syscall_acquire_lock(current);
+        return futex_wake_op(current->p, uaddr, uaddr2, val, val2, val3, private);
 
-    case FUTEX_REQUEUE: rprintf("futex_requeue not implemented\n"); break;
-    case FUTEX_WAKE_BITSET: rprintf("futex_wake_bitset not implemented\n"); break;
     case FUTEX_LOCK_PI: rprintf("futex_lock_pi not implemented\n"); break;
     case FUTEX_TRYLOCK_PI: rprintf("futex_trylock_pi not implemented\n"); break;
     case FUTEX_UNLOCK_PI: rprintf("futex_unlock_pi not implemented\n"); break;
@@ -279,20 +557,24 @@ sysreturn futex(int *uaddr, int futex_op, int val,
     default: rprintf("futex op %d not implemented\n", op); break;
     }
 
-    return set_syscall_error(current, ENOSYS);
+    return -ENOSYS;
 }
 
-void
-init_futices(process p)
+boolean futex_init(unix_heaps uh, tuple root)
 {
-    p->futices = allocate_table(
-        heap_general((kernel_heaps)p->uh),
-        futex_key_function,
-        futex_key_equal
-    );
-    if (p->futices == INVALID_ADDRESS)
-        halt("failed to allocate futex table\n");
-
+    futex_heap = heap_general((kernel_heaps)uh);
+    for (int i = 0; i < FUTEX_HASH_SIZE; i++) {
+        spin_lock_init(&futex_table[i].lock);
+        list_init(&futex_table[i].futexes);
+    }
+    futex_stats = table_find(root, sym(futex_stats)) != 0;
+    if (futex_stats) {
+        shutdown_handler sh = closure(futex_heap, print_futex_stats);
+        if (sh == INVALID_ADDRESS)
+            return false;
+        vector_push(shutdown_completions, sh);
+    }
+    return true;
 }
 
 /* robust mutex handling */
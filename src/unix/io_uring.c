@@ -1,9 +1,16 @@
+#include <net_system_structs.h>
 #include <unix_internal.h>
+#include <socket.h>
 
+#define IORING_SETUP_SQPOLL     (1 << 1)
+#define IORING_SETUP_SQ_AFF     (1 << 2)
 #define IORING_SETUP_CQSIZE     (1 << 3)
 
 #define IORING_FEAT_SINGLE_MMAP     (1 << 0)
 #define IORING_FEAT_RW_CUR_POS      (1 << 3)
+#define IORING_FEAT_SQPOLL_NONFIXED (1 << 7)
+
+#define IORING_SQ_NEED_WAKEUP   (1 << 0)
 
 #define IORING_OFF_SQ_RING  0ULL
 #define IORING_OFF_CQ_RING  0x8000000ULL
@@ -12,6 +19,7 @@
 #define IORING_TIMEOUT_ABS  (1 << 0)
 
 #define IORING_ENTER_GETEVENTS  (1 << 0)
+#define IORING_ENTER_SQ_WAKEUP  (1 << 1)
 
 #define IO_URING_OP_SUPPORTED   (1 << 0)
 
@@ -19,6 +27,8 @@
 #define IOUR_CQ_ENTRIES_MAX (2 * IOUR_SQ_ENTRIES_MAX)
 #define IOUR_FILES_MAX      0x8000
 
+#define IOUR_SQ_IDLE_DEFAULT    1000    /* milliseconds */
+
 #define IOSQE_FIXED_FILE    (1 << 0)
 #define IOSQE_ASYNC         (1 << 4)
 
@@ -46,6 +56,7 @@ struct io_uring_sqe {
         u32 sync_range_flags;
         u32 msg_flags;
         u32 timeout_flags;
+        u32 accept_flags;
     };
     u64 user_data;
     union{
@@ -85,6 +96,10 @@ enum iour_enter_opcode {
     IORING_OP_STATX,
     IORING_OP_READ,
     IORING_OP_WRITE,
+    IORING_OP_FADVISE,
+    IORING_OP_MADVISE,
+    IORING_OP_SEND,
+    IORING_OP_RECV,
     IORING_OP_LAST,
 };
 
@@ -136,6 +151,9 @@ declare_closure_struct(1, 2, sysreturn, iour_close,
                        struct io_uring *, iour,
                        thread, t, io_completion, completion);
 
+declare_closure_struct(1, 0, void, iour_sq_poll,
+                       struct io_uring *, iour);
+
 typedef struct io_uring {
     struct fdesc f;    /* must be first */
     heap h;
@@ -163,6 +181,19 @@ typedef struct io_uring {
     u32 cq_timeouts;
     u64 noncancelable_ops;
 
+    /* IORING_SETUP_SQPOLL: the SQ ring is consumed by a poller running on
+     * sq_cpu on behalf of sq_thread. While the poller is active it accounts
+     * for one non-cancelable operation, so that the context is not released
+     * from under it. */
+    u32 setup_flags;
+    thread sq_thread;
+    u64 sq_cpu;
+    timestamp sq_idle;
+    timestamp sq_last_active;
+    boolean sq_polling;
+    boolean sq_exit;
+    closure_struct(iour_sq_poll, sq_poll);
+
     /* When true, the io_uring context is being shut down in the background,
      * i.e. no thread is blocked on close() and the context will be deallocated
      * when its last non-cancelable operation is completed. This can happen if
@@ -173,7 +204,7 @@ typedef struct io_uring {
     io_completion shutdown_completion;
 } *io_uring;
 
-declare_closure_struct(2, 2, void, iour_poll_notify,
+declare_closure_struct(2, 2, boolean, iour_poll_notify,
                        io_uring, iour, struct iour_poll *, p,
                        u64, events, thread, t);
 
@@ -221,6 +252,8 @@ typedef struct iour_timer {
 #define iour_lock(iour)     u64 _irqflags = spin_lock_irq(&(iour)->lock)
 #define iour_unlock(iour)   spin_unlock_irq(&(iour)->lock, _irqflags)
 
+static boolean iour_sq_start(io_uring iour);
+
 static void iour_release(io_uring iour)
 {
     iour_debug("completion %p", iour->shutdown_completion);
@@ -232,6 +265,8 @@ static void iour_release(io_uring iour)
     }
     if (iour->buf_count)
         deallocate(iour->h, iour->bufs, sizeof(struct iovec) * iour->buf_count);
+    if (iour->sq_thread)
+        thread_release(iour->sq_thread);
     u64 alloc_size = IOUR_ALLOC_SIZE(iour);
     unmap(u64_from_pointer(iour->user_rings), alloc_size);
     release_fdesc(&iour->f);
@@ -302,6 +337,7 @@ define_closure_function(1, 2, sysreturn, iour_close,
         fdesc_put(iour->eventfd);
         iour->eventfd = 0;
     }
+    iour->sq_exit = true;
     if (t) {
         spin_unlock_irq(&iour->lock, irqflags);
         if (iour->noncancelable_ops) {
@@ -349,9 +385,14 @@ sysreturn io_uring_setup(unsigned int entries, struct io_uring_params *params)
     iour_debug("entries %d, flags 0x%x, CQ entries %d", entries, params->flags,
                params->cq_entries);
     if ((entries == 0) || (entries > IOUR_SQ_ENTRIES_MAX) ||
-            (params->flags & ~IORING_SETUP_CQSIZE) || params->resv[0] ||
+            (params->flags & ~(IORING_SETUP_SQPOLL | IORING_SETUP_SQ_AFF |
+                               IORING_SETUP_CQSIZE)) || params->resv[0] ||
             params->resv[1] || params->resv[2] || params->resv[3])
         return -EINVAL;
+    if ((params->flags & IORING_SETUP_SQ_AFF) &&
+            (!(params->flags & IORING_SETUP_SQPOLL) ||
+             (params->sq_thread_cpu >= total_processors)))
+        return -EINVAL;
     params->sq_entries = U64_FROM_BIT(find_order(entries));
     if (params->flags & IORING_SETUP_CQSIZE) {
         if ((params->cq_entries < params->sq_entries) ||
@@ -406,6 +447,9 @@ sysreturn io_uring_setup(unsigned int entries, struct io_uring_params *params)
     iour->noncancelable_ops = 0;
     iour->shutdown = false;
     iour->shutdown_completion = 0;
+    iour->setup_flags = params->flags;
+    iour->sq_thread = 0;
+    iour->sq_polling = iour->sq_exit = false;
     ret = allocate_fd(current->p, iour);
     if (ret == INVALID_PHYSICAL) {
         ret = -EMFILE;
@@ -414,7 +458,17 @@ sysreturn io_uring_setup(unsigned int entries, struct io_uring_params *params)
     iour_debug("fd %d", ret);
     init_fdesc(h, &iour->f, FDESC_TYPE_IORING);
     iour->f.close = init_closure(&iour->close, iour_close, iour);
-    params->features = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_RW_CUR_POS;
+    if (params->flags & IORING_SETUP_SQPOLL) {
+        iour->sq_thread = current;
+        thread_reserve(current);
+        iour->sq_cpu = params->sq_thread_cpu;
+        iour->sq_idle = milliseconds(params->sq_thread_idle ?
+                                     params->sq_thread_idle :
+                                     IOUR_SQ_IDLE_DEFAULT);
+        iour_sq_start(iour);
+    }
+    params->features = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_RW_CUR_POS |
+            IORING_FEAT_SQPOLL_NONFIXED;
     params->sq_off.head = offsetof(io_rings, sq_head);
     params->sq_off.tail = offsetof(io_rings, sq_tail);
     params->sq_off.ring_mask = offsetof(io_rings, sq_mask);
@@ -606,12 +660,12 @@ static void iour_rw(io_uring iour, fdesc f, boolean write, void *addr, u32 len,
     }
 }
 
-define_closure_function(2, 2, void, iour_poll_notify,
+define_closure_function(2, 2, boolean, iour_poll_notify,
                         io_uring, iour, iour_poll, p,
                         u64, events, thread, t)
 {
     if (!events)
-        return;
+        return false;
     io_uring iour = bound(iour);
     iour_poll p = bound(p);
     iour_lock(iour);
@@ -627,6 +681,7 @@ define_closure_function(2, 2, void, iour_poll_notify,
         fdesc_put(p->f);
         deallocate(iour->h, p, sizeof(*p));
     }
+    return found;
 }
 
 static void iour_poll_add(io_uring iour, fdesc f, u16 events, u64 user_data)
@@ -728,7 +783,7 @@ static void iour_timeout_add(io_uring iour, struct timespec *ts, u32 flags,
     iour_debug("target %ld", iour_tim->target);
 
     list_push_back(&iour->timers, &iour_tim->l);
-    iour_tim->t = register_timer(runloop_timers, CLOCK_ID_MONOTONIC,
+    iour_tim->t = kern_register_timer(CLOCK_ID_MONOTONIC,
         time_from_timespec(ts), flags & IORING_TIMEOUT_ABS, 0,
         init_closure(&iour_tim->handler, iour_timeout, iour, iour_tim));
     if (iour_tim->t == INVALID_ADDRESS) {
@@ -766,6 +821,102 @@ static void iour_timeout_remove(io_uring iour, u64 addr, u64 user_data)
     iour_complete(iour, user_data, res, false, false);
 }
 
+static void iour_sock(io_uring iour, fdesc f, struct io_uring_sqe *sqe)
+{
+    iour_debug("opcode %d, fd %d, addr 0x%lx, len %d, flags 0x%x",
+               sqe->opcode, sqe->fd, sqe->addr, sqe->len, sqe->msg_flags);
+    struct sock *s = (struct sock *)f;
+    u64 user_data = sqe->user_data;
+    void *addr = pointer_from_u64(sqe->addr);
+    s32 err = 0;
+    if (f->type != FDESC_TYPE_SOCKET) {
+        err = -ENOTSOCK;
+        goto error;
+    }
+    if (sqe->ioprio || sqe->buf_index) {
+        err = -EINVAL;
+        goto error;
+    }
+
+    /* Validate user memory up front, as the corresponding syscalls do. */
+    boolean supported;
+    boolean valid = true;
+    switch (sqe->opcode) {
+    case IORING_OP_ACCEPT: {
+        socklen_t *addrlen = pointer_from_u64(sqe->off);
+        supported = !!s->accept4;
+        if (addr)
+            valid = validate_user_memory(addrlen, sizeof(socklen_t), true) &&
+                    validate_user_memory(addr, *addrlen, true);
+        break;
+    }
+    case IORING_OP_CONNECT:
+        supported = !!s->connect;
+        valid = validate_user_memory(addr, sqe->off, false);
+        break;
+    case IORING_OP_SEND:
+        supported = !!s->sendto;
+        valid = validate_user_memory(addr, sqe->len, false);
+        break;
+    case IORING_OP_RECV:
+        supported = !!s->recvfrom;
+        valid = validate_user_memory(addr, sqe->len, true);
+        break;
+    case IORING_OP_SENDMSG:
+        supported = !!s->sendmsg;
+        valid = validate_msghdr(addr, false);
+        break;
+    case IORING_OP_RECVMSG:
+        supported = !!s->recvmsg;
+        valid = validate_msghdr(addr, true);
+        break;
+    default:
+        supported = false;
+    }
+    if (!supported) {
+        err = -EOPNOTSUPP;
+        goto error;
+    }
+    if (!valid) {
+        err = -EFAULT;
+        goto error;
+    }
+    io_completion completion = closure(iour->h, iour_rw_complete, iour, f,
+        user_data);
+    if (completion == INVALID_ADDRESS) {
+        err = -ENOMEM;
+        goto error;
+    }
+    fetch_and_add(&iour->noncancelable_ops, 1);
+    switch (sqe->opcode) {
+    case IORING_OP_ACCEPT:
+        s->accept4(s, addr, pointer_from_u64(sqe->off), sqe->accept_flags,
+                   current, true, completion);
+        break;
+    case IORING_OP_CONNECT:
+        s->connect(s, addr, sqe->off, current, true, completion);
+        break;
+    case IORING_OP_SEND:
+        s->sendto(s, addr, sqe->len, sqe->msg_flags, 0, 0, current, true,
+                  completion);
+        break;
+    case IORING_OP_RECV:
+        s->recvfrom(s, addr, sqe->len, sqe->msg_flags, 0, 0, current, true,
+                    completion);
+        break;
+    case IORING_OP_SENDMSG:
+        s->sendmsg(s, addr, sqe->msg_flags, current, true, completion);
+        break;
+    case IORING_OP_RECVMSG:
+        s->recvmsg(s, addr, sqe->msg_flags, current, true, completion);
+        break;
+    }
+    return;
+error:
+    fdesc_put(f);
+    iour_complete(iour, user_data, err, false, false);
+}
+
 closure_function(2, 2, void, iour_close_complete,
                  io_uring, iour, u64, user_data,
                  thread, t, sysreturn, rv)
@@ -836,6 +987,12 @@ static boolean iour_submit(io_uring iour, struct io_uring_sqe *sqe)
     case IORING_OP_POLL_ADD:
     case IORING_OP_READ:
     case IORING_OP_WRITE:
+    case IORING_OP_ACCEPT:
+    case IORING_OP_CONNECT:
+    case IORING_OP_SEND:
+    case IORING_OP_RECV:
+    case IORING_OP_SENDMSG:
+    case IORING_OP_RECVMSG:
         if (sqe->flags & IOSQE_FIXED_FILE) {
             iour_lock(iour);
             int fd = sqe->fd;
@@ -989,6 +1146,14 @@ static boolean iour_submit(io_uring iour, struct io_uring_sqe *sqe)
             iour_rw(iour, f, write, buf, len, sqe->off, sqe->user_data);
         }
         break;
+    case IORING_OP_ACCEPT:
+    case IORING_OP_CONNECT:
+    case IORING_OP_SEND:
+    case IORING_OP_RECV:
+    case IORING_OP_SENDMSG:
+    case IORING_OP_RECVMSG:
+        iour_sock(iour, f, sqe);
+        break;
     default:
         iour_complete(iour, sqe->user_data, -EINVAL, false, false);
         return false;
@@ -1001,6 +1166,106 @@ complete:
     return true;
 }
 
+static unsigned int iour_submit_sq(io_uring iour, unsigned int to_submit)
+{
+    io_rings rings = iour->rings;
+    read_barrier();
+    iour_debug("SQ head %d, SQ tail %d", rings->sq_head, rings->sq_tail);
+    unsigned int submitted;
+    for (submitted = 0; submitted < to_submit;) {
+        if (rings->sq_head >= rings->sq_tail)
+            break;
+        u32 sqe_index = iour->sq_array[rings->sq_head & iour->sq_mask];
+        rings->sq_head++;
+        if (sqe_index < iour->sq_entries) {
+            submitted++;
+            if (!iour_submit(iour, &iour->sqes[sqe_index]))
+                break;
+        } else {
+            iour_debug("sqe dropped: index %d, entries %d", sqe_index,
+                iour->sq_entries);
+            iour->rings->sq_dropped++;
+            break;
+        }
+    }
+    return submitted;
+}
+
+define_closure_function(1, 0, void, iour_sq_poll,
+                        io_uring, iour)
+{
+    io_uring iour = bound(iour);
+    io_rings rings = iour->rings;
+    if (!iour->sq_exit) {
+        timestamp here = now(CLOCK_ID_MONOTONIC);
+        nanos_thread nt = get_current_thread();
+        set_current_thread(&iour->sq_thread->thrd);
+        unsigned int submitted = iour_submit_sq(iour, iour->sq_entries);
+        set_current_thread(nt);
+        if (submitted) {
+            iour->sq_last_active = here;
+        } else if (here - iour->sq_last_active >= iour->sq_idle) {
+            /* Publish NEED_WAKEUP before looking at the SQ tail one last
+             * time: entries queued concurrently are either seen here, or
+             * followed by an io_uring_enter() with IORING_ENTER_SQ_WAKEUP. */
+            rings->sq_flags |= IORING_SQ_NEED_WAKEUP;
+            memory_barrier();
+            if (rings->sq_head == rings->sq_tail)
+                goto stop;
+            rings->sq_flags &= ~IORING_SQ_NEED_WAKEUP;
+        }
+        if (enqueue_cpu_poll(iour->sq_cpu, (thunk)&iour->sq_poll))
+            return;
+        /* The CPU's poll queue is full: go idle as if the ring were, and
+           pick up whatever was queued before NEED_WAKEUP became visible. */
+        iour_debug("SQ poller could not be requeued");
+        rings->sq_flags |= IORING_SQ_NEED_WAKEUP;
+        memory_barrier();
+        set_current_thread(&iour->sq_thread->thrd);
+        iour_submit_sq(iour, iour->sq_entries);
+        set_current_thread(nt);
+    }
+  stop:
+    iour_debug("SQ poller going idle, exit %d", iour->sq_exit);
+    iour->sq_polling = false;
+    iour_lock(iour);
+    if ((fetch_and_add(&iour->noncancelable_ops, -1) == 1) && iour->shutdown) {
+        iour_release(iour);
+        return;
+    }
+    blockq bq = iour->bq;
+    iour_unlock(iour);
+    if (bq)
+        blockq_wake_one(bq);
+}
+
+/* Called with the kernel lock held, like the poller itself. Returns false
+   if the poller could not be queued because the CPU's poll queue is full;
+   the ring is then left in NEED_WAKEUP state, so that userspace keeps
+   calling io_uring_enter(), which submits on its behalf. */
+static boolean iour_sq_start(io_uring iour)
+{
+    iour->sq_polling = true;
+    iour->rings->sq_flags &= ~IORING_SQ_NEED_WAKEUP;
+    iour->sq_last_active = now(CLOCK_ID_MONOTONIC);
+    fetch_and_add(&iour->noncancelable_ops, 1);
+    if (!(iour->setup_flags & IORING_SETUP_SQ_AFF)) {
+        /* prefer a CPU that has nothing else to do */
+        u64 self = current_cpu()->id;
+        u64 idle = idle_cpu_mask & MASK(total_processors) & ~U64_FROM_BIT(self);
+        iour->sq_cpu = idle ? lsb(idle) : self;
+    }
+    iour_debug("starting SQ poller on CPU %ld", iour->sq_cpu);
+    if (enqueue_cpu_poll(iour->sq_cpu,
+                         (thunk)init_closure(&iour->sq_poll, iour_sq_poll, iour)))
+        return true;
+    iour_debug("poll queue of CPU %ld full", iour->sq_cpu);
+    iour->sq_polling = false;
+    iour->rings->sq_flags |= IORING_SQ_NEED_WAKEUP;
+    fetch_and_add(&iour->noncancelable_ops, -1);
+    return false;
+}
+
 simple_closure_function(7, 1, sysreturn, iour_getevents_bh,
                         io_uring, iour, sysreturn, submitted, unsigned int, min_complete, unsigned int, timeouts, boolean, sig_set, thread, t, io_completion, completion,
                         u64, flags)
@@ -1046,7 +1311,7 @@ sysreturn io_uring_enter(int fd, unsigned int to_submit,
         to_submit, min_complete, flags, sig);
     io_uring iour = iour_from_fd(current->p, fd);
     sysreturn rv;
-    if (flags & ~IORING_ENTER_GETEVENTS) {
+    if (flags & ~(IORING_ENTER_GETEVENTS | IORING_ENTER_SQ_WAKEUP)) {
         rv = -EINVAL;
         goto out;
     }
@@ -1062,25 +1327,16 @@ sysreturn io_uring_enter(int fd, unsigned int to_submit,
             goto out;
         }
     }
-    io_rings rings = iour->rings;
-    read_barrier();
-    iour_debug("SQ head %d, SQ tail %d", rings->sq_head, rings->sq_tail);
     unsigned int submitted;
-    for (submitted = 0; submitted < to_submit;) {
-        if (rings->sq_head >= rings->sq_tail)
-            break;
-        u32 sqe_index = iour->sq_array[rings->sq_head & iour->sq_mask];
-        rings->sq_head++;
-        if (sqe_index < iour->sq_entries) {
-            submitted++;
-            if (!iour_submit(iour, &iour->sqes[sqe_index]))
-                break;
-        } else {
-            iour_debug("sqe dropped: index %d, entries %d", sqe_index,
-                iour->sq_entries);
-            iour->rings->sq_dropped++;
-            break;
-        }
+    if (iour->setup_flags & IORING_SETUP_SQPOLL) {
+        /* submission is up to the SQ poller, unless it can't be started */
+        if ((flags & IORING_ENTER_SQ_WAKEUP) && !iour->sq_polling &&
+            !iour_sq_start(iour))
+            submitted = iour_submit_sq(iour, to_submit);
+        else
+            submitted = to_submit;
+    } else {
+        submitted = iour_submit_sq(iour, to_submit);
     }
     rv = submitted;
     if (flags & IORING_ENTER_GETEVENTS) {
@@ -1243,21 +1499,33 @@ static sysreturn iour_register_probe(struct io_uring_probe *probe,
     if (op_count > IORING_OP_LAST)
         op_count = IORING_OP_LAST;
     zero(probe->ops, sizeof(probe->ops[0]) * op_count);
-    for (unsigned int i = 0; i < op_count; i++)
-        probe->ops[i].op = i;
     probe->ops_len = op_count;
-    probe->ops[IORING_OP_NOP].flags = probe->ops[IORING_OP_READV].flags =
-            probe->ops[IORING_OP_WRITEV].flags =
-            probe->ops[IORING_OP_READ_FIXED].flags =
-            probe->ops[IORING_OP_WRITE_FIXED].flags =
-            probe->ops[IORING_OP_POLL_ADD].flags =
-            probe->ops[IORING_OP_POLL_REMOVE].flags =
-            probe->ops[IORING_OP_TIMEOUT].flags =
-            probe->ops[IORING_OP_TIMEOUT_REMOVE].flags =
-            probe->ops[IORING_OP_CLOSE].flags =
-            probe->ops[IORING_OP_FILES_UPDATE].flags =
-            probe->ops[IORING_OP_READ].flags =
-            probe->ops[IORING_OP_WRITE].flags = IO_URING_OP_SUPPORTED;
+    for (unsigned int i = 0; i < op_count; i++) {
+        probe->ops[i].op = i;
+        switch (i) {
+        case IORING_OP_NOP:
+        case IORING_OP_READV:
+        case IORING_OP_WRITEV:
+        case IORING_OP_READ_FIXED:
+        case IORING_OP_WRITE_FIXED:
+        case IORING_OP_POLL_ADD:
+        case IORING_OP_POLL_REMOVE:
+        case IORING_OP_TIMEOUT:
+        case IORING_OP_TIMEOUT_REMOVE:
+        case IORING_OP_CLOSE:
+        case IORING_OP_FILES_UPDATE:
+        case IORING_OP_READ:
+        case IORING_OP_WRITE:
+        case IORING_OP_ACCEPT:
+        case IORING_OP_CONNECT:
+        case IORING_OP_SEND:
+        case IORING_OP_RECV:
+        case IORING_OP_SENDMSG:
+        case IORING_OP_RECVMSG:
+            probe->ops[i].flags = IO_URING_OP_SUPPORTED;
+            break;
+        }
+    }
     return 0;
 }
 
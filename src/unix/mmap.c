@@ -7,8 +7,14 @@
 #define pf_debug(x, ...)
 #endif
 
-#define vmap_lock(p) u64 _savedflags = spin_lock_irq(&(p)->vmap_lock)
-#define vmap_unlock(p) spin_unlock_irq(&(p)->vmap_lock, _savedflags)
+/* Lookups (page faults, validation) take the vmap lock shared so that they
+   may proceed in parallel; anything modifying the vmaps takes it exclusive.
+   Nothing under the lock may touch user memory or start I/O: a fault taken
+   while holding it would take it again behind a waiting writer. */
+#define vmap_lock(p) u64 _savedflags = spin_wlock_irq(&(p)->vmap_lock)
+#define vmap_unlock(p) spin_wunlock_irq(&(p)->vmap_lock, _savedflags)
+#define vmap_rlock(p) u64 _savedflags = spin_rlock_irq(&(p)->vmap_lock)
+#define vmap_runlock(p) spin_runlock_irq(&(p)->vmap_lock, _savedflags)
 
 /* kernel frame return must happen from runloop, not a bh completion service */
 closure_function(1, 0, void, kernel_frame_return,
@@ -39,6 +45,56 @@ closure_function(0, 1, void, kernel_demand_pf_complete,
 
 static closure_struct(kernel_demand_pf_complete, do_kernel_demand_pf_complete);
 
+static u64 fault_around_pages = 16;
+
+void mmap_set_fault_around(u64 pages)
+{
+    /* window is aligned to its (power-of-2) size */
+    fault_around_pages = pages > 1 ? U64_FROM_BIT(msb(MIN(pages, PAGECACHE_MAP_AROUND_MAX))) : 0;
+}
+
+static u64 file_page_map_flags(vmap vm)
+{
+    u64 flags = page_map_flags(vm->flags);
+    if ((vm->flags & VMAP_FLAG_SHARED) == 0)
+        flags &= ~PAGE_WRITABLE; /* cow */
+    return flags;
+}
+
+static inline vmap vmap_from_vaddr_locked(process p, u64 vaddr)
+{
+    return (vmap)rangemap_lookup(p->vmaps, vaddr);
+}
+
+/* Map already-cached neighbors of a file page that was just faulted in,
+   so that touching them doesn't take a fault of its own. The vmap that
+   took the fault may have been unmapped or replaced since, so it is looked
+   up again and kept locked while its pages are mapped. */
+static void file_fault_around(process p, u64 page_addr)
+{
+    if (fault_around_pages == 0)
+        return;
+    vmap_rlock(p);
+    vmap vm = vmap_from_vaddr_locked(p, page_addr);
+    if (vm == INVALID_ADDRESS ||
+        (vm->flags & VMAP_MMAP_TYPE_MASK) != VMAP_MMAP_TYPE_FILEBACKED)
+        goto out;
+    u64 span = fault_around_pages << PAGELOG;
+    range q = range_intersection(irangel(page_addr & ~(span - 1), span), vm->node.r);
+    u64 node_offset = vm->node_offset + (q.start - vm->node.r.start);
+    u64 padlen = pad(pagecache_get_node_length(vm->cache_node), PAGESIZE);
+    if (node_offset >= padlen)
+        goto out;
+    if (node_offset + range_span(q) > padlen)
+        q.end = q.start + (padlen - node_offset);
+    u64 n = pagecache_map_filled_pages(vm->cache_node, node_offset, q, file_page_map_flags(vm));
+    if (n > 0)
+        fetch_and_add(&vm->fault_around, n);
+    pf_debug("   fault-around %R mapped %ld pages\n", q, n);
+  out:
+    vmap_runlock(p);
+}
+
 define_closure_function(3, 1, void, thread_demand_file_page_complete,
                         thread, t, context, frame, u64, vaddr,
                         status, s)
@@ -46,6 +102,8 @@ define_closure_function(3, 1, void, thread_demand_file_page_complete,
     if (!is_ok(s)) {
         rprintf("%s: page fill failed with %v\n", __func__, s);
         deliver_fault_signal(SIGBUS, bound(t), bound(vaddr), BUS_ADRERR);
+    } else {
+        file_fault_around(bound(t)->p, bound(vaddr) & ~PAGEMASK);
     }
     schedule_frame(bound(frame));
     refcount_release(&bound(t)->refcount);
@@ -68,6 +126,77 @@ define_closure_function(5, 0, void, thread_demand_file_page,
     }
 }
 
+/* 2M pages for sparsely touched mappings would only inflate memory use, so
+   unless configured otherwise they are used where the program asks for them. */
+static int thp_mode = THP_MADVISE;
+
+void mmap_set_thp_mode(int mode)
+{
+    thp_mode = mode;
+}
+
+static boolean vmap_thp_eligible(vmap vm)
+{
+    if (vm->flags & VMAP_FLAG_NOHUGEPAGE)
+        return false;
+    return thp_mode == THP_ALWAYS ||
+        (thp_mode == THP_MADVISE && (vm->flags & VMAP_FLAG_HUGEPAGE));
+}
+
+/* Zero a 2M frame through a temporary kernel mapping. */
+static boolean zero_2m_frame(u64 paddr)
+{
+    heap virtual_page = (heap)heap_virtual_page(get_kernel_heaps());
+    u64 kv = allocate_u64(virtual_page, PAGESIZE_2M);
+    if (kv == INVALID_PHYSICAL)
+        return false;
+    map(kv, paddr, PAGESIZE_2M, PAGE_WRITABLE | PAGE_NO_EXEC);
+    zero(pointer_from_u64(kv), PAGESIZE_2M);
+    unmap(kv, PAGESIZE_2M);
+    deallocate_u64(virtual_page, kv, PAGESIZE_2M);
+    return true;
+}
+
+/* Try to satisfy an anonymous fault with a whole 2M page. This requires
+   the surrounding 2M extent to lie within the vmap and to be entirely
+   unpopulated; otherwise the caller falls back to a 4K page.
+
+   User faults run without the kernel lock, so once the PDE is installed
+   other threads may access any part of the extent. The frame must
+   therefore be zeroed before it is mapped; zeroing it through the user
+   mapping would expose stale memory to, or wipe data written by, those
+   threads. */
+static boolean demand_anonymous_2m_page(u64 vaddr, vmap vm)
+{
+    u64 v = vaddr & ~PAGEMASK_2M;
+    if (!vmap_thp_eligible(vm) || !range_contains(vm->node.r, irangel(v, PAGESIZE_2M)))
+        return false;
+    heap physical = (heap)heap_physical(get_kernel_heaps());
+    u64 paddr = allocate_u64(physical, PAGESIZE_2M);
+    if (paddr == INVALID_PHYSICAL)
+        return false;
+    if ((paddr & PAGEMASK_2M) || !zero_2m_frame(paddr) ||
+        !map_2m_page(v, paddr, page_map_flags(vm->flags))) {
+        pf_debug("   no 2M page at 0x%lx (paddr 0x%lx)\n", v, paddr);
+        deallocate_u64(physical, paddr, PAGESIZE_2M);
+
+        /* a concurrent fault may have populated the page already */
+        return physical_from_virtual(pointer_from_u64(vaddr)) != INVALID_PHYSICAL;
+    }
+    pf_debug("   mapped 2M page at 0x%lx, paddr 0x%lx\n", v, paddr);
+    return true;
+}
+
+/* A 2M page may not straddle the edge of a range about to be unmapped
+   or reprotected; break up any that do into 4K pages. */
+static void split_2m_pages_at_edges(range q)
+{
+    if (q.start & PAGEMASK_2M)
+        split_2m_pages(q.start, PAGESIZE);
+    if (q.end & PAGEMASK_2M)
+        split_2m_pages(q.end, PAGESIZE);
+}
+
 boolean do_demand_page(u64 vaddr, vmap vm, context frame)
 {
     boolean in_kernel = is_current_kernel_context(frame);
@@ -82,8 +211,12 @@ boolean do_demand_page(u64 vaddr, vmap vm, context frame)
              vaddr, vm->flags);
     pf_debug("   vmap %p, frame %p\n", vm, frame);
 
+    fetch_and_add(&vm->faults, 1);
     int mmap_type = vm->flags & VMAP_MMAP_TYPE_MASK;
     if (mmap_type == VMAP_MMAP_TYPE_ANONYMOUS) {
+        if (demand_anonymous_2m_page(vaddr, vm))
+            return true;
+
         u64 paddr = allocate_u64((heap)heap_physical(get_kernel_heaps()), PAGESIZE);
         if (paddr == INVALID_PHYSICAL) {
             msg_err("cannot get physical page; OOM\n");
@@ -96,10 +229,7 @@ boolean do_demand_page(u64 vaddr, vmap vm, context frame)
     } else if (mmap_type == VMAP_MMAP_TYPE_FILEBACKED) {
         u64 page_addr = vaddr & ~PAGEMASK;
         u64 node_offset = vm->node_offset + (page_addr - vm->node.r.start);
-        boolean shared = (vm->flags & VMAP_FLAG_SHARED) != 0;
-        u64 flags = page_map_flags(vm->flags);
-        if (!shared)
-            flags &= ~PAGE_WRITABLE; /* cow */
+        u64 flags = file_page_map_flags(vm);
         pf_debug("   node %p (start 0x%lx), offset 0x%lx\n",
                  vm->cache_node, vm->node.r.start, node_offset);
 
@@ -131,6 +261,7 @@ boolean do_demand_page(u64 vaddr, vmap vm, context frame)
                                true /* complete on bhqueue */);
             if (kernel_demand_page_completed) {
                 pf_debug("   immediate completion\n");
+                file_fault_around(current->p, page_addr);
                 return true;
             }
             faulting_kernel_context = suspend_kernel_context();
@@ -140,6 +271,7 @@ boolean do_demand_page(u64 vaddr, vmap vm, context frame)
                page, but we can't allocate anything, fill a page or start a storage operation. */
             if (pagecache_map_page_if_filled(vm->cache_node, node_offset, page_addr, flags)) {
                 pf_debug("   immediate completion\n");
+                file_fault_around(current->p, page_addr);
                 return true;
             }
 
@@ -162,28 +294,23 @@ boolean do_demand_page(u64 vaddr, vmap vm, context frame)
     return true;
 }
 
-static inline vmap vmap_from_vaddr_locked(process p, u64 vaddr)
-{
-    return (vmap)rangemap_lookup(p->vmaps, vaddr);
-}
-
 vmap vmap_from_vaddr(process p, u64 vaddr)
 {
-    vmap_lock(p);
+    vmap_rlock(p);
     vmap vm = vmap_from_vaddr_locked(p, vaddr);
-    vmap_unlock(p);
+    vmap_runlock(p);
     return vm;
 }
 
 void vmap_iterator(process p, vmap_handler vmh)
 {
-    vmap_lock(p);
+    vmap_rlock(p);
     vmap vm = (vmap) rangemap_first_node(p->vmaps);
     while (vm != INVALID_ADDRESS) {
         apply(vmh, vm);
         vm = (vmap) rangemap_next_node(p->vmaps, &vm->node);
     }
-    vmap_unlock(p);
+    vmap_runlock(p);
 }
 
 closure_function(0, 1, void, vmap_validate_range_gap,
@@ -195,10 +322,10 @@ closure_function(0, 1, void, vmap_validate_range_gap,
 boolean vmap_validate_range(process p, range q)
 {
     boolean valid;
-    vmap_lock(p);
+    vmap_rlock(p);
     valid = !rangemap_range_find_gaps(p->vmaps, q,
                              stack_closure(vmap_validate_range_gap));
-    vmap_unlock(p);
+    vmap_runlock(p);
     return valid;
 }
 
@@ -230,6 +357,8 @@ vmap allocate_vmap(rangemap rm, range q, struct vmap k)
     vm->allowed_flags = k.allowed_flags;
     vm->node_offset = k.node_offset;
     vm->cache_node = k.cache_node;
+    vm->faults = 0;
+    vm->fault_around = 0;
     if (!rangemap_insert(rm, &vm->node)) {
         deallocate(rm->h, vm, sizeof(struct vmap));
         return INVALID_ADDRESS;
@@ -243,6 +372,58 @@ void deallocate_vmap(rangemap rm, vmap vm)
     deallocate(rm->h, vm, sizeof(struct vmap));
 }
 
+/* Back a newly grown stretch of the process heap with zeroed memory. With
+   THP always on, any whole 2M extents get their own physical allocation so
+   that map() can use 2M pages for them. */
+boolean map_process_heap(u64 start, u64 len)
+{
+    heap physical = (heap)heap_physical(get_kernel_heaps());
+    u64 end = start + len;
+    u64 hstart = pad(start, PAGESIZE_2M);
+    u64 hend = end & ~PAGEMASK_2M;
+    u64 hphys = INVALID_PHYSICAL;
+    if (thp_mode == THP_ALWAYS && hstart < hend)
+        hphys = allocate_u64(physical, hend - hstart);
+    if (hphys == INVALID_PHYSICAL)
+        hstart = hend = end;
+
+    u64 headphys = INVALID_PHYSICAL, tailphys = INVALID_PHYSICAL;
+    if (hstart > start) {
+        headphys = allocate_u64(physical, hstart - start);
+        if (headphys == INVALID_PHYSICAL)
+            goto fail;
+    }
+    if (end > hend) {
+        tailphys = allocate_u64(physical, end - hend);
+        if (tailphys == INVALID_PHYSICAL)
+            goto fail;
+    }
+
+    /* XXX no exec configurable? */
+    u64 flags = PAGE_WRITABLE | PAGE_NO_EXEC | PAGE_USER;
+    if (headphys != INVALID_PHYSICAL)
+        map(start, headphys, hstart - start, flags);
+    if (hphys != INVALID_PHYSICAL)
+        map(hstart, hphys, hend - hstart, flags);
+    if (tailphys != INVALID_PHYSICAL)
+        map(hend, tailphys, end - hend, flags);
+    // people shouldn't depend on this
+    zero(pointer_from_u64(start), len);
+    return true;
+  fail:
+    if (headphys != INVALID_PHYSICAL)
+        deallocate_u64(physical, headphys, hstart - start);
+    if (hphys != INVALID_PHYSICAL)
+        deallocate_u64(physical, hphys, hend - hstart);
+    return false;
+}
+
+void unmap_process_heap(u64 start, u64 len)
+{
+    split_2m_pages_at_edges(irangel(start, len));
+    unmap_and_free_phys(start, len);
+}
+
 boolean adjust_process_heap(process p, range new)
 {
     vmap_lock(p);
@@ -353,6 +534,9 @@ sysreturn mremap(void *old_address, u64 old_size, u64 new_size, int flags, void
     /* remap existing portion */
     thread_log(current, "   remapping existing portion at 0x%lx (old_addr 0x%lx, size 0x%lx)",
                vnew, old_addr, old_size);
+    split_2m_pages_at_edges(irangel(old_addr, old_size));
+    if ((vnew ^ old_addr) & PAGEMASK_2M)
+        split_2m_pages(old_addr, old_size); /* 2M pages can't change phase */
     remap_pages(vnew, old_addr, old_size);
 
     /* map new portion and zero */
@@ -417,11 +601,11 @@ static sysreturn mincore(void *addr, u64 length, u8 *vec)
 
     /* -ENOMEM if any unmapped gaps in range */
     process p = current->p;
-    vmap_lock(p);
+    vmap_rlock(p);
     boolean found = rangemap_range_find_gaps(p->vmaps,
                                              irange(start, start + length),
                                              stack_closure(mincore_vmap_gap));
-    vmap_unlock(p);
+    vmap_runlock(p);
     if (found)
         return -ENOMEM;
 
@@ -466,14 +650,15 @@ closure_function(2, 1, void, vmap_update_protections_validate,
 */
 
 /* refactor with vmap_remove_intersection? might be better as-is. */
-closure_function(4, 1, void, vmap_update_protections_intersection,
-                 heap, h, rangemap, pvmap, range, q, u32, newflags,
+closure_function(5, 1, void, vmap_update_flags_intersection,
+                 heap, h, rangemap, pvmap, range, q, u32, newflags, u32, mask,
                  rmnode, node)
 {
     rangemap pvmap = bound(pvmap);
-
-    u32 newflags = bound(newflags);
     vmap match = (vmap)node;
+
+    /* only flags under mask are replaced */
+    u32 newflags = (match->flags & ~bound(mask)) | bound(newflags);
     if (newflags == match->flags)
         return;
 
@@ -484,9 +669,6 @@ closure_function(4, 1, void, vmap_update_protections_intersection,
     boolean head = ri.start > rn.start;
     boolean tail = ri.end < rn.end;
 
-    /* protection flags only */
-    newflags = (match->flags & ~(VMAP_FLAG_WRITABLE | VMAP_FLAG_EXEC)) | newflags;
-
     if (!head && !tail) {
         /* key (range) remains the same, no need to reinsert */
         match->flags = newflags;
@@ -550,9 +732,11 @@ static sysreturn vmap_update_protections(heap h, rangemap pvmap, range q, u32 ne
     else if (prot_violation)
         return -EACCES;
 
-    rmnode_handler nh = stack_closure(vmap_update_protections_intersection, h, pvmap, q, newflags);
+    rmnode_handler nh = stack_closure(vmap_update_flags_intersection, h, pvmap, q, newflags,
+                                      VMAP_FLAG_WRITABLE | VMAP_FLAG_EXEC);
     rangemap_range_lookup(pvmap, q, nh);
 
+    split_2m_pages_at_edges(q);
     update_map_flags(q.start, range_span(q), page_map_flags(newflags));
     return 0;
 }
@@ -583,6 +767,55 @@ sysreturn mprotect(void * addr, u64 len, int prot)
     return result;
 }
 
+closure_function(1, 1, void, madvise_update_mmap,
+                 rmnode_handler, nh,
+                 rmnode, node)
+{
+    /* the process heap and other non-mmap regions follow the global policy */
+    if (((vmap)node)->flags & VMAP_FLAG_MMAP)
+        apply(bound(nh), node);
+}
+
+static sysreturn madvise(void *addr, u64 length, int advice)
+{
+    thread_log(current, "madvise: addr %p, length 0x%lx, advice %d", addr, length, advice);
+
+    u64 where = u64_from_pointer(addr);
+    if (where & MASK(PAGELOG))
+        return -EINVAL;
+
+    u32 newflags;
+    switch (advice) {
+    case MADV_HUGEPAGE:
+        newflags = VMAP_FLAG_HUGEPAGE;
+        break;
+    case MADV_NOHUGEPAGE:
+        newflags = VMAP_FLAG_NOHUGEPAGE;
+        break;
+    default:
+        /* remaining advice is accepted but not acted upon */
+        return 0;
+    }
+    if (length == 0)
+        return 0;
+
+    /* only affects subsequent faults; existing 2M pages are left as-is */
+    heap h = heap_general(get_kernel_heaps());
+    range q = irangel(where, pad(length, PAGESIZE));
+    process p = current->p;
+    sysreturn rv = 0;
+    vmap_lock(p);
+    if (rangemap_range_find_gaps(p->vmaps, q, stack_closure(vmap_update_protections_gap))) {
+        rv = -ENOMEM;
+    } else {
+        rmnode_handler nh = stack_closure(vmap_update_flags_intersection, h, p->vmaps, q, newflags,
+                                          VMAP_FLAG_HUGEPAGE | VMAP_FLAG_NOHUGEPAGE);
+        rangemap_range_lookup(p->vmaps, q, stack_closure(madvise_update_mmap, nh));
+    }
+    vmap_unlock(p);
+    return rv;
+}
+
 /* blow a hole in the process address space intersecting q */
 closure_function(3, 1, void, vmap_remove_intersection,
                  rangemap, pvmap, range, q, vmap_handler, unmap,
@@ -656,6 +889,7 @@ static void vmap_unmap_page_range(process p, vmap k)
     range r = k->node.r;
     int type = k->flags & VMAP_MMAP_TYPE_MASK;
     u64 len = range_span(r);
+    split_2m_pages_at_edges(r);
     switch (type) {
     case VMAP_MMAP_TYPE_ANONYMOUS:
         unmap_and_free_phys(r.start, len);
@@ -798,6 +1032,7 @@ static sysreturn msync(void *addr, u64 length, int flags)
 
     boolean have_gap = false;
     if (flags & MS_SYNC) {
+        /* not under the vmap lock: committing pages starts storage I/O */
         range q = irangel(u64_from_pointer(addr), pad(length, PAGESIZE));
         rangemap_range_lookup_with_gaps(current->p->vmaps, q,
                                         stack_closure(msync_vmap),
@@ -991,7 +1226,7 @@ void mmap_process_init(process p)
 {
     kernel_heaps kh = &p->uh->kh;
     heap h = heap_general(kh);
-    spin_lock_init(&p->vmap_lock);
+    spin_rw_lock_init(&p->vmap_lock);
     p->vareas = allocate_rangemap(h);
     p->vmaps = allocate_rangemap(h);
     assert(p->vareas != INVALID_ADDRESS && p->vmaps != INVALID_ADDRESS);
@@ -1041,5 +1276,5 @@ void register_mmap_syscalls(struct syscall *map)
     register_syscall(map, msync, msync);
     register_syscall(map, munmap, munmap);
     register_syscall(map, mprotect, mprotect);
-    register_syscall(map, madvise, syscall_ignore);
+    register_syscall(map, madvise, madvise);
 }
@@ -10,6 +10,7 @@ struct notify_set {
     /* XXX add mutex */
     heap h;
     struct list entries;
+    struct list exclusive;      /* EPOLLEXCLUSIVE entries, dispatched last */
 };
 
 notify_set allocate_notify_set(heap h)
@@ -19,6 +20,7 @@ notify_set allocate_notify_set(heap h)
         return s;
     s->h = h;
     list_init(&s->entries);
+    list_init(&s->exclusive);
     /* XXX mutex init */
     return s;
 }
@@ -38,7 +40,7 @@ notify_entry notify_add(notify_set s, u64 eventmask, event_handler eh)
     n->eventmask = eventmask;
     n->eh = eh;
     /* XXX take mutex */
-    list_insert_before(&s->entries, &n->l);
+    list_insert_before((eventmask & EPOLLEXCLUSIVE) ? &s->exclusive : &s->entries, &n->l);
     /* XXX release mutex */
     return n;
 }
@@ -66,6 +68,10 @@ u64 notify_get_eventmask_union(notify_set s)
         notify_entry n = struct_from_list(l, notify_entry, l);
         u |= n->eventmask;
     }
+    list_foreach(&s->exclusive, l) {
+        notify_entry n = struct_from_list(l, notify_entry, l);
+        u |= n->eventmask;
+    }
     /* XXX release mutex */
     return u;
 }
@@ -81,6 +87,14 @@ void notify_dispatch_for_thread(notify_set s, u64 events, thread t)
         assert(n->eh);
         apply(n->eh, events & n->eventmask, t);
     }
+
+    /* wake one of the exclusive waiters only */
+    list_foreach(&s->exclusive, l) {
+        notify_entry n = struct_from_list(l, notify_entry, l);
+        assert(n->eh);
+        if (apply(n->eh, events & n->eventmask, t))
+            break;
+    }
     /* XXX release mutex */
 }
 
@@ -89,14 +103,20 @@ void notify_dispatch(notify_set s, u64 events)
     notify_dispatch_for_thread(s, events, 0);
 }
 
-void notify_release(notify_set s)
+static void notify_release_list(notify_set s, list head)
 {
-    /* XXX take mutex */
-    list_foreach(&s->entries, l) {
+    list_foreach(head, l) {
         notify_entry n = struct_from_list(l, notify_entry, l);
         apply(n->eh, NOTIFY_EVENTS_RELEASE, 0);
         list_delete(l);
         deallocate(s->h, n, sizeof(struct notify_entry));
     }
+}
+
+void notify_release(notify_set s)
+{
+    /* XXX take mutex */
+    notify_release_list(s, &s->entries);
+    notify_release_list(s, &s->exclusive);
     /* XXX release mutex */
 }
@@ -138,8 +138,22 @@ closure_function(1, 2, sysreturn, pipe_close,
     return io_complete(completion, t, 0);
 }
 
-closure_function(5, 1, sysreturn, pipe_read_bh,
-                 pipe_file, pf, thread, t, void *, dest, u64, length, io_completion, completion,
+static void pipe_consume_data(pipe_file pf, u64 length)
+{
+    buffer b = pf->pipe->data;
+    buffer_consume(b, length);
+    pipe_notify_writer(pf, EPOLLOUT);
+
+    // If we have consumed all of the buffer, reset it. This might prevent future writes to allocte new buffer
+    // in buffer_write/buffer_extend. Can improve things until a proper circular buffer is available
+    if (buffer_length(b) == 0) {
+        buffer_clear(b);
+        notify_dispatch(pf->f.ns, 0); /* for edge trigger */
+    }
+}
+
+closure_function(7, 1, sysreturn, pipe_read_bh,
+                 pipe_file, pf, thread, t, void *, dest, u64, length, boolean, peek, boolean, nonblock, io_completion, completion,
                  u64, flags)
 {
     pipe_file pf = bound(pf);
@@ -155,44 +169,45 @@ closure_function(5, 1, sysreturn, pipe_read_bh,
     if (rv == 0) {
         if (pf->pipe->files[PIPE_WRITE].fd == -1)
             goto out;
-        if (pf->f.flags & O_NONBLOCK) {
+        if (bound(nonblock) || (pf->f.flags & O_NONBLOCK)) {
             rv = -EAGAIN;
             goto out;
         }
         return BLOCKQ_BLOCK_REQUIRED;
     }
 
-    buffer_read(b, bound(dest), rv);
-    pipe_notify_writer(pf, EPOLLOUT);
-
-    // If we have consumed all of the buffer, reset it. This might prevent future writes to allocte new buffer
-    // in buffer_write/buffer_extend. Can improve things until a proper circular buffer is available
-    if (buffer_length(b) == 0) {
-        buffer_clear(b);
-        notify_dispatch(pf->f.ns, 0); /* for edge trigger */
-    }
+    runtime_memcpy(bound(dest), buffer_ref(b, 0), rv);
+    if (!bound(peek))
+        pipe_consume_data(pf, rv);
   out:
     blockq_handle_completion(pf->bq, flags, bound(completion), bound(t), rv);
     closure_finish();
     return rv;
 }
 
-closure_function(1, 6, sysreturn, pipe_read,
-                 pipe_file, pf,
-                 void *, dest, u64, length, u64, offset_arg, thread, t, boolean, bh, io_completion, completion)
+static sysreturn pipe_read_internal(pipe_file pf, void *dest, u64 length, boolean peek,
+                                    boolean nonblock, thread t, boolean bh,
+                                    io_completion completion)
 {
-    pipe_file pf = bound(pf);
-
     if (length == 0)
         return io_complete(completion, t, 0);
 
     blockq_action ba = closure(pf->pipe->h, pipe_read_bh, pf, t, dest, length,
-                               completion);
+                               peek, nonblock, completion);
+    if (ba == INVALID_ADDRESS)
+        return io_complete(completion, t, -ENOMEM);
     return blockq_check(pf->bq, t, ba, bh);
 }
 
-closure_function(5, 1, sysreturn, pipe_write_bh,
-                 pipe_file, pf, thread, t, void *, dest, u64, length, io_completion, completion,
+closure_function(1, 6, sysreturn, pipe_read,
+                 pipe_file, pf,
+                 void *, dest, u64, length, u64, offset_arg, thread, t, boolean, bh, io_completion, completion)
+{
+    return pipe_read_internal(bound(pf), dest, length, false, false, t, bh, completion);
+}
+
+closure_function(6, 1, sysreturn, pipe_write_bh,
+                 pipe_file, pf, thread, t, void *, dest, u64, length, boolean, nonblock, io_completion, completion,
                  u64, flags)
 {
     sysreturn rv = 0;
@@ -213,7 +228,7 @@ closure_function(5, 1, sysreturn, pipe_write_bh,
             rv = -EPIPE;
             goto out;
         }
-        if (pf->f.flags & O_NONBLOCK) {
+        if (bound(nonblock) || (pf->f.flags & O_NONBLOCK)) {
             rv = -EAGAIN;
             goto out;
         }
@@ -234,19 +249,26 @@ closure_function(5, 1, sysreturn, pipe_write_bh,
     return rv;
 }
 
-closure_function(1, 6, sysreturn, pipe_write,
-                 pipe_file, pf,
-                 void *, dest, u64, length, u64, offset, thread, t, boolean, bh, io_completion, completion)
+static sysreturn pipe_write_internal(pipe_file pf, void *dest, u64 length, boolean nonblock,
+                                     thread t, boolean bh, io_completion completion)
 {
     if (length == 0)
         return io_complete(completion, t, 0);
 
-    pipe_file pf = bound(pf);
     blockq_action ba = closure(pf->pipe->h, pipe_write_bh, pf, t, dest, length,
-            completion);
+            nonblock, completion);
+    if (ba == INVALID_ADDRESS)
+        return io_complete(completion, t, -ENOMEM);
     return blockq_check(pf->bq, t, ba, bh);
 }
 
+closure_function(1, 6, sysreturn, pipe_write,
+                 pipe_file, pf,
+                 void *, dest, u64, length, u64, offset, thread, t, boolean, bh, io_completion, completion)
+{
+    return pipe_write_internal(bound(pf), dest, length, false, t, bh, completion);
+}
+
 closure_function(1, 1, u32, pipe_read_events,
                  pipe_file, pf,
                  thread, t /* ignore */)
@@ -381,3 +403,33 @@ int pipe_get_capacity(fdesc f)
     pipe_file pf = (pipe_file)f;
     return (int)pf->pipe->max_size;
 }
+
+/* Kernel-side access for splice(2) and tee(2): data is copied out of the read
+   end with pipe_peek() and only removed, with pipe_consume(), once it has been
+   delivered. nonblock overrides a blocking pipe (SPLICE_F_NONBLOCK). */
+sysreturn pipe_peek(fdesc f, void *dest, u64 length, boolean nonblock, thread t,
+                    boolean bh, io_completion completion)
+{
+    return pipe_read_internal((pipe_file)f, dest, length, true, nonblock, t, bh,
+                              completion);
+}
+
+void pipe_consume(fdesc f, u64 length)
+{
+    pipe_file pf = (pipe_file)f;
+    length = MIN(length, buffer_length(pf->pipe->data));
+    if (length > 0)
+        pipe_consume_data(pf, length);
+}
+
+sysreturn pipe_push(fdesc f, void *src, u64 length, boolean nonblock, thread t,
+                    boolean bh, io_completion completion)
+{
+    return pipe_write_internal((pipe_file)f, src, length, nonblock, t, bh, completion);
+}
+
+u64 pipe_space(fdesc f)
+{
+    pipe p = ((pipe_file)f)->pipe;
+    return p->max_size - buffer_length(p->data);
+}
@@ -9,6 +9,10 @@
 
 typedef struct epollfd *epollfd;
 
+#define EPOLLEXCLUSIVE_OK_BITS  (EPOLLIN | EPOLLOUT | EPOLLRDNORM | EPOLLRDBAND | \
+                                 EPOLLWRNORM | EPOLLWRBAND | EPOLLERR | EPOLLHUP | \
+                                 EPOLLWAKEUP | EPOLLET | EPOLLEXCLUSIVE)
+
 declare_closure_struct(1, 0, void, epollfd_free,
                        epollfd, efd);
 
@@ -23,6 +27,8 @@ typedef struct epollfd {
     boolean registered;
     boolean zombie;		/* freed or masked by oneshot */
     notify_entry notify_handle;
+    struct list ready_l;        /* on epoll ready list; unlinked if next is 0 */
+    thread ready_t;             /* thread the events were posted for, if only one */
 } *epollfd;
 
 typedef struct epoll_blocked *epoll_blocked;
@@ -70,6 +76,7 @@ struct epoll {
     closure_struct(epoll_free, free);
     heap h;
     vector events;		/* epollfds indexed by fd */
+    struct list ready_head;     /* epollfds with events posted since last wait */
     int nfds;
     bitmap fds;			/* fds being watched / epollfd registered */
 };
@@ -93,6 +100,7 @@ static epoll epoll_alloc_internal(void)
 	return e;
 
     list_init(&e->blocked_head);
+    list_init(&e->ready_head);
     init_refcount(&e->refcount, 1, init_closure(&e->free, epoll_free, e));
     e->h = heap_general(get_kernel_heaps());
     e->events = allocate_vector(e->h, 8);
@@ -135,6 +143,8 @@ static epollfd alloc_epollfd(epoll e, int fd, u32 eventmask, u64 data)
     init_refcount(&efd->refcount, 1, init_closure(&efd->free, epollfd_free, efd));
     efd->registered = false;
     efd->zombie = false;
+    efd->ready_l.prev = efd->ready_l.next = 0;
+    efd->ready_t = 0;
     assert(vector_set(e->events, fd, efd));
     bitmap_set(e->fds, fd, 1);
     if (fd >= e->nfds)
@@ -143,6 +153,12 @@ static epollfd alloc_epollfd(epoll e, int fd, u32 eventmask, u64 data)
     return efd;
 }
 
+static inline void epollfd_dequeue(epollfd efd)
+{
+    if (efd->ready_l.next)
+        list_delete(&efd->ready_l);
+}
+
 static void unregister_epollfd(epollfd efd)
 {
     fdesc f = resolve_fd_noret(current->p, efd->fd);
@@ -163,6 +179,7 @@ static void release_epollfd(epollfd efd)
     assert(vector_set(e->events, fd, 0));
     bitmap_set(e->fds, fd, 0);
     efd->zombie = true;
+    epollfd_dequeue(efd);
     if (efd->registered)
         unregister_epollfd(efd);
     refcount_release(&efd->refcount); /* alloc */
@@ -277,56 +294,102 @@ static inline u32 report_from_notify_events(epollfd efd, u64 notify_events)
     return edge_detect ? ~efd->lastevents & events : events;
 }
 
-closure_function(1, 2, void, epoll_wait_notify,
+/* Queue efd on the ready list, at most once, and wake a waiter to collect
+   it. Waiters poll each queued fd again on collection, so a post is only a
+   hint that events may be pending. Returns true if a waiter was woken. */
+static boolean epollfd_post(epollfd efd, thread t)
+{
+    epoll e = efd->e;
+    if (!efd->ready_l.next) {
+        list_push_back(&e->ready_head, &efd->ready_l);
+        efd->ready_t = t;
+    } else if (efd->ready_t != t) {
+        efd->ready_t = 0;
+    }
+
+    list_foreach(&e->blocked_head, l) {
+        epoll_blocked w = struct_from_list(l, epoll_blocked, blocked_list);
+        if ((!t || t == w->t) && blockq_wake_one(w->t->thread_bq) != INVALID_ADDRESS) {
+            epoll_debug("   woke tid %d\n", w->t->tid);
+            return true;
+        }
+    }
+    return false;
+}
+
+closure_function(1, 2, boolean, epoll_wait_notify,
                  epollfd, efd,
                  u64, notify_events,
                  thread, t)
 {
     epollfd efd = bound(efd);
-    list l = list_get_next(&efd->e->blocked_head);
 
     /* only path to freedom - even fd removals trigger release */
     if (notify_events == NOTIFY_EVENTS_RELEASE) {
         epoll_debug("efd->fd %d unregistered\n", efd->fd);
         efd->registered = false;
+        epollfd_dequeue(efd);
         closure_finish();
-        return;
+        return false;
     }
 
-    epoll_blocked w = l ? struct_from_list(l, epoll_blocked, blocked_list) : 0;
     u32 events = (u32)notify_events;
     u32 report = report_from_notify_events(efd, events);
     assert(efd->registered);
-    epoll_debug("efd->fd %d, events 0x%x, report 0x%x, blocked %p, zombie %d\n",
-                efd->fd, events, report, w, efd->zombie);
+    epoll_debug("efd->fd %d, events 0x%x, report 0x%x, zombie %d\n",
+                efd->fd, events, report, efd->zombie);
 
-    /* XXX need to do some work to properly dole out to multiple epoll_waits (threads)... */
-    if (report == 0 || !w || efd->zombie)
-        return;
+    if (report == 0 || efd->zombie)
+        return false;
+    return epollfd_post(efd, t);
+}
 
-    if (t && t != w->t)
-        return;
+/* Move events from the ready list into the waiter's buffer. Level-triggered
+   entries go back on the tail, so the next wait polls them again and drops
+   them once they are no longer ready; edge-triggered entries wait for the
+   next rising edge and oneshot entries are masked until rearmed. */
+static int epoll_collect(epoll_blocked w)
+{
+    epoll e = w->e;
+    buffer b = w->user_events;
+    struct list requeue;
+    list l;
+
+    list_init(&requeue);
+    while (b->end < b->length && (l = list_get_next(&e->ready_head))) {
+        epollfd efd = struct_from_list(l, epollfd, ready_l);
+        list_delete(l);
+        if (efd->zombie || !efd->registered)
+            continue;
+        fdesc f = resolve_fd_noret(w->t->p, efd->fd);
+        if (!f)
+            continue;
+        u32 events = apply(f->events, w->t) & efd->eventmask;
+        if (!events) {
+            /* leave thread-specific events for the thread they were posted for */
+            if (efd->ready_t && efd->ready_t != w->t)
+                list_push_back(&requeue, l);
+            continue;
+        }
 
-    if (!w->user_events || (w->user_events->length - w->user_events->end) <= 0) {
-        /* XXX here we should advance to the next blocked head, probably */
-        epoll_debug("   user_events null or full\n");
-        return;
+        struct epoll_event *ev = buffer_ref(b, b->end);
+        ev->data = efd->data;
+        ev->events = events;
+        b->end += sizeof(struct epoll_event);
+        epoll_debug("   fd %d, data 0x%lx, events 0x%x\n", efd->fd, ev->data, ev->events);
+
+        if (efd->eventmask & EPOLLONESHOT)
+            efd->zombie = true;
+        else if (efd->eventmask & EPOLLET)
+            efd->lastevents = events;
+        else
+            list_push_back(&requeue, l);
     }
-
-    thread_resume(w->t);
-    struct epoll_event *e = buffer_ref(w->user_events, w->user_events->end);
-    e->data = efd->data;
-    e->events = report;
-    w->user_events->end += sizeof(struct epoll_event);
-    epoll_debug("   epoll_event %p, data 0x%lx, events 0x%x\n", e, e->data, e->events);
-
-    /* XXX check this */
-    if (efd->eventmask & EPOLLONESHOT)
-        efd->zombie = true;
-
-    /* now that we've reported these events, update last */
-    efd->lastevents |= report;
-    blockq_wake_one(w->t->thread_bq);
+    while ((l = list_get_next(&requeue))) {
+        list_delete(l);
+        list_push_back(&e->ready_head, l);
+    }
+    return user_event_count(w);
 }
 
 static epoll_blocked alloc_epoll_blocked(epoll e)
@@ -362,7 +425,7 @@ closure_function(3, 1, sysreturn, epoll_wait_bh,
     thread t = bound(t);
     epoll_blocked w = bound(w);
     timestamp timeout = bound(timeout);
-    int eventcount = user_event_count(w);
+    int eventcount = epoll_collect(w);
 
     epoll_debug("w %p on tid %d, timeout %ld, flags 0x%lx, event count %d\n",
                 w, t->tid, timeout, flags, eventcount);
@@ -392,15 +455,17 @@ closure_function(3, 1, sysreturn, epoll_wait_bh,
    - notify all waiters on a match (default)
    - notify on a match only once until condition is reset (EPOLLET)
    - notify once before removing the registration, handled upstream (EPOLLONESHOT)
-   - notify only one matching waiter, even across multiple epoll instances (EPOLLEXCLUSIVE)
-     - XXX Not implemented; will require tracking reported events on a per fd - not per
-           registration - basis.
+   - notify only one matching waiter, even across multiple epoll instances (EPOLLEXCLUSIVE);
+     exclusive registrations are dispatched last, and dispatch stops at the first one
+     that wakes a waiter
 */
 sysreturn epoll_wait(int epfd,
                      struct epoll_event *events,
                      int maxevents,
                      int timeout)
 {
+    if (maxevents <= 0)
+        return -EINVAL;
     if (!validate_user_memory(events, sizeof(struct epoll_event) * maxevents, true))
         return -EFAULT;
 
@@ -414,27 +479,6 @@ sysreturn epoll_wait(int epfd,
     w->user_events = wrap_buffer(e->h, events, maxevents * sizeof(struct epoll_event));
     w->user_events->end = 0;
 
-    bitmap_foreach_set(e->fds, fd) {
-	epollfd efd = vector_get(e->events, fd);
-	assert(efd);
-        assert(efd->fd == fd);
-
-        if (efd->zombie)
-            continue;
-
-        fdesc f = resolve_fd_noret(current->p, efd->fd);
-        if (!f) {
-            epoll_debug("   x fd %d\n", efd->fd);
-            release_epollfd(efd);
-            continue;
-        }
-
-        /* event transitions may in some cases need to be polled for
-           (e.g. due to change in lwIP internal state), so request a check */
-        if (efd->registered)
-            check_fdesc(f, current);
-    }
-
     timestamp ts = (timeout > 0) ? milliseconds(timeout) : 0;
     return blockq_check_timeout(w->t->thread_bq, current,
                                 closure(e->h, epoll_wait_bh, w, current,
@@ -451,28 +495,18 @@ static epollfd epollfd_from_fd(epoll e, int fd)
     return efd;
 }
 
-static void epollfd_update(epollfd efd, fdesc f)
-{
-    /* It may seem excessive to perform a check for all
-       waiters. However, thanks to thread-specific fd events (thanks
-       in turn to signalfd), we could have independent events for
-       multiple threads that require waking - even on the same fd. */
-
-    /* XXX take lock */
-    list_foreach(&efd->e->blocked_head, l) {
-        epoll_blocked w = struct_from_list(l, epoll_blocked, blocked_list);
-        epoll_debug("   posting check for blocked waiter (tid %d)\n", w->t->tid);
-        check_fdesc(f, w->t);
-    }
-    /* XXX release lock */
-}
-
 static sysreturn epoll_add_fd(epoll e, int fd, u32 events, u64 data)
 {
     epollfd efd = epollfd_from_fd(e, fd);
-    if ((efd != INVALID_ADDRESS) && efd->registered) {
-        epoll_debug("   can't add fd %d to epoll %p; already exists\n", fd, e);
-        return -EEXIST;
+    if (efd != INVALID_ADDRESS) {
+        if (efd->registered) {
+            epoll_debug("   can't add fd %d to epoll %p; already exists\n", fd, e);
+            return -EEXIST;
+        }
+
+        /* left over from a closed fd; start afresh with the new mask and data */
+        release_epollfd(efd);
+        efd = INVALID_ADDRESS;
     }
 
     epoll_debug("   adding %d, events 0x%x, data 0x%lx\n", fd, events, data);
@@ -487,8 +521,8 @@ static sysreturn epoll_add_fd(epoll e, int fd, u32 events, u64 data)
     assert(f);
     register_epollfd(efd, closure(e->h, epoll_wait_notify, efd));
 
-    /* apply check(s) for any current waiters */
-    epollfd_update(efd, f);
+    /* the fd may already be ready; have the next collection poll it */
+    epollfd_post(efd, 0);
     return 0;
 }
 
@@ -514,11 +548,10 @@ sysreturn epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
         return set_syscall_error(current, EFAULT);
     }
 
-    /* EPOLLEXCLUSIVE not yet implemented */
-    if (event && (event->events & EPOLLEXCLUSIVE)) {
-        msg_err("add: EPOLLEXCLUSIVE not supported\n");
+    /* EPOLLEXCLUSIVE is only valid when adding, and with a limited set of events */
+    if (op != EPOLL_CTL_DEL && (event->events & EPOLLEXCLUSIVE) &&
+        (op != EPOLL_CTL_ADD || (event->events & ~EPOLLEXCLUSIVE_OK_BITS)))
         return set_syscall_error(current, EINVAL);
-    }
 
     if ((f->type == FDESC_TYPE_REGULAR) || (f->type == FDESC_TYPE_DIRECTORY)) {
 	return set_syscall_error(current, EPERM);
@@ -532,6 +565,9 @@ sysreturn epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
         return set_syscall_return(current, remove_fd(e, fd));
     case EPOLL_CTL_MOD:
 	epoll_debug("   modifying %d, events 0x%x, data 0x%lx\n", fd, event->events, event->data);
+        epollfd efd = epollfd_from_fd(e, fd);
+        if (efd != INVALID_ADDRESS && (efd->eventmask & EPOLLEXCLUSIVE))
+            return set_syscall_error(current, EINVAL);
         sysreturn rv = remove_fd(e, fd);
         if (rv != 0)
             return set_syscall_return(current, rv);
@@ -550,7 +586,7 @@ sysreturn epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
 #define POLLFDMASK_WRITE	(EPOLLOUT | EPOLLHUP | EPOLLERR)
 #define POLLFDMASK_EXCEPT	(EPOLLPRI)
 
-closure_function(1, 2, void, select_notify,
+closure_function(1, 2, boolean, select_notify,
                  epollfd, efd,
                  u64, notify_events,
                  thread, t)
@@ -562,7 +598,7 @@ closure_function(1, 2, void, select_notify,
         epoll_debug("efd->fd %d unregistered\n", efd->fd);
         efd->registered = false;
         closure_finish();
-        return;
+        return false;
     }
 
     epoll_blocked w = l ? struct_from_list(l, epoll_blocked, blocked_list) : 0;
@@ -571,10 +607,10 @@ closure_function(1, 2, void, select_notify,
 	    efd->fd, events, w, efd->zombie);
 
     if (efd->zombie || !w || efd->fd >= w->nfds)
-        return;
+        return false;
 
     if (t && t != w->t)
-        return;
+        return false;
 
     thread_resume(w->t);
     assert(w->epoll_type == EPOLL_TYPE_SELECT);
@@ -596,7 +632,9 @@ closure_function(1, 2, void, select_notify,
         fetch_and_add(&w->retcount, count);
         epoll_debug("   event on %d, events 0x%x\n", efd->fd, events);
         blockq_wake_one(w->t->thread_bq);
+        return true;
     }
+    return false;
 }
 
 closure_function(3, 1, sysreturn, select_bh,
@@ -791,7 +829,7 @@ sysreturn select(int nfds,
     return select_internal(nfds, readfds, writefds, exceptfds, timeout ? time_from_timeval(timeout) : infinity, 0);
 }
 
-closure_function(1, 2, void, poll_notify,
+closure_function(1, 2, boolean, poll_notify,
                  epollfd, efd,
                  u64, notify_events,
                  thread, t)
@@ -803,7 +841,7 @@ closure_function(1, 2, void, poll_notify,
         epoll_debug("efd->fd %d unregistered\n", efd->fd);
         efd->registered = false;
         closure_finish();
-        return;
+        return false;
     }
 
     epoll_blocked w = l ? struct_from_list(l, epoll_blocked, blocked_list) : 0;
@@ -813,10 +851,10 @@ closure_function(1, 2, void, poll_notify,
     assert(efd->registered);
 
     if (events == 0 || !w || efd->zombie)
-        return;
+        return false;
 
     if (t && t != w->t)
-        return;
+        return false;
 
     thread_resume(w->t);
     struct pollfd *pfd = buffer_ref(w->poll_fds, efd->data * sizeof(struct pollfd));
@@ -824,6 +862,7 @@ closure_function(1, 2, void, poll_notify,
     pfd->revents = events;
     epoll_debug("   event on %d (%d), events 0x%x\n", efd->fd, pfd->fd, pfd->revents);
     blockq_wake_one(w->t->thread_bq);
+    return true;
 }
 
 closure_function(3, 1, sysreturn, poll_bh,
@@ -47,19 +47,23 @@ static inline u64 sigstate_get_mask(sigstate ss)
     return normalize_signal_mask(ss->mask);
 }
 
+/* rt_sigprocmask changes the mask without the kernel lock, so mask updates
+   are atomic and act as full barriers: either the delivering side sees the
+   new mask, or the thread sees the newly pending signal on its way out of
+   the syscall. */
 static inline void sigstate_set_mask(sigstate ss, u64 mask)
 {
-    ss->mask = mask;
+    __sync_lock_test_and_set(&ss->mask, mask);
 }
 
 static inline void sigstate_block(sigstate ss, u64 mask)
 {
-    ss->mask |= normalize_signal_mask(mask);
+    __sync_fetch_and_or(&ss->mask, normalize_signal_mask(mask));
 }
 
 static inline void sigstate_unblock(sigstate ss, u64 mask)
 {
-    ss->mask &= ~mask;
+    __sync_fetch_and_and(&ss->mask, ~mask);
 }
 
 static inline u64 sigstate_get_ignored(sigstate ss)
@@ -100,7 +104,8 @@ static inline u64 get_effective_signals(thread t)
 
 static inline void sigstate_set_pending(sigstate ss, int sig)
 {
-    ss->pending |= mask_from_sig(sig);
+    /* orders the pending bit before the sender's read of the mask */
+    __sync_fetch_and_or(&ss->pending, mask_from_sig(sig));
 }
 
 static inline list sigstate_get_sighead(sigstate ss, int signum)
@@ -567,6 +572,11 @@ sysreturn rt_sigaction(int signum,
     return 0;
 }
 
+boolean thread_signals_deliverable(thread t)
+{
+    return get_effective_signals(t) != 0;
+}
+
 sysreturn rt_sigprocmask(int how, const u64 *set, u64 *oldset, u64 sigsetsize)
 {
     if (sigsetsize != (NSIG / 8))
@@ -991,7 +1001,7 @@ closure_function(1, 2, sysreturn, signalfd_close,
     return io_complete(completion, t, 0);
 }
 
-closure_function(1, 2, void, signalfd_notify,
+closure_function(1, 2, boolean, signalfd_notify,
                  signal_fd, sfd,
                  u64, events,
                  thread, t)
@@ -1000,14 +1010,16 @@ closure_function(1, 2, void, signalfd_notify,
     if (events == NOTIFY_EVENTS_RELEASE) {
         sig_debug("%d released\n", sfd->fd);
         closure_finish();
+        return false;
     }
 
     if ((events & sfd->mask) == 0) {
         sig_debug("%d spurious notify\n", sfd->fd);
-        return;
+        return false;
     }
     blockq_wake_one_for_thread(sfd->bq, t);
     notify_dispatch_for_thread(sfd->f.ns, EPOLLIN, t);
+    return true;
 }
 
 static void signalfd_update_siginterest(thread t)
@@ -1271,7 +1283,7 @@ void register_signal_syscalls(struct syscall *map)
     register_syscall(map, pause, pause);
     register_syscall(map, rt_sigaction, rt_sigaction);
     register_syscall(map, rt_sigpending, rt_sigpending);
-    register_syscall(map, rt_sigprocmask, rt_sigprocmask);
+    register_syscall_nolock(map, rt_sigprocmask, rt_sigprocmask);
     register_syscall(map, rt_sigqueueinfo, rt_sigqueueinfo);
     register_syscall(map, rt_tgsigqueueinfo, rt_tgsigqueueinfo);
     register_syscall(map, rt_sigreturn, rt_sigreturn);
@@ -438,8 +438,8 @@ static sysreturn unixsock_listen(struct sock *sock, int backlog)
     return 0;
 }
 
-closure_function(2, 1, sysreturn, connect_bh,
-                 unixsock, s, thread, t,
+closure_function(3, 1, sysreturn, connect_bh,
+                 unixsock, s, thread, t, io_completion, completion,
                  u64, bqflags)
 {
     unixsock s = bound(s);
@@ -464,41 +464,41 @@ closure_function(2, 1, sysreturn, connect_bh,
     s->connecting = false;  /* connection has been established */
     rv = 0;
 out:
-    syscall_return(t, rv);
+    blockq_handle_completion(s->sock.txbq, bqflags, bound(completion), t, rv);
     closure_finish();
     return rv;
 }
 
 static sysreturn unixsock_connect(struct sock *sock, struct sockaddr *addr,
-        socklen_t addrlen)
+        socklen_t addrlen, thread t, boolean bh, io_completion completion)
 {
     unixsock s = (unixsock) sock;
     if (unixsock_is_connecting(s)) {
-        return -EALREADY;
+        return io_complete(completion, t, -EALREADY);
     } else if (unixsock_is_connected(s)) {
-        return -EISCONN;
+        return io_complete(completion, t, -EISCONN);
     }
 
     struct sockaddr_un *unixaddr = (struct sockaddr_un *) addr;
-    tuple t;
+    tuple fs_entry;
     buffer b;
     unixsock listener, peer;
-    if (filesystem_get_tuple(unixaddr->sun_path, &t) < 0) {
-        return -ECONNREFUSED;
+    if (filesystem_get_tuple(unixaddr->sun_path, &fs_entry) < 0) {
+        return io_complete(completion, t, -ECONNREFUSED);
     }
-    b = table_find(t, sym(socket));
+    b = table_find(fs_entry, sym(socket));
     if (!b || (buffer_length(b) != sizeof(u64))) {
-        return -ECONNREFUSED;
+        return io_complete(completion, t, -ECONNREFUSED);
     }
     listener = pointer_from_u64(*((u64 *) buffer_ref(b, 0)));
     assert(listener);
     if (!s->connecting) {
         if (!listener->conn_q || queue_full(listener->conn_q)) {
-            return -ECONNREFUSED;
+            return io_complete(completion, t, -ECONNREFUSED);
         }
         peer = unixsock_alloc(sock->h, sock->type, 0);
         if (!peer) {
-            return -ENOMEM;
+            return io_complete(completion, t, -ENOMEM);
         }
 
         peer->peer = s;
@@ -506,12 +506,12 @@ static sysreturn unixsock_connect(struct sock *sock, struct sockaddr *addr,
         s->connecting = true;
         unixsock_notify_reader(listener);
     }
-    blockq_action ba = closure(sock->h, connect_bh, s, current);
-    return blockq_check(sock->txbq, current, ba, false);
+    blockq_action ba = closure(sock->h, connect_bh, s, t, completion);
+    return blockq_check(sock->txbq, t, ba, bh);
 }
 
-closure_function(5, 1, sysreturn, accept_bh,
-                 unixsock, s, thread, t, struct sockaddr *, addr, socklen_t *, addrlen, int, flags,
+closure_function(6, 1, sysreturn, accept_bh,
+                 unixsock, s, thread, t, struct sockaddr *, addr, socklen_t *, addrlen, int, flags, io_completion, completion,
                  u64, bqflags)
 {
     unixsock s = bound(s);
@@ -549,89 +549,91 @@ closure_function(5, 1, sysreturn, accept_bh,
     child->peer->peer = child;
     unixsock_notify_writer(child->peer);
 out:
-    syscall_return(t, rv);
+    blockq_handle_completion(s->sock.rxbq, bqflags, bound(completion), t, rv);
     closure_finish();
     return rv;
 }
 
 static sysreturn unixsock_accept4(struct sock *sock, struct sockaddr *addr,
-        socklen_t *addrlen, int flags)
+        socklen_t *addrlen, int flags, thread t, boolean bh,
+        io_completion completion)
 {
     unixsock s = (unixsock) sock;
     if (!s->conn_q) {
-        return -EINVAL;
+        return io_complete(completion, t, -EINVAL);
     }
-    blockq_action ba = closure(sock->h, accept_bh, s, current, addr, addrlen,
-            flags);
-    return blockq_check(sock->rxbq, current, ba, false);
+    blockq_action ba = closure(sock->h, accept_bh, s, t, addr, addrlen,
+            flags, completion);
+    return blockq_check(sock->rxbq, t, ba, bh);
 }
 
 sysreturn unixsock_sendto(struct sock *sock, void *buf, u64 len, int flags,
-        struct sockaddr *dest_addr, socklen_t addrlen)
+        struct sockaddr *dest_addr, socklen_t addrlen, thread t, boolean bh,
+        io_completion completion)
 {
     /* Non-connected sockets are not supported, so destination address is
      * ignored. */
-    return apply(sock->f.write, buf, len, 0, current, false,
-            syscall_io_complete);
+    return apply(sock->f.write, buf, len, 0, t, bh, completion);
 }
 
 sysreturn unixsock_recvfrom(struct sock *sock, void *buf, u64 len, int flags,
-        struct sockaddr *dest_addr, socklen_t *addrlen)
+        struct sockaddr *dest_addr, socklen_t *addrlen, thread t, boolean bh,
+        io_completion completion)
 {
     /* Non-connected sockets are not supported, so source address is not set. */
     if (addrlen) {
         *addrlen = 0;
     }
-    return apply(sock->f.read, buf, len, 0, current, false,
-            syscall_io_complete);
+    return apply(sock->f.read, buf, len, 0, t, bh, completion);
 }
 
-closure_function(1, 2, void, sendmsg_complete,
-                 sg_list, sg,
+closure_function(2, 2, void, sendmsg_complete,
+                 sg_list, sg, io_completion, completion,
                  thread, t, sysreturn, rv)
 {
     sg_list sg = bound(sg);
     deallocate_sg_list(sg);
-    apply(syscall_io_complete, t, rv);
+    apply(bound(completion), t, rv);
     closure_finish();
 }
 
 sysreturn unixsock_sendmsg(struct sock *sock, const struct msghdr *msg,
-        int flags)
+        int flags, thread t, boolean bh, io_completion completion)
 {
     sg_list sg = allocate_sg_list();
     if (sg == INVALID_ADDRESS)
-        return -ENOMEM;
+        return io_complete(completion, t, -ENOMEM);
     if (!iov_to_sg(sg, msg->msg_iov, msg->msg_iovlen))
         goto err_dealloc_sg;
-    io_completion complete = closure(sock->h, sendmsg_complete, sg);
+    io_completion complete = closure(sock->h, sendmsg_complete, sg, completion);
     if (complete == INVALID_ADDRESS)
         goto err_dealloc_sg;
-    return apply(sock->f.sg_write, sg, sg->count, 0, current, false, complete);
+    return apply(sock->f.sg_write, sg, sg->count, 0, t, bh, complete);
   err_dealloc_sg:
     deallocate_sg_list(sg);
-    return -ENOMEM;
+    return io_complete(completion, t, -ENOMEM);
 }
 
-closure_function(3, 2, void, recvmsg_complete,
-                 sg_list, sg, struct iovec *, iov, int, iovlen,
+closure_function(4, 2, void, recvmsg_complete,
+                 sg_list, sg, struct iovec *, iov, int, iovlen, io_completion, completion,
                  thread, t, sysreturn, rv)
 {
     thread_resume(t);
     sg_list sg = bound(sg);
     sg_to_iov(sg, bound(iov), bound(iovlen));
     deallocate_sg_list(sg);
-    apply(syscall_io_complete, t, rv);
+    apply(bound(completion), t, rv);
     closure_finish();
 }
 
-sysreturn unixsock_recvmsg(struct sock *sock, struct msghdr *msg, int flags)
+sysreturn unixsock_recvmsg(struct sock *sock, struct msghdr *msg, int flags,
+        thread t, boolean bh, io_completion completion)
 {
     sg_list sg = allocate_sg_list();
     if (sg == INVALID_ADDRESS)
-        return -ENOMEM;
+        return io_complete(completion, t, -ENOMEM);
     io_completion complete = closure(sock->h, recvmsg_complete, sg,
-        msg->msg_iov, msg->msg_iovlen);
+        msg->msg_iov, msg->msg_iovlen, completion);
     if (complete == INVALID_ADDRESS)
         goto err_dealloc_sg;
 
@@ -639,11 +641,10 @@ sysreturn unixsock_recvmsg(struct sock *sock, struct msghdr *msg, int flags)
     msg->msg_namelen = 0;
 
     return apply(sock->f.sg_read, sg,
-        iov_total_len(msg->msg_iov, msg->msg_iovlen), 0, current, false,
-        complete);
+        iov_total_len(msg->msg_iov, msg->msg_iovlen), 0, t, bh, complete);
   err_dealloc_sg:
     deallocate_sg_list(sg);
-    return -ENOMEM;
+    return io_complete(completion, t, -ENOMEM);
 }
 
 static unixsock unixsock_alloc(heap h, int type, u32 flags)
@@ -32,17 +32,24 @@ struct sock {
     sysreturn (*bind)(struct sock *sock, struct sockaddr *addr,
             socklen_t addrlen);
     sysreturn (*listen)(struct sock *sock, int backlog);
+    /* The operations below deliver their result to the supplied completion;
+     * with bh set, they may return BLOCKQ_BLOCK_REQUIRED instead of
+     * suspending the calling thread (used by io_uring). */
     sysreturn (*connect)(struct sock *sock, struct sockaddr *addr,
-            socklen_t addrlen);
+            socklen_t addrlen, thread t, boolean bh, io_completion completion);
     sysreturn (*accept4)(struct sock *sock, struct sockaddr *addr,
-            socklen_t *addrlen, int flags);
+            socklen_t *addrlen, int flags, thread t, boolean bh,
+            io_completion completion);
     sysreturn (*sendto)(struct sock *sock, void *buf, u64 len, int flags,
-             struct sockaddr *dest_addr, socklen_t addrlen);
+             struct sockaddr *dest_addr, socklen_t addrlen, thread t,
+             boolean bh, io_completion completion);
     sysreturn (*recvfrom)(struct sock *sock, void *buf, u64 len, int flags,
-             struct sockaddr *dest_addr, socklen_t *addrlen);
+             struct sockaddr *dest_addr, socklen_t *addrlen, thread t,
+             boolean bh, io_completion completion);
     sysreturn (*sendmsg)(struct sock *sock, const struct msghdr *msg,
-            int flags);
-    sysreturn (*recvmsg)(struct sock *sock, struct msghdr *msg, int flags);
+            int flags, thread t, boolean bh, io_completion completion);
+    sysreturn (*recvmsg)(struct sock *sock, struct msghdr *msg, int flags,
+            thread t, boolean bh, io_completion completion);
     sysreturn (*shutdown)(struct sock *sock, int how);
 };
 
@@ -9,6 +9,7 @@ typedef struct special_file {
     sysreturn (*read)(file f, void *dest, u64 length, u64 offset);
     sysreturn (*write)(file f, void *dest, u64 length, u64 offset);
     u32 (*events)(file f);
+    proc_stats_handler stats;
 } special_file;
 
 static sysreturn urandom_read(file f, void *dest, u64 length, u64 offset)
@@ -82,6 +83,31 @@ static u32 maps_events(file f)
     return EPOLLIN;
 }
 
+closure_function(1, 1, void, faults_handler,
+                 buffer, b,
+                 vmap, map)
+{
+    bprintf(bound(b), "%016lx-%016lx faults %ld around %ld\n", map->node.r.start,
+            map->node.r.end, map->faults, map->fault_around);
+}
+
+static sysreturn faults_read(file f, void *dest, u64 length, u64 offset)
+{
+    heap h = heap_general(get_kernel_heaps());
+    buffer b = allocate_buffer(h, 512);
+    if (b == INVALID_ADDRESS)
+        return -ENOMEM;
+    vmap_iterator(current->p, stack_closure(faults_handler, b));
+    if (offset >= buffer_length(b)) {
+        deallocate_buffer(b);
+        return 0;
+    }
+    length = MIN(length, buffer_length(b) - offset);
+    runtime_memcpy(dest, buffer_ref(b, offset), length);
+    deallocate_buffer(b);
+    return length;
+}
+
 static sysreturn cpu_online_read(file f, void *dest, u64 length, u64 offset)
 {
     buffer b = little_stack_buffer(16);
@@ -96,14 +122,47 @@ static u32 cpu_online_events(file f)
     return (EPOLLIN | EPOLLOUT);
 }
 
+static special_file *get_special(file f);
+
+static sysreturn proc_stats_read(file f, void *dest, u64 length, u64 offset)
+{
+    heap h = heap_general(get_kernel_heaps());
+    buffer b = allocate_buffer(h, 512);
+    if (b == INVALID_ADDRESS)
+        return -ENOMEM;
+    apply(get_special(f)->stats, b);
+    if (offset >= buffer_length(b)) {
+        deallocate_buffer(b);
+        return 0;
+    }
+    length = MIN(length, buffer_length(b) - offset);
+    runtime_memcpy(dest, buffer_ref(b, offset), length);
+    deallocate_buffer(b);
+    return length;
+}
+
+static u32 proc_stats_events(file f)
+{
+    return EPOLLIN;
+}
+
 static special_file special_files[] = {
     { "/dev/urandom", .read = urandom_read, .write = 0, .events = urandom_events },
     { "/dev/null", .read = null_read, .write = null_write, .events = null_events },
     { "/proc/self/maps", .read = maps_read, .events = maps_events, },
+    { "/proc/self/faults", .read = faults_read, .events = maps_events, },
     { "/sys/devices/system/cpu/online", .read = cpu_online_read, .write = null_write, .events = cpu_online_events },
     FTRACE_SPECIAL_FILES
 };
 
+static void special_file_create(process p, heap h, special_file *sf)
+{
+    tuple entry = allocate_tuple();
+    buffer b = wrap_buffer(h, sf, sizeof(*sf));
+    table_set(entry, sym(special), b);
+    filesystem_mkentry(p->root_fs, 0, sf->path, entry, false, true);
+}
+
 void register_special_files(process p)
 {
     heap h = heap_general((kernel_heaps)p->uh);
@@ -129,14 +188,23 @@ void register_special_files(process p)
         deallocate_buffer(b);
     }
 
-    for (int i = 0; i < sizeof(special_files) / sizeof(special_files[0]); i++) {
-        special_file *sf = special_files + i;
-
-        /* create special file */
-        tuple entry = allocate_tuple();
-        buffer b = wrap_buffer(h, sf, sizeof(*sf));
-        table_set(entry, sym(special), b);
-        filesystem_mkentry(p->root_fs, 0, sf->path, entry, false, true);
+    for (int i = 0; i < sizeof(special_files) / sizeof(special_files[0]); i++)
+        special_file_create(p, h, special_files + i);
+
+    /* statistics registered by kernel components */
+    if (proc_stats) {
+        table_foreach(proc_stats, k, v) {
+            special_file *sf = allocate_zero(h, sizeof(*sf));
+            buffer path = allocate_buffer(h, 32);
+            assert(sf != INVALID_ADDRESS && path != INVALID_ADDRESS);
+            bprintf(path, "/proc/%b", symbol_string(k));
+            assert(buffer_write_byte(path, '\0'));
+            sf->path = buffer_ref(path, 0);
+            sf->read = proc_stats_read;
+            sf->events = proc_stats_events;
+            sf->stats = v;
+            special_file_create(p, h, sf);
+        }
     }
 
     filesystem_mkdirpath(p->root_fs, 0, "/sys/devices/system/cpu/cpu0", false);
@@ -53,8 +53,8 @@ void register_other_syscalls(struct syscall *map)
     register_syscall(map, lchown, syscall_ignore);
     register_syscall(map, ptrace, 0);
     register_syscall(map, syslog, 0);
-    register_syscall(map, getgid, syscall_ignore);
-    register_syscall(map, getegid, syscall_ignore);
+    register_syscall_nolock(map, getgid, syscall_ignore);
+    register_syscall_nolock(map, getegid, syscall_ignore);
     register_syscall(map, setpgid, 0);
     register_syscall(map, getppid, 0);
     register_syscall(map, getpgrp, 0);
@@ -117,7 +117,6 @@ void register_other_syscalls(struct syscall *map)
     register_syscall(map, afs_syscall, 0);
     register_syscall(map, tuxcall, 0);
     register_syscall(map, security, 0);
-    register_syscall(map, readahead, 0);
     register_syscall(map, setxattr, 0);
     register_syscall(map, lsetxattr, 0);
     register_syscall(map, fsetxattr, 0);
@@ -168,17 +167,13 @@ void register_other_syscalls(struct syscall *map)
     register_syscall(map, fchmodat, syscall_ignore);
     register_syscall(map, faccessat, 0);
     register_syscall(map, unshare, 0);
-    register_syscall(map, splice, 0);
-    register_syscall(map, tee, 0);
     register_syscall(map, sync_file_range, 0);
-    register_syscall(map, vmsplice, 0);
     register_syscall(map, move_pages, 0);
     register_syscall(map, utimensat, 0);
     register_syscall(map, inotify_init1, 0);
     register_syscall(map, preadv, 0);
     register_syscall(map, pwritev, 0);
     register_syscall(map, perf_event_open, 0);
-    register_syscall(map, recvmmsg, 0);
     register_syscall(map, fanotify_init, 0);
     register_syscall(map, fanotify_mark, 0);
     register_syscall(map, name_to_handle_at, 0);
@@ -199,7 +194,6 @@ void register_other_syscalls(struct syscall *map)
     register_syscall(map, userfaultfd, 0);
     register_syscall(map, membarrier, 0);
     register_syscall(map, mlock2, syscall_ignore);
-    register_syscall(map, copy_file_range, 0);
     register_syscall(map, preadv2, 0);
     register_syscall(map, pwritev2, 0);
     register_syscall(map, pkey_mprotect, 0);
@@ -566,85 +560,106 @@ static boolean is_special(tuple n)
     return table_find(n, sym(special)) ? true : false;
 }
 
+/* Data is moved in windows: a window is read from the input file into an sg
+   list and written to the output before the next one is read. The window
+   starts at SENDFILE_WINDOW_MIN and doubles each time one is written in full,
+   so that long transfers over fast links (with a large bandwidth-delay
+   product) are not limited by a read per 64kB. If the output has an sg_write
+   method, the pagecache pages are passed on as is; a TCP socket queues them
+   by reference rather than copying them into the stack. */
+
+#define SENDFILE_WINDOW_MIN (64 * KB)
+#define SENDFILE_WINDOW_MAX (2 * MB)
+
 closure_function(9, 2, void, sendfile_bh,
-                 fdesc, in, fdesc, out, int *, offset, sg_list, sg, sg_buf, cur_buf, bytes, count, bytes, readlen, bytes, written, boolean, bh,
+                 fdesc, in, fdesc, out, int *, offset, sg_list, sg, bytes, count, bytes, window, bytes, readlen, bytes, written, bytes, total,
                  thread, t, sysreturn, rv)
 {
-    thread_log(t, "%s: readlen %ld, written %ld, bh %d, rv %ld",
-               __func__, bound(readlen), bound(written), bound(bh), rv);
+    fdesc out = bound(out);
+    sg_list sg = bound(sg);
+    boolean reading = bound(readlen) == infinity;
+    thread_log(t, "%s: count %ld, window %ld, readlen %ld, written %ld, total %ld, rv %ld",
+               __func__, bound(count), bound(window), bound(readlen), bound(written),
+               bound(total), rv);
 
     if (rv <= 0) {
-        if (bound(bh) && rv == -EAGAIN) { /* result of a write */
-            if (!bound(offset) && bound(in)->type == FDESC_TYPE_REGULAR) {
-                /* rewind file offset ... another reason to create an sg read method */
+        if (!reading) {
+            /* give back the unsent remainder of the window */
+            s64 rewind = bound(readlen) - bound(written);
+            assert(rewind >= 0);
+            if (bound(offset)) {
+                *bound(offset) -= rewind;
+            } else if (bound(in)->type == FDESC_TYPE_REGULAR) {
                 file f_in = (file)bound(in);
-                s64 rewind = bound(count) - bound(written);
-                assert(rewind >= 0);
                 f_in->offset -= rewind;
-                thread_log(t, "   rewound %ld bytes to %ld", rewind, f_in->offset);
             }
-            rv = bound(written) == 0 ? -EAGAIN : bound(written);
-            sg_buf_release(bound(cur_buf));
-            thread_log(t, "   write would block, returning %ld", rv);
-        } else {
-            thread_log(t, "   zero or error, rv %ld", rv);
+            thread_log(t, "   write returned %ld, rewound %ld bytes", rv, rewind);
         }
+        if (bound(total) > 0)
+            rv = bound(total);
         goto out_complete;
     }
     thread_resume(t);
 
-    /* !bh means read complete (rv == bytes read) */
-    if (!bound(bh)) {
-        bound(bh) = true;
+    if (reading) {
+        if (rv < MIN(bound(count), bound(window)))
+            bound(count) = 0;   /* end of file */
+        else
+            bound(count) -= rv;
         bound(readlen) = rv;
-
-        /* this whole offset advance / rewind thing can go away if we
-           redo the io methods so that the file_op_complete* only
-           happens at the end of the chain, using only status_handlers
-           (io_status_handler for linear) in the middle */
+        bound(written) = 0;
         if (bound(offset))
             *bound(offset) += rv;
-        bound(cur_buf) = sg_list_head_remove(bound(sg)); /* initial dequeue */
-        assert(bound(cur_buf) != INVALID_ADDRESS);
-        bound(cur_buf)->offset = 0; /* offset for our use */
-        thread_log(t, "   read %ld bytes\n", rv);
+        thread_log(t, "   read %ld bytes", rv);
     } else {
+        if (!out->sg_write) {
+            sg_buf sgb = sg_list_head_peek(sg);
+            assert(sgb != INVALID_ADDRESS);
+            sgb->offset += rv;
+            assert(sgb->offset <= sgb->size);
+            if (sgb->offset == sgb->size) {
+                sg_list_head_remove(sg);
+                sg_buf_release(sgb);
+            }
+        }
         bound(written) += rv;
-        bound(cur_buf)->offset += rv;
-        if (bound(cur_buf)->offset == bound(cur_buf)->size) {
-            sg_buf_release(bound(cur_buf));
-            if (bound(written) == bound(readlen)) {
-                rv = bound(written);
+        bound(total) += rv;
+        if (bound(written) == bound(readlen)) {
+            if (bound(count) == 0) {
+                rv = bound(total);
                 goto out_complete;
             }
-            bound(cur_buf) = sg_list_head_remove(bound(sg));
-            assert(bound(cur_buf) != INVALID_ADDRESS);
-            bound(cur_buf)->offset = 0; /* offset for our use */
+
+            /* read next window */
+            bound(window) = MIN(bound(window) * 2, SENDFILE_WINDOW_MAX);
+            bound(readlen) = infinity;
+            int *offset = bound(offset);
+            apply(bound(in)->sg_read, sg, MIN(bound(count), bound(window)),
+                  offset ? *offset : infinity, t, true, (io_completion)closure_self());
+            return;
         }
-        assert(bound(cur_buf)->offset < bound(cur_buf)->size);
     }
 
     /* issue next write */
-    assert(bound(cur_buf));
-    void *buf = bound(cur_buf)->buf + bound(cur_buf)->offset;
-    u32 n = bound(cur_buf)->size - bound(cur_buf)->offset;
-    thread_log(t, "   writing %d bytes from %p", rv, n, buf);
-    apply(bound(out)->write, buf, n, 0, t, true, (io_completion)closure_self());
+    if (out->sg_write) {
+        apply(out->sg_write, sg, bound(readlen) - bound(written), infinity, t, true,
+              (io_completion)closure_self());
+    } else {
+        sg_buf sgb = sg_list_head_peek(sg);
+        assert(sgb != INVALID_ADDRESS);
+        void *buf = sgb->buf + sgb->offset;
+        u32 n = sgb->size - sgb->offset;
+        thread_log(t, "   writing %d bytes from %p", n, buf);
+        apply(out->write, buf, n, infinity, t, true, (io_completion)closure_self());
+    }
     return;
 out_complete:
-    sg_list_release(bound(sg));
-    deallocate_sg_list(bound(sg));
+    sg_list_release(sg);
+    deallocate_sg_list(sg);
     syscall_return(t, rv);
     closure_finish();
 }
 
-/* Should be determined more intelligently based on available
-   buffering on output side, modulated by link capacity
-   (e.g. bandwidth delay product). Right now assuming the common mode
-   is tcp output with 64kB max window size... */
-
-#define SENDFILE_READ_MAX (64 * KB)
-
 /* requires infile to have sg_read method - so sendfile from special files isn't supported */
 static sysreturn sendfile(int out_fd, int in_fd, int *offset, bytes count)
 {
@@ -658,18 +673,288 @@ static sysreturn sendfile(int out_fd, int in_fd, int *offset, bytes count)
         return -EBADF;
     if (!infile->sg_read || !outfile->write)
         return set_syscall_error(current, EINVAL);
+    if (count == 0)
+        return 0;
 
     sg_list sg = allocate_sg_list();
     if (sg == INVALID_ADDRESS)
         return set_syscall_error(current, ENOMEM);
 
-    u64 n = MIN(count, SENDFILE_READ_MAX);
+    u64 n = MIN(count, SENDFILE_WINDOW_MIN);
     io_completion read_complete = closure(heap_general(get_kernel_heaps()), sendfile_bh, infile, outfile,
-                                          offset, sg, 0, n, 0, 0, false);
+                                          offset, sg, count, SENDFILE_WINDOW_MIN, infinity, 0, 0);
+    if (read_complete == INVALID_ADDRESS) {
+        deallocate_sg_list(sg);
+        return set_syscall_error(current, ENOMEM);
+    }
     apply(infile->sg_read, sg, n, offset ? *offset : infinity, current, false, read_complete);
     return sysreturn_value(current);
 }
 
+/* splice(2) and tee(2) move data through a kernel buffer of up to a pipe's
+   capacity. Data taken from a pipe is only consumed once it has been written
+   out (and never for tee), so that nothing is lost on a short write. */
+
+#define SPLICE_TEE      (1ull << 32)    /* internal: leave input in place */
+
+closure_function(9, 2, void, splice_bh,
+                 fdesc, in, fdesc, out, u64 *, off_in, u64 *, off_out, void *, buf, u64, buflen, u64, flags, u64, readlen, u64, written,
+                 thread, t, sysreturn, rv)
+{
+    fdesc in = bound(in);
+    fdesc out = bound(out);
+    boolean nonblock = (bound(flags) & SPLICE_F_NONBLOCK) != 0;
+    thread_log(t, "%s: buflen %ld, readlen %ld, written %ld, rv %ld", __func__,
+               bound(buflen), bound(readlen), bound(written), rv);
+
+    if (bound(readlen) == infinity) {
+        if (rv <= 0)
+            goto out_complete;
+        bound(readlen) = rv;
+        if (bound(off_in))
+            *bound(off_in) += rv;
+    } else {
+        if (rv <= 0) {
+            if (bound(written) > 0)
+                rv = bound(written);
+            goto out_consume;
+        }
+        bound(written) += rv;
+        if (bound(off_out))
+            *bound(off_out) += rv;
+        if (bound(written) == bound(readlen)) {
+            rv = bound(written);
+            goto out_consume;
+        }
+    }
+    thread_resume(t);
+
+    /* issue next write */
+    void *buf = bound(buf) + bound(written);
+    u64 n = bound(readlen) - bound(written);
+    if (out->type == FDESC_TYPE_PIPE)
+        pipe_push(out, buf, n, nonblock, t, true, (io_completion)closure_self());
+    else
+        apply(out->write, buf, n, bound(off_out) ? *bound(off_out) : infinity, t, true,
+              (io_completion)closure_self());
+    return;
+  out_consume:
+    if (in->type == FDESC_TYPE_PIPE) {
+        if (!(bound(flags) & SPLICE_TEE))
+            pipe_consume(in, bound(written));
+    } else {
+        /* give back what couldn't be written */
+        u64 unwritten = bound(readlen) - bound(written);
+        if (bound(off_in))
+            *bound(off_in) -= unwritten;
+        else if (in->type == FDESC_TYPE_REGULAR)
+            ((file)in)->offset -= unwritten;
+    }
+  out_complete:
+    deallocate(heap_general(get_kernel_heaps()), bound(buf), bound(buflen));
+    syscall_return(t, rv);
+    closure_finish();
+}
+
+static sysreturn do_splice(fdesc in, u64 *off_in, fdesc out, u64 *off_out, u64 len,
+                           u64 flags)
+{
+    boolean nonblock = (flags & SPLICE_F_NONBLOCK) != 0;
+    u64 n = len;
+    if (in->type == FDESC_TYPE_PIPE)
+        n = MIN(n, pipe_get_capacity(in));
+    if (out->type == FDESC_TYPE_PIPE) {
+        /* don't take more from a non-pipe input than the output can hold */
+        if (nonblock || (out->flags & O_NONBLOCK)) {
+            u64 space = pipe_space(out);
+            if (space == 0)
+                return -EAGAIN;
+            n = MIN(n, space);
+        } else {
+            n = MIN(n, pipe_get_capacity(out));
+        }
+    }
+    if (n == 0)
+        return 0;
+
+    heap h = heap_general(get_kernel_heaps());
+    void *buf = allocate(h, n);
+    if (buf == INVALID_ADDRESS)
+        return -ENOMEM;
+    io_completion c = closure(h, splice_bh, in, out, off_in, off_out, buf, n, flags,
+                              infinity, 0);
+    if (c == INVALID_ADDRESS) {
+        deallocate(h, buf, n);
+        return -ENOMEM;
+    }
+    if (in->type == FDESC_TYPE_PIPE)
+        pipe_peek(in, buf, n, nonblock, current, true, c);
+    else
+        apply(in->read, buf, n, off_in ? *off_in : infinity, current, true, c);
+    return thread_maybe_sleep_uninterruptible(current);
+}
+
+static sysreturn splice(int fd_in, u64 *off_in, int fd_out, u64 *off_out, u64 len,
+                        unsigned int flags)
+{
+    thread_log(current, "%s: in %d, off_in %p, out %d, off_out %p, len %ld, flags 0x%x",
+               __func__, fd_in, off_in, fd_out, off_out, len, flags);
+    if ((off_in && !validate_user_memory(off_in, sizeof(u64), true)) ||
+        (off_out && !validate_user_memory(off_out, sizeof(u64), true)))
+        return -EFAULT;
+    fdesc in = resolve_fd(current->p, fd_in);
+    fdesc out = resolve_fd(current->p, fd_out);
+    if (!fdesc_is_readable(in) || !fdesc_is_writable(out))
+        return -EBADF;
+    if (in->type != FDESC_TYPE_PIPE && out->type != FDESC_TYPE_PIPE)
+        return -EINVAL;
+    if ((off_in && in->type != FDESC_TYPE_REGULAR) ||
+        (off_out && out->type != FDESC_TYPE_REGULAR))
+        return -ESPIPE;
+    if (!in->read || !out->write)
+        return -EINVAL;
+    if (len == 0)
+        return 0;
+    return do_splice(in, off_in, out, off_out, len, flags & SPLICE_F_NONBLOCK);
+}
+
+static sysreturn tee(int fd_in, int fd_out, u64 len, unsigned int flags)
+{
+    thread_log(current, "%s: in %d, out %d, len %ld, flags 0x%x", __func__, fd_in,
+               fd_out, len, flags);
+    fdesc in = resolve_fd(current->p, fd_in);
+    fdesc out = resolve_fd(current->p, fd_out);
+    if (!fdesc_is_readable(in) || !fdesc_is_writable(out))
+        return -EBADF;
+    if (in->type != FDESC_TYPE_PIPE || out->type != FDESC_TYPE_PIPE)
+        return -EINVAL;
+    if (len == 0)
+        return 0;
+    return do_splice(in, 0, out, 0, len, (flags & SPLICE_F_NONBLOCK) | SPLICE_TEE);
+}
+
+/* User pages are copied rather than mapped into the pipe. */
+static sysreturn vmsplice(int fd, struct iovec *iov, u64 nr_segs, unsigned int flags)
+{
+    thread_log(current, "%s: fd %d, iov %p, nr_segs %ld, flags 0x%x", __func__, fd,
+               iov, nr_segs, flags);
+    fdesc f = resolve_fd(current->p, fd);
+    if (f->type != FDESC_TYPE_PIPE)
+        return -EBADF;
+    boolean write = fdesc_is_writable(f);
+    if (!validate_iovec(iov, nr_segs, !write))
+        return -EFAULT;
+    iov_op(f, write, iov, nr_segs, infinity, true, syscall_io_complete);
+    return thread_maybe_sleep_uninterruptible(current);
+}
+
+/* copy_file_range(2) reads pagecache pages of the source into an sg list
+   and writes them straight into the pagecache of the destination. */
+
+#define COPY_FILE_RANGE_WINDOW  (1 * MB)
+
+/* Give back the part of a window that was read but not written. */
+static void copy_file_range_unread(fdesc in, u64 *off_in, u64 n)
+{
+    if (off_in)
+        *off_in -= n;
+    else
+        ((file)in)->offset -= n;
+}
+
+closure_function(8, 2, void, copy_file_range_bh,
+                 fdesc, in, fdesc, out, u64 *, off_in, u64 *, off_out, sg_list, sg, u64, remain, u64, readlen, u64, total,
+                 thread, t, sysreturn, rv)
+{
+    sg_list sg = bound(sg);
+    boolean reading = bound(readlen) == infinity;
+    thread_log(t, "%s: remain %ld, readlen %ld, total %ld, rv %ld", __func__,
+               bound(remain), bound(readlen), bound(total), rv);
+
+    if (rv <= 0) {
+        if (!reading)
+            copy_file_range_unread(bound(in), bound(off_in), bound(readlen));
+        if (bound(total) > 0)
+            rv = bound(total);
+        goto out_complete;
+    }
+    thread_resume(t);
+
+    if (reading) {
+        bound(readlen) = rv;
+        if (bound(off_in))
+            *bound(off_in) += rv;
+        u64 *off_out = bound(off_out);
+        apply(bound(out)->sg_write, sg, rv, off_out ? *off_out : infinity, t, true,
+              (io_completion)closure_self());
+        return;
+    }
+
+    boolean eof = bound(readlen) < MIN(bound(remain), COPY_FILE_RANGE_WINDOW);
+    bound(total) += rv;
+    bound(remain) -= rv;
+    if (bound(off_out))
+        *bound(off_out) += rv;
+    if (eof || bound(remain) == 0 || rv < bound(readlen)) {
+        if (rv < bound(readlen))
+            copy_file_range_unread(bound(in), bound(off_in), bound(readlen) - rv);
+        rv = bound(total);
+        goto out_complete;
+    }
+
+    /* read next window */
+    bound(readlen) = infinity;
+    u64 *off_in = bound(off_in);
+    apply(bound(in)->sg_read, sg, MIN(bound(remain), COPY_FILE_RANGE_WINDOW),
+          off_in ? *off_in : infinity, t, true, (io_completion)closure_self());
+    return;
+  out_complete:
+    sg_list_release(sg);
+    deallocate_sg_list(sg);
+    syscall_return(t, rv);
+    closure_finish();
+}
+
+static sysreturn copy_file_range(int fd_in, u64 *off_in, int fd_out, u64 *off_out,
+                                 u64 len, unsigned int flags)
+{
+    thread_log(current, "%s: in %d, off_in %p, out %d, off_out %p, len %ld, flags 0x%x",
+               __func__, fd_in, off_in, fd_out, off_out, len, flags);
+    if ((off_in && !validate_user_memory(off_in, sizeof(u64), true)) ||
+        (off_out && !validate_user_memory(off_out, sizeof(u64), true)))
+        return -EFAULT;
+    fdesc in = resolve_fd(current->p, fd_in);
+    fdesc out = resolve_fd(current->p, fd_out);
+    if (!fdesc_is_readable(in) || !fdesc_is_writable(out) || (out->flags & O_APPEND))
+        return -EBADF;
+    if (flags || in->type != FDESC_TYPE_REGULAR || out->type != FDESC_TYPE_REGULAR ||
+        !in->sg_read || !out->sg_write)
+        return -EINVAL;
+    file f_in = (file)in;
+    file f_out = (file)out;
+    if (f_in->fsf == f_out->fsf) {
+        u64 start_in = off_in ? *off_in : f_in->offset;
+        u64 start_out = off_out ? *off_out : f_out->offset;
+        if (start_in < start_out + len && start_out < start_in + len)
+            return -EINVAL;
+    }
+    if (len == 0)
+        return 0;
+
+    sg_list sg = allocate_sg_list();
+    if (sg == INVALID_ADDRESS)
+        return -ENOMEM;
+    io_completion c = closure(heap_general(get_kernel_heaps()), copy_file_range_bh, in,
+                              out, off_in, off_out, sg, len, infinity, 0);
+    if (c == INVALID_ADDRESS) {
+        deallocate_sg_list(sg);
+        return -ENOMEM;
+    }
+    apply(in->sg_read, sg, MIN(len, COPY_FILE_RANGE_WINDOW), off_in ? *off_in : infinity,
+          current, true, c);
+    return thread_maybe_sleep_uninterruptible(current);
+}
+
 static void begin_file_read(thread t, file f)
 {
     if ((f->length > 0) && !(f->f.flags & O_NOATIME)) {
@@ -1064,7 +1349,7 @@ sysreturn open_internal(filesystem fs, tuple cwd, const char *name, int flags,
         assert(f->fs_read);
         f->fs_write = fsfile_get_writer(fsf);
         assert(f->fs_write);
-        f->fadv = POSIX_FADV_NORMAL;
+        pagecache_ra_init(&f->ra, pagecache_get_readahead_max());
     } else {
         f->meta = n;
     }
@@ -1800,27 +2085,24 @@ static sysreturn getcwd(char *buf, u64 length)
 static sysreturn brk(void *x)
 {
     process p = current->p;
-    kernel_heaps kh = get_kernel_heaps();
 
     if (x) {
         if (p->brk > x) {
             /* on failure, return the current break */
             if (u64_from_pointer(x) < p->heap_base)
                 goto fail;
+            u64 old_end = pad(u64_from_pointer(p->brk), PAGESIZE);
+            u64 new_end = pad(u64_from_pointer(x), PAGESIZE);
             p->brk = x;
             assert(adjust_process_heap(p, irange(p->heap_base, u64_from_pointer(x))));
-            // free
+            if (old_end > new_end)
+                unmap_process_heap(new_end, old_end - new_end);
         } else if (p->brk < x) {
             // I guess assuming we're aligned
             u64 alloc = pad(u64_from_pointer(x), PAGESIZE) - pad(u64_from_pointer(p->brk), PAGESIZE);
             assert(adjust_process_heap(p, irange(p->heap_base, u64_from_pointer(p->brk) + alloc)));
-            u64 phys = allocate_u64((heap)heap_physical(kh), alloc);
-            if (phys == INVALID_PHYSICAL)
+            if (!map_process_heap(pad(u64_from_pointer(p->brk), PAGESIZE), alloc))
                 goto fail;
-            /* XXX no exec configurable? */
-            map(u64_from_pointer(p->brk), phys, alloc, PAGE_WRITABLE | PAGE_NO_EXEC | PAGE_USER);
-            // people shouldn't depend on this
-            zero(p->brk, alloc);
             p->brk += alloc;         
         }
     }
@@ -2206,6 +2488,10 @@ sysreturn getpid()
 
 sysreturn sched_yield()
 {
+    /* nothing else is waiting to run here */
+    if (queue_empty(runqueue) && queue_empty(current_cpu()->thread_queue))
+        return 0;
+    syscall_acquire_lock(current);
     thread_yield();             /* noreturn */
 }
 
@@ -2374,7 +2660,12 @@ void register_file_syscalls(struct syscall *map)
     register_syscall(map, fstat, fstat);
     register_syscall(map, fallocate, fallocate);
     register_syscall(map, fadvise64, fadvise64);
+    register_syscall(map, readahead, readahead);
     register_syscall(map, sendfile, sendfile);
+    register_syscall(map, splice, splice);
+    register_syscall(map, tee, tee);
+    register_syscall(map, vmsplice, vmsplice);
+    register_syscall(map, copy_file_range, copy_file_range);
     register_syscall(map, stat, stat);
     register_syscall(map, lstat, lstat);
     register_syscall(map, readv, readv);
@@ -2405,14 +2696,14 @@ void register_file_syscalls(struct syscall *map)
     register_syscall(map, renameat, renameat);
     register_syscall(map, renameat2, renameat2);
     register_syscall(map, close, close);
-    register_syscall(map, sched_yield, sched_yield);
+    register_syscall_nolock(map, sched_yield, sched_yield);
     register_syscall(map, brk, brk);
     register_syscall(map, uname, uname);
     register_syscall(map, getrlimit, getrlimit);
     register_syscall(map, setrlimit, setrlimit);
     register_syscall(map, prlimit64, prlimit64);
     register_syscall(map, getrusage, getrusage);
-    register_syscall(map, getpid, getpid);
+    register_syscall_nolock(map, getpid, getpid);
     register_syscall(map, exit_group, exit_group);
     register_syscall(map, exit, (sysreturn (*)())exit);
     register_syscall(map, getdents, getdents);
@@ -2433,8 +2724,8 @@ void register_file_syscalls(struct syscall *map)
     register_syscall(map, newfstatat, newfstatat);
     register_syscall(map, sched_getaffinity, sched_getaffinity);
     register_syscall(map, sched_setaffinity, sched_setaffinity);
-    register_syscall(map, getuid, syscall_ignore);
-    register_syscall(map, geteuid, syscall_ignore);
+    register_syscall_nolock(map, getuid, syscall_ignore);
+    register_syscall_nolock(map, geteuid, syscall_ignore);
     register_syscall(map, chown, syscall_ignore);
     register_syscall(map, setgroups, syscall_ignore);
     register_syscall(map, setuid, syscall_ignore);
@@ -2449,11 +2740,9 @@ void register_file_syscalls(struct syscall *map)
     register_syscall(map, io_uring_setup, io_uring_setup);
     register_syscall(map, io_uring_enter, io_uring_enter);
     register_syscall(map, io_uring_register, io_uring_register);
-    register_syscall(map, getcpu, getcpu);
+    register_syscall_nolock(map, getcpu, getcpu);
 }
 
-#define SYSCALL_F_NOTRACE 0x1
-
 struct syscall {
     void *handler;
     const char *name;
@@ -2625,9 +2914,56 @@ closure_function(0, 2, void, print_syscall_stats_cfn,
 
 static boolean syscall_defer;
 
+/* Run a SYSCALL_F_NOLOCK handler without the kernel lock and return
+   straight to the thread with sysret. If the handler ended up taking the
+   lock, or a signal is now deliverable, return false with the lock held
+   so that the caller resumes the thread through the scheduler instead. */
+static boolean syscall_nolock(context f, u64 call, struct syscall *s)
+{
+    thread t = pointer_from_u64(f[FRAME_THREAD]);
+    sysreturn (*h)(u64, u64, u64, u64, u64, u64) = s->handler;
+
+    t->syscall = call;
+    if (do_syscall_stats) {
+        assert(t->last_syscall == -1);
+        t->last_syscall = call;
+        t->syscall_enter_ts = now(CLOCK_ID_MONOTONIC);
+    }
+    thread_enter_system(t);
+    t->syscall_complete = false;
+    t->syscall_nolock = true;
+    sysreturn rv = h(f[FRAME_RDI], f[FRAME_RSI], f[FRAME_RDX], f[FRAME_R10], f[FRAME_R8], f[FRAME_R9]);
+    set_syscall_return(t, rv);
+    if (do_syscall_stats)
+        count_syscall(t, rv);
+    t->syscall = -1;
+    if (!t->syscall_nolock)
+        return false;
+    t->syscall_nolock = false;
+    if (thread_signals_deliverable(t)) {
+        kern_lock();
+        return false;
+    }
+    thread_enter_user(t);
+    current_cpu()->state = cpu_user;
+    frame_return(f);
+}
+
 // some validation can be moved up here
 static void syscall_schedule(context f, u64 call)
 {
+    thread t = pointer_from_u64(f[FRAME_THREAD]);
+    struct syscall *s = t->p->syscalls + call;
+    if (call < SYS_MAX && (s->flags & SYSCALL_F_NOLOCK) && !debugsyscalls &&
+        !t->p->trace) {
+        current_cpu()->state = cpu_kernel;
+        if (!syscall_nolock(f, call, s)) {
+            schedule_frame(f);
+            kern_unlock();
+            runloop();
+        }
+    }
+
     /* kernel context set on syscall entry */
     if (!syscall_defer)
         kern_lock();
@@ -2651,11 +2987,13 @@ void init_syscalls()
     print_syscall_stats = closure(h, print_syscall_stats_cfn);
 }
 
-void _register_syscall(struct syscall *m, int n, sysreturn (*f)(), const char *name)
+void _register_syscall(struct syscall *m, int n, sysreturn (*f)(), const char *name,
+                       int flags)
 {
     assert(m[n].handler == 0);
     m[n].handler = f;
     m[n].name = name;
+    m[n].flags = flags;
 }
 
 void configure_syscalls(process p)
@@ -143,6 +143,12 @@ typedef struct iovec {
 #define F_SETPIPE_SZ    (F_LINUX_SPECIFIC_BASE + 7)
 #define F_GETPIPE_SZ    (F_LINUX_SPECIFIC_BASE + 8)
 
+/* splice(2), tee(2) and vmsplice(2) flags */
+#define SPLICE_F_MOVE           1
+#define SPLICE_F_NONBLOCK       2
+#define SPLICE_F_MORE           4
+#define SPLICE_F_GIFT           8
+
 /* Values for 'mode' argument of access/faccessat syscalls */
 #define F_OK    0x0
 #define X_OK    0x1
@@ -212,6 +218,15 @@ struct flock {
 #define MS_INVALIDATE 2
 #define MS_SYNC       4
 
+/* madvise */
+#define MADV_NORMAL     0
+#define MADV_RANDOM     1
+#define MADV_SEQUENTIAL 2
+#define MADV_WILLNEED   3
+#define MADV_DONTNEED   4
+#define MADV_HUGEPAGE   14
+#define MADV_NOHUGEPAGE 15
+
 // straight from linux
 #define ARCH_SET_GS 0x1001
 #define ARCH_SET_FS 0x1002
@@ -279,13 +294,17 @@ struct utimbuf {
 #define FUTEX_WAIT_REQUEUE_PI	11
 #define FUTEX_CMP_REQUEUE_PI	12
 
+#define FUTEX_PRIVATE_FLAG      (1 << 7)
 #define FUTEX_CLOCK_REALTIME    (1 << 8)
 
+#define FUTEX_BITSET_MATCH_ANY  0xffffffff
+
 #define  FUTEX_OP_SET        0  /* uaddr2 = oparg; */
 #define  FUTEX_OP_ADD        1  /* uaddr2 += oparg; */
 #define  FUTEX_OP_OR         2  /* uaddr2 |= oparg; */
 #define  FUTEX_OP_ANDN       3  /* uaddr2 &= ~oparg; */
 #define  FUTEX_OP_XOR        4  /* uaddr2 ^= oparg; */
+#define  FUTEX_OP_OPARG_SHIFT 8 /* use (1 << oparg) as operand */
 
 #define FUTEX_OP_CMP_EQ     0  /* if (oldval == cmparg) wake */
 #define FUTEX_OP_CMP_NE     1  /* if (oldval != cmparg) wake */
@@ -804,7 +823,7 @@ struct epoll_event {
 #define EPOLLWRBAND	0x00000200
 #define EPOLLMSG	0x00000400
 #define EPOLLRDHUP	0x00002000
-#define EPOLLEXCLUSIVE	(1u << 29)
+#define EPOLLEXCLUSIVE	(1u << 28)
 #define EPOLLWAKEUP	(1u << 29)
 #define EPOLLONESHOT	(1u << 30)
 #define EPOLLET		(1u << 31)
@@ -908,6 +927,7 @@ struct io_uring_params {
 #define SO_RCVBUF    8
 #define SO_PRIORITY  12
 #define SO_LINGER    13
+#define SO_REUSEPORT 15
 
 #define IPV6_V6ONLY     26
 
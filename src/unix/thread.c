@@ -92,13 +92,13 @@ sysreturn clone(unsigned long flags, void *child_stack, int *ptid, int *ctid, un
 
 void register_thread_syscalls(struct syscall *map)
 {
-    register_syscall(map, futex, futex);
+    register_syscall_nolock(map, futex, futex);
     register_syscall(map, set_robust_list, set_robust_list);
     register_syscall(map, get_robust_list, get_robust_list);
     register_syscall(map, clone, clone);
     register_syscall(map, arch_prctl, arch_prctl);
     register_syscall(map, set_tid_address, set_tid_address);
-    register_syscall(map, gettid, gettid);
+    register_syscall_nolock(map, gettid, gettid);
 }
 
 void thread_log_internal(thread t, const char *desc, ...)
@@ -175,6 +175,8 @@ define_closure_function(1, 0, void, run_thread,
                         thread, t)
 {
     thread t = bound(t);
+    if (t->futex_wake_ts)
+        futex_account_wakeup(t);
     dispatch_signals(t);
     run_thread_frame(t);
 }
@@ -326,6 +328,9 @@ thread create_thread(process p)
     t->active_signo = 0;
     init_closure(&t->deferred_syscall, resume_syscall, t);
     t->sysctx = false;
+    t->syscall_nolock = false;
+    t->futex_spin = 0;
+    t->futex_wake_ts = 0;
     t->utime = t->stime = 0;
     t->start_time = now(CLOCK_ID_MONOTONIC);
     t->last_syscall = -1;
@@ -431,5 +436,4 @@ void init_threads(process p)
     heap h = heap_general((kernel_heaps)p->uh);
     p->threads = allocate_rbtree(h, closure(h, thread_tid_compare), closure(h, tid_print_key));
     spin_lock_init(&p->threads_lock);
-    init_futices(p);
 }
@@ -151,6 +151,9 @@ define_closure_function(1, 1, context, default_fault_handler,
        resuming deferred processing. */
     p = current_thread->p;
 
+    /* faulting on a user buffer from a lockless syscall handler */
+    syscall_acquire_lock(current_thread);
+
     if (frame[FRAME_VECTOR] == 0) {
         if (current_cpu()->state == cpu_user) {
             deliver_fault_signal(SIGFPE, current_thread, vaddr, FPE_INTDIV);
@@ -467,6 +470,34 @@ process init_unix(kernel_heaps kh, tuple root, filesystem fs)
 
     u_heap = uh;
     uh->kh = *kh;
+
+    value v = table_find(root, sym(readahead_max));
+    if (v) {
+        u64 ra_max;
+        if (u64_from_value(v, &ra_max))
+            pagecache_set_readahead_max(ra_max);
+        else
+            msg_err("invalid readahead_max; ignored\n");
+    }
+    v = table_find(root, sym(fault_around_pages));
+    if (v) {
+        u64 pages;
+        if (u64_from_value(v, &pages))
+            mmap_set_fault_around(pages);
+        else
+            msg_err("invalid fault_around_pages; ignored\n");
+    }
+    v = table_find(root, sym(transparent_hugepages));
+    if (v) {
+        if (buffer_compare_with_cstring(v, "never"))
+            mmap_set_thp_mode(THP_NEVER);
+        else if (buffer_compare_with_cstring(v, "madvise"))
+            mmap_set_thp_mode(THP_MADVISE);
+        else if (buffer_compare_with_cstring(v, "always"))
+            mmap_set_thp_mode(THP_ALWAYS);
+        else
+            msg_err("invalid transparent_hugepages; ignored\n");
+    }
     uh->processes = create_id_heap(h, h, 1, 65535, 1, false);
     uh->file_cache = allocate_objcache(h, heap_backed(kh), sizeof(struct file), PAGESIZE);
     if (uh->file_cache == INVALID_ADDRESS)
@@ -477,10 +508,12 @@ process init_unix(kernel_heaps kh, tuple root, filesystem fs)
 	goto alloc_fail;
     if (!unix_timers_init(uh))
         goto alloc_fail;
+    if (!futex_init(uh, root))
+        goto alloc_fail;
     if (ftrace_init(uh, fs))
 	goto alloc_fail;
 #ifdef NET
-    if (!netsyscall_init(uh))
+    if (!netsyscall_init(uh, root))
         goto alloc_fail;
 #endif
 
@@ -133,11 +133,11 @@ sysreturn clock_gettime(clockid_t clk_id, struct timespec *tp)
 
 void register_clock_syscalls(struct syscall *map)
 {
-    register_syscall(map, clock_gettime, clock_gettime);
+    register_syscall_nolock(map, clock_gettime, clock_gettime);
     register_syscall(map, clock_getres, syscall_ignore);
     register_syscall(map, clock_nanosleep, clock_nanosleep);
-    register_syscall(map, gettimeofday, gettimeofday);
+    register_syscall_nolock(map, gettimeofday, gettimeofday);
     register_syscall(map, nanosleep, nanosleep);
-    register_syscall(map, time, sys_time);
+    register_syscall_nolock(map, time, sys_time);
     register_syscall(map, times, times);
 }
@@ -36,7 +36,7 @@ typedef s64 sysreturn;
 // conditionalize
 // fix config/build, remove this include to take off network
 #include <net.h>
-boolean netsyscall_init(unix_heaps uh);
+boolean netsyscall_init(unix_heaps uh, tuple root);
 
 typedef struct process *process;
 typedef struct thread *thread;
@@ -251,12 +251,20 @@ typedef struct thread {
     /* set by set_robust_list syscall */
     void *robust_list;
 
+    /* adaptive spin count for FUTEX_WAIT */
+    u64 futex_spin;
+    /* time of the futex wake, for wake-to-run latency accounting */
+    timestamp futex_wake_ts;
+
     /* blockq thread is waiting on, INVALID_ADDRESS for uninterruptible */
     blockq blocked_on;
 
     /* set by syscall_return(); used to detect if blocking is necessary */
     boolean syscall_complete;
 
+    /* in a SYSCALL_F_NOLOCK handler, not holding the kernel lock */
+    boolean syscall_nolock;
+
     /* for waiting on thread-specific conditions rather than a resource */
     blockq thread_bq;
 
@@ -322,7 +330,7 @@ struct file {
             fsfile fsf;         /* fsfile for regular files */
             sg_io fs_read;
             sg_io fs_write;
-            int fadv;           /* posix_fadvise advice */
+            struct pagecache_ra ra; /* readahead state */
         };
         tuple meta;             /* meta tuple for others */
     };
@@ -342,6 +350,8 @@ void epoll_finish(epoll e);
 #define VMAP_FLAG_MMAP     0x0010
 #define VMAP_FLAG_SHARED   0x0020 /* vs private; same semantics as unix */
 #define VMAP_FLAG_PREALLOC 0x0040
+#define VMAP_FLAG_HUGEPAGE   0x0080 /* madvise(MADV_HUGEPAGE) */
+#define VMAP_FLAG_NOHUGEPAGE 0x1000 /* madvise(MADV_NOHUGEPAGE) */
 
 #define VMAP_MMAP_TYPE_MASK       0x0f00
 #define VMAP_MMAP_TYPE_ANONYMOUS  0x0100
@@ -360,6 +370,8 @@ typedef struct vmap {
     u32 allowed_flags;
     pagecache_node cache_node;
     u64 node_offset;
+    u64 faults;                 /* demand faults taken */
+    u64 fault_around;           /* pages mapped around faults */
 } *vmap;
 
 typedef struct varea {
@@ -407,14 +419,13 @@ typedef struct process {
     filesystem        cwd_fs;
     tuple             process_root;
     tuple             cwd;
-    table             futices;
     fault_handler     handler;
     rbtree            threads;
     struct spinlock   threads_lock;
     struct syscall   *syscalls;
     vector            files;
     rangemap          vareas;   /* available address space */
-    struct spinlock   vmap_lock;
+    struct rw_spinlock vmap_lock;
     rangemap          vmaps;    /* process mappings */
     vmap              stack_map;
     vmap              heap_map;
@@ -591,6 +602,15 @@ void init_vdso(process p);
 
 void mmap_process_init(process p);
 
+/* transparent huge page policy for anonymous memory */
+#define THP_NEVER   0
+#define THP_MADVISE 1           /* only for MADV_HUGEPAGE regions (default) */
+#define THP_ALWAYS  2           /* unless MADV_NOHUGEPAGE */
+void mmap_set_thp_mode(int mode);
+void mmap_set_fault_around(u64 pages);
+boolean map_process_heap(u64 start, u64 len);
+void unmap_process_heap(u64 start, u64 len);
+
 /* This "validation" is just a simple limit check right now, but this
    could optionally expand to do more rigorous validation (e.g. vmap
    lookup or page table walk). We may also want to place attributes on
@@ -681,15 +701,31 @@ static inline sigaction sigaction_from_sig(thread t, int signum)
 }
 
 boolean dispatch_signals(thread t);
+boolean thread_signals_deliverable(thread t);
 void deliver_signal_to_thread(thread t, struct siginfo *);
 void deliver_signal_to_process(process p, struct siginfo *);
 void deliver_fault_signal(u32 signo, thread t, u64 vaddr, s32 si_code);
 
 void threads_to_vector(process p, vector v);
 
-void _register_syscall(struct syscall *m, int n, sysreturn (*f)(), const char *name);
+#define SYSCALL_F_NOTRACE   0x1
+#define SYSCALL_F_NOLOCK    0x2 /* touches only thread-local or read-only state */
 
-#define register_syscall(m, n, f) _register_syscall(m, SYS_##n, f, #n)
+void _register_syscall(struct syscall *m, int n, sysreturn (*f)(), const char *name,
+                       int flags);
+
+#define register_syscall(m, n, f) _register_syscall(m, SYS_##n, f, #n, 0)
+#define register_syscall_nolock(m, n, f) _register_syscall(m, SYS_##n, f, #n, SYSCALL_F_NOLOCK)
+
+/* A SYSCALL_F_NOLOCK handler calls this before touching shared state,
+   and so do kernel page faults taken on its behalf. */
+static inline void syscall_acquire_lock(thread t)
+{
+    if (t->syscall_nolock) {
+        kern_lock();
+        t->syscall_nolock = false;
+    }
+}
 
 void configure_syscalls(process p);
 boolean syscall_notrace(process p, int syscall);
@@ -838,11 +874,13 @@ static inline u64 iov_total_len(struct iovec *iov, int iovcnt)
 }
 
 #define resolve_fd_noret(__p, __fd) vector_get(__p->files, __fd)
+
 #define resolve_fd(__p, __fd) ({void *f ; if (!(f = resolve_fd_noret(__p, __fd))) return set_syscall_error(current, EBADF); f;})
 
 void init_syscalls();
 void init_threads(process p);
-void init_futices(process p);
+boolean futex_init(unix_heaps uh, tuple root);
+void futex_account_wakeup(thread t);
 
 sysreturn futex(int *uaddr, int futex_op, int val, u64 val2, int *uaddr2, int val3);
 sysreturn get_robust_list(int pid, void *head, u64 *len);
@@ -872,6 +910,12 @@ sysreturn io_uring_register(int fd, unsigned int opcode, void *arg,
 int do_pipe2(int fds[2], int flags);
 int pipe_set_capacity(fdesc f, int capacity);
 int pipe_get_capacity(fdesc f);
+sysreturn pipe_peek(fdesc f, void *dest, u64 length, boolean nonblock, thread t,
+                    boolean bh, io_completion completion);
+void pipe_consume(fdesc f, u64 length);
+sysreturn pipe_push(fdesc f, void *src, u64 length, boolean nonblock, thread t,
+                    boolean bh, io_completion completion);
+u64 pipe_space(fdesc f);
 
 sysreturn socketpair(int domain, int type, int protocol, int sv[2]);
 
@@ -40,8 +40,13 @@
 #include "lwip/snmp.h"
 #include "lwip/ethip6.h"
 #include "lwip/etharp.h"
+#include "lwip/ip.h"
 #include "lwip/dhcp.h"
 #include "lwip/timeouts.h"
+#include "lwip/inet_chksum.h"
+#include "lwip/prot/ip4.h"
+#include "lwip/prot/ip6.h"
+#include "lwip/prot/tcp.h"
 #include "netif/ethernet.h"
 #include "virtio_internal.h"
 #include "virtio_mmio.h"
@@ -56,54 +61,416 @@
 # define virtio_net_debug(...) do { } while(0)
 #endif // defined(VIRTIO_NET_DEBUG)
 
+/* one rx/tx queue pair per cpu at most */
+#define VIRTIO_NET_MAX_QUEUE_PAIRS  MAX_CPUS
+
+/* control command layout within ctl_buf */
+#define VIRTIO_NET_CTL_HDR_OFFSET   0
+#define VIRTIO_NET_CTL_DATA_OFFSET  sizeof(struct virtio_net_ctrl_hdr)
+#define VIRTIO_NET_CTL_ACK_OFFSET   (VIRTIO_NET_CTL_DATA_OFFSET + sizeof(struct virtio_net_ctrl_mq))
+
+#define VIRTIO_NET_DRV_FEATURES     (VIRTIO_NET_F_MAC | VIRTIO_NET_F_MRG_RXBUF |  \
+                                     VIRTIO_NET_F_CSUM | VIRTIO_NET_F_GUEST_CSUM | \
+                                     VIRTIO_NET_F_HOST_TSO4 | VIRTIO_NET_F_HOST_TSO6 | \
+                                     VIRTIO_NET_F_GUEST_TSO4 | VIRTIO_NET_F_GUEST_TSO6)
+
+/* With VIRTIO_NET_F_CSUM, the device completes TCP checksums from the
+   pseudo-header sum left in the checksum field, and with HOST_TSO4/6 it
+   cuts TCP frames of up to 64KB into segments of gso_size. lwIP never
+   builds segments larger than the MSS, so while a received packet is
+   processed - typically an ACK opening the send window - consecutive
+   segments that lwIP sends for one flow are gathered into a single GSO
+   frame, which goes to the device once the receive is done or a segment
+   arrives that can't be added. */
+#define VNET_GSO_MAX_SEGS           64
+#define VNET_GSO_MAX_DESC           64
+#define VNET_TX_HEADERS_MAX         (SIZEOF_ETH_HDR + IP6_HLEN + 60)
+
+/* Without mergeable rx buffers, the device needs receives of at least
+   this size to deliver GUEST_TSO packets. */
+#define VNET_RX_BIG_LEN             65562
+
+#define VNET_CHECK_L4               (NETIF_CHECKSUM_CHECK_TCP | NETIF_CHECKSUM_CHECK_UDP)
+
+typedef struct vnet_tx {
+    struct virtio_net_hdr_mrg_rxbuf hdr;
+    u8 headers[VNET_TX_HEADERS_MAX];    /* GSO frame headers, through TCP */
+    struct virtqueue *txq;
+    vqmsg m;
+    u16 desc_count;
+    u16 npbufs;
+    u16 header_len;
+    u16 l4_offset;
+    boolean ipv6;
+    boolean psh;
+    u16 gso_size;
+    u32 payload_len;
+    u32 next_seq;
+    struct pbuf *pbufs[VNET_GSO_MAX_SEGS];
+} *vnet_tx;
+
+typedef struct vnet_rx {
+    struct virtqueue *q;
+    struct pbuf *head;          /* packet assembled from merged buffers */
+    struct pbuf *tail;
+    u64 len;
+    u16 buffers;                /* of the packet, yet to be received */
+    boolean csum_valid;
+} *vnet_rx;
+
 typedef struct vnet {
     vtdev dev;
     u16 port;
     heap rxbuffers;
+    heap txbufs;
     bytes net_header_len;
     int rxbuflen;
+    int rx_chain;               /* buffers per receive */
+    boolean mrg_rxbuf;
+    boolean guest_csum;
+    boolean tx_csum;
+    boolean tso4;
+    boolean tso6;
+    u16 chksum_flags;           /* netif checksum control outside of receive */
     struct netif *n;
-    struct virtqueue *txq;
-    struct virtqueue *rxq;
+    int queue_pairs;            /* rx/tx pairs allocated */
+    int active_pairs;           /* rx/tx pairs enabled on the device */
+    struct virtqueue *txq[VIRTIO_NET_MAX_QUEUE_PAIRS];
+    struct vnet_rx rx[VIRTIO_NET_MAX_QUEUE_PAIRS];
+    struct {
+        boolean active;         /* gathering segments into GSO frames */
+        vnet_tx pending;
+    } tx_batch[VIRTIO_NET_MAX_QUEUE_PAIRS];
     struct virtqueue *ctl;
-    u64 empty_phys;
-    void *empty; // just a mac..fix, from pre-heap days
+    u64 ctl_phys;
+    void *ctl_buf;
 } *vnet;
 
 typedef struct xpbuf
 {
     struct pbuf_custom p;
     vnet vn;
+    vnet_rx rx;
+    struct xpbuf *next;         /* in a chained receive */
 } *xpbuf;
 
-
-closure_function(1, 1, void, tx_complete,
-                 struct pbuf *, p,
+/* a TCP frame with headers in the first pbuf */
+struct vnet_tcp_frame {
+    u16 l4_offset;
+    u16 header_len;
+    u32 payload_len;
+    boolean ipv6;
+    struct tcp_hdr *tcph;
+};
+
+closure_function(2, 1, void, tx_complete,
+                 vnet, vn, vnet_tx, tx,
                  u64, len)
 {
-    // unfortunately we dont have control over the allocation
-    // path (?)
-    // free me!
-    pbuf_free(bound(p));
+    vnet_tx tx = bound(tx);
+    for (int i = 0; i < tx->npbufs; i++)
+        pbuf_free(tx->pbufs[i]);
+    deallocate(bound(vn)->txbufs, tx, sizeof(struct vnet_tx));
     closure_finish();
 }
 
+/* Have the device checksum the TCP segment at l4_offset, seeding the
+   checksum field with the pseudo-header sum. */
+static void vnet_tcp_csum_offload(struct virtio_net_hdr *hdr, void *l3, boolean ipv6,
+                                  u16 l4_offset, u32 l4_len, struct tcp_hdr *tcph)
+{
+    u64 sum;
+    if (ipv6) {
+        struct ip6_hdr *ip6h = l3;
+        sum = csum_add(0, &ip6h->src, 2 * sizeof(ip6h->src));
+    } else {
+        struct ip_hdr *iph = l3;
+        sum = csum_add(0, &iph->src, 2 * sizeof(iph->src));
+    }
+    u16 tail[2] = { lwip_htons(IP_PROTO_TCP), lwip_htons(l4_len) };
+    tcph->chksum = csum_fold(csum_add(sum, tail, sizeof(tail)));
+    hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    hdr->csum_start = l4_offset;
+    hdr->csum_offset = offsetof(struct tcp_hdr *, chksum);
+}
 
-static err_t low_level_output(struct netif *netif, struct pbuf *p)
+static boolean vnet_parse_tcp(struct pbuf *p, struct vnet_tcp_frame *f)
 {
-    vnet vn = netif->state;
+    struct eth_hdr *eh = p->payload;
+    u32 l4_len;
+    if (p->len < SIZEOF_ETH_HDR)
+        return false;
+    if (eh->type == PP_HTONS(ETHTYPE_IP)) {
+        struct ip_hdr *iph = p->payload + SIZEOF_ETH_HDR;
+        if (p->len < SIZEOF_ETH_HDR + IP_HLEN || IPH_PROTO(iph) != IP_PROTO_TCP ||
+            (IPH_OFFSET(iph) & PP_HTONS(IP_OFFMASK | IP_MF)) ||
+            lwip_ntohs(IPH_LEN(iph)) < IPH_HL_BYTES(iph))
+            return false;
+        f->ipv6 = false;
+        f->l4_offset = SIZEOF_ETH_HDR + IPH_HL_BYTES(iph);
+        l4_len = lwip_ntohs(IPH_LEN(iph)) - IPH_HL_BYTES(iph);
+    } else if (eh->type == PP_HTONS(ETHTYPE_IPV6)) {
+        struct ip6_hdr *ip6h = p->payload + SIZEOF_ETH_HDR;
+        if (p->len < SIZEOF_ETH_HDR + IP6_HLEN || IP6H_NEXTH(ip6h) != IP6_NEXTH_TCP)
+            return false;
+        f->ipv6 = true;
+        f->l4_offset = SIZEOF_ETH_HDR + IP6_HLEN;
+        l4_len = IP6H_PLEN(ip6h);
+    } else {
+        return false;
+    }
+    if (p->len < f->l4_offset + TCP_HLEN)
+        return false;
+    f->tcph = p->payload + f->l4_offset;
+    f->header_len = f->l4_offset + TCPH_HDRLEN_BYTES(f->tcph);
+    if (p->len < f->header_len || l4_len < f->header_len - f->l4_offset ||
+        p->tot_len != f->l4_offset + l4_len)
+        return false;
+    f->payload_len = l4_len - (f->header_len - f->l4_offset);
+    return true;
+}
 
-    vqmsg m = allocate_vqmsg(vn->txq);
-    assert(m != INVALID_ADDRESS);
-    vqmsg_push(vn->txq, m, vn->empty_phys, vn->net_header_len, false);
+/* lwIP doesn't generate TCP checksums on a netif with offload, so a TCP
+   frame that vnet_parse_tcp() can't describe to the device is checksummed
+   here instead. Fragments can't be checksummed one at a time; lwIP doesn't
+   fragment TCP segments anyway. */
+static void vnet_tcp_csum_sw(struct pbuf *p)
+{
+    struct eth_hdr *eh = p->payload;
+    struct tcp_hdr *tcph;
+    u16 l4_offset, l4_len;
+    if (p->len < SIZEOF_ETH_HDR)
+        return;
+    if (eh->type == PP_HTONS(ETHTYPE_IP)) {
+        struct ip_hdr *iph = p->payload + SIZEOF_ETH_HDR;
+        if (p->len < SIZEOF_ETH_HDR + IP_HLEN || IPH_PROTO(iph) != IP_PROTO_TCP ||
+            (IPH_OFFSET(iph) & PP_HTONS(IP_OFFMASK | IP_MF)) ||
+            lwip_ntohs(IPH_LEN(iph)) < IPH_HL_BYTES(iph) + TCP_HLEN)
+            return;
+        l4_offset = SIZEOF_ETH_HDR + IPH_HL_BYTES(iph);
+        l4_len = lwip_ntohs(IPH_LEN(iph)) - IPH_HL_BYTES(iph);
+        if (p->len < l4_offset + TCP_HLEN || p->tot_len < l4_offset + l4_len)
+            return;
+        ip4_addr_t src, dst;
+        ip4_addr_copy(src, iph->src);
+        ip4_addr_copy(dst, iph->dest);
+        tcph = p->payload + l4_offset;
+        tcph->chksum = 0;
+        pbuf_remove_header(p, l4_offset);
+        tcph->chksum = inet_chksum_pseudo_partial(p, IP_PROTO_TCP, l4_len, l4_len,
+                                                  &src, &dst);
+    } else if (eh->type == PP_HTONS(ETHTYPE_IPV6)) {
+        struct ip6_hdr *ip6h = p->payload + SIZEOF_ETH_HDR;
+        if (p->len < SIZEOF_ETH_HDR + IP6_HLEN || IP6H_NEXTH(ip6h) != IP6_NEXTH_TCP ||
+            IP6H_PLEN(ip6h) < TCP_HLEN)
+            return;
+        l4_offset = SIZEOF_ETH_HDR + IP6_HLEN;
+        l4_len = IP6H_PLEN(ip6h);
+        if (p->len < l4_offset + TCP_HLEN || p->tot_len < l4_offset + l4_len)
+            return;
+        ip6_addr_t src, dst;
+        ip6_addr_copy_from_packed(src, ip6h->src);
+        ip6_addr_copy_from_packed(dst, ip6h->dest);
+        tcph = p->payload + l4_offset;
+        tcph->chksum = 0;
+        pbuf_remove_header(p, l4_offset);
+        tcph->chksum = ip6_chksum_pseudo_partial(p, IP6_NEXTH_TCP, l4_len, l4_len,
+                                                 &src, &dst);
+    } else {
+        return;
+    }
+    pbuf_add_header(p, l4_offset);
+}
+
+static inline void vnet_tx_push(vnet_tx tx, u64 phys, u32 len)
+{
+    vqmsg_push(tx->txq, tx->m, phys, len, false);
+    tx->desc_count++;
+}
 
+static int vnet_pbuf_descs(struct pbuf *p, u64 offset)
+{
+    int n = 0;
+    for (struct pbuf *q = p; q != NULL; q = q->next) {
+        if (offset < q->len)
+            n++;
+        offset = offset < q->len ? 0 : offset - q->len;
+    }
+    return n;
+}
+
+/* queue the data of p from offset on, holding p until completion */
+static void vnet_tx_push_pbuf(vnet_tx tx, struct pbuf *p, u64 offset)
+{
+    for (struct pbuf *q = p; q != NULL; q = q->next) {
+        if (offset < q->len)
+            vnet_tx_push(tx, physical_from_virtual(q->payload + offset), q->len - offset);
+        offset = offset < q->len ? 0 : offset - q->len;
+    }
     pbuf_ref(p);
+    tx->pbufs[tx->npbufs++] = p;
+}
+
+static vnet_tx vnet_tx_alloc(vnet vn, struct virtqueue *txq)
+{
+    vnet_tx tx = allocate(vn->txbufs, sizeof(struct vnet_tx));
+    assert(tx != INVALID_ADDRESS);
+    zero(&tx->hdr, sizeof(tx->hdr));
+    tx->txq = txq;
+    tx->m = allocate_vqmsg(txq);
+    assert(tx->m != INVALID_ADDRESS);
+    tx->desc_count = 0;
+    tx->npbufs = 0;
+    vnet_tx_push(tx, physical_from_virtual(&tx->hdr), vn->net_header_len);
+    return tx;
+}
+
+static void vnet_tx_commit(vnet vn, vnet_tx tx)
+{
+    vqmsg_commit(tx->txq, tx->m, closure(vn->dev->general, tx_complete, vn, tx));
+}
+
+static boolean vnet_gso_eligible(vnet vn, struct vnet_tcp_frame *f)
+{
+    if (!(f->ipv6 ? vn->tso6 : vn->tso4) || f->payload_len == 0 ||
+        (TCPH_FLAGS(f->tcph) & ~TCP_PSH) != TCP_ACK)
+        return false;
+    /* the headers template has no room for IPv4 options */
+    return f->ipv6 || f->l4_offset == SIZEOF_ETH_HDR + IP_HLEN;
+}
+
+static void vnet_gso_start(vnet_tx tx, struct pbuf *p, struct vnet_tcp_frame *f)
+{
+    runtime_memcpy(tx->headers, p->payload, f->header_len);
+    tx->header_len = f->header_len;
+    tx->l4_offset = f->l4_offset;
+    tx->ipv6 = f->ipv6;
+    tx->psh = (TCPH_FLAGS(f->tcph) & TCP_PSH) != 0;
+    tx->gso_size = f->payload_len;
+    tx->payload_len = f->payload_len;
+    tx->next_seq = lwip_ntohl(f->tcph->seqno) + f->payload_len;
+    vnet_tx_push(tx, physical_from_virtual(tx->headers), tx->header_len);
+    vnet_tx_push_pbuf(tx, p, f->header_len);
+}
+
+static inline boolean vnet_hdr_match(u8 *a, u8 *b, u64 start, u64 end)
+{
+    return runtime_memcmp(a + start, b + start, end - start) == 0;
+}
+
+/* Add the segment in p to the GSO frame in tx if it directly follows
+   and, apart from lengths, ids, checksums, sequence number and PSH, has
+   the same headers. */
+static boolean vnet_gso_append(vnet_tx tx, struct pbuf *p, struct vnet_tcp_frame *f)
+{
+    if (f->ipv6 != tx->ipv6 || f->header_len != tx->header_len ||
+        f->payload_len == 0 || f->payload_len > tx->gso_size ||
+        (tx->payload_len % tx->gso_size) != 0 ||   /* only the last may be short */
+        tx->npbufs == VNET_GSO_MAX_SEGS ||
+        tx->header_len - SIZEOF_ETH_HDR + tx->payload_len + f->payload_len > 0xffff ||
+        tx->desc_count + vnet_pbuf_descs(p, f->header_len) > VNET_GSO_MAX_DESC ||
+        lwip_ntohl(f->tcph->seqno) != tx->next_seq ||
+        (TCPH_FLAGS(f->tcph) & ~TCP_PSH) != TCP_ACK)
+        return false;
+
+    u8 *a = tx->headers;
+    u8 *b = p->payload;
+    if (!vnet_hdr_match(a, b, 0, SIZEOF_ETH_HDR))
+        return false;
+    a += SIZEOF_ETH_HDR;
+    b += SIZEOF_ETH_HDR;
+    if (tx->ipv6) {
+        if (!vnet_hdr_match(a, b, 0, offsetof(struct ip6_hdr *, _plen)) ||
+            !vnet_hdr_match(a, b, offsetof(struct ip6_hdr *, _nexth), IP6_HLEN))
+            return false;
+    } else {
+        if (!vnet_hdr_match(a, b, 0, offsetof(struct ip_hdr *, _len)) ||
+            !vnet_hdr_match(a, b, offsetof(struct ip_hdr *, _offset), offsetof(struct ip_hdr *, _chksum)) ||
+            !vnet_hdr_match(a, b, offsetof(struct ip_hdr *, src), IP_HLEN))
+            return false;
+    }
+    a = tx->headers + tx->l4_offset;
+    b = (u8 *)f->tcph;
+    /* the header length shares a word with the flags, in its first byte */
+    if (!vnet_hdr_match(a, b, 0, offsetof(struct tcp_hdr *, seqno)) ||
+        !vnet_hdr_match(a, b, offsetof(struct tcp_hdr *, ackno), offsetof(struct tcp_hdr *, _hdrlen_rsvd_flags) + 1) ||
+        !vnet_hdr_match(a, b, offsetof(struct tcp_hdr *, wnd), offsetof(struct tcp_hdr *, chksum)) ||
+        !vnet_hdr_match(a, b, offsetof(struct tcp_hdr *, urgp), tx->header_len - tx->l4_offset))
+        return false;
+
+    vnet_tx_push_pbuf(tx, p, f->header_len);
+    tx->payload_len += f->payload_len;
+    tx->next_seq += f->payload_len;
+    if (TCPH_FLAGS(f->tcph) & TCP_PSH)
+        tx->psh = true;
+    return true;
+}
+
+/* Fix up the template headers for the whole frame; a single segment
+   goes out as an ordinary frame. */
+static void vnet_gso_finish(vnet_tx tx)
+{
+    void *l3 = tx->headers + SIZEOF_ETH_HDR;
+    struct tcp_hdr *tcph = (struct tcp_hdr *)(tx->headers + tx->l4_offset);
+    u32 l4_len = tx->header_len - tx->l4_offset + tx->payload_len;
+    if (tx->payload_len > tx->gso_size) {
+        tx->hdr.hdr.gso_type = tx->ipv6 ? VIRTIO_NET_HDR_GSO_TCPV6 : VIRTIO_NET_HDR_GSO_TCPV4;
+        tx->hdr.hdr.hdr_len = tx->header_len;
+        tx->hdr.hdr.gso_size = tx->gso_size;
+        if (tx->psh)
+            TCPH_SET_FLAG(tcph, TCP_PSH);
+        if (tx->ipv6) {
+            IP6H_PLEN_SET((struct ip6_hdr *)l3, l4_len);
+        } else {
+            struct ip_hdr *iph = l3;
+            IPH_LEN_SET(iph, lwip_htons(IP_HLEN + l4_len));
+            IPH_CHKSUM_SET(iph, 0);
+            IPH_CHKSUM_SET(iph, (u16)~csum_fold(csum_add(0, iph, IP_HLEN)));
+        }
+    }
+    vnet_tcp_csum_offload(&tx->hdr.hdr, l3, tx->ipv6, tx->l4_offset, l4_len, tcph);
+}
+
+static void vnet_tx_flush(vnet vn, int pair)
+{
+    vnet_tx tx = vn->tx_batch[pair].pending;
+    vnet_gso_finish(tx);
+    vnet_tx_commit(vn, tx);
+    vn->tx_batch[pair].pending = 0;
+}
+
+static err_t low_level_output(struct netif *netif, struct pbuf *p)
+{
+    vnet vn = netif->state;
 
-    for (struct pbuf * q = p; q != NULL; q = q->next)
-        vqmsg_push(vn->txq, m, physical_from_virtual(q->payload), q->len, false);
+    /* Transmit on the queue pair of the sending cpu; with automatic
+       receive steering, the device delivers the flow's incoming packets
+       to the rx queue of the same pair, and thus to the same cpu. */
+    int pair = current_cpu()->id % vn->active_pairs;
+    struct virtqueue *txq = vn->txq[pair];
+    struct vnet_tcp_frame f;
+    boolean tcp = vn->tx_csum && vnet_parse_tcp(p, &f);
+    if (vn->tx_batch[pair].pending) {
+        if (tcp && vnet_gso_append(vn->tx_batch[pair].pending, p, &f))
+            goto out;
+        vnet_tx_flush(vn, pair);
+    }
 
-    vqmsg_commit(vn->txq, m, closure(vn->dev->general, tx_complete, p));
-    
+    vnet_tx tx = vnet_tx_alloc(vn, txq);
+    if (tcp && vn->tx_batch[pair].active && vnet_gso_eligible(vn, &f)) {
+        vnet_gso_start(tx, p, &f);
+        vn->tx_batch[pair].pending = tx;
+    } else {
+        if (tcp)
+            vnet_tcp_csum_offload(&tx->hdr.hdr, p->payload + SIZEOF_ETH_HDR, f.ipv6, f.l4_offset,
+                                  f.header_len - f.l4_offset + f.payload_len, f.tcph);
+        else if (vn->tx_csum)
+            vnet_tcp_csum_sw(p);
+        vnet_tx_push_pbuf(tx, p, 0);
+        vnet_tx_commit(vn, tx);
+    }
+
+  out:
     MIB2_STATS_NETIF_ADD(netif, ifoutoctets, p->tot_len);
     if (((u8_t *)p->payload)[0] & 1) {
         /* broadcast or multicast packet*/
@@ -125,54 +492,101 @@ static void receive_buffer_release(struct pbuf *p)
     deallocate(x->vn->rxbuffers, x, x->vn->rxbuflen + sizeof(struct xpbuf));
 }
 
-static void post_receive(vnet vn);
+static void post_receive(vnet vn, vnet_rx rx);
 
-static u16 vnet_csum(u8 *buf, u64 len)
+/* Pass a packet to lwIP, which runs under the kernel lock, so the
+   netif checksum controls can be set for just this packet: TCP and UDP
+   checksums the device vouched for aren't checked again. Segments sent
+   in response are gathered into GSO frames. */
+static void vnet_input(vnet vn, struct pbuf *p, boolean csum_valid, netif_input_fn input)
 {
-    u64 sum = 0;
-    while (len >= sizeof(u64)) {
-        u64 s = *(u64 *)buf;
-        sum += s;
-        if (sum < s)
-            sum++;
-        buf += sizeof(u64);
-        len -= sizeof(u64);
-    }
-    if (len >= sizeof(u32)) {
-        u32 s = *(u32 *)buf;
-        sum += s;
-        if (sum < s)
-            sum++;
-        buf += sizeof(u32);
-        len -= sizeof(u32);
+    struct netif *n = vn->n;
+    int pair = current_cpu()->id % vn->active_pairs;
+    if (vn->guest_csum)
+        NETIF_SET_CHECKSUM_CTRL(n, csum_valid ? vn->chksum_flags & ~VNET_CHECK_L4 :
+                                vn->chksum_flags | VNET_CHECK_L4);
+    vn->tx_batch[pair].active = true;
+    if (input(p, n) != ERR_OK)
+        pbuf_free(p);
+    vn->tx_batch[pair].active = false;
+    if (vn->tx_batch[pair].pending)
+        vnet_tx_flush(vn, pair);
+    NETIF_SET_CHECKSUM_CTRL(n, vn->chksum_flags);
+}
+
+/* Append the buffers of a receive holding len bytes to the packet being
+   assembled; buffers left empty are released. */
+static void vnet_rx_append(vnet_rx rx, xpbuf x, u64 len)
+{
+    while (x != NULL) {
+        xpbuf next = x->next;
+        struct pbuf *p = &x->p.pbuf;
+        u64 n = MIN(len, p->len);
+        if (n == 0) {
+            pbuf_free(p);
+        } else {
+            p->len = n;
+            p->next = NULL;
+            if (rx->tail)
+                rx->tail->next = p;
+            else
+                rx->head = p;
+            rx->tail = p;
+            rx->len += n;
+            len -= n;
+        }
+        x = next;
     }
-    if (len >= sizeof(u16)) {
-        u16 s = *(u16 *)buf;
-        sum += s;
-        if (sum < s)
-            sum++;
-        buf += sizeof(u16);
-        len -= sizeof(u16);
+}
+
+/* A GUEST_TSO frame may carry a full 64KB IP packet, which with its
+   Ethernet header no longer fits a pbuf length. Such a frame is unicast
+   to us by the host, so it's handed to IP directly with the Ethernet
+   header stripped, skipping only what ethernet_input would have done
+   to get there. Anything else that large is dropped. */
+static netif_input_fn vnet_rx_oversized(struct pbuf *p, u64 *len)
+{
+    struct eth_hdr *ethhdr = p->payload;
+    netif_input_fn input;
+    if (p->len <= SIZEOF_ETH_HDR)
+        return 0;
+    if (ethhdr->type == PP_HTONS(ETHTYPE_IP))
+        input = ip4_input;
+    else if (ethhdr->type == PP_HTONS(ETHTYPE_IPV6))
+        input = ip6_input;
+    else
+        return 0;
+    if (*len - SIZEOF_ETH_HDR > 0xffff)
+        return 0;
+    p->payload += SIZEOF_ETH_HDR;
+    p->len -= SIZEOF_ETH_HDR;
+    *len -= SIZEOF_ETH_HDR;
+    return input;
+}
+
+static void vnet_rx_deliver(vnet vn, vnet_rx rx)
+{
+    struct pbuf *p = rx->head;
+    u64 len = rx->len;
+    netif_input_fn input = vn->n->input;
+    rx->head = rx->tail = NULL;
+    if (p == NULL)
+        return;
+    if (len > 0xffff) {
+        input = vnet_rx_oversized(p, &len);
+        if (!input) {
+            virtio_net_debug("%s: dropping oversized frame, len %ld\n", __func__, len);
+            LINK_STATS_INC(link.lenerr);
+            LINK_STATS_INC(link.drop);
+            pbuf_free(p);
+            return;
+        }
     }
-    if (len) {
-        u8 s = *buf;
-        sum += s;
-        if (sum < s)
-            sum++;
+    for (struct pbuf *q = p; q != NULL; q = q->next) {
+        q->tot_len = len;
+        len -= q->len;
     }
-
-    /* Fold down to 16 bits */
-    u32 s1 = sum;
-    u32 s2 = sum >> 32;
-    s1 += s2;
-    if (s1 < s2)
-        s1++;
-    u16 s3 = s1;
-    u16 s4 = s1 >> 16;
-    s3 += s4;
-    if (s3 < s4)
-        s3++;
-    return ~s3;
+    vnet_input(vn, p, rx->csum_valid, input);
 }
 
 closure_function(1, 1, void, input,
@@ -182,56 +596,109 @@ closure_function(1, 1, void, input,
     virtio_net_debug("%s: len %ld\n", __func__, len);
 
     xpbuf x = bound(x);
-    vnet vn= x->vn;
-    // under what conditions does a virtio queue give us zero?
-    if (x != NULL) {
-        struct virtio_net_hdr *hdr = (struct virtio_net_hdr *)x->p.pbuf.payload;
-        boolean err = false;
-        len -= vn->net_header_len;
-        assert(len <= x->p.pbuf.len);
-        x->p.pbuf.tot_len = x->p.pbuf.len = len;
+    vnet vn = x->vn;
+    vnet_rx rx = x->rx;
+    if (rx->buffers == 0) {
+        /* first buffer of a packet */
+        struct virtio_net_hdr_mrg_rxbuf *hdr = (struct virtio_net_hdr_mrg_rxbuf *)x->p.pbuf.payload;
+        rx->buffers = vn->mrg_rxbuf && hdr->num_buffers > 1 ? hdr->num_buffers : 1;
+        rx->csum_valid = (hdr->hdr.flags & (VIRTIO_NET_HDR_F_NEEDS_CSUM |
+                                            VIRTIO_NET_HDR_F_DATA_VALID)) != 0;
+        rx->len = 0;
         x->p.pbuf.payload += vn->net_header_len;
-        if (hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
-            if (hdr->csum_start + hdr->csum_offset <= len - sizeof(u16)) {
-                u16 csum = vnet_csum(x->p.pbuf.payload + hdr->csum_start,
-                    len - hdr->csum_start);
-                *(u16 *)(x->p.pbuf.payload + hdr->csum_start +
-                        hdr->csum_offset) = csum;
-            } else
-                err = true;
-        }
-        if (!err)
-            err = (vn->n->input(&x->p.pbuf, vn->n) != ERR_OK);
-        if (err) {
-            receive_buffer_release(&x->p.pbuf);
-        }
-    } else {
-        rprintf("virtio null\n");
+        x->p.pbuf.len -= vn->net_header_len;
+        len = len > vn->net_header_len ? len - vn->net_header_len : 0;
     }
+    vnet_rx_append(rx, x, len);
+    if (--rx->buffers == 0)
+        vnet_rx_deliver(vn, rx);
     // we need to get a signal from the device side that there was
     // an underrun here to open up the window
-    post_receive(vn);
+    post_receive(vn, rx);
     closure_finish();
 }
 
 
-static void post_receive(vnet vn)
+static void post_receive(vnet vn, vnet_rx rx)
 {
-    xpbuf x = allocate(vn->rxbuffers, sizeof(struct xpbuf) + vn->rxbuflen);
-    assert(x != INVALID_ADDRESS);
-    x->vn = vn;
-    x->p.custom_free_function = receive_buffer_release;
-    pbuf_alloced_custom(PBUF_RAW,
-                        vn->rxbuflen,
-                        PBUF_REF,
-                        &x->p,
-                        x+1,
-                        vn->rxbuflen);
-
-    vqmsg m = allocate_vqmsg(vn->rxq);
+    vqmsg m = allocate_vqmsg(rx->q);
     assert(m != INVALID_ADDRESS);
-    vqmsg_push(vn->rxq, m, physical_from_virtual(x+1), vn->rxbuflen, true);
-    vqmsg_commit(vn->rxq, m, closure(vn->dev->general, input, x));
+    xpbuf head = NULL, *link = &head;
+    for (int i = 0; i < vn->rx_chain; i++) {
+        xpbuf x = allocate(vn->rxbuffers, sizeof(struct xpbuf) + vn->rxbuflen);
+        assert(x != INVALID_ADDRESS);
+        x->vn = vn;
+        x->rx = rx;
+        x->next = NULL;
+        x->p.custom_free_function = receive_buffer_release;
+        pbuf_alloced_custom(PBUF_RAW,
+                            vn->rxbuflen,
+                            PBUF_REF,
+                            &x->p,
+                            x+1,
+                            vn->rxbuflen);
+        vqmsg_push(rx->q, m, physical_from_virtual(x+1), vn->rxbuflen, true);
+        *link = x;
+        link = &x->next;
+    }
+    vqmsg_commit(rx->q, m, closure(vn->dev->general, input, head));
+}
+
+static void post_receive_all(vnet vn, vnet_rx rx)
+{
+    for (int i = 0; i < virtqueue_entries(rx->q) / vn->rx_chain; i++)
+        post_receive(vn, rx);
+}
+
+closure_function(2, 1, void, vnet_mq_set_complete,
+                 vnet, vn, int, pairs,
+                 u64, len)
+{
+    vnet vn = bound(vn);
+    u8 ack = *(u8 *)(vn->ctl_buf + VIRTIO_NET_CTL_ACK_OFFSET);
+    if (ack == VIRTIO_NET_OK) {
+        virtio_net_debug("%s: %d queue pairs active\n", __func__, bound(pairs));
+        vn->active_pairs = bound(pairs);
+    } else {
+        msg_err("failed to enable %d queue pairs (ack %d)\n", bound(pairs), ack);
+    }
+    closure_finish();
+}
+
+/* Run once the secondary cpus are up: bind each queue pair's
+   interrupts to its cpu, then ask the device to spread flows across
+   the pairs. */
+closure_function(1, 0, void, vnet_mq_setup,
+                 vnet, vn)
+{
+    vnet vn = bound(vn);
+    int pairs = MIN(vn->queue_pairs, total_processors);
+    virtio_net_debug("%s: queue pairs %d, cpus %d\n", __func__, vn->queue_pairs, total_processors);
+    if (pairs > 1) {
+        for (int i = 0; i < pairs; i++) {
+            vtpci_set_vq_affinity((vtpci)vn->dev, 2 * i, i);
+            vtpci_set_vq_affinity((vtpci)vn->dev, 2 * i + 1, i);
+            if (i > 0)
+                post_receive_all(vn, &vn->rx[i]);
+        }
+
+        struct virtio_net_ctrl_hdr *hdr = vn->ctl_buf + VIRTIO_NET_CTL_HDR_OFFSET;
+        struct virtio_net_ctrl_mq *mq = vn->ctl_buf + VIRTIO_NET_CTL_DATA_OFFSET;
+        hdr->class = VIRTIO_NET_CTRL_MQ;
+        hdr->cmd = VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET;
+        mq->virtqueue_pairs = pairs;
+        *(u8 *)(vn->ctl_buf + VIRTIO_NET_CTL_ACK_OFFSET) = VIRTIO_NET_ERR;
+
+        vqmsg m = allocate_vqmsg(vn->ctl);
+        assert(m != INVALID_ADDRESS);
+        vqmsg_push(vn->ctl, m, vn->ctl_phys + VIRTIO_NET_CTL_HDR_OFFSET,
+                   sizeof(struct virtio_net_ctrl_hdr), false);
+        vqmsg_push(vn->ctl, m, vn->ctl_phys + VIRTIO_NET_CTL_DATA_OFFSET,
+                   sizeof(struct virtio_net_ctrl_mq), false);
+        vqmsg_push(vn->ctl, m, vn->ctl_phys + VIRTIO_NET_CTL_ACK_OFFSET, sizeof(u8), true);
+        vqmsg_commit(vn->ctl, m, closure(vn->dev->general, vnet_mq_set_complete, vn, pairs));
+    }
+    closure_finish();
 }
 
 void lwip_status_callback(struct netif *netif);
@@ -265,45 +732,92 @@ static err_t virtioif_init(struct netif *netif)
     /* device capabilities */
     /* don't set NETIF_FLAG_ETHARP if this device is not an ethernet one */
     netif->flags = NETIF_FLAG_BROADCAST | NETIF_FLAG_ETHARP | NETIF_FLAG_LINK_UP | NETIF_FLAG_UP;
+    NETIF_SET_CHECKSUM_CTRL(netif, vn->chksum_flags);
+
+    post_receive_all(vn, &vn->rx[0]);
 
-    for (int i = 0; i < virtqueue_entries(vn->rxq); i++)
-        post_receive(vn);
-    
     return ERR_OK;
 }
 
 static void virtio_net_attach(vtdev dev)
 {
-    //u32 badness = VIRTIO_F_BAD_FEATURE | VIRTIO_NET_F_CSUM | VIRTIO_NET_F_GUEST_CSUM |
-    //    VIRTIO_NET_F_GUEST_TSO4 | VIRTIO_NET_F_GUEST_TSO6 |  VIRTIO_NET_F_GUEST_ECN|
-    //    VIRTIO_NET_F_GUEST_UFO | VIRTIO_NET_F_CTRL_VLAN | VIRTIO_NET_F_MQ;
-
     heap h = dev->general;
     backed_heap contiguous = dev->contiguous;
-    vnet vn = allocate(h, sizeof(struct vnet));
+    vnet vn = allocate_zero(h, sizeof(struct vnet));
     assert(vn != INVALID_ADDRESS);
     vn->n = allocate(h, sizeof(struct netif));
     assert(vn->n != INVALID_ADDRESS);
-    vn->net_header_len = (dev->features & VIRTIO_F_VERSION_1) ||
-        (dev->features & VIRTIO_NET_F_MRG_RXBUF) != 0 ?
+    vn->mrg_rxbuf = (dev->features & VIRTIO_NET_F_MRG_RXBUF) != 0;
+    vn->net_header_len = (dev->features & VIRTIO_F_VERSION_1) || vn->mrg_rxbuf ?
         sizeof(struct virtio_net_hdr_mrg_rxbuf) : sizeof(struct virtio_net_hdr);
     vn->rxbuflen = vn->net_header_len + sizeof(struct eth_hdr) + sizeof(struct eth_vlan_hdr) + 1500;
-    virtio_net_debug("%s: net_header_len %d, rxbuflen %d\n", __func__, vn->net_header_len, vn->rxbuflen);
+    vn->rx_chain = 1;
+    if (!vn->mrg_rxbuf &&
+        (dev->features & (VIRTIO_NET_F_GUEST_TSO4 | VIRTIO_NET_F_GUEST_TSO6))) {
+        /* each receive is a chain of page-sized buffers */
+        vn->rxbuflen = PAGESIZE - sizeof(struct xpbuf);
+        vn->rx_chain = (VNET_RX_BIG_LEN + vn->rxbuflen - 1) / vn->rxbuflen;
+    }
+    virtio_net_debug("%s: net_header_len %d, rxbuflen %d, rx_chain %d\n", __func__,
+                     vn->net_header_len, vn->rxbuflen, vn->rx_chain);
     vn->rxbuffers = allocate_objcache(h, (heap)contiguous,
 				      vn->rxbuflen + sizeof(struct xpbuf), PAGESIZE_2M);
-    /* rx = 0, tx = 1, ctl = 2 by 
-       page 53 of http://docs.oasis-open.org/virtio/virtio/v1.0/cs01/virtio-v1.0-cs01.pdf */
+    vn->txbufs = allocate_objcache(h, (heap)contiguous, sizeof(struct vnet_tx), PAGESIZE_2M);
     vn->dev = dev;
-    virtio_alloc_virtqueue(dev, "virtio net tx", 1, runqueue, &vn->txq);
-    virtio_alloc_virtqueue(dev, "virtio net rx", 0, runqueue, &vn->rxq);
-    // just need vn->net_header_len contig bytes really
-    vn->empty = alloc_map(contiguous, contiguous->h.pagesize, &vn->empty_phys);
-    assert(vn->empty != INVALID_ADDRESS);
-    for (int i = 0; i < vn->net_header_len; i++)  ((u8 *)vn->empty)[i] = 0;
+
+    /* Checksum offload is used only in both directions, so that TCP
+       looped back within the netif is neither checksummed nor checked. */
+    vn->guest_csum = (dev->features & VIRTIO_NET_F_GUEST_CSUM) != 0;
+    vn->tx_csum = vn->guest_csum && (dev->features & VIRTIO_NET_F_CSUM);
+    vn->tso4 = vn->tx_csum && (dev->features & VIRTIO_NET_F_HOST_TSO4);
+    vn->tso6 = vn->tx_csum && (dev->features & VIRTIO_NET_F_HOST_TSO6);
+    vn->chksum_flags = NETIF_CHECKSUM_ENABLE_ALL;
+    if (vn->tx_csum)
+        vn->chksum_flags &= ~(NETIF_CHECKSUM_GEN_TCP | VNET_CHECK_L4);
+    virtio_net_debug("%s: csum tx %d rx %d, tso4 %d, tso6 %d\n", __func__,
+                     vn->tx_csum, vn->guest_csum, vn->tso4, vn->tso6);
+
+    /* With VIRTIO_NET_F_MQ, queue pairs are rx = 2N, tx = 2N + 1 and
+       ctl = 2 * max_virtqueue_pairs; otherwise rx = 0, tx = 1, ctl = 2 by
+       page 53 of http://docs.oasis-open.org/virtio/virtio/v1.0/cs01/virtio-v1.0-cs01.pdf
+
+       Each pair gets its own MSI-X vectors and its completions are
+       serviced on the cpu queue of the pair's cpu, so more pairs than
+       MSI-X vectors (less one for ctl) cannot be used. */
+    vn->queue_pairs = 1;
+    u16 max_pairs = 0;
+    if (dev->transport == VTIO_TRANSPORT_PCI &&
+        (dev->features & (VIRTIO_NET_F_MQ | VIRTIO_NET_F_CTRL_VQ)) ==
+        (VIRTIO_NET_F_MQ | VIRTIO_NET_F_CTRL_VQ)) {
+        struct virtio_net_config cfg;
+        vtdev_cfg_read_mem(dev, &cfg, sizeof(cfg));
+        max_pairs = cfg.max_virtqueue_pairs;
+        vn->queue_pairs = MIN(MIN(max_pairs, VIRTIO_NET_MAX_QUEUE_PAIRS),
+                              (((vtpci)dev)->msix_count - 1) / 2);
+        if (vn->queue_pairs < 1)
+            vn->queue_pairs = 1;
+    }
+    vn->active_pairs = 1;
+    virtio_net_debug("%s: max queue pairs %d, using %d\n", __func__, max_pairs, vn->queue_pairs);
+    for (int i = 0; i < vn->queue_pairs; i++) {
+        queue sched_queue = vn->queue_pairs > 1 ? cpuinfo_from_id(i)->cpu_queue : runqueue;
+        virtio_alloc_virtqueue(dev, "virtio net tx", 2 * i + 1, sched_queue, &vn->txq[i]);
+        virtio_alloc_virtqueue(dev, "virtio net rx", 2 * i, sched_queue, &vn->rx[i].q);
+    }
+    if (vn->queue_pairs > 1) {
+        virtio_alloc_virtqueue(dev, "virtio net ctl", 2 * max_pairs, runqueue, &vn->ctl);
+        vn->ctl_buf = alloc_map(contiguous, contiguous->h.pagesize, &vn->ctl_phys);
+        assert(vn->ctl_buf != INVALID_ADDRESS);
+    }
     vn->n->state = vn;
     // initialization complete
     vtdev_set_status(dev, VIRTIO_CONFIG_STATUS_DRIVER_OK);
 
+    /* defer enabling more queue pairs until the runloop starts, by which
+       time all cpus are online */
+    if (vn->queue_pairs > 1)
+        assert(enqueue(runqueue, closure(h, vnet_mq_setup, vn)));
+
     netif_add(vn->n,
               0, 0, 0, 
               vn,
@@ -318,7 +832,7 @@ closure_function(2, 1, boolean, vtpci_net_probe,
     if (!vtpci_probe(d, VIRTIO_ID_NETWORK))
         return false;
     vtpci dev = attach_vtpci(bound(general), bound(page_allocator), d,
-        VIRTIO_NET_F_MAC);
+        VIRTIO_NET_DRV_FEATURES | VIRTIO_NET_F_CTRL_VQ | VIRTIO_NET_F_MQ);
     virtio_net_attach(&dev->virtio_dev);
     return true;
 }
@@ -332,7 +846,7 @@ closure_function(2, 1, void, vtmmio_net_probe,
             sizeof(struct virtio_net_config)))
         return;
     if (attach_vtmmio(bound(general), bound(page_allocator), d,
-            VIRTIO_NET_F_MAC))
+            VIRTIO_NET_DRV_FEATURES))
         virtio_net_attach(&d->virtio_dev);
 }
 
@@ -202,11 +202,15 @@ status vtpci_alloc_virtqueue(vtpci dev,
     if (!is_ok(s))
         return s;
 
-    // setup virtqueue MSI-X interrupt
-    pci_setup_msix(dev->dev, idx, handler, name);
-    pci_bar_write_2(&dev->common_config, dev->regs[VTPCI_REG_QUEUE_MSIX_VECTOR], idx);
-    int check_idx = pci_bar_read_2(&dev->common_config, dev->regs[VTPCI_REG_QUEUE_MSIX_VECTOR]);
-    if (check_idx != idx)
+    // setup virtqueue MSI-X interrupt; vectors are handed out in allocation order
+    int msix_slot = dev->msix_next;
+    if (msix_slot >= dev->msix_count)
+        return timm("status", "no MSI-X vector available for virtqueue %d", idx);
+    dev->msix_next++;
+    pci_setup_msix(dev->dev, msix_slot, handler, name);
+    pci_bar_write_2(&dev->common_config, dev->regs[VTPCI_REG_QUEUE_MSIX_VECTOR], msix_slot);
+    int check_slot = pci_bar_read_2(&dev->common_config, dev->regs[VTPCI_REG_QUEUE_MSIX_VECTOR]);
+    if (check_slot != msix_slot)
         return timm("status", "cannot configure virtqueue MSI-X vector");
 
     // queue ring
@@ -223,6 +227,16 @@ status vtpci_alloc_virtqueue(vtpci dev,
     return STATUS_OK;
 }
 
+/* Deliver interrupts for virtqueue idx to target_cpu. */
+void vtpci_set_vq_affinity(vtpci dev, int idx, u32 target_cpu)
+{
+    pci_bar_write_2(&dev->common_config, dev->regs[VTPCI_REG_QUEUE_SELECT], idx);
+    u16 msix_slot = pci_bar_read_2(&dev->common_config, dev->regs[VTPCI_REG_QUEUE_MSIX_VECTOR]);
+    virtio_pci_debug("%s: queue %d, msix slot %d, cpu %d\n", __func__, idx, msix_slot, target_cpu);
+    if (msix_slot != VIRTIO_MSI_NO_VECTOR)
+        pci_set_msix_target(dev->dev, msix_slot, target_cpu);
+}
+
 static void vtpci_legacy_alloc_resources(vtpci dev)
 {
     dev->regs[VTPCI_REG_DEVICE_STATUS] = VIRTIO_PCI_STATUS;
@@ -300,7 +314,8 @@ vtpci attach_vtpci(heap h, backed_heap page_allocator, pci_dev d, u64 feature_ma
         vtpci_legacy_alloc_resources(dev);
     }
     pci_set_bus_master(dev->dev);
-    pci_enable_msix(dev->dev);
+    dev->msix_count = pci_enable_msix(dev->dev);
+    dev->msix_next = 0;
 
     vtpci_set_status(dev, VIRTIO_CONFIG_STATUS_RESET);
     vtpci_set_status(dev, VIRTIO_CONFIG_STATUS_ACK);
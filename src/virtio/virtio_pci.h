@@ -65,6 +65,9 @@ struct vtpci {
 
     closure_struct(vtpci_notify, notify);
 
+    int msix_count;             /* MSI-X table size */
+    int msix_next;              /* next unassigned MSI-X slot */
+
     int vtpci_nvqs;
     struct virtqueue *vtpci_vqs;
 };
@@ -90,6 +93,7 @@ struct vtpci {
 boolean vtpci_probe(pci_dev d, int virtio_dev_id);
 vtpci attach_vtpci(heap h, backed_heap page_allocator, pci_dev d, u64 feature_mask);
 status vtpci_alloc_virtqueue(vtpci dev, const char *name, int idx, queue sched_queue, struct virtqueue **result);
+void vtpci_set_vq_affinity(vtpci dev, int idx, u32 target_cpu);
 void vtpci_set_status(vtpci dev, u8 status);
 boolean vtpci_is_modern(vtpci dev);
 
@@ -45,6 +45,17 @@
 # define virtqueue_debug_verbose(...) do { } while(0)
 #endif // defined(VIRTQUEUE_DEBUG_VERBOSE)
 
+/* NAPI-style polling: once an interrupt finds at least poll_threshold
+   completions pending, device notifications are suppressed and the used
+   ring is polled from the cpu's poll queue, poll_budget completions per
+   runloop pass, until it drains. A budget of 0 disables polling. */
+#define VIRTQUEUE_POLL_BUDGET_DEFAULT       64
+#define VIRTQUEUE_POLL_THRESHOLD_DEFAULT    4
+
+static u32 vq_poll_budget = VIRTQUEUE_POLL_BUDGET_DEFAULT;
+static u32 vq_poll_threshold = VIRTQUEUE_POLL_THRESHOLD_DEFAULT;
+static struct list virtqueues;  /* for stats */
+
 #define VQ_RING_DESC_CHAIN_END  32768
 #define VRING_DESC_F_NEXT       1
 #define VRING_DESC_F_WRITE      2
@@ -107,6 +118,17 @@ typedef struct virtqueue {
     queue service_queue;
     thunk service;
     queue sched_queue;
+    thunk poll;
+    boolean polling;            /* notifications suppressed, poll queued */
+    boolean poll_first;         /* next poll pass is the one the interrupt asked for */
+    struct list l;              /* virtqueues */
+    struct {
+        u64 interrupts;
+        u64 polls;
+        u64 polled;             /* completions reaped by poll passes */
+        u64 interrupts_saved;   /* poll passes that found completions arriving while suppressed */
+        u64 poll_fallbacks;     /* polls not queued because the cpu poll queue was full */
+    } stats;
     struct spinlock lock;
     vqmsg msgs[0];
 } *virtqueue;
@@ -158,20 +180,11 @@ void vqmsg_commit(virtqueue vq, vqmsg m, vqfinish completion)
     spin_unlock_irq(&vq->lock, irqflags);
 }
 
-closure_function(1, 0, void, vq_interrupt,
-                 virtqueue, vq)
+/* called with lock held; moves up to budget used messages onto q */
+static int virtqueue_reap_locked(virtqueue vq, int budget, list q)
 {
-    // ensure we see up-to-date used->idx (updated by host)
-    memory_barrier();
-    virtqueue vq = bound(vq);
-    virtqueue_debug_verbose("%s: ENTRY: vq %s: entries %d, last_used_idx %d, used->idx %d, desc_idx %d\n",
-        __func__, vq->name, vq->entries, vq->last_used_idx, vq->used->idx, vq->desc_idx);
-    
     int processed = 0;
-    struct list q;
-    list_init(&q);
-    spin_lock(&vq->lock);
-    while (vq->last_used_idx != vq->used->idx) {
+    while (processed < budget && vq->last_used_idx != vq->used->idx) {
         volatile struct vring_used_elem *uep = vq->used->ring + (vq->last_used_idx & (vq->entries - 1));
         virtqueue_debug_verbose("%s: vq %s: last_used_idx %d, id %d, len %d\n",
             __func__, vq->name, vq->last_used_idx, uep->id, uep->len);
@@ -195,21 +208,103 @@ closure_function(1, 0, void, vq_interrupt,
         m->len = uep->len;
         vq->msgs[head] = 0;
         virtqueue_debug("add msg %p\n", m);
-        list_insert_before(&q, &m->l);
+        list_insert_before(q, &m->l);
     }
+    return processed;
+}
+
+static void virtqueue_schedule_service(virtqueue vq, list q)
+{
+    /* a little trick ... collapse the list head for queueing */
+    list l = list_get_next(q);
+    assert(l);
+    list_delete(q);
+    assert(enqueue(vq->service_queue, l));
+    enqueue(vq->sched_queue, vq->service);
+}
+
+closure_function(1, 0, void, vq_interrupt,
+                 virtqueue, vq)
+{
+    // ensure we see up-to-date used->idx (updated by host)
+    memory_barrier();
+    virtqueue vq = bound(vq);
+    virtqueue_debug_verbose("%s: ENTRY: vq %s: entries %d, last_used_idx %d, used->idx %d, desc_idx %d\n",
+        __func__, vq->name, vq->entries, vq->last_used_idx, vq->used->idx, vq->desc_idx);
+    
+    int processed = 0;
+    struct list q;
+    list_init(&q);
+    spin_lock(&vq->lock);
+    vq->stats.interrupts++;
+    if (vq->polling) {
+        /* suppression is only a hint to the device; the poller will get it */
+        spin_unlock(&vq->lock);
+        return;
+    }
+    u16 pending = vq->used->idx - vq->last_used_idx;
+    if (vq_poll_budget > 0 && pending >= vq_poll_threshold) {
+        /* the poller can't run before we return, so queue it first */
+        if (enqueue_cpu_poll(current_cpu()->id, vq->poll)) {
+            virtqueue_debug("%s: vq %s: %d pending, polling\n", __func__, vq->name, pending);
+            vq->polling = true;
+            vq->poll_first = true;
+            vq->avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
+            spin_unlock(&vq->lock);
+            return;
+        }
+        vq->stats.poll_fallbacks++;
+    }
+    processed = virtqueue_reap_locked(vq, vq->entries, &q);
     virtqueue_fill(vq);
     virtqueue_debug("%s: EXIT: vq %s: processed %d, last_used_idx %d, desc_idx %d\n",
         __func__, vq->name, processed, vq->last_used_idx, vq->desc_idx);
     spin_unlock(&vq->lock);
 
-    if (processed > 0) {
-        /* a little trick ... collapse the list head for queueing */
-        list l = list_get_next(&q);
-        assert(l);
-        list_delete(&q);
-        assert(enqueue(vq->service_queue, l));
-        enqueue(vq->sched_queue, vq->service);
+    if (processed > 0)
+        virtqueue_schedule_service(vq, &q);
+}
+
+closure_function(1, 0, void, virtqueue_poll,
+                 virtqueue, vq)
+{
+    virtqueue vq = bound(vq);
+    struct list q;
+    list_init(&q);
+    memory_barrier();
+    u64 irqflags = spin_lock_irq(&vq->lock);
+    int processed = virtqueue_reap_locked(vq, vq_poll_budget, &q);
+    vq->stats.polls++;
+    vq->stats.polled += processed;
+    if (processed > 0 && !vq->poll_first)
+        vq->stats.interrupts_saved++;
+    vq->poll_first = false;
+    boolean more = processed == vq_poll_budget;
+    while (true) {
+        if (more) {
+            if (enqueue_cpu_poll(current_cpu()->id, vq->poll))
+                break;
+            /* no room to keep polling: drain here, back to interrupts */
+            vq->stats.poll_fallbacks++;
+            processed += virtqueue_reap_locked(vq, vq->entries, &q);
+        }
+        /* drained: re-arm notifications, then catch any completion that
+           slipped in before the device saw the flag change */
+        vq->avail->flags &= ~VRING_AVAIL_F_NO_INTERRUPT;
+        memory_barrier();
+        more = vq->last_used_idx != vq->used->idx;
+        if (!more) {
+            vq->polling = false;
+            break;
+        }
+        vq->avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
     }
+    virtqueue_fill(vq);
+    virtqueue_debug_verbose("%s: vq %s: processed %d, more %d\n", __func__, vq->name, processed, more);
+    spin_unlock_irq(&vq->lock, irqflags);
+
+    if (processed > 0)
+        virtqueue_schedule_service(vq, &q);
 }
 
 closure_function(1, 0, void, virtqueue_service_vqmsgs,
@@ -232,6 +327,18 @@ closure_function(1, 0, void, virtqueue_service_vqmsgs,
     virtqueue_debug("%s exit\n", __func__);
 }
 
+closure_function(0, 1, void, virtqueue_stats,
+                 buffer, b)
+{
+    list_foreach(&virtqueues, l) {
+        virtqueue vq = struct_from_list(l, virtqueue, l);
+        bprintf(b, "%s %d: interrupts %ld polls %ld polled %ld interrupts_saved %ld "
+                "poll_fallbacks %ld\n",
+                vq->name, vq->queue_index, vq->stats.interrupts, vq->stats.polls,
+                vq->stats.polled, vq->stats.interrupts_saved, vq->stats.poll_fallbacks);
+    }
+}
+
 status virtqueue_alloc(vtdev dev,
                        const char *name,
                        u16 queue_index,
@@ -265,6 +372,10 @@ status virtqueue_alloc(vtdev dev,
     assert(vq->service_queue != INVALID_ADDRESS);
     vq->service = closure(dev->general, virtqueue_service_vqmsgs, vq);
     vq->sched_queue = sched_queue;
+    vq->poll = closure(dev->general, virtqueue_poll, vq);
+    vq->polling = false;
+    vq->poll_first = false;
+    zero(&vq->stats, sizeof(vq->stats));
     spin_lock_init(&vq->lock);
 
     if ((vq->ring_mem = allocate_zero(&dev->contiguous->h, alloc)) == INVALID_ADDRESS) {
@@ -285,9 +396,34 @@ status virtqueue_alloc(vtdev dev,
 
     *t = closure(dev->general, vq_interrupt, vq);
     *vqp = vq;
+    if (!virtqueues.next) {
+        list_init(&virtqueues);
+        register_proc_stats(dev->general, sym(virtqueues),
+                            closure(dev->general, virtqueue_stats));
+    }
+    list_push_back(&virtqueues, &vq->l);
     return STATUS_OK;
 }
 
+void virtqueue_configure(tuple root)
+{
+    u64 v;
+    value budget = table_find(root, sym(virtio_poll_budget));
+    if (budget) {
+        if (u64_from_value(budget, &v) && v <= U16_MAX)
+            vq_poll_budget = v;
+        else
+            msg_err("invalid virtio_poll_budget; ignored\n");
+    }
+    value threshold = table_find(root, sym(virtio_poll_threshold));
+    if (threshold) {
+        if (u64_from_value(threshold, &v) && v <= U16_MAX)
+            vq_poll_threshold = v;
+        else
+            msg_err("invalid virtio_poll_threshold; ignored\n");
+    }
+}
+
 void virtqueue_set_max_queued(virtqueue vq, int max_queued)
 {
     vq->max_queued = max_queued;
@@ -70,6 +70,13 @@ void ioapic_set_int(unsigned int gsi, u64 v);
 boolean ioapic_int_is_free(unsigned int gsi);
 
 extern apic_iface apic_if;
+extern int apic_id_map[MAX_CPUS];
+
+/* APIC id of the given cpu, e.g. as an interrupt destination */
+static inline u32 apic_id_from_cpu(u64 cpu)
+{
+    return apic_id_map[cpu];
+}
 
 static inline u8 apic_id(void)
 {
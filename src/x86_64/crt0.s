@@ -46,27 +46,73 @@ extern  init_service
 %endmacro
 
 
-;; XXX - stick with fx until we can choose according to capabilities -
-;; otherwise existing stuff breaks with ops, etc.
+;; The extended state is saved with the instruction picked by
+;; init_extended_state(); rax and rdx are clobbered. XSAVEOPT and XSAVES
+;; skip components that are in their init state or, when saving to the
+;; area last restored from, have not been modified since.
+extern xsave_mode
+
 %macro load_extended_registers 1
-;        mov edx, 0xffffffff
-;        mov eax, edx
+        mov eax, [xsave_mode]
+        cmp eax, XSAVE_MODE_FXSAVE
+        je %%fx
+        cmp eax, XSAVE_MODE_XSAVES
+        mov eax, 0xffffffff
+        mov edx, eax
+        je %%xs
+        xrstor [%1+FRAME_EXTENDED_SAVE*8]
+        jmp %%done
+%%xs:
+        xrstors [%1+FRAME_EXTENDED_SAVE*8]
+        jmp %%done
+%%fx:
         fxrstor [%1+FRAME_EXTENDED_SAVE*8]
+%%done:
 %endmacro
-        
+
 %macro save_extended_registers 1
-;        mov edx, 0xffffffff
-;        mov eax, edx
-        fxsave [%1+FRAME_EXTENDED_SAVE*8]  ; we wouldn't have to do this if we could guarantee no other user thread ran before us
+        mov eax, [xsave_mode]
+        cmp eax, XSAVE_MODE_FXSAVE
+        je %%fx
+        cmp eax, XSAVE_MODE_XSAVE
+        je %%x
+        cmp eax, XSAVE_MODE_XSAVES
+        mov eax, 0xffffffff
+        mov edx, eax
+        je %%xs
+        xsaveopt [%1+FRAME_EXTENDED_SAVE*8]
+        jmp %%done
+%%xs:
+        xsaves [%1+FRAME_EXTENDED_SAVE*8]
+        jmp %%done
+%%x:
+        mov eax, 0xffffffff
+        mov edx, eax
+        xsave [%1+FRAME_EXTENDED_SAVE*8]
+        jmp %%done
+%%fx:
+        fxsave [%1+FRAME_EXTENDED_SAVE*8]
+%%done:
 %endmacro
 
-        
-      
-;;;  helper so userspace can save a frame without
-;;; 
-global xsave        
+;;; save the current extended state into a new frame; this must write
+;;; every component, so no modified-state optimization here
+global xsave
 xsave:
-        save_extended_registers rdi
+        mov eax, [xsave_mode]
+        cmp eax, XSAVE_MODE_FXSAVE
+        je .fx
+        cmp eax, XSAVE_MODE_XSAVES
+        mov eax, 0xffffffff
+        mov edx, eax
+        je .xc
+        xsave [rdi+FRAME_EXTENDED_SAVE*8]
+        ret
+.xc:
+        xsavec [rdi+FRAME_EXTENDED_SAVE*8]   ; same compacted format as xsaves
+        ret
+.fx:
+        fxsave [rdi+FRAME_EXTENDED_SAVE*8]
         ret
         
 ;; stack frame upon entry:
@@ -48,3 +48,8 @@
 #define FRAME_MAX 37
 #define FRAME_EXTENDED_SAVE 40
 
+#define XSAVE_MODE_FXSAVE   0
+#define XSAVE_MODE_XSAVE    1
+#define XSAVE_MODE_XSAVEOPT 2
+#define XSAVE_MODE_XSAVES   3
+
@@ -36,6 +36,7 @@
 #define GS_MSR           0xc0000101
 #define KERNEL_GS_MSR    0xc0000102
 #define TSC_AUX_MSR      0xc0000103
+#define XSS_MSR          0x00000da0
 
 #define C0_MP   0x00000002
 #define C0_EM   0x00000004
@@ -129,13 +130,12 @@ extern void write_xmsr(u64, u64);
     rv;\
 })
 
+extern u32 xsave_mode;
+extern u64 extended_frame_size;
+void init_extended_state(void);
+void extended_state_cpu_init(void);
+
 static inline u64 xsave_frame_size(void)
 {
-#if 0
-    u32 v[4];
-    cpuid(0xd, 0, v);
-    return v[1];
-#else
-    return 512;                 /* XXX fx only right now */
-#endif
+    return extended_frame_size;
 }
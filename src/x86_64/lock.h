@@ -64,14 +64,14 @@ static inline void spin_unlock(spinlock l)
     l->w = 0;
 }
 
+/* readers may nest, as they can on SMP */
 static inline void spin_rlock(rw_spinlock l) {
     assert(l->l.w == 0);
-    assert(l->readers == 0);
     l->readers++;
 }
 
 static inline void spin_runlock(rw_spinlock l) {
-    assert(l->readers == 1);
+    assert(l->readers > 0);
     assert(l->l.w == 0);
     l->readers--;
 }
@@ -5,7 +5,6 @@
 #include <page.h>
 
 static void *apboot = INVALID_ADDRESS;
-extern int apic_id_map[MAX_CPUS];
 extern u8 apinit, apinit_end;
 extern void *ap_pagetable, *ap_idt_pointer, *ap_stack;
 void *ap_stack;
@@ -60,6 +59,8 @@ static void __attribute__((noinline)) ap_new_stack()
 
 void ap_start()
 {
+    /* before anything might touch vector state */
+    extended_state_cpu_init();
     apic_per_cpu_init();
     int id = 0;
     for (int i = 0, aid = apic_id(); i < MAX_CPUS; i++) {
@@ -71,6 +72,37 @@ void ap_start()
     switch_stack(stack_from_kernel_context(cpuinfo_from_id(id)->kernel_context), ap_new_stack);
 }
 
+/* Group CPUs into SMT and package siblings by their APIC IDs, using the shift
+   widths from the extended topology leaf. Without that leaf, all CPUs are
+   treated as sharing one package. */
+void init_cpu_topology(void)
+{
+    u32 v[4];
+    u32 smt_shift = 0, pkg_shift = 32;
+    cpuid(0, 0, v);
+    if (v[0] >= 0xb) {
+        cpuid(0xb, 0, v);
+        if (v[1] != 0) {
+            smt_shift = v[0] & 0x1f;
+            cpuid(0xb, 1, v);
+            if (v[1] != 0)
+                pkg_shift = v[0] & 0x1f;
+        }
+    }
+    for (int i = 0; i < total_processors; i++) {
+        cpuinfo ci = cpuinfo_from_id(i);
+        u64 id = apic_id_map[i];
+        ci->smt_siblings = ci->pkg_siblings = 0;
+        for (int j = 0; j < total_processors; j++) {
+            u64 other = apic_id_map[j];
+            if ((id >> smt_shift) == (other >> smt_shift))
+                ci->smt_siblings |= U64_FROM_BIT(j);
+            if (pkg_shift >= 32 || (id >> pkg_shift) == (other >> pkg_shift))
+                ci->pkg_siblings |= U64_FROM_BIT(j);
+        }
+    }
+}
+
 void start_cpu(heap h, heap stackheap, int index, void (*ap_entry)()) {
     if (apboot == INVALID_ADDRESS) {
         start_callback = ap_entry;
@@ -622,6 +622,101 @@ void unmap_and_free_phys(u64 virtual, u64 length)
     unmap_pages_with_handler(virtual, length, stack_closure(dealloc_phys_page));
 }
 
+/* pt_lock should already be held here */
+static u64 *pde_lookup(u64 v, boolean alloc)
+{
+    u64 table = pagebase;
+    for (int level = 1; level < 3; level++) {
+        u64 *e = pte_lookup_ptr(table, v, level_shift[level]);
+        if (!pt_entry_is_present(*e)) {
+            if (!alloc)
+                return 0;
+            u64 *n = allocate_zero(pageheap, PAGESIZE);
+            if (n == INVALID_ADDRESS)
+                return 0;
+            *e = pteaddr_from_pointer(n) | PAGE_WRITABLE | PAGE_USER | PAGE_PRESENT;
+        }
+        table = page_from_pte(*e);
+    }
+    return pte_lookup_ptr(table, v, level_shift[3]);
+}
+
+/* Install a single 2M mapping at v, but only if nothing at all is mapped
+   within [v, v + 2M). A directory of 4K ptes left empty by earlier unmaps
+   is replaced (and leaked, as with other directory pages). Returns false
+   if the range is already populated or no directory memory is available;
+   callers are expected to fall back to 4K pages. */
+boolean map_2m_page(u64 v, physical p, u64 flags)
+{
+    assert(!(v & PAGEMASK_2M));
+    assert(!(p & PAGEMASK_2M));
+    page_debug("v 0x%lx, p 0x%lx, flags 0x%lx\n", v, p, flags);
+    boolean mapped = false;
+    boolean invalidate = false;
+    pagetable_lock();
+    u64 *pde = pde_lookup(v & MASK(VIRTUAL_ADDRESS_BITS), true);
+    if (!pde)
+        goto out;
+    u64 e = *pde;
+    if (pt_entry_is_present(e)) {
+        if (pt_entry_is_fat(3, e))
+            goto out;
+        u64 *ptes = pointer_from_pteaddr(page_from_pte(e));
+        for (int i = 0; i < PTE_ENTRIES; i++)
+            if (pt_entry_is_present(ptes[i]))
+                goto out;
+        invalidate = true;
+    }
+    *pde = p | (flags & ~PAGE_NO_FAT) | PAGE_2M_SIZE | PAGE_PRESENT;
+    mapped = true;
+  out:
+    pagetable_unlock();
+    if (invalidate) {
+        /* drop any cached walks through the old directory */
+        flush_entry fe = get_page_flush_entry();
+        page_invalidate(fe, v);
+        page_invalidate_sync(fe, ignore);
+    }
+    return mapped;
+}
+
+/* called with lock held */
+closure_function(1, 3, boolean, split_2m_entry,
+                 flush_entry, fe,
+                 int, level, u64, addr, u64 *, entry)
+{
+    u64 e = *entry;
+    if (!pt_entry_is_present(e) || !pt_entry_is_fat(level, e))
+        return true;
+    u64 *n = allocate(pageheap, PAGESIZE);
+    if (n == INVALID_ADDRESS)
+        return false;
+
+    /* same frames and protections, minus the size bit (PAT for a 4K pte) */
+    u64 p = page_from_pte(e) & ~PAGEMASK_2M;
+    u64 flags = flags_from_pte(e) & ~PAGE_2M_SIZE;
+    for (int i = 0; i < PTE_ENTRIES; i++)
+        n[i] = (p + (i << PAGELOG)) | flags;
+#ifdef PAGE_UPDATE_DEBUG
+    page_debug("addr 0x%lx, entry 0x%lx -> table %p\n", addr, e, n);
+#endif
+    *entry = pteaddr_from_pointer(n) | PAGE_WRITABLE | PAGE_USER | PAGE_PRESENT;
+    page_invalidate(bound(fe), addr);
+    return true;
+}
+
+/* Break any 2M mappings intersecting [vaddr, vaddr + length) into 4K
+   ptes, preserving the frames and protections, so that parts of them
+   may be unmapped or reprotected individually. */
+void split_2m_pages(u64 vaddr, u64 length)
+{
+    page_debug("vaddr 0x%lx, length 0x%lx\n", vaddr, length);
+    flush_entry fe = get_page_flush_entry();
+    if (!traverse_ptes(vaddr, length, stack_closure(split_2m_entry, fe)))
+        halt("%s: ran out of page table memory\n", __func__);
+    page_invalidate_sync(fe, ignore);
+}
+
 /* pt_lock should already be held here */
 static u64 pt_2m_alloc(heap h, bytes size)
 {
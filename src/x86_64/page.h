@@ -78,6 +78,8 @@ void *bootstrap_page_tables(heap initial);
 #ifdef STAGE3
 void map_setup_2mbpages(u64 v, physical p, int pages, u64 flags,
                         u64 *pdpt, u64 *pdt);
+boolean map_2m_page(u64 v, physical p, u64 flags);
+void split_2m_pages(u64 vaddr, u64 length);
 void init_page_tables(heap h, id_heap physical, range initial_map);
 #else
 void init_page_tables(heap initial);
@@ -0,0 +1,85 @@
+#include <kernel.h>
+
+/* Extended (FPU/vector) state management
+
+   The extended state of a context is saved into its frame on every kernel
+   entry and restored on return. Rather than trapping the first FPU use
+   after a switch (CR0.TS), which leaks state across contexts on affected
+   CPUs, we rely on the processor's own state tracking: XSAVEOPT and XSAVES
+   skip components that are in their initial configuration (XINUSE clear)
+   and, when saving to the area last restored from, components that have
+   not been modified since. A thread that never touches AVX or AVX-512
+   state therefore pays only for the x87/SSE state it actually uses, and
+   a syscall that returns to the same thread writes back little or
+   nothing.
+
+   XSAVES additionally uses the compacted format, which leaves out the
+   holes for components that are not enabled. */
+
+#define XFEATURE_X87        U64_FROM_BIT(0)
+#define XFEATURE_SSE        U64_FROM_BIT(1)
+#define XFEATURE_AVX        U64_FROM_BIT(2)
+#define XFEATURE_OPMASK     U64_FROM_BIT(5)
+#define XFEATURE_ZMM_HI256  U64_FROM_BIT(6)
+#define XFEATURE_HI16_ZMM   U64_FROM_BIT(7)
+
+/* user state components we are prepared to context switch */
+#define XFEATURES_USER      (XFEATURE_X87 | XFEATURE_SSE | XFEATURE_AVX | \
+                             XFEATURE_OPMASK | XFEATURE_ZMM_HI256 | XFEATURE_HI16_ZMM)
+#define XFEATURES_AVX512    (XFEATURE_OPMASK | XFEATURE_ZMM_HI256 | XFEATURE_HI16_ZMM)
+
+#define CPUID_1_ECX_XSAVE   U64_FROM_BIT(26)
+#define CPUID_D_1_EAX_XSAVEOPT  U64_FROM_BIT(0)
+#define CPUID_D_1_EAX_XSAVEC    U64_FROM_BIT(1)
+#define CPUID_D_1_EAX_XSAVES    U64_FROM_BIT(3)
+
+#define FXSAVE_AREA_SIZE    512
+
+/* an XSAVE_MODE_* value (frame.h); read from crt0.s on every kernel entry
+   and exit */
+u32 xsave_mode = XSAVE_MODE_FXSAVE;
+u64 extended_frame_size = FXSAVE_AREA_SIZE;
+static u64 xfeatures;
+
+/* Enable XSAVE and the selected state components on the calling cpu; must
+   run on each cpu before it saves or restores a frame. */
+void extended_state_cpu_init(void)
+{
+    if (xsave_mode == XSAVE_MODE_FXSAVE)
+        return;
+    u64 cr;
+    mov_from_cr("cr4", cr);
+    cr |= CR4_OSXSAVE;
+    mov_to_cr("cr4", cr);
+    write_xmsr(0, xfeatures);
+    if (xsave_mode == XSAVE_MODE_XSAVES)
+        write_msr(XSS_MSR, 0);  /* no supervisor state */
+}
+
+/* Pick the save instruction and size the frame save area. Called on the
+   boot cpu before any frame is allocated. */
+void init_extended_state(void)
+{
+    u32 v[4];
+    cpuid(0x1, 0, v);
+    if (!(v[2] & CPUID_1_ECX_XSAVE))
+        return;
+    cpuid(0xd, 0, v);
+    xfeatures = (v[0] | ((u64)v[3] << 32)) & XFEATURES_USER;
+    /* AVX-512 state can only be enabled as a whole */
+    if ((xfeatures & XFEATURES_AVX512) != XFEATURES_AVX512)
+        xfeatures &= ~XFEATURES_AVX512;
+    cpuid(0xd, 1, v);
+    if ((v[0] & (CPUID_D_1_EAX_XSAVES | CPUID_D_1_EAX_XSAVEC)) ==
+        (CPUID_D_1_EAX_XSAVES | CPUID_D_1_EAX_XSAVEC))
+        xsave_mode = XSAVE_MODE_XSAVES;
+    else if (v[0] & CPUID_D_1_EAX_XSAVEOPT)
+        xsave_mode = XSAVE_MODE_XSAVEOPT;
+    else
+        xsave_mode = XSAVE_MODE_XSAVE;
+    extended_state_cpu_init();
+
+    /* sizes reflect the components now enabled in XCR0 (and XSS) */
+    cpuid(0xd, xsave_mode == XSAVE_MODE_XSAVES ? 1 : 0, v);
+    extended_frame_size = pad(v[1], 64);
+}
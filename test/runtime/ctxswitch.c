@@ -0,0 +1,133 @@
+/* Context switch cost benchmark
+
+   Measures the round trip of a trivial syscall and the cost of a switch
+   between two threads handing a futex back and forth, first with the
+   vector state in its initial configuration and then with AVX (and
+   AVX-512, where present) state live, so that the cost of saving and
+   restoring extended state on kernel entry and exit can be compared. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define DEFAULT_ITERATIONS  100000
+
+enum vstate {
+    VSTATE_INIT,
+    VSTATE_AVX,
+    VSTATE_AVX512,
+};
+
+static const char *vstate_names[] = { "init", "avx", "avx512" };
+
+static long iterations = DEFAULT_ITERATIONS;
+static enum vstate pingpong_vstate;
+static volatile int pingpong_word;
+
+/* Leave upper vector state live so that it must be preserved across
+   kernel entries. */
+static inline void dirty_vector_state(enum vstate v)
+{
+    switch (v) {
+    case VSTATE_AVX512:
+        asm volatile("vpternlogd $0xff, %%zmm16, %%zmm16, %%zmm16" ::: "memory");
+        /* fall through */
+    case VSTATE_AVX:
+        asm volatile("vpcmpeqd %%ymm8, %%ymm8, %%ymm8" ::: "xmm8");
+        break;
+    default:
+        break;
+    }
+}
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void bench_syscall(enum vstate v)
+{
+    unsigned long long start = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        dirty_vector_state(v);
+        syscall(SYS_getppid);
+    }
+    unsigned long long elapsed = now_ns() - start;
+    printf("syscall round trip (%s state): %llu ns\n", vstate_names[v],
+           elapsed / iterations);
+}
+
+static void futex_wait(volatile int *uaddr, int val)
+{
+    while (*uaddr == val)
+        syscall(SYS_futex, uaddr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_set_and_wake(volatile int *uaddr, int val)
+{
+    *uaddr = val;
+    syscall(SYS_futex, uaddr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static void *pingpong_thread(void *arg)
+{
+    for (long i = 0; i < iterations; i++) {
+        futex_wait(&pingpong_word, 0);
+        dirty_vector_state(pingpong_vstate);
+        futex_set_and_wake(&pingpong_word, 0);
+    }
+    return NULL;
+}
+
+static void bench_pingpong(enum vstate v)
+{
+    pthread_t pt;
+
+    pingpong_vstate = v;
+    pingpong_word = 0;
+    if (pthread_create(&pt, NULL, pingpong_thread, NULL)) {
+        printf("pthread_create failed\n");
+        exit(EXIT_FAILURE);
+    }
+    unsigned long long start = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        dirty_vector_state(v);
+        futex_set_and_wake(&pingpong_word, 1);
+        futex_wait(&pingpong_word, 1);
+    }
+    unsigned long long elapsed = now_ns() - start;
+    pthread_join(pt, NULL);
+    /* two switches per round trip */
+    printf("thread switch via futex (%s state): %llu ns\n", vstate_names[v],
+           elapsed / (2 * iterations));
+}
+
+int main(int argc, char **argv)
+{
+    enum vstate max = VSTATE_INIT;
+
+    if (argc > 1)
+        iterations = atol(argv[1]);
+    if (iterations <= 0) {
+        printf("usage: %s [iterations]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx"))
+        max = VSTATE_AVX;
+    if (__builtin_cpu_supports("avx512f"))
+        max = VSTATE_AVX512;
+
+    for (enum vstate v = VSTATE_INIT; v <= max; v++) {
+        bench_syscall(v);
+        bench_pingpong(v);
+    }
+    exit(EXIT_SUCCESS);
+}
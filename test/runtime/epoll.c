@@ -3,6 +3,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <errno.h>
 
@@ -67,9 +68,140 @@ void test_ctl()
     exit(EXIT_FAILURE);
 }
 
+static void test_assert_events(int efd, int expected, const char *what)
+{
+    struct epoll_event events[2];
+    int n = epoll_wait(efd, events, 2, 0);
+
+    if (n != expected) {
+        printf("%s: expected %d events, got %d\n", what, expected, n);
+        printf("test failed\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Covers reporting of level-triggered, edge-triggered and oneshot events */
+void test_ready()
+{
+    struct epoll_event event;
+    uint64_t val = 1;
+    int efd = epoll_create1(0);
+    int lt = eventfd(0, EFD_NONBLOCK);
+    int et = eventfd(0, EFD_NONBLOCK);
+    int os = eventfd(0, EFD_NONBLOCK);
+
+    if (efd < 0 || lt < 0 || et < 0 || os < 0) {
+        printf("Cannot create descriptors\n");
+        goto fail;
+    }
+    event.events = EPOLLIN;
+    event.data.fd = lt;
+    if (epoll_ctl(efd, EPOLL_CTL_ADD, lt, &event))
+        goto fail;
+    event.events = EPOLLIN | EPOLLET;
+    event.data.fd = et;
+    if (epoll_ctl(efd, EPOLL_CTL_ADD, et, &event))
+        goto fail;
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.fd = os;
+    if (epoll_ctl(efd, EPOLL_CTL_ADD, os, &event))
+        goto fail;
+    test_assert_events(efd, 0, "idle");
+
+    if (write(lt, &val, sizeof(val)) != sizeof(val) ||
+        write(et, &val, sizeof(val)) != sizeof(val) ||
+        write(os, &val, sizeof(val)) != sizeof(val))
+        goto fail;
+    test_assert_events(efd, 2, "first wait, truncated");
+    test_assert_events(efd, 2, "second wait");
+
+    /* only the level-triggered fd remains ready */
+    test_assert_events(efd, 1, "third wait");
+    if (read(lt, &val, sizeof(val)) != sizeof(val))
+        goto fail;
+    test_assert_events(efd, 0, "drained");
+
+    /* a new edge after draining is reported again */
+    if (read(et, &val, sizeof(val)) != sizeof(val) ||
+        write(et, &val, sizeof(val)) != sizeof(val))
+        goto fail;
+    test_assert_events(efd, 1, "new edge");
+    test_assert_events(efd, 0, "edge consumed");
+
+    /* oneshot stays masked until rearmed */
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.fd = os;
+    if (epoll_ctl(efd, EPOLL_CTL_MOD, os, &event))
+        goto fail;
+    test_assert_events(efd, 1, "rearmed");
+    test_assert_events(efd, 0, "oneshot consumed");
+
+    close(lt);
+    close(et);
+    close(os);
+    close(efd);
+    return;
+  fail:
+    printf("test failed\n");
+    exit(EXIT_FAILURE);
+}
+
+/* Covers EPOLLEXCLUSIVE: one of the exclusive waiters is woken per event */
+void test_exclusive()
+{
+    struct epoll_event event;
+    uint64_t val = 1;
+    int efd[2];
+    int fd = eventfd(0, EFD_NONBLOCK);
+
+    if (fd < 0) {
+        printf("Cannot create eventfd\n");
+        goto fail;
+    }
+    for (int i = 0; i < 2; i++) {
+        efd[i] = epoll_create1(0);
+        if (efd[i] < 0)
+            goto fail;
+    }
+
+    event.data.fd = fd;
+    event.events = EPOLLIN | EPOLLONESHOT | EPOLLEXCLUSIVE;
+    if ((epoll_ctl(efd[0], EPOLL_CTL_ADD, fd, &event) != -1) || (errno != EINVAL)) {
+        printf("EPOLLEXCLUSIVE must not be combined with EPOLLONESHOT\n");
+        goto fail;
+    }
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    for (int i = 0; i < 2; i++) {
+        if (epoll_ctl(efd[i], EPOLL_CTL_ADD, fd, &event)) {
+            printf("Cannot add exclusive descriptor to epoll\n");
+            goto fail;
+        }
+    }
+    if ((epoll_ctl(efd[0], EPOLL_CTL_MOD, fd, &event) != -1) || (errno != EINVAL)) {
+        printf("EPOLL_CTL_MOD of an exclusive descriptor must fail\n");
+        goto fail;
+    }
+
+    /* without blocked waiters, both instances see the event */
+    if (write(fd, &val, sizeof(val)) != sizeof(val))
+        goto fail;
+    test_assert_events(efd[0], 1, "first exclusive");
+    test_assert_events(efd[1], 1, "second exclusive");
+
+    close(fd);
+    close(efd[0]);
+    close(efd[1]);
+    return;
+  fail:
+    printf("test failed\n");
+    exit(EXIT_FAILURE);
+}
+
 int main(int argc, char **argv)
 {
     test_ctl();
+    test_ready();
+    test_exclusive();
 
     printf("test passed\n");
     return EXIT_SUCCESS;
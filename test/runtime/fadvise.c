@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -5,7 +6,7 @@
 #include <unistd.h>
 #include <errno.h>
 
-/* fadvise stub test for parameters only */
+/* fadvise and readahead tests for parameters only */
 
 void test_fadvise(int fd, int64_t off, uint64_t len, int adv, int exp, char *name)
 {
@@ -19,6 +20,16 @@ void test_fadvise(int fd, int64_t off, uint64_t len, int adv, int exp, char *nam
     }
 }
 
+void test_readahead(int fd, off64_t off, size_t len, int exp, char *name)
+{
+    int r = readahead(fd, off, len) == 0 ? 0 : errno;
+    if (r != exp) {
+        fprintf(stderr, "readahead test '%s' did not get expected result: %d != %d\n",
+            name, r, exp);
+        exit(EXIT_FAILURE);
+    }
+}
+
 int main(int argc, char **argv)
 {
     int fd = open("test_fadvise", O_CREAT|O_RDWR, 0644);
@@ -33,8 +44,20 @@ int main(int argc, char **argv)
     test_fadvise(fd, 0, 128, POSIX_FADV_DONTNEED, 0, "set dontneed");
     test_fadvise(fd, 0, 128, POSIX_FADV_NORMAL, 0, "set normal");
     test_fadvise(fd, 0, 128, 9999, EINVAL, "use bad advice");
+    test_readahead(fd, 0, 128, 0, "readahead");
+    test_readahead(fd, 0, 1ull << 30, 0, "readahead past end of file");
     close(fd);
     test_fadvise(fd, 0, 128, 9999, EBADF, "use bad fd");
+    test_readahead(fd, 0, 128, EBADF, "readahead bad fd");
+
+    int pfds[2];
+    if (pipe(pfds) < 0) {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+    test_readahead(pfds[0], 0, 128, EINVAL, "readahead on pipe");
+    close(pfds[0]);
+    close(pfds[1]);
     printf("fadvise test passed\n");
     exit(EXIT_SUCCESS);
 }
@@ -23,6 +23,7 @@ int wake_test_futex = FUTEX_INITIALIZER;
 int empty_futex = FUTEX_INITIALIZER;
 int wait_test_futex = FUTEX_INITIALIZER;
 int wait_bitset_test_futex = FUTEX_INITIALIZER;
+int wake_bitset_test_futex = FUTEX_INITIALIZER;
 int cmp_requeue_test_futex_1 = FUTEX_INITIALIZER;
 int cmp_requeue_test_futex_2 = FUTEX_INITIALIZER;
 int wake_op_test_futex_1 = FUTEX_INITIALIZER;
@@ -32,6 +33,7 @@ int wake_op_test_futex_2 = FUTEX_INITIALIZER;
 static void *futex_wake_test_thread(void *arg);
 static void *futex_cmp_requeue_test_thread(void *arg);
 static void *futex_wake_op_test_thread(void *arg);
+static void *futex_wake_bitset_test_thread(void *arg);
 
 /* FUTEX_WAKE test: Creates num_to_wake threads which wait
 on uaddr and then wakes up all the threads */
@@ -166,6 +168,61 @@ static boolean futex_wait_bitset_test_2()
     return false;
 }
 
+/* FUTEX_WAKE_BITSET test: Creates two groups of threads waiting on
+the same futex with disjoint bitsets, and checks that a wake with one
+group's bitset leaves the other group waiting */
+static boolean futex_wake_bitset_test()
+{
+    int *uaddr = (int*)(&wake_bitset_test_futex);
+    int num_threads = 10;
+    pthread_t threads[2 * num_threads];
+
+    if (syscall(SYS_futex, uaddr, FUTEX_WAIT_BITSET, FUTEX_INITIALIZER, 0, NULL, 0) != -1 ||
+        errno != EINVAL) {
+        printf("wake_bitset test: zero wait bitset not rejected\n");
+        return false;
+    }
+    if (syscall(SYS_futex, uaddr, FUTEX_WAKE_BITSET, 1, 0, NULL, 0) != -1 ||
+        errno != EINVAL) {
+        printf("wake_bitset test: zero wake bitset not rejected\n");
+        return false;
+    }
+
+    for (long index = 0; index < 2 * num_threads; index++) {
+        if (pthread_create(&(threads[index]), NULL, futex_wake_bitset_test_thread,
+                           (void *)(1l << (index % 2)))) {
+            printf("Unable to create thread.\n");
+            return false;
+        }
+    }
+
+    sleep(1); /* for main thread */
+    int woken_1 = syscall(SYS_futex, uaddr, FUTEX_WAKE_BITSET, INT_MAX, 0, NULL, 0x1);
+    int woken_2 = syscall(SYS_futex, uaddr, FUTEX_WAKE_BITSET, INT_MAX, 0, NULL, 0x2);
+
+    for (int i = 0; i < 2 * num_threads; i++) {
+        if (pthread_join(threads[i], NULL) != 0) {
+            printf("Unable to join thread.\n");
+            return false;
+        }
+    }
+    if (woken_1 != num_threads || woken_2 != num_threads) {
+        printf("wake_bitset test: woke %d and %d threads, expected %d\n",
+               woken_1, woken_2, num_threads);
+        return false;
+    }
+    printf("wake_bitset test: passed\n");
+    return true;
+}
+
+static void *futex_wake_bitset_test_thread(void *arg)
+{
+    int bitset = (long)arg;
+    syscall(SYS_futex, &wake_bitset_test_futex, FUTEX_WAIT_BITSET, FUTEX_INITIALIZER,
+            0, NULL, bitset);
+    return NULL;
+}
+
 /* FUTEX_CMP_REQUEUE test 1: Check for error -1 because
 the value at uaddr does not match val3 */
 static boolean futex_cmp_requeue_test_1() 
@@ -376,6 +433,10 @@ boolean basic_test()
     if (!futex_wait_bitset_test_2())
         num_failed++;
 
+    printf("---FUTEX_WAKE_BITSET TESTS--- \n");
+    if (!futex_wake_bitset_test())
+        num_failed++;
+
     /* Cmp_Requeue Tests */
     printf("---FUTEX_CMP_REQUEUE TESTS--- \n");
     if (!futex_cmp_requeue_test_1())
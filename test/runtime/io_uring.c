@@ -1,5 +1,6 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <netinet/in.h>
 #include <poll.h>
 #include <signal.h>
 #include <stdbool.h>
@@ -9,6 +10,7 @@
 #include <string.h>
 #include <sys/eventfd.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/syscall.h>
 #include <sys/uio.h>
 #include <time.h>
@@ -26,8 +28,12 @@
 #define SYS_io_uring_register   427
 #endif
 
+#define IORING_SETUP_SQPOLL     (1 << 1)
+#define IORING_SETUP_SQ_AFF     (1 << 2)
 #define IORING_SETUP_CQSIZE     (1 << 3)
 
+#define IORING_SQ_NEED_WAKEUP   (1 << 0)
+
 #define IO_URING_OP_SUPPORTED   (1 << 0)
 
 #define IORING_OFF_SQ_RING  0ULL
@@ -149,6 +155,10 @@ enum {
     IORING_OP_STATX,
     IORING_OP_READ,
     IORING_OP_WRITE,
+    IORING_OP_FADVISE,
+    IORING_OP_MADVISE,
+    IORING_OP_SEND,
+    IORING_OP_RECV,
 };
 
 #define IORING_FEAT_SINGLE_MMAP (1 << 0)
@@ -158,6 +168,7 @@ enum {
 #define IORING_TIMEOUT_ABS  (1 << 0)
 
 #define IORING_ENTER_GETEVENTS  (1 << 0)
+#define IORING_ENTER_SQ_WAKEUP  (1 << 1)
 
 #define IORING_REGISTER_BUFFERS         0
 #define IORING_UNREGISTER_BUFFERS       1
@@ -228,7 +239,11 @@ static int iour_init(struct iour *iour, unsigned int entries)
     test_assert(iour->params.sq_entries >= entries);
     test_assert(*iour->sq_head == 0 && *iour->sq_tail == 0);
     test_assert(iour->sq_mask == iour->params.sq_entries - 1);
-    test_assert(*(uint32_t *)(iour->rings + iour->params.sq_off.flags) == 0);
+    if (iour->params.flags & IORING_SETUP_SQPOLL)
+        test_assert((*(uint32_t *)(iour->rings + iour->params.sq_off.flags) &
+                     ~IORING_SQ_NEED_WAKEUP) == 0);
+    else
+        test_assert(*(uint32_t *)(iour->rings + iour->params.sq_off.flags) == 0);
     test_assert(*(uint32_t *)(iour->rings + iour->params.sq_off.dropped) == 0);
     test_assert(iour->params.cq_entries >= entries);
     test_assert(*iour->cq_head == 0 && *iour->cq_tail == 0);
@@ -394,6 +409,25 @@ static void iour_setup_write(struct iour *iour, int fd, uint8_t *buf,
         user_data);
 }
 
+static void iour_setup_sock(struct iour *iour, uint8_t opcode, int fd,
+                            void *addr, uint32_t len, uint64_t offset,
+                            uint32_t msg_flags, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = iour_get_sqe(iour);
+
+    test_assert(sqe);
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)addr;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->msg_flags = msg_flags;
+    sqe->user_data = user_data;
+    write_barrier();
+    (*iour->sq_tail)++;
+}
+
 static int iour_submit(struct iour *iour, unsigned int count,
                        unsigned int min_complete)
 {
@@ -426,7 +460,7 @@ static void iour_test_basic(void)
     struct io_uring_params params;
     int fd;
     struct io_uring_probe *probe;
-    const int probe_ops = IORING_OP_WRITE + 1;
+    const int probe_ops = IORING_OP_RECV + 1;
     void *ptr;
     struct timespec ts;
     struct io_uring_cqe *cqe;
@@ -484,6 +518,12 @@ static void iour_test_basic(void)
         case IORING_OP_FILES_UPDATE:
         case IORING_OP_READ:
         case IORING_OP_WRITE:
+        case IORING_OP_ACCEPT:
+        case IORING_OP_CONNECT:
+        case IORING_OP_SEND:
+        case IORING_OP_RECV:
+        case IORING_OP_SENDMSG:
+        case IORING_OP_RECVMSG:
             test_assert(probe->ops[i].flags & IO_URING_OP_SUPPORTED);
             break;
         default:
@@ -1202,6 +1242,193 @@ static void iour_test_register_files(void)
     test_assert(iour_exit(&iour) == 0);
 }
 
+/* Wait for two completions, which may arrive in any order, and return their
+ * results indexed by user data (0 or 1). */
+static void iour_wait_pair(struct iour *iour, int res[2])
+{
+    struct io_uring_cqe *cqe;
+
+    res[0] = res[1] = 0x7fffffff;
+    test_assert(iour_submit(iour, 0, 2) == 0);
+    for (int i = 0; i < 2; i++) {
+        cqe = iour_get_cqe(iour);
+        test_assert(cqe && (cqe->user_data < 2));
+        res[cqe->user_data] = cqe->res;
+    }
+}
+
+/* More SQ pollers on one CPU than its poll queue holds */
+#define SQPOLL_RINGS    80
+
+static void iour_test_sqpoll(void)
+{
+    struct iour *rings = calloc(SQPOLL_RINGS, sizeof(struct iour));
+    struct io_uring_cqe *cqe;
+    unsigned int flags;
+
+    test_assert(rings);
+    for (int i = 0; i < SQPOLL_RINGS; i++) {
+        rings[i].params.flags = IORING_SETUP_SQPOLL | IORING_SETUP_SQ_AFF;
+        rings[i].params.sq_thread_cpu = 0;
+        rings[i].params.sq_thread_idle = 10000;
+        test_assert(iour_init(&rings[i], 1) == 0);
+    }
+
+    /* Each request goes through, either picked up by the poller or, for rings
+     * whose poller could not be queued, submitted by io_uring_enter(). */
+    for (int i = 0; i < SQPOLL_RINGS; i++) {
+        iour_setup_nop(&rings[i], i);
+        __sync_synchronize();
+        flags = IORING_ENTER_GETEVENTS;
+        if (*(uint32_t *)(rings[i].rings + rings[i].params.sq_off.flags) &
+                IORING_SQ_NEED_WAKEUP)
+            flags |= IORING_ENTER_SQ_WAKEUP;
+        test_assert(syscall(SYS_io_uring_enter, rings[i].fd, 1, 1, flags,
+                            NULL) == 1);
+        cqe = iour_get_cqe(&rings[i]);
+        test_assert(cqe && (cqe->user_data == i) && (cqe->res == 0));
+    }
+
+    for (int i = 0; i < SQPOLL_RINGS; i++)
+        test_assert(iour_exit(&rings[i]) == 0);
+    free(rings);
+}
+
+static void iour_test_sock(void)
+{
+    const int port = 1239;
+    struct iour iour;
+    struct io_uring_cqe *cqe;
+    struct sockaddr_in addr, peer_addr;
+    socklen_t addrlen = sizeof(peer_addr);
+    int lfd, cfd, afd, pipefd[2];
+    int res[2];
+    char send_buf[] = "io_uring socket test";
+    char recv_buf[64];
+    struct iovec iov[2];
+    struct msghdr msg;
+
+    memset(&iour.params, 0, sizeof(iour.params));
+    test_assert(iour_init(&iour, 2) == 0);
+
+    lfd = socket(AF_INET, SOCK_STREAM, 0);
+    test_assert(lfd > 0);
+    cfd = socket(AF_INET, SOCK_STREAM, 0);
+    test_assert(cfd > 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    test_assert(bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+
+    /* accept on a socket that is not listening */
+    iour_setup_sock(&iour, IORING_OP_ACCEPT, lfd, NULL, 0, 0, 0, 0);
+    test_assert(iour_submit(&iour, 1, 1) == 1);
+    cqe = iour_get_cqe(&iour);
+    test_assert(cqe && (cqe->user_data == 0) && (cqe->res == -EINVAL));
+
+    test_assert(listen(lfd, 1) == 0);
+
+    /* invalid address buffer */
+    iour_setup_sock(&iour, IORING_OP_CONNECT, cfd, NULL, 0, sizeof(addr), 0, 0);
+    test_assert(iour_submit(&iour, 1, 1) == 1);
+    cqe = iour_get_cqe(&iour);
+    test_assert(cqe && (cqe->user_data == 0) && (cqe->res == -EFAULT));
+
+    /* accept completes after connect, both asynchronously */
+    iour_setup_sock(&iour, IORING_OP_ACCEPT, lfd, &peer_addr,
+        0, (uint64_t)&addrlen, 0, 0);
+    test_assert(iour_submit(&iour, 1, 0) == 1);
+    iour_setup_sock(&iour, IORING_OP_CONNECT, cfd, &addr, 0, sizeof(addr), 0, 1);
+    test_assert(iour_submit(&iour, 1, 0) == 1);
+    iour_wait_pair(&iour, res);
+    afd = res[0];
+    test_assert((afd > 0) && (res[1] == 0));
+    test_assert((addrlen == sizeof(peer_addr)) &&
+        (peer_addr.sin_family == AF_INET) &&
+        (peer_addr.sin_addr.s_addr == htonl(INADDR_LOOPBACK)));
+
+    /* already connected */
+    iour_setup_sock(&iour, IORING_OP_CONNECT, cfd, &addr, 0, sizeof(addr), 0, 0);
+    test_assert(iour_submit(&iour, 1, 1) == 1);
+    cqe = iour_get_cqe(&iour);
+    test_assert(cqe && (cqe->user_data == 0) && (cqe->res == -EISCONN));
+
+    /* recv waits for the data from send */
+    memset(recv_buf, 0, sizeof(recv_buf));
+    iour_setup_sock(&iour, IORING_OP_RECV, afd, recv_buf, sizeof(recv_buf), 0,
+        0, 1);
+    test_assert(iour_submit(&iour, 1, 0) == 1);
+    iour_setup_sock(&iour, IORING_OP_SEND, cfd, send_buf, sizeof(send_buf), 0,
+        0, 0);
+    test_assert(iour_submit(&iour, 1, 0) == 1);
+    iour_wait_pair(&iour, res);
+    test_assert((res[0] == sizeof(send_buf)) && (res[1] == sizeof(send_buf)));
+    test_assert(!memcmp(recv_buf, send_buf, sizeof(send_buf)));
+
+    /* sendmsg with two iovecs, recvmsg into one */
+    iov[0].iov_base = send_buf;
+    iov[0].iov_len = 8;
+    iov[1].iov_base = send_buf + 8;
+    iov[1].iov_len = sizeof(send_buf) - 8;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    iour_setup_sock(&iour, IORING_OP_SENDMSG, afd, &msg, 0, 0, 0, 0);
+    test_assert(iour_submit(&iour, 1, 1) == 1);
+    cqe = iour_get_cqe(&iour);
+    test_assert(cqe && (cqe->user_data == 0) && (cqe->res == sizeof(send_buf)));
+    struct iovec riov = { .iov_base = recv_buf, .iov_len = sizeof(recv_buf) };
+    struct msghdr rmsg;
+    memset(recv_buf, 0, sizeof(recv_buf));
+    memset(&rmsg, 0, sizeof(rmsg));
+    rmsg.msg_iov = &riov;
+    rmsg.msg_iovlen = 1;
+    iour_setup_sock(&iour, IORING_OP_RECVMSG, cfd, &rmsg, 0, 0, 0, 0);
+    test_assert(iour_submit(&iour, 1, 1) == 1);
+    cqe = iour_get_cqe(&iour);
+    test_assert(cqe && (cqe->user_data == 0) && (cqe->res == sizeof(send_buf)));
+    test_assert(!memcmp(recv_buf, send_buf, sizeof(send_buf)));
+
+    /* error paths */
+    iour_setup_sock(&iour, IORING_OP_SEND, cfd, NULL, sizeof(send_buf), 0, 0, 0);
+    test_assert(iour_submit(&iour, 1, 1) == 1);
+    cqe = iour_get_cqe(&iour);
+    test_assert(cqe && (cqe->user_data == 0) && (cqe->res == -EFAULT));
+
+    iour_setup_sock(&iour, IORING_OP_RECVMSG, cfd, NULL, 0, 0, 0, 0);
+    test_assert(iour_submit(&iour, 1, 1) == 1);
+    cqe = iour_get_cqe(&iour);
+    test_assert(cqe && (cqe->user_data == 0) && (cqe->res == -EFAULT));
+
+    iour_setup_sock(&iour, IORING_OP_RECV, -1, recv_buf, sizeof(recv_buf), 0,
+        0, 0);
+    test_assert(iour_submit(&iour, 1, 1) == 1);
+    cqe = iour_get_cqe(&iour);
+    test_assert(cqe && (cqe->user_data == 0) && (cqe->res == -EBADF));
+
+    test_assert(pipe(pipefd) == 0);
+    iour_setup_sock(&iour, IORING_OP_SEND, pipefd[1], send_buf,
+        sizeof(send_buf), 0, 0, 0);
+    test_assert(iour_submit(&iour, 1, 1) == 1);
+    cqe = iour_get_cqe(&iour);
+    test_assert(cqe && (cqe->user_data == 0) && (cqe->res == -ENOTSOCK));
+    test_assert(close(pipefd[0]) == 0);
+    test_assert(close(pipefd[1]) == 0);
+
+    iour_setup_sock(&iour, IORING_OP_SEND, cfd, send_buf, sizeof(send_buf), 0,
+        0, 0);
+    iour.sqes[iour.sq_array[(*iour.sq_tail - 1) & iour.sq_mask]].ioprio = 1;
+    test_assert(iour_submit(&iour, 1, 1) == 1);
+    cqe = iour_get_cqe(&iour);
+    test_assert(cqe && (cqe->user_data == 0) && (cqe->res == -EINVAL));
+
+    test_assert(close(afd) == 0);
+    test_assert(close(cfd) == 0);
+    test_assert(close(lfd) == 0);
+    test_assert(iour_exit(&iour) == 0);
+}
+
 int main(int argc, char **argv)
 {
     setbuf(stdout, NULL);
@@ -1217,6 +1444,8 @@ int main(int argc, char **argv)
     iour_test_close();
     iour_test_sig();
     iour_test_register_files();
+    iour_test_sock();
+    iour_test_sqpoll();
     printf("IO uring test OK\n");
     return EXIT_SUCCESS;
 }
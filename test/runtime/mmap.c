@@ -1,4 +1,4 @@
-/* tests for mmap, munmap, mremap, and mincore */
+/* tests for mmap, munmap, mremap, mincore, mprotect and madvise */
 
 #define _GNU_SOURCE
 #include <stdio.h>
@@ -781,6 +781,74 @@ void mprotect_test(void)
     __munmap(addr, 5 * PAGESIZE);
 }
 
+#define HUGEPAGE_TEST_SIZE (4 * PAGESIZE_2M)
+
+static void hugepage_check_pattern(u8 *addr, unsigned long skip_start,
+                                   unsigned long skip_end)
+{
+    for (unsigned long off = 0; off < HUGEPAGE_TEST_SIZE; off += PAGESIZE) {
+        if (off >= skip_start && off < skip_end)
+            continue;
+        if (addr[off] != (u8)(off >> PAGELOG)) {
+            fprintf(stderr, "%s: data mismatch at offset 0x%lx\n", __func__, off);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/* Populate anonymous memory likely to be backed by 2M pages, then
+   reprotect and unmap single 4K pages within them. */
+void hugepage_test(void)
+{
+    u8 *map, *addr;
+    uint8_t vec[HUGEPAGE_TEST_SIZE / PAGESIZE], expected[HUGEPAGE_TEST_SIZE / PAGESIZE];
+
+    /* over-allocate so that a 2M-aligned window is available */
+    map = mmap(NULL, HUGEPAGE_TEST_SIZE + PAGESIZE_2M, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+        handle_err("hugepage test: mmap");
+    addr = (u8 *)(((unsigned long)map + PAGESIZE_2M - 1) & ~(PAGESIZE_2M - 1));
+
+    if (madvise(addr, HUGEPAGE_TEST_SIZE, MADV_HUGEPAGE) < 0)
+        handle_err("madvise(MADV_HUGEPAGE)");
+    if (madvise(addr + HUGEPAGE_TEST_SIZE - PAGESIZE_2M, PAGESIZE_2M,
+                MADV_NOHUGEPAGE) < 0)
+        handle_err("madvise(MADV_NOHUGEPAGE)");
+
+    for (unsigned long off = 0; off < HUGEPAGE_TEST_SIZE; off += PAGESIZE) {
+        if (addr[off] != 0) {
+            fprintf(stderr, "%s: page at offset 0x%lx not zeroed\n", __func__, off);
+            exit(EXIT_FAILURE);
+        }
+        addr[off] = (u8)(off >> PAGELOG);
+    }
+
+    /* write-protect one page in the middle of the first 2M extent */
+    if (mprotect(addr + PAGESIZE_2M / 2, PAGESIZE, PROT_READ) < 0)
+        handle_err("hugepage test: mprotect");
+    addr[PAGESIZE_2M / 2 - PAGESIZE] = (u8)((PAGESIZE_2M / 2 - PAGESIZE) >> PAGELOG);
+    addr[PAGESIZE_2M / 2 + PAGESIZE] = (u8)((PAGESIZE_2M / 2 + PAGESIZE) >> PAGELOG);
+    hugepage_check_pattern(addr, 0, 0);
+
+    /* punch a hole in the middle of the second 2M extent */
+    unsigned long hole = PAGESIZE_2M + PAGESIZE_2M / 2;
+    __munmap(addr + hole, PAGESIZE);
+    hugepage_check_pattern(addr, hole, hole + PAGESIZE);
+
+    memset(expected, 1, sizeof(expected));
+    __mincore(addr, hole, vec, expected);
+    __mincore(addr + hole + PAGESIZE, HUGEPAGE_TEST_SIZE - hole - PAGESIZE, vec, expected);
+
+    if (madvise(addr + hole, PAGESIZE, MADV_HUGEPAGE) == 0 || errno != ENOMEM) {
+        fprintf(stderr, "%s: madvise on unmapped range should fail with ENOMEM\n",
+                __func__);
+        exit(EXIT_FAILURE);
+    }
+
+    __munmap(map, HUGEPAGE_TEST_SIZE + PAGESIZE_2M);
+}
+
 const unsigned char test_sha[2][32] = {
     { 0xca, 0xde, 0xc7, 0x27, 0x1e, 0xaa, 0xd4, 0xc6,
       0x85, 0xa9, 0xc2, 0xc0, 0x57, 0x86, 0xf8, 0x12,
@@ -1004,6 +1072,59 @@ static void filebacked_test(heap h)
     printf("** all file-backed tests passed\n");
 }
 
+#define FAULT_AROUND_TEST_PAGES 64
+
+/* Touching every page of a cached file mapping should take fewer faults
+   than there are pages, as neighbors are mapped around each fault. */
+static void fault_around_test(void)
+{
+    printf("** starting mmap fault-around test\n");
+    char buf[PAGESIZE];
+    int fd = open("aroundfile", O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    if (fd < 0)
+        handle_err("open for aroundfile");
+    for (int i = 0; i < FAULT_AROUND_TEST_PAGES; i++) {
+        memset(buf, i, PAGESIZE);
+        if (write(fd, buf, PAGESIZE) != PAGESIZE)
+            handle_err("write to aroundfile");
+    }
+
+    u8 *p = mmap(NULL, FAULT_AROUND_TEST_PAGES * PAGESIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED)
+        handle_err("mmap aroundfile");
+    for (int i = 0; i < FAULT_AROUND_TEST_PAGES; i++) {
+        if (p[i * PAGESIZE] != (u8)i) {
+            fprintf(stderr, "%s: data mismatch at page %d\n", __func__, i);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    FILE *f = fopen("/proc/self/faults", "r");
+    if (f) {
+        unsigned long start, end, faults, around;
+        bool found = false;
+        while (fscanf(f, "%lx-%lx faults %ld around %ld\n", &start, &end, &faults, &around) == 4) {
+            if (start != (unsigned long)p)
+                continue;
+            found = true;
+            printf("   %ld faults, %ld pages mapped around\n", faults, around);
+            if (faults >= FAULT_AROUND_TEST_PAGES || around == 0) {
+                fprintf(stderr, "%s: no fault-around observed\n", __func__);
+                exit(EXIT_FAILURE);
+            }
+        }
+        fclose(f);
+        if (!found) {
+            fprintf(stderr, "%s: mapping not found in /proc/self/faults\n", __func__);
+            exit(EXIT_FAILURE);
+        }
+    }
+    __munmap(p, FAULT_AROUND_TEST_PAGES * PAGESIZE);
+    close(fd);
+    if (unlink("aroundfile") < 0)
+        handle_err("unlink aroundfile");
+}
+
 static volatile int expect_sigbus = 0;
 static sigjmp_buf sjb;
 
@@ -1091,8 +1212,10 @@ int main(int argc, char * argv[])
     mincore_test();
     mremap_test();
     mprotect_test();
+    hugepage_test();
     filebacked_test(init_process_runtime());
     filebacked_sigbus_test();
+    fault_around_test();
 
     printf("\n**** all tests passed ****\n");
 
@@ -1,14 +1,20 @@
+#define _GNU_SOURCE
+#include <errno.h>
 #include <netinet/in.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #define NETSOCK_TEST_FIO_COUNT  8
+#define NETSOCK_TEST_MMSG_VLEN  4
+#define NETSOCK_TEST_REUSE_CONN 16
+#define NETSOCK_TEST_XFER_SIZE  (4 * 1024 * 1024)
 
 #define test_assert(expr) do { \
     if (!(expr)) { \
@@ -175,12 +181,288 @@ static void netsock_test_connclosed(void)
     test_assert(close(fd) == 0);
 }
 
+static void netsock_test_recvmmsg(void)
+{
+    int fd;
+    struct sockaddr_in addr, src_addr[NETSOCK_TEST_MMSG_VLEN];
+    struct mmsghdr msgs[NETSOCK_TEST_MMSG_VLEN];
+    struct iovec iovs[NETSOCK_TEST_MMSG_VLEN][2];
+    uint8_t buf[NETSOCK_TEST_MMSG_VLEN][8];
+    struct timespec timeout = { 0 };
+    uint8_t data[8];
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    test_assert(fd > 0);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(1235);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    test_assert(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    for (int i = 0; i < NETSOCK_TEST_MMSG_VLEN; i++) {
+        /* each datagram is scattered across two iovecs */
+        iovs[i][0].iov_base = buf[i];
+        iovs[i][0].iov_len = 3;
+        iovs[i][1].iov_base = buf[i] + 3;
+        iovs[i][1].iov_len = sizeof(buf[i]) - 3;
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_iov = iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 2;
+        msgs[i].msg_hdr.msg_name = &src_addr[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(src_addr[i]);
+    }
+
+    for (int i = 0; i < NETSOCK_TEST_MMSG_VLEN - 1; i++) {
+        memset(data, i, sizeof(data));
+        test_assert(sendto(fd, data, i + 4, 0, (struct sockaddr *)&addr,
+            sizeof(addr)) == i + 4);
+    }
+    test_assert(recvmmsg(fd, msgs, NETSOCK_TEST_MMSG_VLEN, MSG_DONTWAIT,
+        NULL) == NETSOCK_TEST_MMSG_VLEN - 1);
+    for (int i = 0; i < NETSOCK_TEST_MMSG_VLEN - 1; i++) {
+        test_assert(msgs[i].msg_len == i + 4);
+        test_assert(msgs[i].msg_hdr.msg_flags == 0);
+        test_assert(src_addr[i].sin_port == addr.sin_port);
+        for (int j = 0; j < i + 4; j++)
+            test_assert(buf[i][j] == i);
+    }
+
+    /* nothing queued: neither flag nor zero timeout may block */
+    test_assert((recvmmsg(fd, msgs, NETSOCK_TEST_MMSG_VLEN, MSG_DONTWAIT,
+        NULL) == -1) && (errno == EAGAIN));
+    test_assert((recvmmsg(fd, msgs, NETSOCK_TEST_MMSG_VLEN, 0,
+        &timeout) == -1) && (errno == EAGAIN));
+
+    /* MSG_WAITFORONE returns after the first datagram; excess is truncated */
+    memset(data, 0xaa, sizeof(data));
+    test_assert(sendto(fd, data, sizeof(data), 0, (struct sockaddr *)&addr,
+        sizeof(addr)) == sizeof(data));
+    iovs[0][1].iov_len = 1;
+    test_assert(recvmmsg(fd, msgs, NETSOCK_TEST_MMSG_VLEN, MSG_WAITFORONE,
+        NULL) == 1);
+    test_assert(msgs[0].msg_len == 4);
+    test_assert(msgs[0].msg_hdr.msg_flags & MSG_TRUNC);
+    test_assert(close(fd) == 0);
+}
+
+/* A stream the peer has shut down reports end of stream, not EAGAIN. */
+static void netsock_test_recvmmsg_eof(void)
+{
+    int fd, client, conn;
+    struct sockaddr_in addr;
+    struct mmsghdr msgs[NETSOCK_TEST_MMSG_VLEN];
+    struct iovec iov;
+    uint8_t buf[8];
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    test_assert(fd > 0);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(1240);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    test_assert(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    test_assert(listen(fd, 1) == 0);
+    client = socket(AF_INET, SOCK_STREAM, 0);
+    test_assert(client > 0);
+    test_assert(connect(client, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    conn = accept(fd, NULL, NULL);
+    test_assert(conn > 0);
+    test_assert(close(conn) == 0);
+
+    iov.iov_base = buf;
+    iov.iov_len = sizeof(buf);
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < NETSOCK_TEST_MMSG_VLEN; i++) {
+        msgs[i].msg_hdr.msg_iov = &iov;
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    test_assert(recvmmsg(client, msgs, NETSOCK_TEST_MMSG_VLEN, 0, NULL) == 0);
+    test_assert(recvmmsg(client, msgs, NETSOCK_TEST_MMSG_VLEN, MSG_DONTWAIT, NULL) == 0);
+    test_assert(close(client) == 0);
+    test_assert(close(fd) == 0);
+}
+
+static void netsock_test_reuseport(void)
+{
+    int fds[2], other, clients[NETSOCK_TEST_REUSE_CONN];
+    struct sockaddr_in addr, local;
+    socklen_t addrlen;
+    int one = 1;
+    int accepted[2] = { 0 };
+
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(1236);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (int i = 0; i < 2; i++) {
+        fds[i] = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        test_assert(fds[i] > 0);
+        test_assert(setsockopt(fds[i], SOL_SOCKET, SO_REUSEPORT, &one,
+            sizeof(one)) == 0);
+        test_assert(bind(fds[i], (struct sockaddr *)&addr, sizeof(addr)) == 0);
+        test_assert(listen(fds[i], NETSOCK_TEST_REUSE_CONN) == 0);
+    }
+
+    /* a socket without SO_REUSEPORT cannot join */
+    other = socket(AF_INET, SOCK_STREAM, 0);
+    test_assert(other > 0);
+    test_assert((bind(other, (struct sockaddr *)&addr, sizeof(addr)) == -1) &&
+        (errno == EADDRINUSE));
+    test_assert(close(other) == 0);
+
+    for (int i = 0; i < NETSOCK_TEST_REUSE_CONN; i++) {
+        clients[i] = socket(AF_INET, SOCK_STREAM, 0);
+        test_assert(clients[i] > 0);
+        test_assert(connect(clients[i], (struct sockaddr *)&addr,
+            sizeof(addr)) == 0);
+    }
+
+    /* every connection is accepted by exactly one of the listeners */
+    for (int retry = 0; retry < 100; retry++) {
+        for (int i = 0; i < 2; i++) {
+            int conn_fd;
+            while ((conn_fd = accept(fds[i], NULL, NULL)) >= 0) {
+                accepted[i]++;
+                test_assert(close(conn_fd) == 0);
+            }
+            test_assert(errno == EAGAIN);
+        }
+        if (accepted[0] + accepted[1] == NETSOCK_TEST_REUSE_CONN)
+            break;
+        usleep(10000);
+    }
+    test_assert(accepted[0] + accepted[1] == NETSOCK_TEST_REUSE_CONN);
+    for (int i = 0; i < NETSOCK_TEST_REUSE_CONN; i++)
+        test_assert(close(clients[i]) == 0);
+
+    /* a connecting socket keeps the port it was bound to with SO_REUSEPORT */
+    other = socket(AF_INET, SOCK_STREAM, 0);
+    test_assert(other > 0);
+    test_assert(setsockopt(other, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == 0);
+    local.sin_family = AF_INET;
+    local.sin_port = htons(1238);
+    local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    test_assert(bind(other, (struct sockaddr *)&local, sizeof(local)) == 0);
+    test_assert(connect(other, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    addrlen = sizeof(local);
+    test_assert(getsockname(other, (struct sockaddr *)&local, &addrlen) == 0);
+    test_assert(ntohs(local.sin_port) == 1238);
+    test_assert(close(other) == 0);
+    test_assert(close(fds[0]) == 0);
+    test_assert(close(fds[1]) == 0);
+}
+
+/* Read the transfer pattern until the peer closes; returns the byte count. */
+static void *netsock_test_xfer_thread(void *arg)
+{
+    int port = (long)arg;
+    int fd;
+    struct sockaddr_in addr;
+    uint8_t buf[8192];
+    long total = 0;
+    ssize_t n;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    test_assert(fd > 0);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    test_assert(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        for (int i = 0; i < n; i++)
+            test_assert(buf[i] == (uint8_t)((total + i) % 251));
+        total += n;
+    }
+    test_assert(n == 0);    /* FIN, not a reset */
+    test_assert(close(fd) == 0);
+    return (void *)total;
+}
+
+/* A transfer that opens the (scaled) window beyond 64kB must still end in an
+ * orderly release, whether the sender closes or shuts down the socket. */
+static void netsock_test_xfer_close(void)
+{
+    int fd, conn_fd;
+    struct sockaddr_in addr;
+    const int port = 1237;
+    pthread_t pt;
+    void *thread_ret;
+    static uint8_t buf[65536];
+
+    for (int i = 0; i < sizeof(buf); i++)
+        buf[i] = i % 251;
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    test_assert(fd > 0);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    test_assert(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    test_assert(listen(fd, 1) == 0);
+    for (int shut = 0; shut < 2; shut++) {
+        test_assert(pthread_create(&pt, NULL, netsock_test_xfer_thread,
+            (void *)(long)port) == 0);
+        conn_fd = accept(fd, NULL, NULL);
+        test_assert(conn_fd > 0);
+        for (long sent = 0; sent < NETSOCK_TEST_XFER_SIZE;) {
+            long off = sent % 251;
+            ssize_t n = write(conn_fd, buf + off, sizeof(buf) - off);
+            test_assert(n > 0);
+            sent += n;
+        }
+        if (shut)
+            test_assert(shutdown(conn_fd, SHUT_RDWR) == 0);
+        test_assert(close(conn_fd) == 0);
+        test_assert(pthread_join(pt, &thread_ret) == 0);
+        test_assert((long)thread_ret >= NETSOCK_TEST_XFER_SIZE);
+    }
+    test_assert(close(fd) == 0);
+}
+
+/* A refused non-blocking connect must be reported to epoll as an error, with
+ * SO_ERROR giving the reason; a blocking connect fails with the same error. */
+static void netsock_test_connrefused(void)
+{
+    int fd, efd, err;
+    struct sockaddr_in addr;
+    struct epoll_event ev;
+    socklen_t len = sizeof(err);
+    const int port = 1239;
+
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    test_assert(fd > 0);
+    efd = epoll_create1(0);
+    test_assert(efd > 0);
+    ev.events = EPOLLOUT;
+    ev.data.fd = fd;
+    test_assert(epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev) == 0);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        test_assert(errno == EINPROGRESS);
+        test_assert(epoll_wait(efd, &ev, 1, 5000) == 1);
+        test_assert(ev.data.fd == fd);
+        test_assert(ev.events & EPOLLERR);
+        test_assert(getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0);
+        test_assert(err == ECONNREFUSED);
+    }
+    test_assert(close(fd) == 0);
+    test_assert(close(efd) == 0);
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    test_assert(fd > 0);
+    test_assert(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1);
+    test_assert(errno == ECONNREFUSED);
+    test_assert(close(fd) == 0);
+}
+
 int main(int argc, char **argv)
 {
     setbuf(stdout, NULL);
 
     netsock_test_fionread();
     netsock_test_connclosed();
+    netsock_test_recvmmsg();
+    netsock_test_recvmmsg_eof();
+    netsock_test_reuseport();
+    netsock_test_xfer_close();
+    netsock_test_connrefused();
     printf("Network socket tests OK\n");
     return EXIT_SUCCESS;
 }
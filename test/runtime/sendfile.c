@@ -1,15 +1,19 @@
 #define GNU_SOURCE
 #include <dirent.h>     /* Defines DT_* constants */
 #include <fcntl.h>
+#include <netinet/in.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <sys/syscall.h>
 #include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <errno.h>
 #include <string.h>
 
 #define BUF_LEN 10
+#define SOCK_FILE_LEN   (2 * 1024 * 1024)
+#define SOCK_PORT       1240
 
 #define SENDFILE_DEBUG
 #ifdef SENDFILE_DEBUG
@@ -26,6 +30,118 @@
 } while (0)
 
 
+/* Connects a TCP socket pair over loopback; the sender is non-blocking, so
+   that sendfile() leaves it with data queued and not yet acknowledged. */
+static int sock_pair(int *snd, int *rcv)
+{
+    struct sockaddr_in addr;
+    int lfd;
+
+    lfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (lfd < 0)
+        sf_err_goto(err_lfd, "socket: %s\n", strerror(errno));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(SOCK_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(lfd, 1) < 0)
+        sf_err_goto(err_snd, "bind/listen: %s\n", strerror(errno));
+    *snd = socket(AF_INET, SOCK_STREAM, 0);
+    if (*snd < 0)
+        sf_err_goto(err_snd, "socket: %s\n", strerror(errno));
+    if (connect(*snd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        sf_err_goto(err_rcv, "connect: %s\n", strerror(errno));
+    *rcv = accept(lfd, NULL, NULL);
+    if (*rcv < 0)
+        sf_err_goto(err_rcv, "accept: %s\n", strerror(errno));
+    if (fcntl(*snd, F_SETFL, O_NONBLOCK) < 0)
+        sf_err_goto(err_fcntl, "fcntl: %s\n", strerror(errno));
+    close(lfd);
+    return 0;
+err_fcntl:
+    close(*rcv);
+err_rcv:
+    close(*snd);
+err_snd:
+    close(lfd);
+err_lfd:
+    return -1;
+}
+
+/* Zero-copy sendfile() to a socket that is closed with the data still in
+   flight: the file pages must stay valid until the peer has read them, and
+   must be released if the connection is reset instead. */
+static int sendfile_sock_test(void)
+{
+    static unsigned char buf[64 * 1024];
+    int fd, snd, rcv;
+    ssize_t ret, sent;
+    long total;
+
+    for (int i = 0; i < sizeof(buf); i++)
+        buf[i] = i % 251;
+    fd = open("sockfile", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        sf_err_goto(err_fd, "open sockfile: %s\n", strerror(errno));
+    for (total = 0; total < SOCK_FILE_LEN; total += sizeof(buf))
+        if (write(fd, buf, sizeof(buf)) != sizeof(buf))
+            sf_err_goto(err_sock, "write sockfile: %s\n", strerror(errno));
+
+    /* orderly close: everything sent must arrive intact after the close */
+    if (sock_pair(&snd, &rcv) < 0)
+        goto err_sock;
+    lseek(fd, 0, SEEK_SET);
+    sent = sendfile(snd, fd, NULL, SOCK_FILE_LEN);
+    if (sent <= 0)
+        sf_err_goto(err_pair, "sendfile to socket: %s\n", strerror(errno));
+    close(snd);
+    total = 0;
+    while ((ret = read(rcv, buf, sizeof(buf))) > 0) {
+        for (int i = 0; i < ret; i++)
+            if (buf[i] != (total + i) % sizeof(buf) % 251)
+                sf_err_goto(err_rcv, "data mismatch at %ld\n", total + i);
+        total += ret;
+    }
+    if (ret < 0 || total != sent)
+        sf_err_goto(err_rcv, "received %ld of %ld bytes: %s\n", total,
+            (long)sent, ret < 0 ? strerror(errno) : "EOF");
+    close(rcv);
+
+    /* reset: unread data on the sender makes close() abort the connection
+       with sendfile() data still unacknowledged */
+    if (sock_pair(&snd, &rcv) < 0)
+        goto err_sock;
+    if (write(rcv, buf, BUF_LEN) != BUF_LEN)
+        sf_err_goto(err_pair, "write to sender: %s\n", strerror(errno));
+    lseek(fd, 0, SEEK_SET);
+    sent = sendfile(snd, fd, NULL, SOCK_FILE_LEN);
+    if (sent <= 0)
+        sf_err_goto(err_pair, "sendfile to socket: %s\n", strerror(errno));
+    close(snd);
+    while ((ret = read(rcv, buf, sizeof(buf))) > 0);
+    if (ret < 0 && errno != ECONNRESET)
+        sf_err_goto(err_rcv, "read after reset: %s\n", strerror(errno));
+    close(rcv);
+
+    /* the file must remain usable once its pages are released */
+    if (ftruncate(fd, 0) < 0 || lseek(fd, 0, SEEK_SET) != 0 ||
+        write(fd, buf, BUF_LEN) != BUF_LEN)
+        sf_err_goto(err_sock, "rewrite sockfile: %s\n", strerror(errno));
+    close(fd);
+    if (unlink("sockfile") < 0)
+        sf_err_goto(err_fd, "unlink sockfile: %s\n", strerror(errno));
+    return 0;
+err_pair:
+    close(snd);
+err_rcv:
+    close(rcv);
+err_sock:
+    close(fd);
+    unlink("sockfile");
+err_fd:
+    return -1;
+}
+
 int main(int argc, char *argv[])
 {
     int ret;
@@ -122,6 +238,9 @@ int main(int argc, char *argv[])
     close(fd_out);
     close(fd_in);
 
+    if (sendfile_sock_test() < 0)
+        exit(1);
+
     printf("!!!Success!!!\n");
     exit (0);
 
@@ -0,0 +1,134 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#define BUF_LEN 64
+
+#define test_assert(expr) do { \
+    if (!(expr)) { \
+        printf("Error: %s -- failed at %s:%d\n", #expr, __FILE__, __LINE__); \
+        exit(EXIT_FAILURE); \
+    } \
+} while (0)
+
+static ssize_t do_copy_file_range(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out,
+                                  size_t len, unsigned int flags)
+{
+    return syscall(SYS_copy_file_range, fd_in, off_in, fd_out, off_out, len, flags);
+}
+
+static void test_copy_file_range(int fd_in, int fd_out, const char *expect)
+{
+    char buf[BUF_LEN];
+    loff_t off_in = 0, off_out = 0;
+
+    test_assert(do_copy_file_range(fd_in, &off_in, fd_out, &off_out, BUF_LEN, 1) == -1);
+    test_assert(errno == EINVAL);
+    test_assert(do_copy_file_range(fd_in, &off_in, fd_out, &off_out, BUF_LEN, 0) == BUF_LEN);
+    test_assert(off_in == BUF_LEN && off_out == BUF_LEN);
+    test_assert(lseek(fd_in, 0, SEEK_CUR) == 0);    /* file offsets untouched */
+    test_assert(pread(fd_out, buf, BUF_LEN, 0) == BUF_LEN);
+    test_assert(memcmp(buf, expect, BUF_LEN) == 0);
+
+    /* overlapping ranges within one file */
+    off_in = 0;
+    off_out = 1;
+    test_assert(do_copy_file_range(fd_out, &off_in, fd_out, &off_out, BUF_LEN, 0) == -1);
+    test_assert(errno == EINVAL);
+}
+
+static void test_splice(int fd_in, int fd_out, const char *expect)
+{
+    char buf[BUF_LEN];
+    int pfds[2], tfds[2];
+    loff_t off = 0;
+
+    test_assert(pipe(pfds) == 0);
+    test_assert(pipe(tfds) == 0);
+
+    /* neither end a pipe */
+    test_assert(splice(fd_in, NULL, fd_out, NULL, BUF_LEN, 0) == -1);
+    test_assert(errno == EINVAL);
+    /* offset on a pipe */
+    test_assert(splice(fd_in, NULL, pfds[1], &off, BUF_LEN, 0) == -1);
+    test_assert(errno == ESPIPE);
+
+    /* file to pipe, at the given offset */
+    test_assert(splice(fd_in, &off, pfds[1], NULL, BUF_LEN, 0) == BUF_LEN);
+    test_assert(off == BUF_LEN);
+
+    /* duplicate into a second pipe, leaving the first one intact */
+    test_assert(tee(pfds[0], tfds[1], BUF_LEN, 0) == BUF_LEN);
+    test_assert(read(tfds[0], buf, BUF_LEN) == BUF_LEN);
+    test_assert(memcmp(buf, expect, BUF_LEN) == 0);
+    test_assert(tee(pfds[0], tfds[1], BUF_LEN, SPLICE_F_NONBLOCK) == BUF_LEN);
+
+    /* pipe to file, using and advancing the file offset */
+    test_assert(lseek(fd_out, 0, SEEK_SET) == 0);
+    test_assert(splice(pfds[0], NULL, fd_out, NULL, BUF_LEN, 0) == BUF_LEN);
+    test_assert(lseek(fd_out, 0, SEEK_CUR) == BUF_LEN);
+    test_assert(pread(fd_out, buf, BUF_LEN, 0) == BUF_LEN);
+    test_assert(memcmp(buf, expect, BUF_LEN) == 0);
+
+    /* pipe to pipe */
+    test_assert(splice(tfds[0], NULL, pfds[1], NULL, BUF_LEN, 0) == BUF_LEN);
+    test_assert(read(pfds[0], buf, BUF_LEN) == BUF_LEN);
+    test_assert(memcmp(buf, expect, BUF_LEN) == 0);
+
+    /* nothing left to move */
+    test_assert(splice(pfds[0], NULL, fd_out, NULL, BUF_LEN, SPLICE_F_NONBLOCK) == -1);
+    test_assert(errno == EAGAIN);
+
+    close(pfds[0]);
+    close(pfds[1]);
+    close(tfds[0]);
+    close(tfds[1]);
+}
+
+static void test_vmsplice(const char *expect)
+{
+    char buf[BUF_LEN];
+    struct iovec iov[2];
+    int pfds[2];
+
+    test_assert(pipe(pfds) == 0);
+    iov[0].iov_base = (void *)expect;
+    iov[0].iov_len = BUF_LEN / 2;
+    iov[1].iov_base = (void *)expect + BUF_LEN / 2;
+    iov[1].iov_len = BUF_LEN / 2;
+    test_assert(vmsplice(pfds[1], iov, 2, 0) == BUF_LEN);
+    iov[0].iov_base = buf;
+    iov[0].iov_len = BUF_LEN;
+    test_assert(vmsplice(pfds[0], iov, 1, 0) == BUF_LEN);
+    test_assert(memcmp(buf, expect, BUF_LEN) == 0);
+    close(pfds[0]);
+    close(pfds[1]);
+}
+
+int main(int argc, char *argv[])
+{
+    char expect[BUF_LEN];
+    int fd_in, fd_out;
+
+    fd_in = open("infile", O_RDONLY);
+    test_assert(fd_in >= 0);
+    fd_out = open("outfile", O_RDWR);
+    test_assert(fd_out >= 0);
+    test_assert(read(fd_in, expect, BUF_LEN) == BUF_LEN);
+    test_assert(lseek(fd_in, 0, SEEK_SET) == 0);
+
+    test_copy_file_range(fd_in, fd_out, expect);
+    test_splice(fd_in, fd_out, expect);
+    test_vmsplice(expect);
+
+    close(fd_out);
+    close(fd_in);
+    printf("splice test passed\n");
+    return EXIT_SUCCESS;
+}
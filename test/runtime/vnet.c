@@ -0,0 +1,137 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* TCP through the virtio-net device: the client connects to the user-mode
+   network gateway at the port that the host forwards back to this guest,
+   so that each byte is both sent and received by the device, with whatever
+   offloads (checksum, GSO, mergeable or big receive buffers) the run
+   negotiated. The server echoes everything back. */
+
+#define VNET_PORT       8080
+#define VNET_GATEWAY    "10.0.2.2"
+#define VNET_XFER_SIZE  (16 * 1024 * 1024)
+#define VNET_CONNECT_RETRIES    50
+
+#define test_assert(expr) do { \
+    if (!(expr)) { \
+        printf("Error: %s -- failed at %s:%d\n", #expr, __FILE__, __LINE__); \
+        exit(EXIT_FAILURE); \
+    } \
+} while (0)
+
+static uint8_t vnet_pattern(long off)
+{
+    return (off * 7 + (off >> 12)) % 253;
+}
+
+static void vnet_check(const uint8_t *buf, long off, ssize_t n)
+{
+    for (ssize_t i = 0; i < n; i++) {
+        if (buf[i] != vnet_pattern(off + i)) {
+            printf("Error: data mismatch at offset %ld\n", off + i);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static void *vnet_server(void *arg)
+{
+    int lfd = (long)arg;
+    static uint8_t buf[65536];
+    long total = 0;
+    ssize_t n;
+
+    int fd = accept(lfd, NULL, NULL);
+    test_assert(fd >= 0);
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        vnet_check(buf, total, n);
+        total += n;
+        for (ssize_t off = 0; off < n;) {
+            ssize_t w = write(fd, buf + off, n - off);
+            test_assert(w > 0);
+            off += w;
+        }
+    }
+    test_assert(n == 0);
+    test_assert(total == VNET_XFER_SIZE);
+    test_assert(close(fd) == 0);
+    return NULL;
+}
+
+static void *vnet_reader(void *arg)
+{
+    int fd = (long)arg;
+    static uint8_t buf[65536];
+    long total = 0;
+    ssize_t n;
+
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        vnet_check(buf, total, n);
+        total += n;
+    }
+    test_assert(n == 0);
+    return (void *)total;
+}
+
+int main(int argc, char **argv)
+{
+    static uint8_t buf[65536];
+    struct sockaddr_in addr;
+    pthread_t server, reader;
+    void *received;
+    int lfd, fd, retries;
+
+    lfd = socket(AF_INET, SOCK_STREAM, 0);
+    test_assert(lfd >= 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(VNET_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    test_assert(bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    test_assert(listen(lfd, 1) == 0);
+    test_assert(pthread_create(&server, NULL, vnet_server, (void *)(long)lfd) == 0);
+
+    /* the interface may still be waiting for its DHCP lease */
+    test_assert(inet_pton(AF_INET, VNET_GATEWAY, &addr.sin_addr) == 1);
+    for (retries = 0; ; retries++) {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        test_assert(fd >= 0);
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+            break;
+        test_assert(retries < VNET_CONNECT_RETRIES);
+        close(fd);
+        usleep(100 * 1000);
+    }
+    test_assert(pthread_create(&reader, NULL, vnet_reader, (void *)(long)fd) == 0);
+
+    for (long sent = 0; sent < VNET_XFER_SIZE;) {
+        ssize_t len = sizeof(buf);
+        if (len > VNET_XFER_SIZE - sent)
+            len = VNET_XFER_SIZE - sent;
+        for (ssize_t i = 0; i < len; i++)
+            buf[i] = vnet_pattern(sent + i);
+        for (ssize_t off = 0; off < len;) {
+            ssize_t w = write(fd, buf + off, len - off);
+            test_assert(w > 0);
+            off += w;
+        }
+        sent += len;
+    }
+    test_assert(shutdown(fd, SHUT_WR) == 0);
+    test_assert(pthread_join(reader, &received) == 0);
+    test_assert((long)received == VNET_XFER_SIZE);
+    test_assert(pthread_join(server, NULL) == 0);
+    test_assert(close(fd) == 0);
+    test_assert(close(lfd) == 0);
+    printf("vnet test passed\n");
+    return EXIT_SUCCESS;
+}
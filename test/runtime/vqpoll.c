@@ -0,0 +1,90 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Virtqueue interrupt / polling mode switching. The manifest lowers
+   virtio_poll_threshold so that any completion interrupt hands the queue to
+   the poller; the poller must then give it back to interrupts once drained. */
+
+#define VQPOLL_FILE_LEN (8 * 1024 * 1024)
+
+#define test_assert(expr) do { \
+    if (!(expr)) { \
+        printf("Error: %s -- failed at %s:%d\n", #expr, __FILE__, __LINE__); \
+        exit(EXIT_FAILURE); \
+    } \
+} while (0)
+
+struct vq_totals {
+    unsigned long interrupts;
+    unsigned long polls;
+    unsigned long polled;
+};
+
+static void vq_read_totals(struct vq_totals *t)
+{
+    static char buf[8192];
+    int fd, len = 0, n;
+    char *line;
+
+    fd = open("/proc/virtqueues", O_RDONLY);
+    test_assert(fd >= 0);
+    while ((n = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0)
+        len += n;
+    test_assert(n == 0);
+    close(fd);
+    buf[len] = '\0';
+    memset(t, 0, sizeof(*t));
+    for (line = strtok(buf, "\n"); line; line = strtok(NULL, "\n")) {
+        unsigned long interrupts, polls, polled;
+        char *stats = strchr(line, ':');
+        test_assert(stats);
+        test_assert(sscanf(stats, ": interrupts %lu polls %lu polled %lu",
+                           &interrupts, &polls, &polled) == 3);
+        t->interrupts += interrupts;
+        t->polls += polls;
+        t->polled += polled;
+    }
+}
+
+static void vq_write_sync(int fd, const char *buf, size_t buflen, long len)
+{
+    test_assert(lseek(fd, 0, SEEK_SET) == 0);
+    for (long written = 0; written < len; written += buflen)
+        test_assert(write(fd, buf, buflen) == buflen);
+    test_assert(fsync(fd) == 0);
+}
+
+int main(int argc, char **argv)
+{
+    static char buf[64 * 1024];
+    struct vq_totals start, busy, idle;
+    int fd;
+
+    memset(buf, 0xa5, sizeof(buf));
+    vq_read_totals(&start);
+    fd = open("vqpoll_file", O_CREAT | O_RDWR | O_TRUNC, 0644);
+    test_assert(fd >= 0);
+
+    /* a burst of block completions moves the queue to polling */
+    vq_write_sync(fd, buf, sizeof(buf), VQPOLL_FILE_LEN);
+    vq_read_totals(&busy);
+    test_assert(busy.polls > start.polls);
+    test_assert(busy.polled > start.polled);
+
+    /* once drained, the queue is back on interrupts */
+    usleep(100 * 1000);
+    vq_write_sync(fd, buf, sizeof(buf), sizeof(buf));
+    vq_read_totals(&idle);
+    test_assert(idle.interrupts > busy.interrupts);
+    test_assert(idle.polls > busy.polls);
+
+    test_assert(close(fd) == 0);
+    test_assert(unlink("vqpoll_file") == 0);
+    printf("vqpoll test passed\n");
+    return EXIT_SUCCESS;
+}
@@ -196,6 +196,81 @@ boolean test_range_check_set(bitmap b) {
     return true;
 }
 
+/* first fit by probing each bit, for comparison with bitmap_alloc */
+static u64 reference_alloc(bitmap b, u64 nbits, u64 start, u64 end)
+{
+    u64 stride = U64_FROM_BIT(find_order(nbits));
+    for (u64 bit = pad(start, stride); bit + nbits <= end; bit += stride) {
+        u64 i;
+        for (i = 0; i < nbits && !bitmap_get(b, bit + i); i++);
+        if (i == nbits)
+            return bit;
+    }
+    return INVALID_PHYSICAL;
+}
+
+/**
+ *  Fills a large bitmap with a mix of allocation sizes and frees,
+ *  checking that the summary-guided search picks the same first fit
+ *  as a bit-by-bit scan.
+ */
+boolean summary_test()
+{
+    heap h = init_process_runtime();
+    u64 length = U64_FROM_BIT(18);
+    bitmap b = allocate_bitmap(h, h, length);
+    if (b == INVALID_ADDRESS) {
+        msg_err("!!! allocation failed for bitmap\n");
+        return false;
+    }
+    int nallocs = 0;
+    struct {
+        u64 bit;
+        u64 nbits;
+    } allocs[4096];
+
+    for (int i = 0; i < 12000; i++) {
+        if (nallocs > 0 && (nallocs == 4096 || rand() % 3 == 0)) {
+            int n = rand() % nallocs;
+            if (!bitmap_dealloc(b, allocs[n].bit, allocs[n].nbits)) {
+                msg_err("!!! dealloc failed at bit %ld\n", allocs[n].bit);
+                return false;
+            }
+            allocs[n] = allocs[--nallocs];
+            continue;
+        }
+        u64 nbits;
+        switch (rand() % 4) {
+        case 0:
+            nbits = 1 + rand() % 63;
+            break;
+        case 1:
+            nbits = 64 + rand() % 960;
+            break;
+        case 2:
+            nbits = 1024 + rand() % 7168;
+            break;
+        default:
+            nbits = 1 + rand() % 8;
+            break;
+        }
+        u64 start = (rand() & 1) ? rand() % length : 0;
+        u64 expect = reference_alloc(b, nbits, start, length);
+        u64 bit = bitmap_alloc_within_range(b, nbits, start, length);
+        if (bit != expect) {
+            msg_err("!!! alloc of %ld bits from %ld returned %ld, expected %ld\n",
+                    nbits, start, bit, expect);
+            return false;
+        }
+        if (bit != INVALID_PHYSICAL) {
+            allocs[nallocs].bit = bit;
+            allocs[nallocs++].nbits = nbits;
+        }
+    }
+    deallocate_bitmap(b);
+    return true;
+}
+
 boolean basic_test()
 {
     heap h = init_process_runtime();
@@ -235,6 +310,9 @@ int main(int argc, char **argv)
     if (!basic_test()) 
         goto fail;
 
+    if (!summary_test())
+        goto fail;
+
     msg_debug("test passed\n");
     exit(EXIT_SUCCESS);
   fail:
@@ -0,0 +1,89 @@
+#include <runtime.h>
+#include <stdlib.h>
+
+#define BUF_SIZE    16384
+#define ITERATIONS  10000
+
+#define test_assert(expr)   do { \
+    if (!(expr)) { \
+        msg_err("%s -- failed at %s:%d\n", #expr, __FILE__, __LINE__); \
+        exit(EXIT_FAILURE); \
+    } \
+} while (0)
+
+/* RFC 1071, one 16-bit little-endian word at a time */
+static u16 ref_csum(const u8 *p, bytes len)
+{
+    u64 sum = 0;
+    for (bytes i = 0; i + 1 < len; i += 2)
+        sum += p[i] | (p[i + 1] << 8);
+    if (len & 1)
+        sum += p[len - 1];
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return sum;
+}
+
+static void test_fold(void)
+{
+    test_assert(csum_fold(0) == 0);
+    test_assert(csum_fold(0xffff) == 0xffff);
+    test_assert(csum_fold(0x10000) == 1);
+    test_assert(csum_fold(0xffffffffffffffffull) == 0xffff);
+    test_assert(csum_fold(0x0001000200030004ull) == 0xa);
+}
+
+/* every offset and length around the vector widths */
+static void test_short(u8 *buf)
+{
+    for (bytes off = 0; off < 64; off++) {
+        for (bytes len = 0; len < 512; len++)
+            test_assert(csum_fold(csum_add(0, buf + off, len)) ==
+                        ref_csum(buf + off, len));
+    }
+}
+
+static void test_random(u8 *buf)
+{
+    for (int i = 0; i < ITERATIONS; i++) {
+        bytes len = rand() % BUF_SIZE;
+        bytes off = rand() % (BUF_SIZE - len + 1);
+        test_assert(csum_fold(csum_add(0, buf + off, len)) ==
+                    ref_csum(buf + off, len));
+
+        /* a sum continued over an even split matches the whole */
+        bytes split = (rand() % (len + 1)) & ~1ull;
+        u64 sum = csum_add(0, buf + off, split);
+        sum = csum_add(sum, buf + off + split, len - split);
+        test_assert(csum_fold(sum) == ref_csum(buf + off, len));
+    }
+}
+
+/* carries out of the vector lanes */
+static void test_saturated(u8 *buf)
+{
+    for (int i = 0; i < BUF_SIZE; i++)
+        buf[i] = 0xff;
+    for (bytes len = BUF_SIZE - 64; len <= BUF_SIZE; len++)
+        test_assert(csum_fold(csum_add(0, buf, len)) == ref_csum(buf, len));
+    test_assert(csum_fold(csum_add(0xffffffffffffffffull, buf, BUF_SIZE)) == 0xffff);
+}
+
+int main(int argc, char *argv[])
+{
+    u8 *buf = malloc(BUF_SIZE);
+
+    init_process_runtime();
+    test_fold();
+    for (int level = MEMOPS_GENERIC; level <= MEMOPS_VEC256; level++) {
+        if (!memops_set_level(level))
+            continue;
+        for (int i = 0; i < BUF_SIZE; i++)
+            buf[i] = rand();
+        test_short(buf);
+        test_random(buf);
+        test_saturated(buf);
+    }
+    free(buf);
+    return 0;
+}
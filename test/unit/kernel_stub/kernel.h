@@ -0,0 +1,58 @@
+/* Userspace stand-ins for the kernel facilities used by the heap wrappers in
+   src/kernel/locking_heap.c. There are no interrupts and a single thread; the
+   test picks the current cpu. */
+#include <runtime.h>
+
+typedef struct cpuinfo {
+    u64 id;
+} *cpuinfo;
+
+extern cpuinfo stub_cpu;
+
+static inline cpuinfo current_cpu(void)
+{
+    return stub_cpu;
+}
+
+static inline u64 irq_disable_save(void)
+{
+    return 0;
+}
+
+static inline void irq_restore(u64 flags)
+{
+}
+
+static inline void spin_lock_init(spinlock l)
+{
+    l->w = 0;
+}
+
+static inline void spin_lock(spinlock l)
+{
+    assert(l->w == 0);
+    l->w = 1;
+}
+
+static inline void spin_unlock(spinlock l)
+{
+    assert(l->w == 1);
+    l->w = 0;
+}
+
+static inline u64 spin_lock_irq(spinlock l)
+{
+    spin_lock(l);
+    return 0;
+}
+
+static inline void spin_unlock_irq(spinlock l, u64 flags)
+{
+    spin_unlock(l);
+}
+
+heap locking_heap_wrapper(heap meta, heap parent);
+heap magazine_heap_wrapper(heap meta, heap parent, bytes parent_pagesize,
+                           int min_order, int max_order);
+u64 magazine_heap_drain(heap h);
+void enable_heap_magazines(void);
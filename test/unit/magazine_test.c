@@ -0,0 +1,173 @@
+/* The magazine layer is built from the kernel source against userspace
+   stand-ins (see kernel_stub/kernel.h) so that its internals can be checked. */
+#include "../../src/kernel/locking_heap.c"
+#include <stdlib.h>
+#include <stdio.h>
+
+#define TEST_PAGESIZE   U64_FROM_BIT(21)
+#define TEST_MIN_ORDER  5
+#define TEST_MAX_ORDER  10
+
+static struct cpuinfo test_cpus[2] = { { .id = 0 }, { .id = 1 } };
+cpuinfo stub_cpu = &test_cpus[0];
+
+/* Magazines on a depot full list must be full, and those on the empty list
+   empty: the exchange on alloc and free relies on it. */
+static boolean magazine_check(magheap mh)
+{
+    for (int i = 0; i < magheap_nclasses(mh); i++) {
+        magazine_depot d = &mh->depots[i];
+        u64 nfull = 0;
+        list_foreach(&d->full, l) {
+            magazine m = struct_from_list(l, magazine, l);
+            if (m->rounds != d->capacity) {
+                msg_err("class %d: magazine on full list with %d of %d rounds\n",
+                        i, m->rounds, d->capacity);
+                return false;
+            }
+            nfull++;
+        }
+        if (nfull != d->nfull || nfull > DEPOT_FULL_MAX) {
+            msg_err("class %d: %ld full magazines, nfull %ld\n", i, nfull, d->nfull);
+            return false;
+        }
+        list_foreach(&d->empty, l) {
+            magazine m = struct_from_list(l, magazine, l);
+            if (m->rounds != 0) {
+                msg_err("class %d: magazine on empty list with %d rounds\n",
+                        i, m->rounds);
+                return false;
+            }
+        }
+        for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+            magazine_cpu mc = &mh->cpus[cpu * magheap_nclasses(mh) + i];
+            if ((mc->loaded && mc->loaded->rounds > d->capacity) ||
+                (mc->previous && mc->previous->rounds > d->capacity)) {
+                msg_err("class %d: cpu %d magazine overfilled\n", i, cpu);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static boolean alloc_objs(heap h, bytes size, u64 *objs, int n)
+{
+    for (int i = 0; i < n; i++) {
+        objs[i] = allocate_u64(h, size);
+        if (objs[i] == INVALID_PHYSICAL) {
+            msg_err("failed to allocate object %d of size %ld\n", i, size);
+            return false;
+        }
+        *(u64 *)pointer_from_u64(objs[i]) = i;
+    }
+    /* an object handed out twice would have been overwritten */
+    for (int i = 0; i < n; i++) {
+        if (*(u64 *)pointer_from_u64(objs[i]) != i) {
+            msg_err("object %d (%lx) allocated twice\n", i, objs[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void free_objs(heap h, bytes size, u64 *objs, int start, int end)
+{
+    for (int i = start; i < end; i++)
+        deallocate_u64(h, objs[i], size);
+}
+
+/* Allocate on one cpu and free on the other, in amounts that cross magazine
+   boundaries (including the half-filled magazines from parent refills) and
+   the depot limit. */
+static boolean magazine_test(heap h, bytes size)
+{
+    magheap mh = (magheap)h;
+    int capacity = mh->depots[magheap_class(mh, size)].capacity;
+    int counts[] = { 1, capacity / 2, capacity / 2 + 1, capacity, 3 * capacity + 1,
+                     (DEPOT_FULL_MAX + 2) * capacity + 3 };
+    int max = counts[sizeof(counts) / sizeof(counts[0]) - 1];
+    u64 *objs = malloc(sizeof(u64) * max);
+
+    for (int c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        int n = counts[c];
+        stub_cpu = &test_cpus[0];
+        if (!alloc_objs(h, size, objs, n) || !magazine_check(mh))
+            return false;
+        free_objs(h, size, objs, 0, n / 3);
+        if (!magazine_check(mh))
+            return false;
+        stub_cpu = &test_cpus[1];
+        free_objs(h, size, objs, n / 3, n);
+        if (!magazine_check(mh))
+            return false;
+
+        /* reuse what the other cpu freed, then return it from the first */
+        if (!alloc_objs(h, size, objs, n) || !magazine_check(mh))
+            return false;
+        stub_cpu = &test_cpus[0];
+        free_objs(h, size, objs, 0, n);
+        if (!magazine_check(mh))
+            return false;
+    }
+    free(objs);
+    return true;
+}
+
+/* Draining empties the depots and hands their objects back to the parent,
+   leaving the per-cpu magazines in place. */
+static boolean drain_test(heap h, heap parent)
+{
+    magheap mh = (magheap)h;
+    bytes before = heap_allocated(parent);
+    u64 drained = magazine_heap_drain(h);
+    if (!magazine_check(mh))
+        return false;
+    for (int i = 0; i < magheap_nclasses(mh); i++) {
+        magazine_depot d = &mh->depots[i];
+        if (d->nfull != 0 || !list_empty(&d->full) || !list_empty(&d->empty)) {
+            msg_err("class %d: depot not drained\n", i);
+            return false;
+        }
+    }
+    /* the parent rounds the magazines themselves up to its own classes */
+    if (drained == 0 || heap_allocated(parent) > before - drained) {
+        msg_err("drained %ld bytes, parent allocation %ld -> %ld\n",
+                drained, before, heap_allocated(parent));
+        return false;
+    }
+    /* the heap keeps working, refilling from the parent */
+    return magazine_test(h, U64_FROM_BIT(TEST_MIN_ORDER));
+}
+
+int main(int argc, char **argv)
+{
+    heap h = init_process_runtime();
+    heap m = allocate_mmapheap(h, TEST_PAGESIZE * 64);
+    heap pageheap = (heap)create_id_heap_backed(h, h, m, TEST_PAGESIZE, false);
+    heap mc = allocate_mcache(h, pageheap, TEST_MIN_ORDER, TEST_MAX_ORDER + 2,
+                              TEST_PAGESIZE);
+    heap mh = magazine_heap_wrapper(h, mc, TEST_PAGESIZE, TEST_MIN_ORDER,
+                                    TEST_MAX_ORDER);
+    if (mh == INVALID_ADDRESS) {
+        msg_err("failed to allocate magazine heap\n");
+        exit(EXIT_FAILURE);
+    }
+    enable_heap_magazines();
+    for (int order = TEST_MIN_ORDER; order <= TEST_MAX_ORDER; order++) {
+        if (!magazine_test(mh, U64_FROM_BIT(order)) ||
+            !magazine_test(mh, U64_FROM_BIT(order) - 1))
+            exit(EXIT_FAILURE);
+    }
+    /* sizes outside the cached classes go to the parent under the lock */
+    u64 big = allocate_u64(mh, U64_FROM_BIT(TEST_MAX_ORDER + 2));
+    if (big == INVALID_PHYSICAL) {
+        msg_err("failed to allocate uncached size\n");
+        exit(EXIT_FAILURE);
+    }
+    deallocate_u64(mh, big, U64_FROM_BIT(TEST_MAX_ORDER + 2));
+    if (!magazine_check((magheap)mh) || !drain_test(mh, mc))
+        exit(EXIT_FAILURE);
+    msg_debug("test passed\n");
+    exit(EXIT_SUCCESS);
+}
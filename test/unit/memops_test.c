@@ -108,15 +108,98 @@ static void test_memcmp(long *buf, unsigned long buf_size)
     test_assert(runtime_memcmp(buf, buf, buf_size * sizeof(long)) == 0);
 }
 
+/* Compare the selected implementation against byte-by-byte references
+   over random offsets and lengths, including overlapping copies. */
+#define RANDOM_BUF_SIZE 8192
+#define RANDOM_ITERATIONS 4000
+
+static void ref_memmove(u8 *dst, const u8 *src, bytes len)
+{
+    if (dst < src) {
+        for (bytes i = 0; i < len; i++)
+            dst[i] = src[i];
+    } else {
+        for (bytes i = len; i > 0; i--)
+            dst[i - 1] = src[i - 1];
+    }
+}
+
+static int ref_memcmp(const u8 *a, const u8 *b, bytes len)
+{
+    for (bytes i = 0; i < len; i++) {
+        if (a[i] != b[i])
+            return a[i] - b[i];
+    }
+    return 0;
+}
+
+static bytes random_len(void)
+{
+    /* favor short lengths around the vector sizes */
+    switch (rand() % 3) {
+    case 0:
+        return rand() % 160;
+    case 1:
+        return rand() % 1024;
+    default:
+        return rand() % (RANDOM_BUF_SIZE / 2);
+    }
+}
+
+static void test_random(u8 *buf, u8 *ref)
+{
+    for (int i = 0; i < RANDOM_BUF_SIZE; i++)
+        buf[i] = ref[i] = rand();
+    for (int i = 0; i < RANDOM_ITERATIONS; i++) {
+        bytes len = random_len();
+        bytes src = rand() % (RANDOM_BUF_SIZE - len + 1);
+        bytes dst = rand() % (RANDOM_BUF_SIZE - len + 1);
+        switch (i % 3) {
+        case 0:
+            runtime_memcpy(buf + dst, buf + src, len);
+            ref_memmove(ref + dst, ref + src, len);
+            break;
+        case 1: {
+            u8 v = rand();
+            runtime_memset(buf + dst, v, len);
+            for (bytes j = 0; j < len; j++)
+                ref[dst + j] = v;
+            break;
+        }
+        default:
+            /* make a mismatch at a random position most of the time */
+            if (len > 0 && (rand() % 4)) {
+                ref_memmove(buf + dst, buf + src, len);
+                ref_memmove(ref + dst, ref + src, len);
+                bytes k = rand() % len;
+                buf[dst + k] = ref[dst + k] = buf[dst + k] + 1 + rand() % 255;
+            }
+            int r = runtime_memcmp(buf + dst, buf + src, len);
+            int e = ref_memcmp(buf + dst, buf + src, len);
+            test_assert((r == 0) == (e == 0));
+            break;
+        }
+        test_assert(ref_memcmp(buf, ref, RANDOM_BUF_SIZE) == 0);
+    }
+}
+
 int main(int argc, char *argv[])
 {
     long buf1[MEM_BUF_SIZE], buf2[MEM_BUF_SIZE];
+    u8 *rbuf = malloc(RANDOM_BUF_SIZE), *rref = malloc(RANDOM_BUF_SIZE);
 
     init_process_runtime();
-    test_memcpy(buf1, buf2, MEM_BUF_SIZE);
-    test_memcpy(buf2, buf1, MEM_BUF_SIZE);
-    test_memcpy_overlap(buf1, MEM_BUF_SIZE);
-    test_memset(buf1, MEM_BUF_SIZE);
-    test_memcmp(buf1, MEM_BUF_SIZE);
+    for (int level = MEMOPS_GENERIC; level <= MEMOPS_VEC256; level++) {
+        if (!memops_set_level(level))
+            continue;
+        test_memcpy(buf1, buf2, MEM_BUF_SIZE);
+        test_memcpy(buf2, buf1, MEM_BUF_SIZE);
+        test_memcpy_overlap(buf1, MEM_BUF_SIZE);
+        test_memset(buf1, MEM_BUF_SIZE);
+        test_memcmp(buf1, MEM_BUF_SIZE);
+        test_random(rbuf, rref);
+    }
+    free(rbuf);
+    free(rref);
     return 0;
 }
@@ -0,0 +1,104 @@
+/* The readahead window logic is built from the pagecache source, as the
+   host tools do, so that the window can be checked without a volume. */
+#include "../../src/kernel/pagecache.c"
+#include <stdlib.h>
+#include <stdio.h>
+
+#define TEST_READ_PAGES 16
+#define TEST_RA_MAX     512
+
+/* Read a file sequentially and check that the readahead chunk grows up to
+   the limit, that chunks are contiguous and never overlap, and that no
+   fetch is issued before the reader reaches the marker. */
+static boolean sequential_test(u64 read_pages)
+{
+    struct pagecache_ra ra;
+    ra.start = ra.size = ra.async_size = ra.prev = 0;
+    ra.max = TEST_RA_MAX;
+    u64 fetched_end = 0;
+    u64 chunk = 0;
+    u64 fetches = 0;
+    for (u64 first = 0; first < 64 * TEST_RA_MAX; first += read_pages) {
+        u64 last = first + read_pages - 1;
+        u64 marker = ra.start + ra.size - ra.async_size;
+        boolean in_window = ra.size > 0 && first >= ra.start && first < ra.start + ra.size;
+        u64 prev = ra.prev;
+        ra.prev = last + 1;
+        range f = ra_advance(&ra, first, last, prev);
+        if (range_span(f) == 0) {
+            if (first > 0 && !in_window) {
+                msg_err("read [%ld, %ld] left the window [%ld, %ld)\n", first, last,
+                        ra.start, ra.start + ra.size);
+                return false;
+            }
+            continue;
+        }
+        if (in_window && last < marker) {
+            msg_err("read [%ld, %ld] issued fetch %R before marker %ld\n",
+                    first, last, f, marker);
+            return false;
+        }
+        if (fetches > 0 && f.start != MAX(fetched_end, last + 1)) {
+            msg_err("fetch %R does not follow previous fetch ending at %ld\n",
+                    f, fetched_end);
+            return false;
+        }
+        u64 span = range_span(f);
+        if (fetches > 1 && span < MIN(2 * chunk, ra.max)) {
+            msg_err("fetch %R of %ld pages did not grow from %ld\n", f, span, chunk);
+            return false;
+        }
+        if (span > ra.max) {
+            msg_err("fetch %R exceeds limit %ld\n", f, ra.max);
+            return false;
+        }
+        if (!(ra.start <= first && ra.start + ra.size == f.end)) {
+            msg_err("window [%ld, %ld) does not cover read at %ld and fetch %R\n",
+                    ra.start, ra.start + ra.size, first, f);
+            return false;
+        }
+        fetched_end = f.end;
+        chunk = span;
+        fetches++;
+    }
+    if (chunk != ra.max) {
+        msg_err("chunk of %ld pages never reached limit %ld\n", chunk, ra.max);
+        return false;
+    }
+    /* one fetch per chunk: far fewer than the number of reads */
+    if (fetches > 64 + 8) {
+        msg_err("%ld fetches for a sequential read\n", fetches);
+        return false;
+    }
+    return true;
+}
+
+/* Reads that don't follow each other drop the window and fetch nothing. */
+static boolean random_test(void)
+{
+    struct pagecache_ra ra;
+    ra.start = ra.size = ra.async_size = ra.prev = 0;
+    ra.max = TEST_RA_MAX;
+    u64 offsets[] = { 1000, 37, 5000, 12, 900 };
+    for (int i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++) {
+        u64 first = offsets[i];
+        u64 prev = ra.prev;
+        ra.prev = first + TEST_READ_PAGES;
+        range f = ra_advance(&ra, first, first + TEST_READ_PAGES - 1, prev);
+        if (range_span(f) != 0 || ra.size != 0) {
+            msg_err("random read at %ld fetched %R\n", first, f);
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    init_process_runtime();
+    if (!sequential_test(TEST_READ_PAGES) || !sequential_test(1) ||
+        !sequential_test(TEST_RA_MAX / 2) || !random_test())
+        exit(EXIT_FAILURE);
+    msg_debug("test passed\n");
+    exit(EXIT_SUCCESS);
+}